@@ -22,6 +22,7 @@ allTests() {
   testFile examples/negative-numbers.fg "OK" 0 "-54 -121 -12" 0
   testFile examples/controlflow.fg "OK" 0 "42"$'\n'"0"$'\n'"-54" 0
   testFile examples/global-var.fg "OK" 0 "554 01235" 0
+  testFile examples/global-wide.fg "OK" 0 "10 40 -30 3 65 -20 70" 0
   testFile examples/global-const.fg "OK" 0 "42AQ"$'\n'"01234" 0
   testFile examples/duplicate.fg "[line 4; pos 7] variable \"i\" is already defined."$'\n'"Fail" 1 
   testFile examples/assign-constant.fg "[line 4; pos 5] attempting to assign to read-only constant \"i\"."$'\n'"Fail" 1 
@@ -37,17 +38,21 @@ allTests() {
   testFile examples/array.fg "OK" 0 "worldhellohellx" 0
   testFile examples/array-return.fg "OK" 0 "5 zyxwv Hello world 0" 0
   testFile examples/array-nested.fg "OK" 0 "a" 0
+  testFile examples/index-store.fg "OK" 0 "21" 0
   testFile examples/global-string.fg "OK" 0 "c Words are cool" 0
   testFile examples/record-basic.fg "OK" 0 "542Hello" 0
   testFile examples/record-global.fg "OK" 0 "5 42 abcde Hello" 0
   testFile examples/record-args.fg "OK" 0 "abcde 5 Hello 10 abcdq Hello world" 0
   testFile examples/record-init.fg "OK" 0 "5 abcde Hello world" 0
   testFile examples/record-nested.fg "OK" 0 "-32" 0
+  testFile examples/wide-array-field.fg "OK" 0 "3 5 2" 0
   testFile examples/record-global-var-init.fg "OK" 0 "5 zyxwv Hello world 0" 0
   testFile examples/record-global-const-init.fg "OK" 0 "5 zyxwv Hello world 0" 0
   testFile examples/record-wrong-field.fg "[line 10; pos 4] The field 'fake' doesn't exist on type 'Test'." 1
   testFile examples/array-of-struct.fg "OK" 0 "42 hello Words 1"$'\n'"12 world News 0" 0
   testFile examples/function-pointer.fg "OK" 0 "do" 0
+  testFile examples/call-result.fg "OK" 0 "10102060" 0
+  testFile examples/parameter-shuffle.fg "OK" 0 "217258" 0
   testFile examples/pointer-arithmetic.fg "OK" 0 "-3296" 0
   testFile examples/pointer-ref-deref.fg "OK" 0 "54" 0
   testFile examples/record-copy-init.fg "OK" 0 "4242" 0
@@ -58,6 +63,119 @@ allTests() {
   testFile examples/isr.fg "OK" 0 "B"$'\n'"42C" 0
   testFile examples/union.fg "OK" 0 "53"$'\n'"42" 0
   testFile examples/union-return.fg "OK" 0 "42" 0
+  testFile examples/module-return.fg "OK" 0 "35" 0
+  testFile examples/constant-branch.fg "OK" 0 "46" 0
+  testFile examples/constant-fold.fg "OK" 0 "19 44 127 4 255 44" 0
+  testFile examples/constant-divide.fg "OK" 0 "962065" 0
+  testFile examples/register-pressure.fg "OK" 0 "-63 -68 -99" 0
+  testFile examples/loop-locals.fg "OK" 0 "55 31 51" 0
+  testFile examples/record-forwarding.fg "OK" 0 "10 5" 0
+  testFile examples/common-subexpressions.fg "OK" 0 "49 23" 0
+  testFile examples/branch-conditions.fg "OK" 0 "8 8 9" 0
+  testFile examples/inlining.fg "OK" 0 "7 43 55 100" 0
+  testFile examples/dead-code.fg "OK" 0 "10" 0
+  testFile examples/calling-convention.fg "OK" 0 "95 26 43 5 55 100 23" 0
+  testFile examples/leaf-functions.fg "OK" 0 "30 36 123 776" 0
+  testFile examples/return-in-place.fg "OK" 0 "20 10 107 51 105 77 8 1 10" 0
+  testFile examples/scalar-records.fg "OK" 0 "80 94 2 7" 0
+  testFile examples/block-copy.fg "OK" 0 "6 ABCa 97 13 0" 0
+  testFile examples/array-walk.fg "OK" 0 "10410491242" 0
+  testFile examples/unroll.fg "OK" 0 "16132317" 0
+  testFile examples/widths.fg "OK" 0 "3144145" 0
+  testFile examples/immediates.fg "OK" 0 "8660-99104" 0
+  testFile examples/call-effects.fg "OK" 0 "99" 0
+  testJobs examples/return-in-place.fg 4
+  testCache examples/return-in-place.fg
+  testElf examples/helloworld.fg "hello world" 0
+}
+
+fail() {
+  echo -e "${RED}[FAIL]${NC}: $1"
+  ERRORS+="${RED}[FAIL]${NC}: $1 - $2"
+  ERRORS+=$'\n'
+  ERRORS+="        Expected: $3"
+  ERRORS+=$'\n'
+  ERRORS+="        Actual: $4"
+  ERRORS+=$'\n'
+  ERRORS+="---------------------------------------"
+  ERRORS+=$'\n'
+  FAILURES=$(($FAILURES + 1))
+}
+
+# Code generated by several workers must match the serial output.
+testJobs() {
+  local FILENAME=$1
+  local JOBS=$2
+  TOTAL=$(($TOTAL + 1))
+  rm -f obj/jobs-1.S obj/jobs-n.S
+  ./fgcc -j 1 $FILENAME obj/jobs-1.S > /dev/null
+  ./fgcc -j $JOBS $FILENAME obj/jobs-n.S > /dev/null
+  if ! cmp -s obj/jobs-1.S obj/jobs-n.S; then
+    fail "$1" "Parallel Output" "same assembly as -j 1" "-j $JOBS differs"
+    return 1
+  fi
+  rm -f obj/jobs-1.S obj/jobs-n.S
+  echo -e "${GREEN}[PASS]${NC}: $1 (-j $JOBS)"
+}
+
+# A second compile must take every function from the cache, writing no
+# new entries, and produce the same assembly as the first.
+testCache() {
+  local FILENAME=$1
+  local CACHE=obj/cache
+  TOTAL=$(($TOTAL + 1))
+  rm -rf $CACHE obj/cold.S obj/warm.S
+  ./fgcc --cache-dir $CACHE $FILENAME obj/cold.S > /dev/null
+  if [ -z "$(ls $CACHE)" ]; then
+    fail "$1" "Cache Entries" "entries in $CACHE" "none"
+    return 1
+  fi
+  touch -t 200001010000 $CACHE/*
+  touch -t 200101010000 $CACHE.stamp
+  ./fgcc --cache-dir $CACHE $FILENAME obj/warm.S > /dev/null
+  local WRITTEN
+  WRITTEN=$(find $CACHE -newer $CACHE.stamp -type f)
+  if [ -n "$WRITTEN" ]; then
+    fail "$1" "Cache Hits" "no entries written" "$WRITTEN"
+    return 1
+  fi
+  if ! cmp -s obj/cold.S obj/warm.S; then
+    fail "$1" "Cached Output" "same assembly as the first compile" "output differs"
+    return 1
+  fi
+  rm -rf $CACHE $CACHE.stamp obj/cold.S obj/warm.S
+  echo -e "${GREEN}[PASS]${NC}: $1 (--cache-dir)"
+}
+
+# The code in an --elf object still makes Darwin system calls, so it can
+# only be run through ELF_RUNNER, such as an emulator. Without one, the
+# object is just linked.
+testElf() {
+  local FILENAME=$1
+  local BIN=obj/elf
+  local LINKER=${ELF_LD:-ld.lld}
+  if ! command -v ${LINKER%% *} > /dev/null; then
+    echo "[SKIP]: $1 (--elf, no $LINKER)"
+    return 0
+  fi
+  TOTAL=$(($TOTAL + 1))
+  rm -f obj/elf.o $BIN
+  ./fgcc --elf $FILENAME obj/elf.o > /dev/null
+  if ! $LINKER -e _start -o $BIN obj/elf.o; then
+    fail "$1" "ELF Link" "a linked executable" "$LINKER failed"
+    return 1
+  fi
+  if [ -n "$ELF_RUNNER" ]; then
+    local OUTPUT
+    OUTPUT=$($ELF_RUNNER $BIN)
+    local OUTPUT_CODE=$?
+    if [ "$OUTPUT" != "$2" ] || [ "$OUTPUT_CODE" != "$3" ]; then
+      fail "$1" "ELF Program Output" "\"$2\" ($3)" "\"$OUTPUT\" ($OUTPUT_CODE)"
+      return 1
+    fi
+  fi
+  rm -f obj/elf.o $BIN
+  echo -e "${GREEN}[PASS]${NC}: $1 (--elf)"
 }
 
 testFile() {
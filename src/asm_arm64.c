@@ -0,0 +1,1709 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "asm_arm64.h"
+#include "elf.h"
+
+#define EM_AARCH64 183
+
+#define R_AARCH64_ABS64 257
+#define R_AARCH64_ABS32 258
+#define R_AARCH64_LD_PREL_LO19 273
+#define R_AARCH64_ADR_PREL_LO21 274
+#define R_AARCH64_ADR_PREL_PG_HI21 275
+#define R_AARCH64_ADD_ABS_LO12_NC 277
+#define R_AARCH64_LDST8_ABS_LO12_NC 278
+#define R_AARCH64_TSTBR14 279
+#define R_AARCH64_CONDBR19 280
+#define R_AARCH64_JUMP26 282
+#define R_AARCH64_CALL26 283
+#define R_AARCH64_LDST16_ABS_LO12_NC 284
+#define R_AARCH64_LDST32_ABS_LO12_NC 285
+#define R_AARCH64_LDST64_ABS_LO12_NC 286
+#define R_AARCH64_LDST128_ABS_LO12_NC 299
+
+#define MAX_OPERANDS 8
+#define OPERAND_LENGTH 256
+
+typedef struct {
+  uint32_t num;
+  char kind; // x, w, q, d, s, h, b or v
+  bool sp;
+} REG;
+
+typedef enum {
+  MOD_NONE,
+  MOD_PAGE,
+  MOD_PAGEOFF
+} MODIFIER;
+
+typedef struct {
+  int64_t value;
+  bool hasSymbol;
+  char symbol[OPERAND_LENGTH];
+  MODIFIER modifier;
+} EXPR;
+
+typedef enum {
+  ADDR_OFFSET,
+  ADDR_PRE,
+  ADDR_POST,
+  ADDR_REGISTER
+} ADDR_MODE;
+
+typedef struct {
+  ADDR_MODE mode;
+  REG base;
+  EXPR offset;
+  REG index;
+  int extend; // option field for register offsets
+  int amount;
+  bool hasAmount;
+} ADDRESS;
+
+typedef struct {
+  char* key;
+  int value;
+} SYMBOL_MAP;
+
+typedef struct {
+  char* name;
+  int section;
+  uint64_t value;
+  bool defined;
+  bool global;
+  bool referenced;
+} ASM_SYMBOL;
+
+typedef struct {
+  int section;
+  ELF_RELA rela;
+} ASM_RELOCATION;
+
+typedef struct {
+  char* name;
+  char** params;
+  char** body;
+} MACRO;
+
+static struct {
+  ELF_OBJECT object;
+  int section;
+  const char* bank;
+  bool final;
+  const char* line;
+  char** names;
+  ASM_SYMBOL* symbols;
+  SYMBOL_MAP* symbolMap;
+  ASM_RELOCATION* relocations;
+  MACRO* macros;
+} as;
+
+static void asmError(const char* message) {
+  printf("Assembler error: %s\n  %s\n", message, as.line == NULL ? "" : as.line);
+  exit(1);
+}
+
+static char* copyString(const char* start, size_t length) {
+  char* result = malloc(length + 1);
+  memcpy(result, start, length);
+  result[length] = '\0';
+  return result;
+}
+
+static char* trim(char* text) {
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  size_t length = strlen(text);
+  while (length > 0 && isspace((unsigned char)text[length - 1])) {
+    text[--length] = '\0';
+  }
+  return text;
+}
+
+static bool isIdentifierChar(char c) {
+  return isalnum((unsigned char)c) || c == '_' || c == '.' || c == '$';
+}
+
+// ---- Sections and symbols ----
+
+static int findSection(const char* name, uint64_t flags) {
+  for (int i = 0; i < arrlen(as.object.sections); i++) {
+    if (strcmp(as.object.sections[i].name, name) == 0) {
+      return i;
+    }
+  }
+  char* stored = copyString(name, strlen(name));
+  arrput(as.names, stored);
+  uint64_t align = (flags & ELF_SHF_EXECINSTR) ? 4 : 8;
+  return ELF_addSection(&as.object, stored, ELF_SHT_PROGBITS, flags, align);
+}
+
+static bool isExecutable(int section) {
+  return (as.object.sections[section].flags & ELF_SHF_EXECINSTR) != 0;
+}
+
+static void switchSection(bool text) {
+  // Banked code and data live in their own sections, so every module's
+  // contribution to a bank is grouped together by the linker.
+  uint64_t flags = ELF_SHF_ALLOC | (text ? ELF_SHF_EXECINSTR : ELF_SHF_WRITE);
+  if (as.bank == NULL) {
+    as.section = findSection(text ? ".text" : ".data", flags);
+  } else {
+    char name[OPERAND_LENGTH + 32];
+    snprintf(name, sizeof(name), "%s.fang.%s", text ? ".text" : ".data", as.bank);
+    as.section = findSection(name, flags);
+  }
+}
+
+static BUFFER* sectionData(void) {
+  return &as.object.sections[as.section].data;
+}
+
+static uint64_t currentOffset(void) {
+  return sectionData()->length;
+}
+
+static int symbolIndex(const char* name) {
+  int index = shgeti(as.symbolMap, name);
+  if (index >= 0) {
+    return as.symbolMap[index].value;
+  }
+  ASM_SYMBOL symbol = {
+    .name = copyString(name, strlen(name)),
+    .section = ELF_UNDEFINED
+  };
+  arrput(as.symbols, symbol);
+  shput(as.symbolMap, name, arrlen(as.symbols) - 1);
+  return arrlen(as.symbols) - 1;
+}
+
+static void defineLabel(const char* name) {
+  int index = symbolIndex(name);
+  ASM_SYMBOL* symbol = &as.symbols[index];
+  if (symbol->defined && !as.final) {
+    asmError("Label is defined more than once");
+  }
+  symbol->defined = true;
+  symbol->section = as.section;
+  symbol->value = currentOffset();
+}
+
+static void addRelocation(uint32_t type, const char* name, int64_t addend) {
+  if (!as.final) {
+    return;
+  }
+  int index = symbolIndex(name);
+  as.symbols[index].referenced = true;
+  ASM_RELOCATION relocation = {
+    .section = as.section,
+    .rela = { .offset = currentOffset(), .type = type, .symbol = index, .addend = addend }
+  };
+  arrput(as.relocations, relocation);
+}
+
+// Offset from here to a label in the current section. Returns false when
+// the target has to be left to the linker.
+static bool localOffset(const char* name, int64_t* offset) {
+  int index = shgeti(as.symbolMap, name);
+  if (index < 0) {
+    *offset = 0;
+    return !as.final;
+  }
+  ASM_SYMBOL symbol = as.symbols[as.symbolMap[index].value];
+  // global symbols stay relocatable so the linker may interpose them
+  if (!symbol.defined || symbol.section != as.section || symbol.global) {
+    *offset = 0;
+    return !as.final;
+  }
+  *offset = (int64_t)symbol.value - (int64_t)currentOffset();
+  return true;
+}
+
+static void emit8(uint8_t value) {
+  BUFFER_putc(sectionData(), (char)value);
+}
+
+static void emitValue(uint64_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    emit8((uint8_t)(value >> (8 * i)));
+  }
+}
+
+static void emit32(uint32_t word) {
+  emitValue(word, 4);
+}
+
+// ---- Operand parsing ----
+
+static int splitOperands(const char* text, char operands[MAX_OPERANDS][OPERAND_LENGTH]) {
+  int count = 0;
+  int depth = 0;
+  bool quoted = false;
+  const char* start = text;
+  const char* c = text;
+  while (true) {
+    if (*c == '"') {
+      quoted = !quoted;
+    } else if (!quoted && *c == '[') {
+      depth++;
+    } else if (!quoted && *c == ']') {
+      depth--;
+    }
+    if (*c == '\0' || (*c == ',' && depth == 0 && !quoted)) {
+      size_t length = c - start;
+      if (count == MAX_OPERANDS || length >= OPERAND_LENGTH) {
+        asmError("Too many operands");
+      }
+      memcpy(operands[count], start, length);
+      operands[count][length] = '\0';
+      char* trimmed = trim(operands[count]);
+      memmove(operands[count], trimmed, strlen(trimmed) + 1);
+      if (operands[count][0] != '\0' || count > 0 || *c != '\0') {
+        count++;
+      }
+      if (*c == '\0') {
+        break;
+      }
+      start = c + 1;
+    }
+    c++;
+  }
+  return count;
+}
+
+static bool equalsIgnoreCase(const char* a, const char* b) {
+  while (*a && *b) {
+    if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) {
+      return false;
+    }
+    a++;
+    b++;
+  }
+  return *a == *b;
+}
+
+static bool parseRegister(const char* text, REG* reg) {
+  char name[16];
+  size_t length = strlen(text);
+  if (length == 0 || length >= sizeof(name)) {
+    return false;
+  }
+  for (size_t i = 0; i <= length; i++) {
+    name[i] = tolower((unsigned char)text[i]);
+  }
+  reg->sp = false;
+  if (strcmp(name, "sp") == 0) {
+    *reg = (REG){ 31, 'x', true };
+    return true;
+  }
+  if (strcmp(name, "wsp") == 0) {
+    *reg = (REG){ 31, 'w', true };
+    return true;
+  }
+  if (strcmp(name, "xzr") == 0) {
+    *reg = (REG){ 31, 'x', false };
+    return true;
+  }
+  if (strcmp(name, "wzr") == 0) {
+    *reg = (REG){ 31, 'w', false };
+    return true;
+  }
+  if (strcmp(name, "fp") == 0) {
+    *reg = (REG){ 29, 'x', false };
+    return true;
+  }
+  if (strcmp(name, "lr") == 0) {
+    *reg = (REG){ 30, 'x', false };
+    return true;
+  }
+  char kind = name[0];
+  if (strchr("xwqdshbv", kind) == NULL || !isdigit((unsigned char)name[1])) {
+    return false;
+  }
+  char* end;
+  long num = strtol(name + 1, &end, 10);
+  if (kind == 'v' && *end == '.') {
+    // the arrangement is implied by each instruction's encoding
+    end += strlen(end);
+  }
+  if (*end != '\0' || num < 0 || num > 31 || ((kind == 'x' || kind == 'w') && num > 30)) {
+    return false;
+  }
+  *reg = (REG){ (uint32_t)num, kind, false };
+  return true;
+}
+
+static REG expectRegister(const char* text) {
+  REG reg;
+  if (!parseRegister(text, &reg)) {
+    asmError("Expected a register");
+  }
+  return reg;
+}
+
+static bool isGeneral(REG reg) {
+  return reg.kind == 'x' || reg.kind == 'w';
+}
+
+static uint32_t sf(REG reg) {
+  return reg.kind == 'x' ? 1 : 0;
+}
+
+typedef struct {
+  const char* p;
+  EXPR* expr;
+} EXPR_PARSER;
+
+static void skipSpace(EXPR_PARSER* parser) {
+  while (isspace((unsigned char)*parser->p)) {
+    parser->p++;
+  }
+}
+
+static bool parseSum(EXPR_PARSER* parser, int64_t* value, bool allowSymbol);
+
+static bool parseCharLiteral(EXPR_PARSER* parser, int64_t* value) {
+  const char* c = parser->p + 1;
+  if (*c == '\\') {
+    c++;
+    switch (*c) {
+      case 'n': *value = '\n'; break;
+      case 't': *value = '\t'; break;
+      case 'r': *value = '\r'; break;
+      case '0': *value = '\0'; break;
+      default: *value = (unsigned char)*c; break;
+    }
+  } else {
+    *value = (unsigned char)*c;
+  }
+  c++;
+  if (*c != '\'') {
+    return false;
+  }
+  parser->p = c + 1;
+  return true;
+}
+
+static bool parsePrimary(EXPR_PARSER* parser, int64_t* value, bool allowSymbol) {
+  skipSpace(parser);
+  char c = *parser->p;
+  if (c == '(') {
+    parser->p++;
+    if (!parseSum(parser, value, allowSymbol)) {
+      return false;
+    }
+    skipSpace(parser);
+    if (*parser->p != ')') {
+      return false;
+    }
+    parser->p++;
+    return true;
+  }
+  if (c == '-' || c == '~' || c == '+') {
+    parser->p++;
+    if (!parsePrimary(parser, value, false)) {
+      return false;
+    }
+    *value = c == '-' ? -*value : (c == '~' ? ~*value : *value);
+    return true;
+  }
+  if (c == '\'') {
+    return parseCharLiteral(parser, value);
+  }
+  if (isdigit((unsigned char)c)) {
+    char* end;
+    if (c == '0' && (parser->p[1] == 'b' || parser->p[1] == 'B')) {
+      *value = strtoull(parser->p + 2, &end, 2);
+    } else {
+      *value = strtoull(parser->p, &end, 0);
+    }
+    parser->p = end;
+    return true;
+  }
+  if (c == ':' && strncmp(parser->p, ":lo12:", 6) == 0) {
+    if (!allowSymbol || parser->expr->hasSymbol) {
+      return false;
+    }
+    parser->p += 6;
+    parser->expr->modifier = MOD_PAGEOFF;
+    c = *parser->p;
+  }
+  if (isIdentifierChar(c) && !isdigit((unsigned char)c)) {
+    if (!allowSymbol || parser->expr->hasSymbol) {
+      return false;
+    }
+    const char* start = parser->p;
+    while (isIdentifierChar(*parser->p)) {
+      parser->p++;
+    }
+    size_t length = parser->p - start;
+    if (length >= OPERAND_LENGTH) {
+      return false;
+    }
+    memcpy(parser->expr->symbol, start, length);
+    parser->expr->symbol[length] = '\0';
+    parser->expr->hasSymbol = true;
+    if (*parser->p == '@') {
+      parser->p++;
+      if (strncmp(parser->p, "PAGEOFF", 7) == 0) {
+        parser->expr->modifier = MOD_PAGEOFF;
+        parser->p += 7;
+      } else if (strncmp(parser->p, "PAGE", 4) == 0) {
+        parser->expr->modifier = MOD_PAGE;
+        parser->p += 4;
+      } else {
+        return false;
+      }
+    }
+    *value = 0;
+    return true;
+  }
+  return false;
+}
+
+static bool parseProduct(EXPR_PARSER* parser, int64_t* value, bool allowSymbol) {
+  if (!parsePrimary(parser, value, allowSymbol)) {
+    return false;
+  }
+  while (true) {
+    skipSpace(parser);
+    char c = *parser->p;
+    bool shift = (c == '<' || c == '>') && parser->p[1] == c;
+    if (c != '*' && c != '/' && !shift) {
+      return true;
+    }
+    bool hadSymbol = parser->expr->hasSymbol;
+    parser->p += shift ? 2 : 1;
+    int64_t right;
+    if (!parsePrimary(parser, &right, false) || hadSymbol) {
+      return false;
+    }
+    if (c == '*') {
+      *value *= right;
+    } else if (c == '/') {
+      if (right == 0) {
+        return false;
+      }
+      *value /= right;
+    } else if (c == '<') {
+      *value = (int64_t)((uint64_t)*value << right);
+    } else {
+      *value >>= right;
+    }
+  }
+}
+
+static bool parseSum(EXPR_PARSER* parser, int64_t* value, bool allowSymbol) {
+  if (!parseProduct(parser, value, allowSymbol)) {
+    return false;
+  }
+  while (true) {
+    skipSpace(parser);
+    char c = *parser->p;
+    if (c != '+' && c != '-') {
+      return true;
+    }
+    parser->p++;
+    int64_t right;
+    // a symbol may only be added, never subtracted
+    if (!parseProduct(parser, &right, allowSymbol && c == '+')) {
+      return false;
+    }
+    *value = c == '+' ? *value + right : *value - right;
+  }
+}
+
+static bool parseExpression(const char* text, EXPR* expr) {
+  expr->value = 0;
+  expr->hasSymbol = false;
+  expr->symbol[0] = '\0';
+  expr->modifier = MOD_NONE;
+  EXPR_PARSER parser = { text, expr };
+  skipSpace(&parser);
+  if (*parser.p == '#') {
+    parser.p++;
+  }
+  if (!parseSum(&parser, &expr->value, true)) {
+    return false;
+  }
+  skipSpace(&parser);
+  return *parser.p == '\0';
+}
+
+static EXPR expectExpression(const char* text) {
+  EXPR expr;
+  if (!parseExpression(text, &expr)) {
+    asmError("Could not parse expression");
+  }
+  return expr;
+}
+
+static int64_t expectImmediate(const char* text) {
+  EXPR expr = expectExpression(text);
+  if (expr.hasSymbol) {
+    asmError("Expected a constant");
+  }
+  return expr.value;
+}
+
+static int parseCondition(const char* text) {
+  static const char* names[] = {
+    "eq", "ne", "hs", "lo", "mi", "pl", "vs", "vc",
+    "hi", "ls", "ge", "lt", "gt", "le", "al", "nv"
+  };
+  for (int i = 0; i < 16; i++) {
+    if (equalsIgnoreCase(text, names[i])) {
+      return i;
+    }
+  }
+  if (equalsIgnoreCase(text, "cs")) {
+    return 2;
+  }
+  if (equalsIgnoreCase(text, "cc")) {
+    return 3;
+  }
+  asmError("Unknown condition code");
+  return 0;
+}
+
+// Parses "LSL #n" style modifiers. Returns the shift type (LSL 0, LSR 1,
+// ASR 2, ROR 3), an extend option (UXTB 0 ... SXTX 7) offset by 4, or -1.
+static int parseModifier(const char* text, int* amount, bool* hasAmount) {
+  static const char* names[] = {
+    "lsl", "lsr", "asr", "ror",
+    "uxtb", "uxth", "uxtw", "uxtx", "sxtb", "sxth", "sxtw", "sxtx"
+  };
+  char word[8];
+  int i = 0;
+  while (isalpha((unsigned char)text[i]) && i < 7) {
+    word[i] = tolower((unsigned char)text[i]);
+    i++;
+  }
+  word[i] = '\0';
+  for (int j = 0; j < 12; j++) {
+    if (strcmp(word, names[j]) == 0) {
+      const char* rest = text + i;
+      while (isspace((unsigned char)*rest)) {
+        rest++;
+      }
+      *hasAmount = *rest != '\0';
+      *amount = *hasAmount ? (int)expectImmediate(rest) : 0;
+      return j;
+    }
+  }
+  return -1;
+}
+
+static ADDRESS parseAddress(char operands[MAX_OPERANDS][OPERAND_LENGTH], int count, int index) {
+  ADDRESS address = { .mode = ADDR_OFFSET };
+  address.offset.value = 0;
+  address.offset.hasSymbol = false;
+  address.offset.modifier = MOD_NONE;
+  if (index >= count || operands[index][0] != '[') {
+    asmError("Expected a memory operand");
+  }
+  char inner[OPERAND_LENGTH];
+  const char* text = operands[index];
+  const char* close = strrchr(text, ']');
+  if (close == NULL) {
+    asmError("Expected ']'");
+  }
+  size_t length = close - text - 1;
+  memcpy(inner, text + 1, length);
+  inner[length] = '\0';
+  bool writeback = close[1] == '!';
+
+  char parts[MAX_OPERANDS][OPERAND_LENGTH];
+  int partCount = splitOperands(inner, parts);
+  address.base = expectRegister(parts[0]);
+  if (partCount > 1) {
+    REG reg;
+    if (parseRegister(parts[1], &reg)) {
+      address.mode = ADDR_REGISTER;
+      address.index = reg;
+      address.extend = reg.kind == 'w' ? 2 : 3; // UXTW or LSL
+      if (partCount > 2) {
+        int modifier = parseModifier(parts[2], &address.amount, &address.hasAmount);
+        if (modifier == 0) {
+          address.extend = 3;
+        } else if (modifier >= 4) {
+          address.extend = modifier - 4;
+        } else {
+          asmError("Unsupported register offset");
+        }
+      }
+    } else {
+      address.offset = expectExpression(parts[1]);
+    }
+  }
+  if (writeback) {
+    address.mode = ADDR_PRE;
+  } else if (index + 1 < count) {
+    address.mode = ADDR_POST;
+    address.offset = expectExpression(operands[index + 1]);
+  }
+  return address;
+}
+
+// ---- Immediate encodings ----
+
+static uint64_t rotateRight(uint64_t value, int amount, int size) {
+  uint64_t mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+  amount %= size;
+  if (amount == 0) {
+    return value & mask;
+  }
+  return ((value >> amount) | (value << (size - amount))) & mask;
+}
+
+static bool encodeBitmask(uint64_t value, bool wide, uint32_t* n, uint32_t* immr, uint32_t* imms) {
+  if (!wide) {
+    value &= 0xFFFFFFFFULL;
+    value |= value << 32;
+  }
+  if (value == 0 || value == ~0ULL) {
+    return false;
+  }
+  int size = 64;
+  while (size > 2) {
+    int half = size / 2;
+    uint64_t mask = (1ULL << half) - 1;
+    if ((value & mask) != ((value >> half) & mask)) {
+      break;
+    }
+    size = half;
+  }
+  uint64_t mask = size == 64 ? ~0ULL : (1ULL << size) - 1;
+  uint64_t element = value & mask;
+  int ones = 0;
+  for (int i = 0; i < size; i++) {
+    ones += (element >> i) & 1;
+  }
+  uint64_t run = ones == 64 ? ~0ULL : (1ULL << ones) - 1;
+  for (int r = 0; r < size; r++) {
+    if (rotateRight(element, r, size) == run) {
+      *n = size == 64 ? 1 : 0;
+      *immr = (size - r) % size;
+      *imms = ((~(size - 1) << 1) | (ones - 1)) & 0x3F;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool encodeMoveImmediate(uint64_t value, REG rd, uint32_t* word) {
+  bool wide = rd.kind == 'x';
+  uint64_t mask = wide ? ~0ULL : 0xFFFFFFFFULL;
+  value &= mask;
+  int chunks = wide ? 4 : 2;
+  for (int hw = 0; hw < chunks; hw++) {
+    if ((value & ~(0xFFFFULL << (16 * hw))) == 0) {
+      *word = 0x52800000 | (sf(rd) << 31) | (hw << 21) | (((value >> (16 * hw)) & 0xFFFF) << 5) | rd.num;
+      return true;
+    }
+  }
+  uint64_t inverted = ~value & mask;
+  for (int hw = 0; hw < chunks; hw++) {
+    if ((inverted & ~(0xFFFFULL << (16 * hw))) == 0) {
+      *word = 0x12800000 | (sf(rd) << 31) | (hw << 21) | (((inverted >> (16 * hw)) & 0xFFFF) << 5) | rd.num;
+      return true;
+    }
+  }
+  uint32_t n, immr, imms;
+  if (encodeBitmask(value, wide, &n, &immr, &imms)) {
+    *word = 0x32000000 | (sf(rd) << 31) | (n << 22) | (immr << 16) | (imms << 10) | (31 << 5) | rd.num;
+    return true;
+  }
+  return false;
+}
+
+// ---- Instructions ----
+
+typedef struct {
+  const char* mnemonic;
+  char (*operands)[OPERAND_LENGTH];
+  int count;
+} INSTRUCTION;
+
+static void expectCount(INSTRUCTION* in, int min, int max) {
+  if (in->count < min || in->count > max) {
+    asmError("Wrong number of operands");
+  }
+}
+
+static void encodeAddSub(uint32_t op, uint32_t setFlags, REG rd, REG rn, char (*rest)[OPERAND_LENGTH], int restCount) {
+  REG rm;
+  if (parseRegister(rest[0], &rm)) {
+    int amount = 0;
+    bool hasAmount = false;
+    int modifier = restCount > 1 ? parseModifier(rest[1], &amount, &hasAmount) : -1;
+    if (restCount > 1 && modifier < 0) {
+      asmError("Unknown shift or extend");
+    }
+    if (modifier >= 4 || rd.sp || rn.sp) {
+      // extended register form, which is the only one that accepts SP
+      uint32_t option = modifier >= 4 ? modifier - 4 : (sf(rd) ? 3 : 2);
+      emit32(0x0B200000 | (sf(rd) << 31) | (op << 30) | (setFlags << 29) | (rm.num << 16) | (option << 13) | (amount << 10) | (rn.num << 5) | rd.num);
+    } else {
+      emit32(0x0B000000 | (sf(rd) << 31) | (op << 30) | (setFlags << 29) | ((modifier < 0 ? 0 : modifier) << 22) | (rm.num << 16) | ((amount & 0x3F) << 10) | (rn.num << 5) | rd.num);
+    }
+    return;
+  }
+  EXPR expr = expectExpression(rest[0]);
+  uint32_t shift = 0;
+  int64_t value = expr.value;
+  if (expr.hasSymbol) {
+    if (expr.modifier != MOD_PAGEOFF || op != 0) {
+      asmError("Only ADD accepts a symbol's page offset");
+    }
+    addRelocation(R_AARCH64_ADD_ABS_LO12_NC, expr.symbol, value);
+    value = 0;
+  } else {
+    if (restCount > 1) {
+      int amount = 0;
+      bool hasAmount = false;
+      if (parseModifier(rest[1], &amount, &hasAmount) != 0 || (amount != 0 && amount != 12)) {
+        asmError("Immediate may only be shifted by LSL #12");
+      }
+      shift = amount == 12;
+    }
+    if (value < 0) {
+      value = -value;
+      op ^= 1;
+    }
+    if (value > 0xFFF && shift == 0 && (value & 0xFFF) == 0 && (value >> 12) <= 0xFFF) {
+      value >>= 12;
+      shift = 1;
+    }
+    if (value > 0xFFF) {
+      asmError("Immediate out of range");
+    }
+  }
+  emit32(0x11000000 | (sf(rd) << 31) | (op << 30) | (setFlags << 29) | (shift << 22) | ((uint32_t)value << 10) | (rn.num << 5) | rd.num);
+}
+
+static void encodeLogical(uint32_t opc, uint32_t invert, REG rd, REG rn, char (*rest)[OPERAND_LENGTH], int restCount) {
+  REG rm;
+  if (parseRegister(rest[0], &rm)) {
+    int amount = 0;
+    bool hasAmount = false;
+    int modifier = restCount > 1 ? parseModifier(rest[1], &amount, &hasAmount) : 0;
+    if (modifier < 0 || modifier > 3) {
+      asmError("Unknown shift");
+    }
+    emit32(0x0A000000 | (sf(rd) << 31) | (opc << 29) | (modifier << 22) | (invert << 21) | (rm.num << 16) | ((amount & 0x3F) << 10) | (rn.num << 5) | rd.num);
+    return;
+  }
+  uint64_t value = (uint64_t)expectImmediate(rest[0]);
+  if (invert) {
+    value = ~value;
+  }
+  uint32_t n, immr, imms;
+  if (!encodeBitmask(value, rd.kind == 'x', &n, &immr, &imms)) {
+    asmError("Immediate cannot be encoded as a bitmask");
+  }
+  emit32(0x12000000 | (sf(rd) << 31) | (opc << 29) | (n << 22) | (immr << 16) | (imms << 10) | (rn.num << 5) | rd.num);
+}
+
+static void encodeBitfield(uint32_t opc, REG rd, REG rn, uint32_t immr, uint32_t imms) {
+  emit32(0x13000000 | (sf(rd) << 31) | (opc << 29) | (sf(rd) << 22) | ((immr & 0x3F) << 16) | ((imms & 0x3F) << 10) | (rn.num << 5) | rd.num);
+}
+
+static void encodeBranchTo(const char* target, uint32_t base, int bits, int shift, uint32_t relocation) {
+  EXPR expr = expectExpression(target);
+  int64_t offset = 0;
+  if (!expr.hasSymbol) {
+    offset = expr.value;
+  } else if (!localOffset(expr.symbol, &offset)) {
+    addRelocation(relocation, expr.symbol, expr.value);
+    emit32(base);
+    return;
+  } else {
+    offset += expr.value;
+  }
+  int64_t range = 1LL << (bits + 1);
+  if (as.final && ((offset & 3) != 0 || offset < -range || offset >= range)) {
+    asmError("Branch target out of range");
+  }
+  uint32_t field = (uint32_t)((offset >> 2) & ((1LL << bits) - 1));
+  emit32(base | (field << shift));
+}
+
+static int loadStoreScale(REG rt, int size) {
+  if (rt.kind == 'q') {
+    return 4;
+  }
+  return size;
+}
+
+// Encodes the single register load/store family. size is log2 of the
+// access width, opc the load/store/sign-extend selector, and V marks
+// SIMD&FP registers.
+static void encodeLoadStore(INSTRUCTION* in, uint32_t size, uint32_t opc, uint32_t v, bool unscaled) {
+  REG rt = expectRegister(in->operands[0]);
+  if (in->count == 2 && in->operands[1][0] != '[') {
+    // literal load
+    uint32_t literalOpc = v ? (size == 2 ? 0 : (size == 3 ? 1 : 2)) : (opc == 2 ? 2 : (size == 3 ? 1 : 0));
+    encodeBranchTo(in->operands[1], 0x18000000 | (literalOpc << 30) | (v << 26) | rt.num, 19, 5, R_AARCH64_LD_PREL_LO19);
+    return;
+  }
+  ADDRESS address = parseAddress(in->operands, in->count, 1);
+  int scale = loadStoreScale(rt, size);
+  uint32_t common = (size << 30) | (v << 26) | (opc << 22) | (address.base.num << 5) | rt.num;
+  switch (address.mode) {
+    case ADDR_REGISTER:
+      {
+        if (address.hasAmount && address.amount != 0 && address.amount != scale) {
+          asmError("Register offset must be scaled by the access size");
+        }
+        uint32_t s = address.hasAmount && address.amount == scale && scale != 0;
+        if (address.hasAmount && scale == 0) {
+          s = 1;
+        }
+        emit32(0x38200800 | common | (address.index.num << 16) | (address.extend << 13) | (s << 12));
+        return;
+      }
+    case ADDR_PRE:
+    case ADDR_POST:
+      {
+        int64_t value = address.offset.value;
+        if (address.offset.hasSymbol || value < -256 || value > 255) {
+          asmError("Writeback offset out of range");
+        }
+        uint32_t mode = address.mode == ADDR_PRE ? 3 : 1;
+        emit32(0x38000000 | common | ((uint32_t)(value & 0x1FF) << 12) | (mode << 10));
+        return;
+      }
+    case ADDR_OFFSET:
+      {
+        EXPR offset = address.offset;
+        if (offset.hasSymbol) {
+          if (offset.modifier != MOD_PAGEOFF || unscaled) {
+            asmError("Only a symbol's page offset can be used here");
+          }
+          static const uint32_t relocations[] = {
+            R_AARCH64_LDST8_ABS_LO12_NC, R_AARCH64_LDST16_ABS_LO12_NC,
+            R_AARCH64_LDST32_ABS_LO12_NC, R_AARCH64_LDST64_ABS_LO12_NC,
+            R_AARCH64_LDST128_ABS_LO12_NC
+          };
+          addRelocation(relocations[scale], offset.symbol, offset.value);
+          emit32(0x39000000 | common);
+          return;
+        }
+        int64_t value = offset.value;
+        int64_t unit = 1LL << scale;
+        if (!unscaled && value >= 0 && value % unit == 0 && value / unit <= 0xFFF) {
+          emit32(0x39000000 | common | ((uint32_t)(value / unit) << 10));
+          return;
+        }
+        if (value < -256 || value > 255) {
+          asmError("Offset out of range");
+        }
+        emit32(0x38000000 | common | ((uint32_t)(value & 0x1FF) << 12));
+        return;
+      }
+  }
+}
+
+static void encodePair(INSTRUCTION* in, uint32_t load, bool signedWord) {
+  expectCount(in, 3, 4);
+  REG rt = expectRegister(in->operands[0]);
+  REG rt2 = expectRegister(in->operands[1]);
+  ADDRESS address = parseAddress(in->operands, in->count, 2);
+  uint32_t v = isGeneral(rt) ? 0 : 1;
+  uint32_t opc;
+  int scale;
+  if (v) {
+    opc = rt.kind == 's' ? 0 : (rt.kind == 'd' ? 1 : 2);
+    scale = 2 + opc;
+  } else if (signedWord) {
+    opc = 1;
+    scale = 2;
+  } else {
+    opc = rt.kind == 'x' ? 2 : 0;
+    scale = rt.kind == 'x' ? 3 : 2;
+  }
+  if (address.mode == ADDR_REGISTER || address.offset.hasSymbol) {
+    asmError("Unsupported addressing mode for a register pair");
+  }
+  int64_t value = address.offset.value;
+  if (value % (1LL << scale) != 0 || (value >> scale) < -64 || (value >> scale) > 63) {
+    asmError("Pair offset out of range");
+  }
+  uint32_t mode = address.mode == ADDR_POST ? 1 : (address.mode == ADDR_PRE ? 3 : 2);
+  emit32(0x28000000 | (opc << 30) | (v << 26) | (mode << 23) | (load << 22) | ((uint32_t)((value >> scale) & 0x7F) << 15) | (rt2.num << 10) | (address.base.num << 5) | rt.num);
+}
+
+static bool assembleInstruction(INSTRUCTION* in) {
+  const char* m = in->mnemonic;
+  char (*ops)[OPERAND_LENGTH] = in->operands;
+
+  if (equalsIgnoreCase(m, "add") || equalsIgnoreCase(m, "adds") || equalsIgnoreCase(m, "sub") || equalsIgnoreCase(m, "subs")) {
+    expectCount(in, 3, 4);
+    uint32_t op = tolower((unsigned char)m[0]) == 's';
+    uint32_t setFlags = strlen(m) == 4;
+    encodeAddSub(op, setFlags, expectRegister(ops[0]), expectRegister(ops[1]), ops + 2, in->count - 2);
+  } else if (equalsIgnoreCase(m, "cmp") || equalsIgnoreCase(m, "cmn")) {
+    expectCount(in, 2, 3);
+    REG rn = expectRegister(ops[0]);
+    REG zr = { 31, rn.kind, false };
+    encodeAddSub(equalsIgnoreCase(m, "cmp"), 1, zr, rn, ops + 1, in->count - 1);
+  } else if (equalsIgnoreCase(m, "neg") || equalsIgnoreCase(m, "negs")) {
+    expectCount(in, 2, 3);
+    REG rd = expectRegister(ops[0]);
+    REG zr = { 31, rd.kind, false };
+    encodeAddSub(1, equalsIgnoreCase(m, "negs"), rd, zr, ops + 1, in->count - 1);
+  } else if (equalsIgnoreCase(m, "and") || equalsIgnoreCase(m, "orr") || equalsIgnoreCase(m, "eor") || equalsIgnoreCase(m, "ands")
+      || equalsIgnoreCase(m, "bic") || equalsIgnoreCase(m, "orn") || equalsIgnoreCase(m, "eon") || equalsIgnoreCase(m, "bics")) {
+    expectCount(in, 3, 4);
+    static const char* names[] = { "and", "orr", "eor", "ands", "bic", "orn", "eon", "bics" };
+    int index = 0;
+    while (!equalsIgnoreCase(m, names[index])) {
+      index++;
+    }
+    encodeLogical(index & 3, index >> 2, expectRegister(ops[0]), expectRegister(ops[1]), ops + 2, in->count - 2);
+  } else if (equalsIgnoreCase(m, "tst")) {
+    expectCount(in, 2, 3);
+    REG rn = expectRegister(ops[0]);
+    REG zr = { 31, rn.kind, false };
+    encodeLogical(3, 0, zr, rn, ops + 1, in->count - 1);
+  } else if (equalsIgnoreCase(m, "mvn")) {
+    expectCount(in, 2, 3);
+    REG rd = expectRegister(ops[0]);
+    REG zr = { 31, rd.kind, false };
+    encodeLogical(1, 1, rd, zr, ops + 1, in->count - 1);
+  } else if (equalsIgnoreCase(m, "mov")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    REG rm;
+    if (parseRegister(ops[1], &rm)) {
+      if (rd.sp || rm.sp) {
+        emit32(0x11000000 | (sf(rd) << 31) | (rm.num << 5) | rd.num);
+      } else {
+        emit32(0x2A0003E0 | (sf(rd) << 31) | (rm.num << 16) | rd.num);
+      }
+    } else {
+      uint32_t word;
+      if (!encodeMoveImmediate((uint64_t)expectImmediate(ops[1]), rd, &word)) {
+        asmError("Immediate cannot be moved in one instruction");
+      }
+      emit32(word);
+    }
+  } else if (equalsIgnoreCase(m, "movz") || equalsIgnoreCase(m, "movn") || equalsIgnoreCase(m, "movk")) {
+    expectCount(in, 2, 3);
+    REG rd = expectRegister(ops[0]);
+    uint32_t opc = equalsIgnoreCase(m, "movn") ? 0 : (equalsIgnoreCase(m, "movz") ? 2 : 3);
+    int64_t value = expectImmediate(ops[1]);
+    int amount = 0;
+    bool hasAmount = false;
+    if (in->count == 3 && (parseModifier(ops[2], &amount, &hasAmount) != 0 || amount % 16 != 0 || amount >= (rd.kind == 'x' ? 64 : 32))) {
+      asmError("Expected LSL by a multiple of 16");
+    }
+    if (value < 0 || value > 0xFFFF) {
+      asmError("Immediate out of range");
+    }
+    emit32(0x12800000 | (sf(rd) << 31) | (opc << 29) | ((amount / 16) << 21) | ((uint32_t)value << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "lsl") || equalsIgnoreCase(m, "lsr") || equalsIgnoreCase(m, "asr") || equalsIgnoreCase(m, "ror")) {
+    expectCount(in, 3, 3);
+    REG rd = expectRegister(ops[0]);
+    REG rn = expectRegister(ops[1]);
+    REG rm;
+    int kind = equalsIgnoreCase(m, "lsl") ? 0 : equalsIgnoreCase(m, "lsr") ? 1 : equalsIgnoreCase(m, "asr") ? 2 : 3;
+    if (parseRegister(ops[2], &rm)) {
+      emit32(0x1AC02000 | (sf(rd) << 31) | (rm.num << 16) | (kind << 10) | (rn.num << 5) | rd.num);
+    } else {
+      int size = rd.kind == 'x' ? 64 : 32;
+      int64_t amount = expectImmediate(ops[2]);
+      if (amount < 0 || amount >= size) {
+        asmError("Shift out of range");
+      }
+      if (kind == 0) {
+        encodeBitfield(2, rd, rn, (size - amount) % size, size - 1 - amount);
+      } else if (kind == 3) {
+        emit32(0x13800000 | (sf(rd) << 31) | (sf(rd) << 22) | (rn.num << 16) | ((uint32_t)amount << 10) | (rn.num << 5) | rd.num);
+      } else {
+        encodeBitfield(kind == 1 ? 2 : 0, rd, rn, amount, size - 1);
+      }
+    }
+  } else if (equalsIgnoreCase(m, "sxtb") || equalsIgnoreCase(m, "sxth") || equalsIgnoreCase(m, "sxtw")
+      || equalsIgnoreCase(m, "uxtb") || equalsIgnoreCase(m, "uxth")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    REG rn = expectRegister(ops[1]);
+    char width = tolower((unsigned char)m[3]);
+    uint32_t imms = width == 'b' ? 7 : (width == 'h' ? 15 : 31);
+    encodeBitfield(tolower((unsigned char)m[0]) == 's' ? 0 : 2, rd, rn, 0, imms);
+  } else if (equalsIgnoreCase(m, "ubfx") || equalsIgnoreCase(m, "sbfx") || equalsIgnoreCase(m, "bfxil")
+      || equalsIgnoreCase(m, "ubfiz") || equalsIgnoreCase(m, "sbfiz") || equalsIgnoreCase(m, "bfi")) {
+    expectCount(in, 4, 4);
+    REG rd = expectRegister(ops[0]);
+    REG rn = expectRegister(ops[1]);
+    int size = rd.kind == 'x' ? 64 : 32;
+    int64_t lsb = expectImmediate(ops[2]);
+    int64_t width = expectImmediate(ops[3]);
+    if (lsb < 0 || width < 1 || lsb + width > size) {
+      asmError("Bitfield out of range");
+    }
+    uint32_t opc = tolower((unsigned char)m[0]) == 's' ? 0 : (tolower((unsigned char)m[0]) == 'u' ? 2 : 1);
+    bool insert = strstr(m, "iz") != NULL || strstr(m, "IZ") != NULL || equalsIgnoreCase(m, "bfi");
+    if (insert) {
+      encodeBitfield(opc, rd, rn, (size - lsb) % size, width - 1);
+    } else {
+      encodeBitfield(opc, rd, rn, lsb, lsb + width - 1);
+    }
+  } else if (equalsIgnoreCase(m, "sbfm") || equalsIgnoreCase(m, "bfm") || equalsIgnoreCase(m, "ubfm")) {
+    expectCount(in, 4, 4);
+    uint32_t opc = tolower((unsigned char)m[0]) == 's' ? 0 : (tolower((unsigned char)m[0]) == 'b' ? 1 : 2);
+    encodeBitfield(opc, expectRegister(ops[0]), expectRegister(ops[1]), expectImmediate(ops[2]), expectImmediate(ops[3]));
+  } else if (equalsIgnoreCase(m, "udiv") || equalsIgnoreCase(m, "sdiv") || equalsIgnoreCase(m, "lslv")
+      || equalsIgnoreCase(m, "lsrv") || equalsIgnoreCase(m, "asrv") || equalsIgnoreCase(m, "rorv")) {
+    expectCount(in, 3, 3);
+    static const char* names[] = { "udiv", "sdiv", "lslv", "lsrv", "asrv", "rorv" };
+    static const uint32_t opcodes[] = { 2, 3, 8, 9, 10, 11 };
+    int index = 0;
+    while (!equalsIgnoreCase(m, names[index])) {
+      index++;
+    }
+    REG rd = expectRegister(ops[0]);
+    emit32(0x1AC00000 | (sf(rd) << 31) | (expectRegister(ops[2]).num << 16) | (opcodes[index] << 10) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "madd") || equalsIgnoreCase(m, "msub") || equalsIgnoreCase(m, "mul") || equalsIgnoreCase(m, "mneg")) {
+    bool accumulate = equalsIgnoreCase(m, "madd") || equalsIgnoreCase(m, "msub");
+    expectCount(in, accumulate ? 4 : 3, accumulate ? 4 : 3);
+    uint32_t o0 = equalsIgnoreCase(m, "msub") || equalsIgnoreCase(m, "mneg");
+    REG rd = expectRegister(ops[0]);
+    uint32_t ra = accumulate ? expectRegister(ops[3]).num : 31;
+    emit32(0x1B000000 | (sf(rd) << 31) | (expectRegister(ops[2]).num << 16) | (o0 << 15) | (ra << 10) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "smaddl") || equalsIgnoreCase(m, "umaddl") || equalsIgnoreCase(m, "smsubl") || equalsIgnoreCase(m, "umsubl")
+      || equalsIgnoreCase(m, "smull") || equalsIgnoreCase(m, "umull")) {
+    bool accumulate = strlen(m) == 6;
+    expectCount(in, accumulate ? 4 : 3, accumulate ? 4 : 3);
+    uint32_t u = tolower((unsigned char)m[0]) == 'u';
+    uint32_t o0 = accumulate && tolower((unsigned char)m[2]) == 's';
+    REG rd = expectRegister(ops[0]);
+    uint32_t ra = accumulate ? expectRegister(ops[3]).num : 31;
+    emit32(0x9B200000 | (u << 23) | (expectRegister(ops[2]).num << 16) | (o0 << 15) | (ra << 10) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "smulh") || equalsIgnoreCase(m, "umulh")) {
+    expectCount(in, 3, 3);
+    uint32_t u = tolower((unsigned char)m[0]) == 'u';
+    REG rd = expectRegister(ops[0]);
+    emit32(0x9B407C00 | (u << 23) | (expectRegister(ops[2]).num << 16) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "csel") || equalsIgnoreCase(m, "csinc") || equalsIgnoreCase(m, "csinv") || equalsIgnoreCase(m, "csneg")) {
+    expectCount(in, 4, 4);
+    uint32_t op = equalsIgnoreCase(m, "csinv") || equalsIgnoreCase(m, "csneg");
+    uint32_t op2 = equalsIgnoreCase(m, "csinc") || equalsIgnoreCase(m, "csneg");
+    REG rd = expectRegister(ops[0]);
+    emit32(0x1A800000 | (sf(rd) << 31) | (op << 30) | (expectRegister(ops[2]).num << 16) | (parseCondition(ops[3]) << 12) | (op2 << 10) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "cset") || equalsIgnoreCase(m, "csetm")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    uint32_t op = equalsIgnoreCase(m, "csetm");
+    uint32_t cond = parseCondition(ops[1]) ^ 1;
+    emit32(0x1A800000 | (sf(rd) << 31) | (op << 30) | (31 << 16) | (cond << 12) | ((1 - op) << 10) | (31 << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "cinc") || equalsIgnoreCase(m, "cinv") || equalsIgnoreCase(m, "cneg")) {
+    expectCount(in, 3, 3);
+    REG rd = expectRegister(ops[0]);
+    REG rn = expectRegister(ops[1]);
+    uint32_t op = !equalsIgnoreCase(m, "cinc");
+    uint32_t op2 = !equalsIgnoreCase(m, "cinv");
+    uint32_t cond = parseCondition(ops[2]) ^ 1;
+    emit32(0x1A800000 | (sf(rd) << 31) | (op << 30) | (rn.num << 16) | (cond << 12) | (op2 << 10) | (rn.num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "clz") || equalsIgnoreCase(m, "cls") || equalsIgnoreCase(m, "rbit") || equalsIgnoreCase(m, "rev")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    uint32_t opcode = equalsIgnoreCase(m, "rbit") ? 0 : equalsIgnoreCase(m, "clz") ? 4 : equalsIgnoreCase(m, "cls") ? 5 : (rd.kind == 'x' ? 3 : 2);
+    emit32(0x5AC00000 | (sf(rd) << 31) | (opcode << 10) | (expectRegister(ops[1]).num << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "b") || equalsIgnoreCase(m, "bl")) {
+    expectCount(in, 1, 1);
+    bool link = equalsIgnoreCase(m, "bl");
+    encodeBranchTo(ops[0], link ? 0x94000000 : 0x14000000, 26, 0, link ? R_AARCH64_CALL26 : R_AARCH64_JUMP26);
+  } else if ((m[0] == 'b' || m[0] == 'B') && m[1] == '.') {
+    expectCount(in, 1, 1);
+    encodeBranchTo(ops[0], 0x54000000 | parseCondition(m + 2), 19, 5, R_AARCH64_CONDBR19);
+  } else if (equalsIgnoreCase(m, "cbz") || equalsIgnoreCase(m, "cbnz")) {
+    expectCount(in, 2, 2);
+    REG rt = expectRegister(ops[0]);
+    uint32_t op = equalsIgnoreCase(m, "cbnz");
+    encodeBranchTo(ops[1], 0x34000000 | (sf(rt) << 31) | (op << 24) | rt.num, 19, 5, R_AARCH64_CONDBR19);
+  } else if (equalsIgnoreCase(m, "tbz") || equalsIgnoreCase(m, "tbnz")) {
+    expectCount(in, 3, 3);
+    REG rt = expectRegister(ops[0]);
+    int64_t bit = expectImmediate(ops[1]);
+    if (bit < 0 || bit >= (rt.kind == 'x' ? 64 : 32)) {
+      asmError("Bit number out of range");
+    }
+    uint32_t op = equalsIgnoreCase(m, "tbnz");
+    uint32_t base = 0x36000000 | ((uint32_t)(bit >> 5) << 31) | (op << 24) | ((uint32_t)(bit & 0x1F) << 19) | rt.num;
+    encodeBranchTo(ops[2], base, 14, 5, R_AARCH64_TSTBR14);
+  } else if (equalsIgnoreCase(m, "br") || equalsIgnoreCase(m, "blr")) {
+    expectCount(in, 1, 1);
+    emit32((equalsIgnoreCase(m, "br") ? 0xD61F0000 : 0xD63F0000) | (expectRegister(ops[0]).num << 5));
+  } else if (equalsIgnoreCase(m, "ret")) {
+    expectCount(in, 0, 1);
+    uint32_t rn = in->count == 1 ? expectRegister(ops[0]).num : 30;
+    emit32(0xD65F0000 | (rn << 5));
+  } else if (equalsIgnoreCase(m, "svc")) {
+    expectCount(in, 1, 1);
+    int64_t value = expectImmediate(ops[0]);
+    if (value < 0 || value > 0xFFFF) {
+      asmError("Immediate out of range");
+    }
+    emit32(0xD4000001 | ((uint32_t)value << 5));
+  } else if (equalsIgnoreCase(m, "nop")) {
+    emit32(0xD503201F);
+  } else if (equalsIgnoreCase(m, "adr")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    EXPR expr = expectExpression(ops[1]);
+    int64_t offset = 0;
+    if (expr.hasSymbol && !localOffset(expr.symbol, &offset)) {
+      addRelocation(R_AARCH64_ADR_PREL_LO21, expr.symbol, expr.value);
+      offset = 0;
+    } else {
+      offset += expr.value;
+    }
+    if (as.final && (offset < -(1 << 20) || offset >= (1 << 20))) {
+      asmError("ADR target out of range");
+    }
+    emit32(0x10000000 | ((uint32_t)(offset & 3) << 29) | ((uint32_t)((offset >> 2) & 0x7FFFF) << 5) | rd.num);
+  } else if (equalsIgnoreCase(m, "adrp")) {
+    expectCount(in, 2, 2);
+    REG rd = expectRegister(ops[0]);
+    EXPR expr = expectExpression(ops[1]);
+    if (!expr.hasSymbol || expr.modifier == MOD_PAGEOFF) {
+      asmError("ADRP expects a symbol's page");
+    }
+    addRelocation(R_AARCH64_ADR_PREL_PG_HI21, expr.symbol, expr.value);
+    emit32(0x90000000 | rd.num);
+  } else if (equalsIgnoreCase(m, "ldp") || equalsIgnoreCase(m, "stp") || equalsIgnoreCase(m, "ldpsw")) {
+    encodePair(in, tolower((unsigned char)m[0]) == 'l', equalsIgnoreCase(m, "ldpsw"));
+  } else {
+    // single register loads and stores
+    static const struct { const char* name; int size; int opc; bool unscaled; } forms[] = {
+      { "strb", 0, 0, false }, { "ldrb", 0, 1, false }, { "ldrsb", 0, -1, false },
+      { "strh", 1, 0, false }, { "ldrh", 1, 1, false }, { "ldrsh", 1, -1, false },
+      { "ldrsw", 2, 2, false }, { "str", -1, 0, false }, { "ldr", -1, 1, false },
+      { "sturb", 0, 0, true }, { "ldurb", 0, 1, true }, { "ldursb", 0, -1, true },
+      { "sturh", 1, 0, true }, { "ldurh", 1, 1, true }, { "ldursh", 1, -1, true },
+      { "ldursw", 2, 2, true }, { "stur", -1, 0, true }, { "ldur", -1, 1, true },
+    };
+    for (size_t i = 0; i < sizeof(forms) / sizeof(forms[0]); i++) {
+      if (!equalsIgnoreCase(m, forms[i].name)) {
+        continue;
+      }
+      expectCount(in, 2, 3);
+      REG rt = expectRegister(in->operands[0]);
+      int size = forms[i].size;
+      int opc = forms[i].opc;
+      uint32_t v = 0;
+      if (size < 0) {
+        // access width comes from the register
+        switch (rt.kind) {
+          case 'x': size = 3; break;
+          case 'w': size = 2; break;
+          case 'q': size = 0; v = 1; opc += 2; break;
+          case 'd': size = 3; v = 1; break;
+          case 's': size = 2; v = 1; break;
+          case 'h': size = 1; v = 1; break;
+          case 'b': size = 0; v = 1; break;
+          default: asmError("Unsupported register for a load or store");
+        }
+      } else if (opc < 0) {
+        // sign-extending loads pick their width from the destination
+        opc = rt.kind == 'x' ? 2 : 3;
+      }
+      encodeLoadStore(in, size, opc, v, forms[i].unscaled);
+      return true;
+    }
+    return false;
+  }
+  return true;
+}
+
+// ---- Directives ----
+
+static void emitData(const char* text, int size) {
+  char operands[MAX_OPERANDS][OPERAND_LENGTH];
+  int count = splitOperands(text, operands);
+  for (int i = 0; i < count; i++) {
+    EXPR expr = expectExpression(operands[i]);
+    if (expr.hasSymbol) {
+      if (size != 8 && size != 4) {
+        asmError("Symbols need a 32 or 64-bit data directive");
+      }
+      addRelocation(size == 8 ? R_AARCH64_ABS64 : R_AARCH64_ABS32, expr.symbol, expr.value);
+      emitValue(0, size);
+    } else {
+      emitValue((uint64_t)expr.value, size);
+    }
+  }
+}
+
+static void emitString(const char* text, bool terminate) {
+  const char* c = text;
+  while (isspace((unsigned char)*c)) {
+    c++;
+  }
+  if (*c != '"') {
+    asmError("Expected a string");
+  }
+  c++;
+  while (*c != '"') {
+    if (*c == '\0') {
+      asmError("Unterminated string");
+    }
+    char value = *c;
+    if (*c == '\\') {
+      c++;
+      switch (*c) {
+        case 'n': value = '\n'; break;
+        case 't': value = '\t'; break;
+        case 'r': value = '\r'; break;
+        case '0': value = '\0'; break;
+        default: value = *c; break;
+      }
+    }
+    emit8((uint8_t)value);
+    c++;
+  }
+  if (terminate) {
+    emit8(0);
+  }
+}
+
+static void alignTo(uint64_t alignment) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    asmError("Alignment must be a power of two");
+  }
+  ELF_SECTION* section = &as.object.sections[as.section];
+  if (section->align < alignment) {
+    section->align = alignment;
+  }
+  while (currentOffset() % alignment != 0) {
+    if (isExecutable(as.section) && currentOffset() % 4 == 0) {
+      emit32(0xD503201F);
+    } else {
+      emit8(0);
+    }
+  }
+}
+
+static void assembleDirective(const char* name, const char* rest) {
+  if (equalsIgnoreCase(name, ".text")) {
+    switchSection(true);
+  } else if (equalsIgnoreCase(name, ".data")) {
+    switchSection(false);
+  } else if (equalsIgnoreCase(name, ".section")) {
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    splitOperands(rest, operands);
+    bool text = strncmp(operands[0], ".text", 5) == 0 || strstr(operands[0], "__text") != NULL;
+    as.section = findSection(operands[0], ELF_SHF_ALLOC | (text ? ELF_SHF_EXECINSTR : ELF_SHF_WRITE));
+  } else if (equalsIgnoreCase(name, ".fang_bank")) {
+    bool text = isExecutable(as.section);
+    as.bank = strcmp(rest, "main") == 0 ? NULL : rest;
+    if (as.bank != NULL) {
+      char* stored = copyString(rest, strlen(rest));
+      arrput(as.names, stored);
+      as.bank = stored;
+    }
+    switchSection(text);
+  } else if (equalsIgnoreCase(name, ".fang_endbank")) {
+    bool text = isExecutable(as.section);
+    as.bank = NULL;
+    switchSection(text);
+  } else if (equalsIgnoreCase(name, ".global") || equalsIgnoreCase(name, ".globl")) {
+    int index = symbolIndex(rest);
+    as.symbols[index].global = true;
+  } else if (equalsIgnoreCase(name, ".balign")) {
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    splitOperands(rest, operands);
+    alignTo(expectImmediate(operands[0]));
+  } else if (equalsIgnoreCase(name, ".align") || equalsIgnoreCase(name, ".p2align")) {
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    splitOperands(rest, operands);
+    alignTo(1ULL << expectImmediate(operands[0]));
+  } else if (equalsIgnoreCase(name, ".byte")) {
+    emitData(rest, 1);
+  } else if (equalsIgnoreCase(name, ".hword") || equalsIgnoreCase(name, ".short") || equalsIgnoreCase(name, ".2byte")) {
+    emitData(rest, 2);
+  } else if (equalsIgnoreCase(name, ".word") || equalsIgnoreCase(name, ".long") || equalsIgnoreCase(name, ".int") || equalsIgnoreCase(name, ".4byte")) {
+    emitData(rest, 4);
+  } else if (equalsIgnoreCase(name, ".quad") || equalsIgnoreCase(name, ".xword") || equalsIgnoreCase(name, ".8byte")) {
+    emitData(rest, 8);
+  } else if (equalsIgnoreCase(name, ".ascii")) {
+    emitString(rest, false);
+  } else if (equalsIgnoreCase(name, ".asciz") || equalsIgnoreCase(name, ".string")) {
+    emitString(rest, true);
+  } else if (equalsIgnoreCase(name, ".zero") || equalsIgnoreCase(name, ".space") || equalsIgnoreCase(name, ".skip")) {
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    int count = splitOperands(rest, operands);
+    int64_t length = expectImmediate(operands[0]);
+    int64_t fill = count > 1 ? expectImmediate(operands[1]) : 0;
+    for (int64_t i = 0; i < length; i++) {
+      emit8((uint8_t)fill);
+    }
+  } else if (equalsIgnoreCase(name, ".fill")) {
+    char operands[MAX_OPERANDS][OPERAND_LENGTH];
+    int count = splitOperands(rest, operands);
+    int64_t repeat = expectImmediate(operands[0]);
+    int64_t size = count > 1 ? expectImmediate(operands[1]) : 1;
+    int64_t value = count > 2 ? expectImmediate(operands[2]) : 0;
+    if (size < 0 || size > 8) {
+      asmError("Fill size out of range");
+    }
+    for (int64_t i = 0; i < repeat; i++) {
+      emitValue((uint64_t)value, size);
+    }
+  } else if (equalsIgnoreCase(name, ".type") || equalsIgnoreCase(name, ".size") || equalsIgnoreCase(name, ".file")) {
+    // symbol metadata is not tracked
+  } else {
+    asmError("Unknown directive");
+  }
+}
+
+// ---- Preprocessing: comments, labels, macros and .rept ----
+
+static char* stripComment(const char* line) {
+  bool quoted = false;
+  const char* c = line;
+  while (*c != '\0') {
+    if (*c == '"') {
+      quoted = !quoted;
+    } else if (*c == '\'' && c[1] != '\0' && c[2] == '\'') {
+      c += 2;
+    } else if (!quoted && (*c == ';' || (*c == '/' && c[1] == '/'))) {
+      break;
+    }
+    c++;
+  }
+  char* copy = copyString(line, c - line);
+  char* trimmed = trim(copy);
+  memmove(copy, trimmed, strlen(trimmed) + 1);
+  return copy;
+}
+
+static const char* firstWord(const char* line, char* word, size_t size) {
+  size_t i = 0;
+  while (line[i] != '\0' && !isspace((unsigned char)line[i]) && i < size - 1) {
+    word[i] = line[i];
+    i++;
+  }
+  word[i] = '\0';
+  const char* rest = line + i;
+  while (isspace((unsigned char)*rest)) {
+    rest++;
+  }
+  return rest;
+}
+
+static MACRO* findMacro(const char* name) {
+  for (int i = 0; i < arrlen(as.macros); i++) {
+    if (equalsIgnoreCase(as.macros[i].name, name)) {
+      return &as.macros[i];
+    }
+  }
+  return NULL;
+}
+
+static char* substitute(const char* line, MACRO* macro, char args[MAX_OPERANDS][OPERAND_LENGTH], int argCount) {
+  BUFFER out;
+  BUFFER_init(&out);
+  const char* c = line;
+  while (*c != '\0') {
+    if (*c == '\\') {
+      bool replaced = false;
+      for (int i = 0; i < arrlen(macro->params); i++) {
+        size_t length = strlen(macro->params[i]);
+        if (strncmp(c + 1, macro->params[i], length) == 0 && !isIdentifierChar(c[1 + length])) {
+          if (i < argCount) {
+            BUFFER_puts(&out, args[i]);
+          }
+          c += 1 + length;
+          replaced = true;
+          break;
+        }
+      }
+      if (replaced) {
+        continue;
+      }
+    }
+    BUFFER_putc(&out, *c);
+    c++;
+  }
+  BUFFER_putc(&out, '\0');
+  return out.data;
+}
+
+// Collects the body of a .macro or .rept block, honouring nesting.
+static int collectBlock(char** lines, int start, int count, const char* open, const char* close, char*** body) {
+  int depth = 1;
+  for (int i = start; i < count; i++) {
+    char word[32];
+    firstWord(lines[i], word, sizeof(word));
+    if (equalsIgnoreCase(word, open)) {
+      depth++;
+    } else if (equalsIgnoreCase(word, close)) {
+      depth--;
+      if (depth == 0) {
+        return i;
+      }
+    }
+    arrput(*body, lines[i]);
+  }
+  as.line = lines[start - 1];
+  asmError("Unterminated block");
+  return count;
+}
+
+static void expand(char** lines, int count, char*** out, int depth) {
+  if (depth > 64) {
+    asmError("Macro expansion is too deep");
+  }
+  for (int i = 0; i < count; i++) {
+    char* line = lines[i];
+    as.line = line;
+    char word[OPERAND_LENGTH];
+    const char* rest = firstWord(line, word, sizeof(word));
+    if (equalsIgnoreCase(word, ".macro")) {
+      MACRO macro = { NULL, NULL, NULL };
+      char name[OPERAND_LENGTH];
+      rest = firstWord(rest, name, sizeof(name));
+      macro.name = copyString(name, strlen(name));
+      while (*rest != '\0') {
+        char param[OPERAND_LENGTH];
+        size_t length = 0;
+        while (rest[length] != '\0' && rest[length] != ',' && !isspace((unsigned char)rest[length]) && length < sizeof(param) - 1) {
+          param[length] = rest[length];
+          length++;
+        }
+        param[length] = '\0';
+        if (length > 0) {
+          arrput(macro.params, copyString(param, length));
+        }
+        rest += length;
+        while (*rest == ',' || isspace((unsigned char)*rest)) {
+          rest++;
+        }
+      }
+      i = collectBlock(lines, i + 1, count, ".macro", ".endm", &macro.body);
+      arrput(as.macros, macro);
+      continue;
+    }
+    if (equalsIgnoreCase(word, ".rept")) {
+      int64_t repeat = expectImmediate(rest);
+      char** body = NULL;
+      i = collectBlock(lines, i + 1, count, ".rept", ".endr", &body);
+      for (int64_t j = 0; j < repeat; j++) {
+        expand(body, arrlen(body), out, depth + 1);
+      }
+      arrfree(body);
+      continue;
+    }
+    MACRO* macro = findMacro(word);
+    if (macro != NULL) {
+      char args[MAX_OPERANDS][OPERAND_LENGTH];
+      int argCount = splitOperands(rest, args);
+      char** body = NULL;
+      for (int j = 0; j < arrlen(macro->body); j++) {
+        char* expanded = substitute(macro->body[j], macro, args, argCount);
+        arrput(as.names, expanded);
+        arrput(body, expanded);
+      }
+      expand(body, arrlen(body), out, depth + 1);
+      arrfree(body);
+      continue;
+    }
+    arrput(*out, line);
+  }
+}
+
+static void assembleLine(char* line) {
+  as.line = line;
+  // leading labels
+  while (true) {
+    const char* c = line;
+    while (isIdentifierChar(*c)) {
+      c++;
+    }
+    if (c == line || *c != ':') {
+      break;
+    }
+    char* name = copyString(line, c - line);
+    defineLabel(name);
+    free(name);
+    line = trim((char*)c + 1);
+  }
+  if (*line == '\0') {
+    return;
+  }
+
+  char word[OPERAND_LENGTH];
+  const char* rest = firstWord(line, word, sizeof(word));
+  if (word[0] == '.') {
+    assembleDirective(word, rest);
+    return;
+  }
+
+  char operands[MAX_OPERANDS][OPERAND_LENGTH];
+  INSTRUCTION in = { word, operands, splitOperands(rest, operands) };
+  if (!isExecutable(as.section)) {
+    asmError("Instruction outside of a code section");
+  }
+  if (currentOffset() % 4 != 0) {
+    asmError("Misaligned instruction");
+  }
+  if (!assembleInstruction(&in)) {
+    asmError("Unknown instruction");
+  }
+}
+
+bool ASM_ARM64_isBitmask(uint64_t value) {
+  uint32_t n, immr, imms;
+  return encodeBitmask(value, true, &n, &immr, &imms);
+}
+
+void ASM_ARM64_assemble(const char* text, size_t length, BUFFER* out) {
+  as.symbols = NULL;
+  as.symbolMap = NULL;
+  as.relocations = NULL;
+  as.macros = NULL;
+  as.names = NULL;
+  as.bank = NULL;
+  as.line = NULL;
+  sh_new_strdup(as.symbolMap);
+  ELF_init(&as.object, EM_AARCH64);
+  // .text comes first so code starts the object
+  switchSection(true);
+  switchSection(false);
+
+  char** source = NULL;
+  const char* start = text;
+  const char* end = text + length;
+  while (start < end) {
+    const char* newline = memchr(start, '\n', end - start);
+    if (newline == NULL) {
+      newline = end;
+    }
+    char* raw = copyString(start, newline - start);
+    char* trimmed = trim(raw);
+    char* statement;
+    // The backend marks banks with comments; they become sections here
+    if (strncmp(trimmed, "; SECTION (", 11) == 0) {
+      const char* name = trimmed + 11;
+      size_t nameLength = strcspn(name, ",)");
+      char buffer[OPERAND_LENGTH + 16];
+      snprintf(buffer, sizeof(buffer), ".fang_bank %.*s", (int)nameLength, name);
+      statement = copyString(buffer, strlen(buffer));
+    } else if (strncmp(trimmed, "; END SECTION", 13) == 0) {
+      statement = copyString(".fang_endbank", 13);
+    } else {
+      statement = stripComment(trimmed);
+    }
+    free(raw);
+    arrput(as.names, statement);
+    if (statement[0] != '\0') {
+      arrput(source, statement);
+    }
+    start = newline + 1;
+  }
+
+  char** lines = NULL;
+  expand(source, arrlen(source), &lines, 0);
+
+  // The first pass places every label, the second encodes with them known
+  for (int pass = 0; pass < 2; pass++) {
+    as.final = pass == 1;
+    as.bank = NULL;
+    for (int i = 0; i < arrlen(as.object.sections); i++) {
+      as.object.sections[i].data.length = 0;
+    }
+    switchSection(false);
+    for (int i = 0; i < arrlen(lines); i++) {
+      assembleLine(lines[i]);
+    }
+  }
+  as.line = NULL;
+
+  uint32_t* elfIndex = NULL;
+  arrsetlen(elfIndex, arrlen(as.symbols));
+  for (int i = 0; i < arrlen(as.symbols); i++) {
+    ASM_SYMBOL symbol = as.symbols[i];
+    bool temporary = symbol.name[0] == 'L' || strncmp(symbol.name, ".L", 2) == 0;
+    if (!symbol.defined && !symbol.referenced) {
+      continue;
+    }
+    if (temporary && !symbol.referenced && !symbol.global) {
+      continue;
+    }
+    uint8_t type = ELF_STT_NOTYPE;
+    if (symbol.defined && symbol.global) {
+      type = isExecutable(symbol.section) ? ELF_STT_FUNC : ELF_STT_OBJECT;
+    }
+    elfIndex[i] = ELF_addSymbol(&as.object, (ELF_SYMBOL){
+      .name = symbol.name,
+      .section = symbol.defined ? symbol.section : ELF_UNDEFINED,
+      .value = symbol.value,
+      .type = type,
+      .global = symbol.global || !symbol.defined
+    });
+  }
+  for (int i = 0; i < arrlen(as.relocations); i++) {
+    ASM_RELOCATION relocation = as.relocations[i];
+    relocation.rela.symbol = elfIndex[relocation.rela.symbol];
+    ELF_addRelocation(&as.object, relocation.section, relocation.rela);
+  }
+
+  ELF_write(&as.object, out);
+
+  ELF_free(&as.object);
+  arrfree(elfIndex);
+  for (int i = 0; i < arrlen(as.symbols); i++) {
+    free(as.symbols[i].name);
+  }
+  arrfree(as.symbols);
+  shfree(as.symbolMap);
+  arrfree(as.relocations);
+  for (int i = 0; i < arrlen(as.macros); i++) {
+    free(as.macros[i].name);
+    for (int j = 0; j < arrlen(as.macros[i].params); j++) {
+      free(as.macros[i].params[j]);
+    }
+    arrfree(as.macros[i].params);
+    arrfree(as.macros[i].body);
+  }
+  arrfree(as.macros);
+  for (int i = 0; i < arrlen(as.names); i++) {
+    free(as.names[i]);
+  }
+  arrfree(as.names);
+  arrfree(source);
+  arrfree(lines);
+}
@@ -0,0 +1,41 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef asm_arm64_h
+#define asm_arm64_h
+
+#include "common.h"
+#include "buffer.h"
+
+// Built-in assembler for the A64 subset produced by the arm64 backend,
+// including its macros, .rept blocks and the contents of asm blocks.
+// The assembled code is written to out as an ELF64 relocatable object.
+void ASM_ARM64_assemble(const char* text, size_t length, BUFFER* out);
+
+// Whether value can be the immediate of a 64-bit AND, ORR or EOR
+bool ASM_ARM64_isBitmask(uint64_t value);
+
+#endif
@@ -135,9 +135,9 @@ struct AST {
     struct AST_MATCH { AST** identifiers; AST** clauses; AST* elseClause; } AST_MATCH;
     struct AST_MATCH_CLAUSE { AST** identifiers; AST** types; AST* body; } AST_MATCH_CLAUSE;
     struct AST_IF { AST* condition; AST* body; AST* elseClause; } AST_IF;
-    struct AST_WHILE { AST* condition; AST* body; } AST_WHILE;
+    struct AST_WHILE { AST* condition; AST* body; STR annotation; } AST_WHILE;
     struct AST_DO_WHILE { AST* condition; AST* body; } AST_DO_WHILE;
-    struct AST_FOR { AST* initializer; AST* condition; AST* increment; AST* body; } AST_FOR;
+    struct AST_FOR { AST* initializer; AST* condition; AST* increment; AST* body; STR annotation; } AST_FOR;
     struct AST_CALL { AST* identifier; AST** arguments; } AST_CALL;
     struct AST_SUBSCRIPT { AST* left; AST* index; } AST_SUBSCRIPT;
     struct AST_CAST { AST* expr; AST* type; TYPE_ID tag; } AST_CAST;
@@ -149,7 +149,7 @@ struct AST {
     struct AST_VAR_INIT { STR identifier; AST* type; AST* expr; } AST_VAR_INIT;
     struct AST_CONST_DECL { STR identifier; AST* type; AST* expr; } AST_CONST_DECL;
 
-    struct AST_FN { STR identifier; AST** params; AST* returnType; AST* body; AST* fnType; int typeIndex; } AST_FN;
+    struct AST_FN { STR identifier; AST** params; AST* returnType; AST* body; AST* fnType; int typeIndex; STR annotation; } AST_FN;
     struct AST_ISR { STR identifier; AST* body; } AST_ISR;
     struct AST_TYPE_DECL { STR name; AST** fields; } AST_TYPE_DECL;
     struct AST_UNION { STR name; AST** fields; } AST_UNION;
@@ -0,0 +1,203 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "buffer.h"
+
+#define BUFFER_INITIAL_CAPACITY (64 * 1024)
+
+void BUFFER_init(BUFFER* buffer) {
+  buffer->data = NULL;
+  buffer->length = 0;
+  buffer->capacity = 0;
+}
+
+void BUFFER_free(BUFFER* buffer) {
+  free(buffer->data);
+  BUFFER_init(buffer);
+}
+
+void BUFFER_reserve(BUFFER* buffer, size_t length) {
+  if (buffer->length + length <= buffer->capacity) {
+    return;
+  }
+  size_t capacity = buffer->capacity < BUFFER_INITIAL_CAPACITY ? BUFFER_INITIAL_CAPACITY : buffer->capacity;
+  while (capacity < buffer->length + length) {
+    capacity *= 2;
+  }
+  buffer->data = realloc(buffer->data, capacity);
+  if (buffer->data == NULL) {
+    printf("Out of memory\n");
+    exit(1);
+  }
+  buffer->capacity = capacity;
+}
+
+void BUFFER_append(BUFFER* buffer, const char* chars, size_t length) {
+  BUFFER_reserve(buffer, length);
+  memcpy(buffer->data + buffer->length, chars, length);
+  buffer->length += length;
+}
+
+void BUFFER_puts(BUFFER* buffer, const char* chars) {
+  BUFFER_append(buffer, chars, strlen(chars));
+}
+
+void BUFFER_putc(BUFFER* buffer, char c) {
+  BUFFER_reserve(buffer, 1);
+  buffer->data[buffer->length++] = c;
+}
+
+void BUFFER_putUInt(BUFFER* buffer, uint64_t value) {
+  char digits[20];
+  int i = sizeof(digits);
+  do {
+    digits[--i] = '0' + (value % 10);
+    value /= 10;
+  } while (value > 0);
+  BUFFER_append(buffer, digits + i, sizeof(digits) - i);
+}
+
+void BUFFER_putInt(BUFFER* buffer, int64_t value) {
+  if (value < 0) {
+    BUFFER_putc(buffer, '-');
+    // negate in unsigned space so INT64_MIN survives
+    BUFFER_putUInt(buffer, -(uint64_t)value);
+  } else {
+    BUFFER_putUInt(buffer, value);
+  }
+}
+
+void BUFFER_printf(BUFFER* buffer, const char* format, ...) {
+  va_list args;
+  va_start(args, format);
+  const char* start = format;
+  const char* c = format;
+  while (*c != '\0') {
+    if (*c != '%') {
+      c++;
+      continue;
+    }
+    BUFFER_append(buffer, start, c - start);
+    c++;
+
+    int size = 0; // -2 hh, -1 h, 0 int, 1 l, 2 ll, 3 z
+    if (c[0] == 'h' && c[1] == 'h') {
+      size = -2;
+      c += 2;
+    } else if (c[0] == 'h') {
+      size = -1;
+      c++;
+    } else if (c[0] == 'l' && c[1] == 'l') {
+      size = 2;
+      c += 2;
+    } else if (c[0] == 'l') {
+      size = 1;
+      c++;
+    } else if (c[0] == 'z') {
+      size = 3;
+      c++;
+    }
+
+    switch (*c) {
+      case 's':
+        {
+          BUFFER_puts(buffer, va_arg(args, const char*));
+          break;
+        }
+      case 'c':
+        {
+          BUFFER_putc(buffer, (char)va_arg(args, int));
+          break;
+        }
+      case 'd':
+      case 'i':
+        {
+          int64_t value;
+          switch (size) {
+            case -2: value = (signed char)va_arg(args, int); break;
+            case -1: value = (short)va_arg(args, int); break;
+            case 1: value = va_arg(args, long); break;
+            case 2: value = va_arg(args, long long); break;
+            case 3: value = (int64_t)va_arg(args, size_t); break;
+            default: value = va_arg(args, int); break;
+          }
+          BUFFER_putInt(buffer, value);
+          break;
+        }
+      case 'u':
+        {
+          uint64_t value;
+          switch (size) {
+            case -2: value = (unsigned char)va_arg(args, unsigned int); break;
+            case -1: value = (unsigned short)va_arg(args, unsigned int); break;
+            case 1: value = va_arg(args, unsigned long); break;
+            case 2: value = va_arg(args, unsigned long long); break;
+            case 3: value = va_arg(args, size_t); break;
+            default: value = va_arg(args, unsigned int); break;
+          }
+          BUFFER_putUInt(buffer, value);
+          break;
+        }
+      case '%':
+        {
+          BUFFER_putc(buffer, '%');
+          break;
+        }
+      default:
+        {
+          printf("Unsupported format directive in \"%s\"\n", format);
+          exit(1);
+        }
+    }
+    c++;
+    start = c;
+  }
+  BUFFER_append(buffer, start, c - start);
+  va_end(args);
+}
+
+bool BUFFER_flush(BUFFER* buffer, int fd) {
+  size_t written = 0;
+  while (written < buffer->length) {
+    ssize_t result = write(fd, buffer->data + written, buffer->length - written);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    written += result;
+  }
+  buffer->length = 0;
+  return true;
+}
@@ -0,0 +1,52 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef buffer_h
+#define buffer_h
+
+#include "common.h"
+
+// Append-only output buffer used by the emitters. Formatting is done by
+// hand: BUFFER_printf understands %s %c %d %i %u and %%, with optional
+// hh, h, l, ll and z length modifiers, and nothing else.
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+} BUFFER;
+
+void BUFFER_init(BUFFER* buffer);
+void BUFFER_free(BUFFER* buffer);
+void BUFFER_reserve(BUFFER* buffer, size_t length);
+void BUFFER_append(BUFFER* buffer, const char* chars, size_t length);
+void BUFFER_puts(BUFFER* buffer, const char* chars);
+void BUFFER_putc(BUFFER* buffer, char c);
+void BUFFER_putInt(BUFFER* buffer, int64_t value);
+void BUFFER_putUInt(BUFFER* buffer, uint64_t value);
+void BUFFER_printf(BUFFER* buffer, const char* format, ...);
+bool BUFFER_flush(BUFFER* buffer, int fd);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+#include "symbol_table.h"
+#include "type_table.h"
+#include "options.h"
+
+// Bump whenever the backend's output changes for the same input, so
+// stale fragments from an older compiler are never spliced in.
+#define CACHE_VERSION "fang-cache-30"
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static const char* cacheDirectory = NULL;
+static PLATFORM cachePlatform;
+static TYPE_ID* visiting = NULL;
+
+static void hashBytes(uint64_t* hash, const void* data, size_t length) {
+  const unsigned char* bytes = data;
+  uint64_t h = *hash;
+  for (size_t i = 0; i < length; i++) {
+    h ^= bytes[i];
+    h *= FNV_PRIME;
+  }
+  *hash = h;
+}
+
+static void hashInt(uint64_t* hash, int64_t value) {
+  hashBytes(hash, &value, sizeof(value));
+}
+
+static void hashChars(uint64_t* hash, const char* chars) {
+  size_t length = strlen(chars);
+  hashInt(hash, length);
+  hashBytes(hash, chars, length);
+}
+
+static void hashStr(uint64_t* hash, STR str) {
+  if (str == EMPTY_STRING) {
+    hashInt(hash, -1);
+    return;
+  }
+  hashChars(hash, CHARS(str));
+}
+
+static void hashType(uint64_t* hash, TYPE_ID id) {
+  // Only the layout matters to the backend, not the type's name or
+  // position in the type table. Recursive types hash a back-reference.
+  for (int i = 0; i < arrlen(visiting); i++) {
+    if (visiting[i] == id) {
+      hashInt(hash, -(i + 1));
+      return;
+    }
+  }
+  TYPE_ENTRY entry = TYPE_get(id);
+  hashInt(hash, entry.entryType);
+  hashInt(hash, cachePlatform.getSize(id));
+  hashInt(hash, arrlen(entry.fields));
+  PUSH(visiting, id);
+  for (int i = 0; i < arrlen(entry.fields); i++) {
+    hashStr(hash, entry.fields[i].name);
+    hashInt(hash, entry.fields[i].elementCount);
+    hashType(hash, entry.fields[i].typeIndex);
+  }
+  POP(visiting);
+}
+
+static void hashValue(uint64_t* hash, Value value) {
+  hashInt(hash, value.type);
+  if (IS_STRING(value)) {
+    hashStr(hash, AS_STRING(value));
+  } else if (IS_PTR(value)) {
+    hashInt(hash, AS_PTR(value));
+  } else if (IS_NUMERICAL(value)) {
+    hashInt(hash, AS_NUMBER(value));
+  }
+}
+
+static void hashNode(uint64_t* hash, AST* ptr);
+
+static void hashSymbol(uint64_t* hash, SYMBOL_TABLE_ENTRY entry) {
+  hashInt(hash, entry.defined);
+  if (!entry.defined) {
+    return;
+  }
+  hashInt(hash, entry.entryType);
+  hashInt(hash, entry.storageType);
+  hashInt(hash, entry.elementCount);
+  hashType(hash, entry.typeIndex);
+  bool global = entry.storageType == STORAGE_TYPE_GLOBAL || entry.storageType == STORAGE_TYPE_GLOBAL_OBJECT;
+  if (!global || entry.entryType == SYMBOL_TYPE_FUNCTION || entry.entryType == SYMBOL_TYPE_CONSTANT || entry.entryType == SYMBOL_TYPE_VARIABLE) {
+    // the backend's rendering of the symbol: its mangled name, or its
+    // frame slot for locals and parameters
+    hashChars(hash, cachePlatform.symbol(entry));
+  }
+  // Uses of constants may be replaced by their value
+  hashNode(hash, entry.constant);
+}
+
+static void hashName(uint64_t* hash, AST* ptr, STR name) {
+  hashStr(hash, name);
+  SYMBOL_TABLE_ENTRY entry = SYMBOL_TABLE_get(ptr->scopeIndex, name);
+  if (!entry.defined) {
+    entry = SYMBOL_TABLE_checkBanks(name);
+  }
+  hashSymbol(hash, entry);
+}
+
+static void hashNodes(uint64_t* hash, AST** nodes) {
+  hashInt(hash, arrlen(nodes));
+  for (int i = 0; i < arrlen(nodes); i++) {
+    hashNode(hash, nodes[i]);
+  }
+}
+
+static void hashNode(uint64_t* hash, AST* ptr) {
+  if (ptr == NULL) {
+    hashInt(hash, -1);
+    return;
+  }
+  AST ast = *ptr;
+  hashInt(hash, ast.tag);
+  hashInt(hash, ast.rvalue);
+  hashType(hash, ast.type);
+  switch (ast.tag) {
+    case AST_ERROR: break;
+    case AST_ASM:
+      {
+        struct AST_ASM data = ast.data.AST_ASM;
+        hashInt(hash, arrlen(data.strings));
+        for (int i = 0; i < arrlen(data.strings); i++) {
+          hashStr(hash, data.strings[i]);
+        }
+        break;
+      }
+    case AST_LITERAL:
+      {
+        struct AST_LITERAL data = ast.data.AST_LITERAL;
+        hashInt(hash, data.constantIndex);
+        hashValue(hash, data.value);
+        break;
+      }
+    case AST_INITIALIZER:
+      {
+        struct AST_INITIALIZER data = ast.data.AST_INITIALIZER;
+        hashInt(hash, data.initType);
+        hashNodes(hash, data.assignments);
+        break;
+      }
+    case AST_IDENTIFIER:
+      {
+        struct AST_IDENTIFIER data = ast.data.AST_IDENTIFIER;
+        hashStr(hash, data.module);
+        hashName(hash, ptr, data.identifier);
+        break;
+      }
+    case AST_TYPE: hashNode(hash, ast.data.AST_TYPE.type); break;
+    case AST_TYPE_NAME:
+      {
+        struct AST_TYPE_NAME data = ast.data.AST_TYPE_NAME;
+        hashStr(hash, data.module);
+        hashStr(hash, data.typeName);
+        break;
+      }
+    case AST_TYPE_ARRAY:
+      {
+        struct AST_TYPE_ARRAY data = ast.data.AST_TYPE_ARRAY;
+        hashNode(hash, data.length);
+        hashNode(hash, data.subType);
+        break;
+      }
+    case AST_TYPE_FN:
+      {
+        struct AST_TYPE_FN data = ast.data.AST_TYPE_FN;
+        hashNodes(hash, data.params);
+        hashNode(hash, data.returnType);
+        break;
+      }
+    case AST_TYPE_PTR: hashNode(hash, ast.data.AST_TYPE_PTR.subType); break;
+    case AST_REF: hashNode(hash, ast.data.AST_REF.expr); break;
+    case AST_DEREF: hashNode(hash, ast.data.AST_DEREF.expr); break;
+    case AST_UNARY:
+      {
+        struct AST_UNARY data = ast.data.AST_UNARY;
+        hashInt(hash, data.op);
+        hashNode(hash, data.expr);
+        break;
+      }
+    case AST_BINARY:
+      {
+        struct AST_BINARY data = ast.data.AST_BINARY;
+        hashInt(hash, data.op);
+        hashNode(hash, data.left);
+        hashNode(hash, data.right);
+        break;
+      }
+    case AST_DOT:
+      {
+        struct AST_DOT data = ast.data.AST_DOT;
+        hashNode(hash, data.left);
+        hashStr(hash, data.name);
+        break;
+      }
+    case AST_CONST_DECL:
+      {
+        struct AST_CONST_DECL data = ast.data.AST_CONST_DECL;
+        hashName(hash, ptr, data.identifier);
+        hashNode(hash, data.type);
+        hashNode(hash, data.expr);
+        break;
+      }
+    case AST_VAR_DECL:
+      {
+        struct AST_VAR_DECL data = ast.data.AST_VAR_DECL;
+        hashName(hash, ptr, data.identifier);
+        hashNode(hash, data.type);
+        break;
+      }
+    case AST_VAR_INIT:
+      {
+        struct AST_VAR_INIT data = ast.data.AST_VAR_INIT;
+        hashName(hash, ptr, data.identifier);
+        hashNode(hash, data.type);
+        hashNode(hash, data.expr);
+        break;
+      }
+    case AST_ASSIGNMENT:
+      {
+        struct AST_ASSIGNMENT data = ast.data.AST_ASSIGNMENT;
+        hashNode(hash, data.lvalue);
+        hashNode(hash, data.expr);
+        break;
+      }
+    case AST_MATCH:
+      {
+        struct AST_MATCH data = ast.data.AST_MATCH;
+        hashNodes(hash, data.identifiers);
+        hashNodes(hash, data.clauses);
+        hashNode(hash, data.elseClause);
+        break;
+      }
+    case AST_MATCH_CLAUSE:
+      {
+        struct AST_MATCH_CLAUSE data = ast.data.AST_MATCH_CLAUSE;
+        hashNodes(hash, data.identifiers);
+        hashNodes(hash, data.types);
+        hashNode(hash, data.body);
+        break;
+      }
+    case AST_IF:
+      {
+        struct AST_IF data = ast.data.AST_IF;
+        hashNode(hash, data.condition);
+        hashNode(hash, data.body);
+        hashNode(hash, data.elseClause);
+        break;
+      }
+    case AST_WHILE:
+      {
+        struct AST_WHILE data = ast.data.AST_WHILE;
+        hashNode(hash, data.condition);
+        hashNode(hash, data.body);
+        hashStr(hash, data.annotation);
+        break;
+      }
+    case AST_DO_WHILE:
+      {
+        struct AST_DO_WHILE data = ast.data.AST_DO_WHILE;
+        hashNode(hash, data.condition);
+        hashNode(hash, data.body);
+        break;
+      }
+    case AST_FOR:
+      {
+        struct AST_FOR data = ast.data.AST_FOR;
+        hashNode(hash, data.initializer);
+        hashNode(hash, data.condition);
+        hashNode(hash, data.increment);
+        hashNode(hash, data.body);
+        hashStr(hash, data.annotation);
+        break;
+      }
+    case AST_BLOCK: hashNodes(hash, ast.data.AST_BLOCK.decls); break;
+    case AST_CALL:
+      {
+        struct AST_CALL data = ast.data.AST_CALL;
+        hashNode(hash, data.identifier);
+        hashNodes(hash, data.arguments);
+        break;
+      }
+    case AST_SUBSCRIPT:
+      {
+        struct AST_SUBSCRIPT data = ast.data.AST_SUBSCRIPT;
+        hashNode(hash, data.left);
+        hashNode(hash, data.index);
+        break;
+      }
+    case AST_CAST:
+      {
+        struct AST_CAST data = ast.data.AST_CAST;
+        hashInt(hash, data.tag);
+        hashNode(hash, data.expr);
+        hashNode(hash, data.type);
+        break;
+      }
+    case AST_RETURN: hashNode(hash, ast.data.AST_RETURN.value); break;
+    case AST_PARAM:
+      {
+        struct AST_PARAM data = ast.data.AST_PARAM;
+        hashName(hash, ptr, data.identifier);
+        hashNode(hash, data.value);
+        break;
+      }
+    case AST_FN:
+      {
+        struct AST_FN data = ast.data.AST_FN;
+        SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(ast.scopeIndex);
+        hashStr(hash, data.identifier);
+        hashStr(hash, data.annotation);
+        hashStr(hash, SYMBOL_TABLE_getNameFromStart(scope.key));
+        hashInt(hash, scope.tableAllocationSize);
+        hashInt(hash, scope.leaf);
+        hashNodes(hash, data.params);
+        hashNode(hash, data.returnType);
+        hashNode(hash, data.body);
+        break;
+      }
+    case AST_ISR:
+      {
+        struct AST_ISR data = ast.data.AST_ISR;
+        SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(ast.scopeIndex);
+        hashStr(hash, data.identifier);
+        hashInt(hash, scope.tableAllocationSize);
+        hashInt(hash, scope.leaf);
+        hashNode(hash, data.body);
+        break;
+      }
+    default:
+      {
+        // declarations which never appear inside a function body
+        break;
+      }
+  }
+}
+
+void CACHE_init(const char* directory, PLATFORM platform) {
+  cacheDirectory = directory;
+  cachePlatform = platform;
+  if (directory != NULL && mkdir(directory, 0755) != 0 && errno != EEXIST) {
+    printf("Error creating cache directory \"%s\"\n", directory);
+    exit(1);
+  }
+}
+
+bool CACHE_enabled(void) {
+  return cacheDirectory != NULL;
+}
+
+uint64_t CACHE_hashFunction(AST* fn, AST** inlined, uint64_t callees) {
+  uint64_t hash = FNV_OFFSET;
+  hashChars(&hash, CACHE_VERSION);
+  hashChars(&hash, cachePlatform.key);
+  hashChars(&hash, options.optimize ? "O1" : "O0");
+  hashNode(&hash, fn);
+  // Bodies inlined into the function are part of its code
+  hashNodes(&hash, inlined);
+  // So is what its callees may write, which decides what survives a call
+  hashInt(&hash, callees);
+  arrfree(visiting);
+  return hash;
+}
+
+static void cachePath(char* path, size_t size, uint64_t key) {
+  snprintf(path, size, "%s/%016" PRIx64 ".S", cacheDirectory, key);
+}
+
+bool CACHE_load(uint64_t key, BUFFER* out) {
+  char path[4096];
+  cachePath(path, sizeof(path), key);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  size_t start = out->length;
+  char chunk[16 * 1024];
+  ssize_t count;
+  while ((count = read(fd, chunk, sizeof(chunk))) != 0) {
+    if (count < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // treat an unreadable entry as a miss
+      out->length = start;
+      close(fd);
+      return false;
+    }
+    BUFFER_append(out, chunk, count);
+  }
+  close(fd);
+  return true;
+}
+
+void CACHE_store(uint64_t key, const char* data, size_t length) {
+  // Write to a private file and rename it into place, so concurrent
+  // compilers never observe a partial entry.
+  char path[4096];
+  char tempPath[4096 + 32];
+  cachePath(path, sizeof(path), key);
+  snprintf(tempPath, sizeof(tempPath), "%s.%d.tmp", path, (int)getpid());
+  int fd = open(tempPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  BUFFER buffer = { .data = (char*)data, .length = length, .capacity = length };
+  bool written = BUFFER_flush(&buffer, fd);
+  close(fd);
+  if (!written || rename(tempPath, path) != 0) {
+    unlink(tempPath);
+  }
+}
@@ -84,6 +84,12 @@ bool compile(const SourceFile* sources) {
 
   if (result) {
     emitTree(ast, p);
+    if (options.dependencyFile != NULL) {
+      if (!SCANNER_writeDependencies(options.dependencyFile, options.outfile)) {
+        printf("Error writing file!\n");
+        result = false;
+      }
+    }
     // evalTree(ast);
   }
 cleanup:
@@ -33,6 +33,8 @@
 typedef struct CONST_TABLE_ENTRY {
   Value value;
   int type;
+  // Set for strings no emitted code refers to
+  bool unused;
 } CONST_TABLE_ENTRY;
 
 extern CONST_TABLE_ENTRY* constTable;
@@ -0,0 +1,319 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "elf.h"
+
+#define SHT_SYMTAB 2
+#define SHT_STRTAB 3
+#define SHT_RELA 4
+#define SHF_INFO_LINK 0x40
+#define STB_LOCAL 0
+#define STB_GLOBAL 1
+
+void ELF_init(ELF_OBJECT* object, uint16_t machine) {
+  object->machine = machine;
+  object->sections = NULL;
+  object->symbols = NULL;
+}
+
+void ELF_free(ELF_OBJECT* object) {
+  for (int i = 0; i < arrlen(object->sections); i++) {
+    BUFFER_free(&object->sections[i].data);
+    arrfree(object->sections[i].relocations);
+  }
+  arrfree(object->sections);
+  arrfree(object->symbols);
+}
+
+int ELF_addSection(ELF_OBJECT* object, const char* name, uint32_t type, uint64_t flags, uint64_t align) {
+  ELF_SECTION section = {
+    .name = name,
+    .type = type,
+    .flags = flags,
+    .align = align,
+    .relocations = NULL
+  };
+  BUFFER_init(&section.data);
+  arrput(object->sections, section);
+  return arrlen(object->sections) - 1;
+}
+
+uint32_t ELF_addSymbol(ELF_OBJECT* object, ELF_SYMBOL symbol) {
+  arrput(object->symbols, symbol);
+  return arrlen(object->symbols) - 1;
+}
+
+void ELF_addRelocation(ELF_OBJECT* object, int section, ELF_RELA relocation) {
+  arrput(object->sections[section].relocations, relocation);
+}
+
+static void put8(BUFFER* out, uint8_t value) {
+  BUFFER_putc(out, (char)value);
+}
+
+static void put16(BUFFER* out, uint16_t value) {
+  put8(out, value);
+  put8(out, value >> 8);
+}
+
+static void put32(BUFFER* out, uint32_t value) {
+  put16(out, value);
+  put16(out, value >> 16);
+}
+
+static void put64(BUFFER* out, uint64_t value) {
+  put32(out, value);
+  put32(out, value >> 32);
+}
+
+static void align(BUFFER* out, size_t alignment) {
+  while (out->length % alignment != 0) {
+    put8(out, 0);
+  }
+}
+
+static uint32_t addString(BUFFER* table, const char* name) {
+  uint32_t offset = table->length;
+  BUFFER_append(table, name, strlen(name) + 1);
+  return offset;
+}
+
+typedef struct {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+  uint32_t info;
+  uint64_t align;
+  uint64_t entrySize;
+} SECTION_HEADER;
+
+void ELF_write(ELF_OBJECT* object, BUFFER* out) {
+  int sectionCount = arrlen(object->sections);
+  BUFFER strings;
+  BUFFER sectionNames;
+  BUFFER symbols;
+  BUFFER_init(&strings);
+  BUFFER_init(&sectionNames);
+  BUFFER_init(&symbols);
+  put8(&strings, 0);
+  put8(&sectionNames, 0);
+
+  SECTION_HEADER* headers = NULL;
+  arrput(headers, ((SECTION_HEADER){ 0 }));
+
+  // Header first; its section table offset is patched in at the end
+  size_t start = out->length;
+  BUFFER_append(out, "\x7f" "ELF", 4);
+  put8(out, 2); // 64-bit
+  put8(out, 1); // little-endian
+  put8(out, 1); // version
+  put8(out, 0); // System V ABI
+  put64(out, 0);
+  put16(out, 1); // ET_REL
+  put16(out, object->machine);
+  put32(out, 1);
+  put64(out, 0); // entry
+  put64(out, 0); // program headers
+  size_t headerTableOffset = out->length;
+  put64(out, 0);
+  put32(out, 0); // flags
+  put16(out, 64); // header size
+  put16(out, 0);
+  put16(out, 0);
+  put16(out, 64); // section header size
+  size_t headerCountOffset = out->length;
+  put16(out, 0);
+  put16(out, 0);
+
+  for (int i = 0; i < sectionCount; i++) {
+    ELF_SECTION* section = &object->sections[i];
+    align(out, section->align > 0 ? section->align : 1);
+    SECTION_HEADER header = {
+      .name = addString(&sectionNames, section->name),
+      .type = section->type,
+      .flags = section->flags,
+      .offset = out->length - start,
+      .size = section->data.length,
+      .align = section->align
+    };
+    if (section->type != ELF_SHT_NOBITS) {
+      BUFFER_append(out, section->data.data, section->data.length);
+    }
+    arrput(headers, header);
+  }
+
+  // Locals must precede globals, and each section gets a section symbol
+  uint32_t* symbolIndex = NULL;
+  arrsetlen(symbolIndex, arrlen(object->symbols));
+  uint32_t symbolCount = 0;
+  for (int pass = 0; pass < 3; pass++) {
+    if (pass == 0) {
+      for (int i = 0; i < 24; i++) {
+        put8(&symbols, 0);
+      }
+      symbolCount++;
+      for (int i = 0; i < sectionCount; i++) {
+        put32(&symbols, 0);
+        put8(&symbols, (STB_LOCAL << 4) | ELF_STT_SECTION);
+        put8(&symbols, 0);
+        put16(&symbols, i + 1);
+        put64(&symbols, 0);
+        put64(&symbols, 0);
+        symbolCount++;
+      }
+      continue;
+    }
+    bool global = pass == 2;
+    for (int i = 0; i < arrlen(object->symbols); i++) {
+      ELF_SYMBOL symbol = object->symbols[i];
+      if (symbol.global != global) {
+        continue;
+      }
+      symbolIndex[i] = symbolCount++;
+      put32(&symbols, addString(&strings, symbol.name));
+      put8(&symbols, ((global ? STB_GLOBAL : STB_LOCAL) << 4) | symbol.type);
+      put8(&symbols, 0);
+      put16(&symbols, symbol.section == ELF_UNDEFINED ? 0 : symbol.section + 1);
+      put64(&symbols, symbol.value);
+      put64(&symbols, 0);
+    }
+  }
+  uint32_t firstGlobal = 1 + sectionCount;
+  for (int i = 0; i < arrlen(object->symbols); i++) {
+    if (!object->symbols[i].global) {
+      firstGlobal++;
+    }
+  }
+
+  uint32_t symtabIndex = 1 + sectionCount;
+  for (int i = 0; i < sectionCount; i++) {
+    if (arrlen(object->sections[i].relocations) > 0) {
+      symtabIndex++;
+    }
+  }
+
+  for (int i = 0; i < sectionCount; i++) {
+    ELF_SECTION* section = &object->sections[i];
+    if (arrlen(section->relocations) == 0) {
+      continue;
+    }
+    char name[256];
+    snprintf(name, sizeof(name), ".rela%s", section->name);
+    align(out, 8);
+    SECTION_HEADER header = {
+      .name = addString(&sectionNames, name),
+      .type = SHT_RELA,
+      .flags = SHF_INFO_LINK,
+      .offset = out->length - start,
+      .size = arrlen(section->relocations) * 24,
+      .link = symtabIndex,
+      .info = i + 1,
+      .align = 8,
+      .entrySize = 24
+    };
+    for (int j = 0; j < arrlen(section->relocations); j++) {
+      ELF_RELA rela = section->relocations[j];
+      put64(out, rela.offset);
+      put64(out, ((uint64_t)symbolIndex[rela.symbol] << 32) | rela.type);
+      put64(out, rela.addend);
+    }
+    arrput(headers, header);
+  }
+
+  align(out, 8);
+  SECTION_HEADER symtab = {
+    .name = addString(&sectionNames, ".symtab"),
+    .type = SHT_SYMTAB,
+    .offset = out->length - start,
+    .size = symbols.length,
+    .link = symtabIndex + 1,
+    .info = firstGlobal,
+    .align = 8,
+    .entrySize = 24
+  };
+  BUFFER_append(out, symbols.data, symbols.length);
+  arrput(headers, symtab);
+
+  SECTION_HEADER strtab = {
+    .name = addString(&sectionNames, ".strtab"),
+    .type = SHT_STRTAB,
+    .offset = out->length - start,
+    .size = strings.length,
+    .align = 1
+  };
+  BUFFER_append(out, strings.data, strings.length);
+  arrput(headers, strtab);
+
+  SECTION_HEADER shstrtab = {
+    .name = addString(&sectionNames, ".shstrtab"),
+    .type = SHT_STRTAB,
+    .offset = out->length - start,
+    .size = sectionNames.length,
+    .align = 1
+  };
+  BUFFER_append(out, sectionNames.data, sectionNames.length);
+  arrput(headers, shstrtab);
+
+  align(out, 8);
+  uint64_t tableOffset = out->length - start;
+  for (int i = 0; i < arrlen(headers); i++) {
+    SECTION_HEADER header = headers[i];
+    put32(out, header.name);
+    put32(out, header.type);
+    put64(out, header.flags);
+    put64(out, 0);
+    put64(out, header.offset);
+    put64(out, header.size);
+    put32(out, header.link);
+    put32(out, header.info);
+    put64(out, header.align);
+    put64(out, header.entrySize);
+  }
+
+  // patch e_shoff, e_shnum and e_shstrndx
+  for (int i = 0; i < 8; i++) {
+    out->data[headerTableOffset + i] = (char)(tableOffset >> (8 * i));
+  }
+  uint16_t headerCount = arrlen(headers);
+  uint16_t namesIndex = headerCount - 1;
+  out->data[headerCountOffset] = (char)headerCount;
+  out->data[headerCountOffset + 1] = (char)(headerCount >> 8);
+  out->data[headerCountOffset + 2] = (char)namesIndex;
+  out->data[headerCountOffset + 3] = (char)(namesIndex >> 8);
+
+  arrfree(headers);
+  arrfree(symbolIndex);
+  BUFFER_free(&strings);
+  BUFFER_free(&sectionNames);
+  BUFFER_free(&symbols);
+}
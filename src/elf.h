@@ -0,0 +1,86 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef elf_h
+#define elf_h
+
+#include "common.h"
+#include "buffer.h"
+
+// Minimal writer for ELF64 relocatable objects (little-endian).
+
+#define ELF_SHF_WRITE 0x1
+#define ELF_SHF_ALLOC 0x2
+#define ELF_SHF_EXECINSTR 0x4
+
+#define ELF_SHT_PROGBITS 1
+#define ELF_SHT_NOBITS 8
+
+#define ELF_STT_NOTYPE 0
+#define ELF_STT_OBJECT 1
+#define ELF_STT_FUNC 2
+#define ELF_STT_SECTION 3
+
+#define ELF_UNDEFINED -1
+
+typedef struct {
+  uint64_t offset;
+  uint32_t type;
+  uint32_t symbol; // index into ELF_OBJECT.symbols
+  int64_t addend;
+} ELF_RELA;
+
+typedef struct {
+  const char* name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t align;
+  BUFFER data;
+  ELF_RELA* relocations;
+} ELF_SECTION;
+
+typedef struct {
+  const char* name;
+  int section; // index into ELF_OBJECT.sections, or ELF_UNDEFINED
+  uint64_t value;
+  uint8_t type;
+  bool global;
+} ELF_SYMBOL;
+
+typedef struct {
+  uint16_t machine;
+  ELF_SECTION* sections;
+  ELF_SYMBOL* symbols;
+} ELF_OBJECT;
+
+void ELF_init(ELF_OBJECT* object, uint16_t machine);
+void ELF_free(ELF_OBJECT* object);
+int ELF_addSection(ELF_OBJECT* object, const char* name, uint32_t type, uint64_t flags, uint64_t align);
+uint32_t ELF_addSymbol(ELF_OBJECT* object, ELF_SYMBOL symbol);
+void ELF_addRelocation(ELF_OBJECT* object, int section, ELF_RELA relocation);
+void ELF_write(ELF_OBJECT* object, BUFFER* out);
+
+#endif
@@ -0,0 +1,186 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "gvn.h"
+#include "ssa.h"
+
+typedef struct KEY {
+  IR_OP op;
+  IR_TYPE type;
+  IR_VREG a;
+  IR_VREG b;
+  int64_t imm;
+  STR symbol;
+} KEY;
+
+// Available values, innermost scope last. Entries with the same hash are
+// chained through previous.
+typedef struct ENTRY {
+  KEY key;
+  uint64_t hash;
+  IR_VREG value;
+  int previous;
+} ENTRY;
+
+static IR_FUNCTION* fn = NULL;
+static int** children = NULL;
+static ENTRY* entries = NULL;
+static struct { uint64_t key; int value; }* latest = NULL;
+static IR_VREG* replacement = NULL;
+
+static IR_VREG resolve(IR_VREG v) {
+  while (replacement[v] != IR_NONE) {
+    v = replacement[v];
+  }
+  return v;
+}
+
+static bool isCommutative(IR_OP op) {
+  switch (op) {
+    case IR_ADD:
+    case IR_MUL:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_EQ:
+    case IR_NE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Constants and frame addresses take one instruction to recompute, so
+// sharing them would only stretch their live ranges
+static bool isNumbered(IR_OP op) {
+  return IR_isPure(op) && IR_hasDestination(op) && op != IR_LOAD && op != IR_PHI && op != IR_COPY
+    && op != IR_CONST && op != IR_SLOT;
+}
+
+static uint64_t hashKey(KEY key) {
+  uint64_t fields[] = { key.op, key.type, key.a, key.b, (uint64_t)key.imm, key.symbol };
+  uint64_t hash = 14695981039346656037ULL;
+  for (int i = 0; i < 6; i++) {
+    hash = (hash ^ fields[i]) * 1099511628211ULL;
+    hash ^= hash >> 29;
+  }
+  return hash;
+}
+
+static bool sameKey(KEY x, KEY y) {
+  return x.op == y.op && x.type == y.type && x.a == y.a && x.b == y.b && x.imm == y.imm && x.symbol == y.symbol;
+}
+
+static void numberBlock(int b) {
+  int mark = arrlen(entries);
+  IR_BLOCK* block = &fn->blocks[b];
+  IR_VREG** operands = NULL;
+  for (int j = 0; j < arrlen(block->insts); j++) {
+    IR_INST* inst = &block->insts[j];
+    operands = IR_operands(inst, operands);
+    for (int k = 0; k < arrlen(operands); k++) {
+      *operands[k] = resolve(*operands[k]);
+    }
+    if (!isNumbered(inst->op)) {
+      continue;
+    }
+    KEY key = { inst->op, inst->type, inst->a, inst->b, inst->imm, inst->symbol };
+    if (isCommutative(key.op) && key.a > key.b) {
+      key.a = inst->b;
+      key.b = inst->a;
+    }
+    uint64_t hash = hashKey(key);
+    int index = hmgeti(latest, hash) >= 0 ? hmget(latest, hash) : -1;
+    for (int e = index; e >= 0; e = entries[e].previous) {
+      if (sameKey(entries[e].key, key)) {
+        replacement[inst->dst] = entries[e].value;
+        inst->op = IR_NOP;
+        break;
+      }
+    }
+    if (inst->op == IR_NOP) {
+      continue;
+    }
+    arrput(entries, ((ENTRY){ key, hash, inst->dst, index }));
+    hmput(latest, hash, arrlen(entries) - 1);
+  }
+  arrfree(operands);
+
+  for (int i = 0; i < arrlen(children[b]); i++) {
+    numberBlock(children[b][i]);
+  }
+
+  // Leave the scope
+  while (arrlen(entries) > mark) {
+    ENTRY entry = arrpop(entries);
+    if (entry.previous >= 0) {
+      hmput(latest, entry.hash, entry.previous);
+    } else {
+      (void)hmdel(latest, entry.hash);
+    }
+  }
+}
+
+void GVN_function(IR_FUNCTION* function) {
+  fn = function;
+  int count = arrlen(fn->blocks);
+  int* idom = SSA_dominators(fn);
+  children = calloc(count, sizeof(int*));
+  for (int i = 1; i < count; i++) {
+    if (idom[i] >= 0) {
+      arrput(children[idom[i]], i);
+    }
+  }
+  replacement = calloc(fn->vregCount + 1, sizeof(IR_VREG));
+  numberBlock(0);
+
+  // Phi arguments can come from blocks numbered later
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      operands = IR_operands(&block->insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        *operands[k] = resolve(*operands[k]);
+      }
+    }
+    arrfree(children[i]);
+  }
+  IR_removeNops(fn);
+
+  arrfree(operands);
+  arrfree(idom);
+  arrfree(entries);
+  hmfree(latest);
+  free(children);
+  free(replacement);
+  children = NULL;
+  replacement = NULL;
+  fn = NULL;
+}
@@ -0,0 +1,322 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "inline.h"
+#include "lower.h"
+
+// A callee of up to this many instructions is inlined...
+#define INLINE_THRESHOLD 12
+// ...plus this many for every constant argument, which is likely to fold
+#define INLINE_CONSTANT_BONUS 4
+// A function stops growing once it reaches this size, bar fn<inline>
+#define INLINE_BUDGET 800
+#define INLINE_DEPTH 6
+
+static PLATFORM p;
+static struct { STR key; AST* value; }* definitions = NULL;
+// Callees lowered and expanded for the current function, by symbol
+static struct { STR key; IR_FUNCTION* value; }* expanded = NULL;
+// Symbols being expanded, outermost first, to stop at recursion
+static STR* chain = NULL;
+static AST** inlined = NULL;
+
+void INLINE_init(PLATFORM platform) {
+  p = platform;
+}
+
+void INLINE_register(AST* fn) {
+  if (fn->tag != AST_FN) {
+    return;
+  }
+  struct AST_FN data = fn->data.AST_FN;
+  SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(fn->scopeIndex);
+  SYMBOL_TABLE_ENTRY entry = SYMBOL_TABLE_get(scope.parent, data.identifier);
+  if (!entry.defined || entry.entryType != SYMBOL_TYPE_FUNCTION) {
+    return;
+  }
+  hmput(definitions, STR_create(p.symbol(entry)), fn);
+}
+
+void INLINE_free(void) {
+  hmfree(definitions);
+}
+
+static int sizeOf(IR_FUNCTION* fn) {
+  int size = 0;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_OP op = fn->blocks[i].insts[j].op;
+      // Frame addresses fold into the accesses, and jumps mostly vanish
+      if (op != IR_NOP && op != IR_SLOT && op != IR_JUMP && op != IR_RETURN) {
+        size++;
+      }
+    }
+  }
+  return size;
+}
+
+static bool hasAsm(IR_FUNCTION* fn) {
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      if (fn->blocks[i].insts[j].op == IR_ASM) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static bool isRecursive(STR symbol) {
+  for (int i = 0; i < arrlen(chain); i++) {
+    if (chain[i] == symbol) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool isConstant(IR_BLOCK* block, int end, IR_VREG v) {
+  for (int j = 0; j < end; j++) {
+    if (block->insts[j].dst == v && block->insts[j].op == IR_CONST) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void expand(IR_FUNCTION* fn, int depth);
+
+// Lowers a callee once per function being compiled
+static IR_FUNCTION* getCallee(STR symbol, int depth) {
+  if (hmgeti(expanded, symbol) >= 0) {
+    return hmget(expanded, symbol);
+  }
+  AST* definition = hmget(definitions, symbol);
+  IR_FUNCTION* callee = LOWER_function(definition, p);
+  // Inline assembly addresses the callee's own frame, so it stays a call
+  if (callee->inlining != IR_INLINE_NEVER && !hasAsm(callee) && depth < INLINE_DEPTH) {
+    arrput(chain, symbol);
+    expand(callee, depth + 1);
+    arrsetlen(chain, arrlen(chain) - 1);
+  } else {
+    callee->inlining = IR_INLINE_NEVER;
+  }
+  hmput(expanded, symbol, callee);
+  return callee;
+}
+
+static bool shouldInline(IR_FUNCTION* fn, IR_FUNCTION* callee, IR_BLOCK* block, int index) {
+  if (callee->inlining != IR_INLINE_AUTO) {
+    return callee->inlining == IR_INLINE_ALWAYS;
+  }
+  IR_INST call = block->insts[index];
+  int size = sizeOf(callee);
+  if (sizeOf(fn) + size > INLINE_BUDGET) {
+    return false;
+  }
+  // The call itself goes away, along with pushing its arguments
+  int limit = INLINE_THRESHOLD + 1 + arrlen(call.args);
+  for (int i = 0; i < arrlen(call.args); i++) {
+    if (isConstant(block, index, call.args[i])) {
+      limit += INLINE_CONSTANT_BONUS;
+    }
+  }
+  return size <= limit;
+}
+
+// The type a parameter is read as, so the argument can be stored the same
+// way and the slot promoted
+static IR_TYPE parameterType(IR_FUNCTION* callee, int slot) {
+  IR_VREG* addresses = NULL;
+  for (int i = 0; i < arrlen(callee->blocks); i++) {
+    IR_BLOCK block = callee->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      IR_INST inst = block.insts[j];
+      if (inst.op == IR_SLOT && inst.imm == slot) {
+        arrput(addresses, inst.dst);
+      } else if (inst.op == IR_LOAD) {
+        for (int k = 0; k < arrlen(addresses); k++) {
+          if (addresses[k] == inst.a) {
+            arrfree(addresses);
+            return inst.type;
+          }
+        }
+      }
+    }
+  }
+  arrfree(addresses);
+  return IR_U64;
+}
+
+static int renumberBlock(int target, int block, int count) {
+  return target > block ? target + count + 1 : target;
+}
+
+// Splits block at the call, and places the callee's blocks between the
+// two halves. Parameters become locals, initialised from the arguments,
+// and each return jumps to the second half with the result.
+static void splice(IR_FUNCTION* fn, int block, int index, IR_FUNCTION* callee) {
+  IR_INST call = fn->blocks[block].insts[index];
+  int count = arrlen(callee->blocks);
+  int entry = block + 1;
+  int rest = block + count + 1;
+  IR_VREG base = fn->vregCount;
+  fn->vregCount += callee->vregCount;
+  int slotBase = arrlen(fn->slots);
+
+  IR_BLOCK* blocks = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* source = &fn->blocks[i];
+    for (int j = 0; j < arrlen(source->insts); j++) {
+      IR_INST* inst = &source->insts[j];
+      if (inst->op == IR_JUMP || inst->op == IR_BRANCH) {
+        inst->target = renumberBlock(inst->target, block, count);
+        inst->other = renumberBlock(inst->other, block, count);
+      }
+    }
+    arrput(blocks, *source);
+    if (i != block) {
+      continue;
+    }
+    IR_BLOCK head = { NULL, source->unroll };
+    IR_BLOCK tail = { NULL };
+    for (int j = 0; j < arrlen(source->insts); j++) {
+      if (j < index) {
+        arrput(head.insts, source->insts[j]);
+      } else if (j > index) {
+        arrput(tail.insts, source->insts[j]);
+      }
+    }
+    for (int k = 0; k < arrlen(callee->slots); k++) {
+      IR_STACK_SLOT slot = callee->slots[k];
+      if (slot.param) {
+        // Arguments occupy a full register, like the stack slot they had
+        slot.size = slot.size < 8 ? 8 : slot.size;
+        IR_VREG address = IR_newVreg(fn);
+        IR_INST addressInst = { .op = IR_SLOT, .type = IR_U64, .dst = address, .imm = slotBase + k };
+        arrput(head.insts, addressInst);
+        IR_INST store = { .op = IR_STORE, .type = parameterType(callee, k), .a = address, .b = call.args[slot.entry.paramOrdinal] };
+        arrput(head.insts, store);
+      }
+      slot.param = false;
+      slot.temporary = true;
+      arrput(fn->slots, slot);
+    }
+    IR_INST jump = { .op = IR_JUMP, .target = entry };
+    arrput(head.insts, jump);
+    blocks[i] = head;
+
+    for (int c = 0; c < count; c++) {
+      IR_BLOCK original = callee->blocks[c];
+      IR_BLOCK copy = { NULL, original.unroll };
+      for (int j = 0; j < arrlen(original.insts); j++) {
+        IR_INST inst = original.insts[j];
+        inst.args = NULL;
+        inst.sources = NULL;
+        if (inst.op == IR_PARAM) {
+          // Only the hidden result address is read this way before SSA
+          arrput(copy.insts, ((IR_INST){ .op = IR_COPY, .type = inst.type, .dst = base + inst.dst, .a = call.args[inst.imm] }));
+          continue;
+        }
+        if (inst.op == IR_RETURN) {
+          IR_INST result = { .op = IR_CONST, .type = call.type, .dst = call.dst };
+          if (inst.a != IR_NONE) {
+            result = (IR_INST){ .op = IR_EXT, .type = call.type, .dst = call.dst, .a = base + inst.a };
+          }
+          arrput(copy.insts, result);
+          inst = (IR_INST){ .op = IR_JUMP, .target = rest };
+          arrput(copy.insts, inst);
+          continue;
+        }
+        inst.dst = inst.dst == IR_NONE ? IR_NONE : base + inst.dst;
+        inst.a = inst.a == IR_NONE ? IR_NONE : base + inst.a;
+        inst.b = inst.b == IR_NONE ? IR_NONE : base + inst.b;
+        for (int k = 0; k < arrlen(original.insts[j].args); k++) {
+          arrput(inst.args, base + original.insts[j].args[k]);
+        }
+        if (inst.op == IR_SLOT) {
+          inst.imm += slotBase;
+        } else if (inst.op == IR_JUMP || inst.op == IR_BRANCH) {
+          inst.target += entry;
+          inst.other += entry;
+        }
+        arrput(copy.insts, inst);
+      }
+      arrput(blocks, copy);
+    }
+    arrput(blocks, tail);
+    arrfree(source->insts);
+  }
+  arrfree(call.args);
+  arrfree(fn->blocks);
+  fn->blocks = blocks;
+}
+
+static void expand(IR_FUNCTION* fn, int depth) {
+  int i = 0;
+  while (i < arrlen(fn->blocks)) {
+    int next = i + 1;
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST inst = block->insts[j];
+      if (inst.op != IR_CALL || inst.symbol == EMPTY_STRING || hmgeti(definitions, inst.symbol) < 0 || isRecursive(inst.symbol)) {
+        continue;
+      }
+      IR_FUNCTION* callee = getCallee(inst.symbol, depth);
+      if (!shouldInline(fn, callee, block, j)) {
+        continue;
+      }
+      arrput(inlined, hmget(definitions, inst.symbol));
+      splice(fn, i, j, callee);
+      // Carry on after the inlined body, which is already expanded
+      next = i + arrlen(callee->blocks) + 1;
+      break;
+    }
+    i = next;
+  }
+}
+
+AST** INLINE_function(IR_FUNCTION* fn) {
+  inlined = NULL;
+  if (fn->kind == IR_FUNCTION_FN) {
+    SYMBOL_TABLE_ENTRY entry = SYMBOL_TABLE_get(fn->scope.parent, fn->name);
+    if (entry.defined && entry.entryType == SYMBOL_TYPE_FUNCTION) {
+      arrput(chain, STR_create(p.symbol(entry)));
+    }
+  }
+  expand(fn, 0);
+  for (int i = 0; i < hmlen(expanded); i++) {
+    IR_free(expanded[i].value);
+  }
+  hmfree(expanded);
+  arrfree(chain);
+  AST** result = inlined;
+  inlined = NULL;
+  return result;
+}
@@ -0,0 +1,666 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ir.h"
+
+#define USES_A 1
+#define USES_B 2
+#define MAY_USE_A 4
+
+static const struct {
+  const char* name;
+  bool hasDst;
+  int uses;
+} opInfo[] = {
+  [IR_NOP] = { "nop", false, 0 },
+  [IR_CONST] = { "const", true, 0 },
+  [IR_STRING] = { "string", true, 0 },
+  [IR_GLOBAL] = { "global", true, 0 },
+  [IR_SLOT] = { "slot", true, 0 },
+  [IR_PARAM] = { "param", true, 0 },
+  [IR_COPY] = { "copy", true, USES_A },
+  [IR_LOAD] = { "load", true, USES_A },
+  [IR_STORE] = { "store", false, USES_A | USES_B },
+  [IR_MEMCPY] = { "memcpy", false, USES_A | USES_B },
+  [IR_MEMZERO] = { "memzero", false, USES_A },
+  [IR_ADD] = { "add", true, USES_A | USES_B },
+  [IR_SUB] = { "sub", true, USES_A | USES_B },
+  [IR_MUL] = { "mul", true, USES_A | USES_B },
+  [IR_DIV] = { "div", true, USES_A | USES_B },
+  [IR_MOD] = { "mod", true, USES_A | USES_B },
+  [IR_AND] = { "and", true, USES_A | USES_B },
+  [IR_OR] = { "or", true, USES_A | USES_B },
+  [IR_XOR] = { "xor", true, USES_A | USES_B },
+  [IR_SHL] = { "shl", true, USES_A | USES_B },
+  [IR_SHR] = { "shr", true, USES_A | USES_B },
+  [IR_NEG] = { "neg", true, USES_A },
+  [IR_NOT] = { "not", true, USES_A },
+  [IR_EXT] = { "ext", true, USES_A },
+  [IR_EQ] = { "eq", true, USES_A | USES_B },
+  [IR_NE] = { "ne", true, USES_A | USES_B },
+  [IR_LT] = { "lt", true, USES_A | USES_B },
+  [IR_LE] = { "le", true, USES_A | USES_B },
+  [IR_GT] = { "gt", true, USES_A | USES_B },
+  [IR_GE] = { "ge", true, USES_A | USES_B },
+  [IR_CALL] = { "call", true, MAY_USE_A },
+  [IR_PHI] = { "phi", true, 0 },
+  [IR_ASM] = { "asm", false, 0 },
+  [IR_JUMP] = { "jump", false, 0 },
+  [IR_BRANCH] = { "branch", false, USES_A },
+  [IR_RETURN] = { "ret", false, MAY_USE_A },
+};
+
+static const char* typeNames[] = { "u8", "i8", "u16", "i16", "u32", "i32", "u64", "i64" };
+
+IR_FUNCTION* IR_newFunction(IR_FUNCTION_KIND kind, STR name, STR module, SYMBOL_TABLE_SCOPE scope) {
+  IR_FUNCTION* fn = calloc(1, sizeof(IR_FUNCTION));
+  fn->kind = kind;
+  fn->name = name;
+  fn->module = module;
+  fn->scope = scope;
+  fn->current = -1;
+  IR_placeBlock(fn, IR_newBlock(fn));
+  return fn;
+}
+
+void IR_free(IR_FUNCTION* fn) {
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK block = fn->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      arrfree(block.insts[j].args);
+      arrfree(block.insts[j].sources);
+    }
+    arrfree(block.insts);
+  }
+  arrfree(fn->blocks);
+  arrfree(fn->slots);
+  arrfree(fn->placed);
+  free(fn);
+}
+
+IR_VREG IR_newVreg(IR_FUNCTION* fn) {
+  return ++fn->vregCount;
+}
+
+int IR_newBlock(IR_FUNCTION* fn) {
+  IR_BLOCK block = { NULL };
+  arrput(fn->blocks, block);
+  return arrlen(fn->blocks) - 1;
+}
+
+bool IR_isTerminator(IR_OP op) {
+  return op == IR_JUMP || op == IR_BRANCH || op == IR_RETURN;
+}
+
+bool IR_hasDestination(IR_OP op) {
+  return opInfo[op].hasDst;
+}
+
+bool IR_isPure(IR_OP op) {
+  switch (op) {
+    case IR_STORE:
+    case IR_MEMCPY:
+    case IR_MEMZERO:
+    case IR_CALL:
+    case IR_ASM:
+    case IR_JUMP:
+    case IR_BRANCH:
+    case IR_RETURN:
+      return false;
+    default:
+      return true;
+  }
+}
+
+bool IR_isTerminated(IR_FUNCTION* fn) {
+  IR_INST* insts = fn->blocks[fn->current].insts;
+  return arrlen(insts) > 0 && IR_isTerminator(insts[arrlen(insts) - 1].op);
+}
+
+void IR_placeBlock(IR_FUNCTION* fn, int block) {
+  // Falling off the end of the previous block continues in this one
+  if (fn->current >= 0 && !IR_isTerminated(fn)) {
+    IR_emit(fn, (IR_INST){ .op = IR_JUMP, .target = block });
+  }
+  arrput(fn->placed, block);
+  fn->current = block;
+}
+
+void IR_emit(IR_FUNCTION* fn, IR_INST inst) {
+  if (IR_isTerminated(fn)) {
+    // Code after a return or jump is unreachable, but still needs a home
+    IR_placeBlock(fn, IR_newBlock(fn));
+  }
+  arrput(fn->blocks[fn->current].insts, inst);
+}
+
+int IR_getSlot(IR_FUNCTION* fn, SYMBOL_TABLE_ENTRY entry, uint32_t size) {
+  for (int i = 0; i < arrlen(fn->slots); i++) {
+    if (!fn->slots[i].temporary && fn->slots[i].entry.key == entry.key && fn->slots[i].entry.scopeIndex == entry.scopeIndex) {
+      return i;
+    }
+  }
+  IR_STACK_SLOT slot = { entry, entry.storageType == STORAGE_TYPE_PARAMETER, size };
+  arrput(fn->slots, slot);
+  return arrlen(fn->slots) - 1;
+}
+
+int IR_newTemporary(IR_FUNCTION* fn, uint32_t size) {
+  SYMBOL_TABLE_ENTRY entry = { .key = EMPTY_STRING, .storageType = STORAGE_TYPE_LOCAL_OBJECT };
+  IR_STACK_SLOT slot = { entry, false, size, true };
+  arrput(fn->slots, slot);
+  return arrlen(fn->slots) - 1;
+}
+
+void IR_finish(IR_FUNCTION* fn) {
+  if (!IR_isTerminated(fn)) {
+    IR_emit(fn, (IR_INST){ .op = IR_RETURN });
+  }
+  // Lay the blocks out in the order they were placed
+  int count = arrlen(fn->blocks);
+  int* index = NULL;
+  arrsetlen(index, count);
+  for (int i = 0; i < count; i++) {
+    index[i] = -1;
+  }
+  IR_BLOCK* blocks = NULL;
+  for (int i = 0; i < arrlen(fn->placed); i++) {
+    index[fn->placed[i]] = arrlen(blocks);
+    arrput(blocks, fn->blocks[fn->placed[i]]);
+  }
+  for (int i = 0; i < count; i++) {
+    if (index[i] == -1) {
+      index[i] = arrlen(blocks);
+      arrput(blocks, fn->blocks[i]);
+    }
+  }
+  for (int i = 0; i < arrlen(blocks); i++) {
+    for (int j = 0; j < arrlen(blocks[i].insts); j++) {
+      IR_INST* inst = &blocks[i].insts[j];
+      if (inst->op == IR_JUMP || inst->op == IR_BRANCH) {
+        inst->target = index[inst->target];
+      }
+      if (inst->op == IR_BRANCH) {
+        inst->other = index[inst->other];
+      }
+    }
+  }
+  arrfree(fn->blocks);
+  arrfree(fn->placed);
+  arrfree(index);
+  fn->blocks = blocks;
+  fn->current = arrlen(blocks) - 1;
+}
+
+const char* IR_opName(IR_OP op) {
+  return opInfo[op].name;
+}
+
+int64_t IR_normalize(int64_t value, IR_TYPE type) {
+  int bits = IR_TYPE_SIZE(type) * 8;
+  if (bits == 64) {
+    return value;
+  }
+  uint64_t mask = (1ULL << bits) - 1;
+  uint64_t result = (uint64_t)value & mask;
+  if (IR_TYPE_SIGNED(type) && (result >> (bits - 1)) & 1) {
+    result |= ~mask;
+  }
+  return (int64_t)result;
+}
+
+bool IR_fold(IR_OP op, IR_TYPE type, int64_t a, int64_t b, int64_t* result) {
+  // Matches what the hardware does, including division by zero, so
+  // folding never changes the behaviour of a program.
+  uint64_t ua = (uint64_t)a;
+  uint64_t ub = (uint64_t)b;
+  bool isSigned = type != IR_U64;
+  int64_t value;
+  switch (op) {
+    case IR_COPY: *result = a; return true;
+    case IR_EXT: value = a; break;
+    case IR_ADD: value = (int64_t)(ua + ub); break;
+    case IR_SUB: value = (int64_t)(ua - ub); break;
+    case IR_MUL: value = (int64_t)(ua * ub); break;
+    case IR_DIV:
+    case IR_MOD:
+      {
+        int64_t quotient;
+        if (b == 0) {
+          quotient = 0;
+        } else if (!isSigned) {
+          quotient = (int64_t)(ua / ub);
+        } else if (a == INT64_MIN && b == -1) {
+          quotient = INT64_MIN;
+        } else {
+          quotient = a / b;
+        }
+        value = op == IR_DIV ? quotient : (int64_t)(ua - (uint64_t)quotient * ub);
+        break;
+      }
+    case IR_AND: value = a & b; break;
+    case IR_OR: value = a | b; break;
+    case IR_XOR: value = a ^ b; break;
+    case IR_SHL: value = (int64_t)(ua << (ub & 63)); break;
+    case IR_SHR:
+      if (IR_TYPE_SIGNED(type)) {
+        value = a >> (ub & 63);
+      } else {
+        value = (int64_t)(ua >> (ub & 63));
+      }
+      break;
+    case IR_NEG: value = (int64_t)(0 - ua); break;
+    case IR_NOT: value = ~a; break;
+    // Comparisons are typed by their operands, which are already extended
+    case IR_EQ: *result = a == b; return true;
+    case IR_NE: *result = a != b; return true;
+    case IR_LT: *result = IR_TYPE_SIGNED(type) ? a < b : ua < ub; return true;
+    case IR_LE: *result = IR_TYPE_SIGNED(type) ? a <= b : ua <= ub; return true;
+    case IR_GT: *result = IR_TYPE_SIGNED(type) ? a > b : ua > ub; return true;
+    case IR_GE: *result = IR_TYPE_SIGNED(type) ? a >= b : ua >= ub; return true;
+    default: return false;
+  }
+  *result = IR_normalize(value, type);
+  return true;
+}
+
+IR_INST* IR_terminator(IR_BLOCK* block) {
+  int count = arrlen(block->insts);
+  if (count == 0 || !IR_isTerminator(block->insts[count - 1].op)) {
+    return NULL;
+  }
+  return &block->insts[count - 1];
+}
+
+int IR_successors(IR_BLOCK* block, int successors[2]) {
+  IR_INST* inst = IR_terminator(block);
+  if (inst == NULL || inst->op == IR_RETURN) {
+    return 0;
+  }
+  successors[0] = inst->target;
+  if (inst->op == IR_BRANCH && inst->other != inst->target) {
+    successors[1] = inst->other;
+    return 2;
+  }
+  return 1;
+}
+
+int** IR_predecessors(IR_FUNCTION* fn) {
+  int** predecessors = NULL;
+  arrsetlen(predecessors, arrlen(fn->blocks));
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    predecessors[i] = NULL;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    int successors[2];
+    int count = IR_successors(&fn->blocks[i], successors);
+    for (int j = 0; j < count; j++) {
+      arrput(predecessors[successors[j]], i);
+    }
+  }
+  return predecessors;
+}
+
+void IR_freePredecessors(int** predecessors) {
+  for (int i = 0; i < arrlen(predecessors); i++) {
+    arrfree(predecessors[i]);
+  }
+  arrfree(predecessors);
+}
+
+void IR_removeUnreachable(IR_FUNCTION* fn) {
+  int count = arrlen(fn->blocks);
+  int* index = NULL;
+  int* stack = NULL;
+  arrsetlen(index, count);
+  for (int i = 0; i < count; i++) {
+    index[i] = -1;
+  }
+  index[0] = 0;
+  arrput(stack, 0);
+  while (arrlen(stack) > 0) {
+    int block = arrpop(stack);
+    int successors[2];
+    int n = IR_successors(&fn->blocks[block], successors);
+    for (int j = 0; j < n; j++) {
+      if (index[successors[j]] == -1) {
+        index[successors[j]] = 0;
+        arrput(stack, successors[j]);
+      }
+    }
+  }
+  arrfree(stack);
+
+  // Keep the reachable blocks in their current order
+  IR_BLOCK* blocks = NULL;
+  for (int i = 0; i < count; i++) {
+    if (index[i] == -1) {
+      for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+        arrfree(fn->blocks[i].insts[j].args);
+        arrfree(fn->blocks[i].insts[j].sources);
+      }
+      arrfree(fn->blocks[i].insts);
+      continue;
+    }
+    index[i] = arrlen(blocks);
+    arrput(blocks, fn->blocks[i]);
+  }
+  for (int i = 0; i < arrlen(blocks); i++) {
+    for (int j = 0; j < arrlen(blocks[i].insts); j++) {
+      IR_INST* inst = &blocks[i].insts[j];
+      if (inst->op == IR_JUMP || inst->op == IR_BRANCH) {
+        inst->target = index[inst->target];
+      }
+      if (inst->op == IR_BRANCH) {
+        inst->other = index[inst->other];
+      }
+      if (inst->op == IR_PHI) {
+        // Incoming values from removed blocks go away with them
+        int kept = 0;
+        for (int k = 0; k < arrlen(inst->sources); k++) {
+          if (index[inst->sources[k]] != -1) {
+            inst->args[kept] = inst->args[k];
+            inst->sources[kept] = index[inst->sources[k]];
+            kept++;
+          }
+        }
+        arrsetlen(inst->args, kept);
+        arrsetlen(inst->sources, kept);
+      }
+    }
+  }
+  arrfree(fn->blocks);
+  arrfree(index);
+  fn->blocks = blocks;
+}
+
+void IR_removeNops(IR_FUNCTION* fn) {
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    int kept = 0;
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      if (block->insts[j].op == IR_NOP) {
+        arrfree(block->insts[j].args);
+        arrfree(block->insts[j].sources);
+        continue;
+      }
+      block->insts[kept++] = block->insts[j];
+    }
+    arrsetlen(block->insts, kept);
+  }
+}
+
+void IR_insert(IR_BLOCK* block, int index, IR_INST inst) {
+  arrins(block->insts, index, inst);
+}
+
+IR_VREG** IR_operands(IR_INST* inst, IR_VREG** operands) {
+  arrsetlen(operands, 0);
+  int uses = opInfo[inst->op].uses;
+  if ((uses & (USES_A | MAY_USE_A)) && inst->a != IR_NONE) {
+    arrput(operands, &inst->a);
+  }
+  if ((uses & USES_B) && inst->b != IR_NONE) {
+    arrput(operands, &inst->b);
+  }
+  for (int i = 0; i < arrlen(inst->args); i++) {
+    arrput(operands, &inst->args[i]);
+  }
+  return operands;
+}
+
+static void printVreg(BUFFER* out, IR_VREG v) {
+  BUFFER_printf(out, "v%u", v);
+}
+
+void IR_print(BUFFER* out, IR_FUNCTION* fn) {
+  BUFFER_printf(out, "%s %s", fn->kind == IR_FUNCTION_ISR ? "isr" : "fn", CHARS(fn->name));
+  if (fn->module != EMPTY_STRING) {
+    BUFFER_printf(out, " (%s)", CHARS(fn->module));
+  }
+  BUFFER_printf(out, "\n");
+  for (int i = 0; i < arrlen(fn->slots); i++) {
+    IR_STACK_SLOT slot = fn->slots[i];
+    const char* name = slot.entry.key == EMPTY_STRING ? "(temporary)" : CHARS(slot.entry.key);
+    BUFFER_printf(out, "  %%%i: %s %s, %u bytes\n", i, slot.param ? "param" : "local", name, slot.size);
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    BUFFER_printf(out, "b%i:\n", i);
+    IR_BLOCK block = fn->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      IR_INST inst = block.insts[j];
+      BUFFER_printf(out, "  ");
+      if (opInfo[inst.op].hasDst) {
+        printVreg(out, inst.dst);
+        BUFFER_printf(out, " = ");
+      }
+      BUFFER_printf(out, "%s", IR_opName(inst.op));
+      switch (inst.op) {
+        case IR_CONST:
+          BUFFER_printf(out, ".%s %lli", typeNames[inst.type], (long long)inst.imm);
+          break;
+        case IR_STRING:
+          BUFFER_printf(out, " %lli", (long long)inst.imm);
+          break;
+        case IR_GLOBAL:
+          BUFFER_printf(out, " %s", CHARS(inst.symbol));
+          break;
+        case IR_SLOT:
+          BUFFER_printf(out, " %%%lli", (long long)inst.imm);
+          break;
+        case IR_PARAM:
+          BUFFER_printf(out, ".%s %lli", typeNames[inst.type], (long long)inst.imm);
+          break;
+        case IR_MEMCPY:
+          BUFFER_printf(out, " ");
+          printVreg(out, inst.a);
+          BUFFER_printf(out, ", ");
+          printVreg(out, inst.b);
+          BUFFER_printf(out, ", %lli", (long long)inst.imm);
+          break;
+        case IR_MEMZERO:
+          BUFFER_printf(out, " ");
+          printVreg(out, inst.a);
+          BUFFER_printf(out, ", %lli", (long long)inst.imm);
+          break;
+        case IR_CALL:
+          BUFFER_printf(out, ".%s ", typeNames[inst.type]);
+          if (inst.symbol != EMPTY_STRING) {
+            BUFFER_printf(out, "%s", CHARS(inst.symbol));
+          } else {
+            printVreg(out, inst.a);
+          }
+          BUFFER_printf(out, "(");
+          for (int k = 0; k < arrlen(inst.args); k++) {
+            if (k > 0) {
+              BUFFER_printf(out, ", ");
+            }
+            printVreg(out, inst.args[k]);
+          }
+          BUFFER_printf(out, ")");
+          break;
+        case IR_PHI:
+          BUFFER_printf(out, ".%s", typeNames[inst.type]);
+          for (int k = 0; k < arrlen(inst.args); k++) {
+            BUFFER_printf(out, "%s [", k > 0 ? "," : "");
+            printVreg(out, inst.args[k]);
+            BUFFER_printf(out, ", b%i]", inst.sources[k]);
+          }
+          break;
+        case IR_ASM:
+          BUFFER_printf(out, " \"%s\"", inst.text);
+          break;
+        case IR_JUMP:
+          BUFFER_printf(out, " b%i", inst.target);
+          break;
+        case IR_BRANCH:
+          BUFFER_printf(out, " ");
+          printVreg(out, inst.a);
+          BUFFER_printf(out, ", b%i, b%i", inst.target, inst.other);
+          break;
+        case IR_RETURN:
+          if (inst.a != IR_NONE) {
+            BUFFER_printf(out, " ");
+            printVreg(out, inst.a);
+          }
+          break;
+        default:
+          BUFFER_printf(out, ".%s ", typeNames[inst.type]);
+          printVreg(out, inst.a);
+          if (opInfo[inst.op].uses & USES_B) {
+            BUFFER_printf(out, ", ");
+            printVreg(out, inst.b);
+          }
+          break;
+      }
+      BUFFER_printf(out, "\n");
+    }
+  }
+}
+
+static bool verifyError(IR_FUNCTION* fn, int block, int index, const char* message) {
+  printf("IR error in %s, b%i:%i: %s\n", CHARS(fn->name), block, index, message);
+  return false;
+}
+
+static bool verifyPhi(IR_FUNCTION* fn, int* predecessors, IR_BLOCK block, int i, int j) {
+  IR_INST inst = block.insts[j];
+  if (!fn->ssa) {
+    return verifyError(fn, i, j, "phi outside of SSA form");
+  }
+  if (j > 0 && block.insts[j - 1].op != IR_PHI) {
+    return verifyError(fn, i, j, "phi after the start of a block");
+  }
+  if (arrlen(inst.args) != arrlen(inst.sources) || arrlen(inst.sources) != arrlen(predecessors)) {
+    return verifyError(fn, i, j, "phi does not cover every predecessor");
+  }
+  for (int k = 0; k < arrlen(inst.sources); k++) {
+    bool found = false;
+    for (int l = 0; l < arrlen(predecessors); l++) {
+      found |= predecessors[l] == inst.sources[k];
+    }
+    if (!found) {
+      return verifyError(fn, i, j, "phi source is not a predecessor");
+    }
+  }
+  return true;
+}
+
+bool IR_verify(IR_FUNCTION* fn) {
+  int blockCount = arrlen(fn->blocks);
+  if (blockCount == 0) {
+    return verifyError(fn, 0, 0, "function has no blocks");
+  }
+  bool* defined = calloc(fn->vregCount + 1, sizeof(bool));
+  bool valid = true;
+  for (int i = 0; i < blockCount && valid; i++) {
+    IR_BLOCK block = fn->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      IR_INST inst = block.insts[j];
+      if (opInfo[inst.op].hasDst) {
+        if (inst.dst == IR_NONE || inst.dst > fn->vregCount) {
+          valid = verifyError(fn, i, j, "invalid destination register");
+          break;
+        }
+        if (fn->ssa && defined[inst.dst]) {
+          valid = verifyError(fn, i, j, "register defined more than once");
+          break;
+        }
+        defined[inst.dst] = true;
+      }
+    }
+  }
+
+  int** predecessors = valid ? IR_predecessors(fn) : NULL;
+
+  for (int i = 0; i < blockCount && valid; i++) {
+    IR_BLOCK block = fn->blocks[i];
+    int count = arrlen(block.insts);
+    if (count == 0 || !IR_isTerminator(block.insts[count - 1].op)) {
+      valid = verifyError(fn, i, count, "block does not end in a terminator");
+      break;
+    }
+    for (int j = 0; j < count && valid; j++) {
+      IR_INST inst = block.insts[j];
+      int uses = opInfo[inst.op].uses;
+      IR_VREG operands[2] = { IR_NONE, IR_NONE };
+      if (uses & USES_A) {
+        operands[0] = inst.a;
+        if (inst.a == IR_NONE) {
+          valid = verifyError(fn, i, j, "missing operand");
+        }
+      }
+      if (uses & MAY_USE_A) {
+        operands[0] = inst.a;
+      }
+      if (uses & USES_B) {
+        operands[1] = inst.b;
+        if (inst.b == IR_NONE) {
+          valid = verifyError(fn, i, j, "missing operand");
+        }
+      }
+      for (int k = 0; k < 2 && valid; k++) {
+        if (operands[k] != IR_NONE && (operands[k] > fn->vregCount || !defined[operands[k]])) {
+          valid = verifyError(fn, i, j, "use of an undefined register");
+        }
+      }
+      for (int k = 0; k < arrlen(inst.args) && valid; k++) {
+        if (inst.args[k] == IR_NONE || inst.args[k] > fn->vregCount || !defined[inst.args[k]]) {
+          valid = verifyError(fn, i, j, "use of an undefined register");
+        }
+      }
+      if (!valid) {
+        break;
+      }
+      if (IR_isTerminator(inst.op) && j != count - 1) {
+        valid = verifyError(fn, i, j, "terminator in the middle of a block");
+      } else if (inst.op == IR_CALL && inst.symbol == EMPTY_STRING && inst.a == IR_NONE) {
+        valid = verifyError(fn, i, j, "call has no target");
+      } else if (inst.op == IR_SLOT && (inst.imm < 0 || inst.imm >= arrlen(fn->slots))) {
+        valid = verifyError(fn, i, j, "unknown stack slot");
+      } else if (inst.op == IR_PARAM && (inst.imm < 0 || inst.imm >= fn->paramCount)) {
+        valid = verifyError(fn, i, j, "unknown parameter");
+      } else if ((inst.op == IR_JUMP || inst.op == IR_BRANCH) && (inst.target < 0 || inst.target >= blockCount)) {
+        valid = verifyError(fn, i, j, "branch to an unknown block");
+      } else if (inst.op == IR_BRANCH && (inst.other < 0 || inst.other >= blockCount)) {
+        valid = verifyError(fn, i, j, "branch to an unknown block");
+      } else if ((inst.op == IR_MEMCPY || inst.op == IR_MEMZERO) && inst.imm < 0) {
+        valid = verifyError(fn, i, j, "negative copy size");
+      } else if (inst.op == IR_ASM && inst.text == NULL) {
+        valid = verifyError(fn, i, j, "missing assembly text");
+      } else if (inst.op == IR_PHI) {
+        valid = verifyPhi(fn, predecessors[i], block, i, j);
+      }
+    }
+  }
+  free(defined);
+  IR_freePredecessors(predecessors);
+  return valid;
+}
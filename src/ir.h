@@ -0,0 +1,200 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef ir_h
+#define ir_h
+
+#include "common.h"
+#include "buffer.h"
+#include "symbol_table.h"
+
+// Three-address intermediate representation of a function body. Code is a
+// list of basic blocks, each ending in exactly one terminator (jump,
+// branch or return). Values live in virtual registers, numbered from 1,
+// and memory is only touched through explicit loads and stores.
+
+typedef uint32_t IR_VREG;
+#define IR_NONE 0
+
+// Width and signedness of a value. A value narrower than 64 bits is held
+// truncated to its width and then sign- or zero-extended, so every
+// operation producing one wraps the result accordingly.
+typedef enum IR_TYPE {
+  IR_U8,
+  IR_I8,
+  IR_U16,
+  IR_I16,
+  IR_U32,
+  IR_I32,
+  IR_U64,
+  IR_I64
+} IR_TYPE;
+
+#define IR_TYPE_SIZE(t) (1 << ((t) >> 1))
+#define IR_TYPE_SIGNED(t) (((t) & 1) != 0)
+
+typedef enum IR_OP {
+  IR_NOP,
+  IR_CONST,    // dst = imm
+  IR_STRING,   // dst = address of the characters of string constant imm
+  IR_GLOBAL,   // dst = address of symbol
+  IR_SLOT,     // dst = address of stack slot imm
+  IR_PARAM,    // dst = argument imm passed to the function
+  IR_COPY,     // dst = a
+  IR_LOAD,     // dst = *a
+  IR_STORE,    // *a = b
+  IR_MEMCPY,   // copy imm bytes from b to a
+  IR_MEMZERO,  // clear imm bytes at a
+  IR_ADD,
+  IR_SUB,
+  IR_MUL,
+  IR_DIV,
+  IR_MOD,
+  IR_AND,
+  IR_OR,
+  IR_XOR,
+  IR_SHL,
+  IR_SHR,
+  IR_NEG,      // dst = -a
+  IR_NOT,      // dst = ~a
+  IR_EXT,      // dst = a converted to type
+  IR_EQ,       // comparisons of a and b, typed by their operands,
+  IR_NE,       // giving 1 or 0
+  IR_LT,
+  IR_LE,
+  IR_GT,
+  IR_GE,
+  IR_CALL,     // dst = symbol(args) when symbol is set, a(args) otherwise,
+               // with imm set when the arguments go on the stack
+  IR_PHI,      // dst = args[i] when entered from block sources[i]
+  IR_ASM,      // inline assembly text
+  IR_JUMP,     // goto target
+  IR_BRANCH,   // if a goto target else other
+  IR_RETURN    // return a, or 0 when there is no value
+} IR_OP;
+
+typedef struct IR_INST {
+  IR_OP op;
+  IR_TYPE type;
+  IR_VREG dst;
+  IR_VREG a;
+  IR_VREG b;
+  int64_t imm;
+  STR symbol;
+  IR_VREG* args;
+  int* sources;
+  const char* text;
+  int target;
+  int other;
+} IR_INST;
+
+// Set by the for<unroll> and for<nounroll> annotations, and the same on
+// while loops, on the block holding the loop test
+typedef enum IR_UNROLL_HINT {
+  IR_UNROLL_AUTO,
+  IR_UNROLL_ALWAYS,
+  IR_UNROLL_NEVER
+} IR_UNROLL_HINT;
+
+typedef struct IR_BLOCK {
+  IR_INST* insts;
+  IR_UNROLL_HINT unroll;
+} IR_BLOCK;
+
+// Parameters and locals which live in the stack frame. The backend
+// decides where each one goes.
+typedef struct IR_STACK_SLOT {
+  SYMBOL_TABLE_ENTRY entry;
+  bool param;
+  uint32_t size;
+  // Not in this function's symbol table, as it was copied from an
+  // inlined callee or holds an intermediate value
+  bool temporary;
+} IR_STACK_SLOT;
+
+typedef enum IR_FUNCTION_KIND {
+  IR_FUNCTION_FN,
+  IR_FUNCTION_ISR
+} IR_FUNCTION_KIND;
+
+// Set by the fn<inline> and fn<noinline> annotations
+typedef enum IR_INLINE_HINT {
+  IR_INLINE_AUTO,
+  IR_INLINE_ALWAYS,
+  IR_INLINE_NEVER
+} IR_INLINE_HINT;
+
+typedef struct IR_FUNCTION {
+  IR_FUNCTION_KIND kind;
+  STR name;
+  STR module;
+  SYMBOL_TABLE_SCOPE scope;
+  uint32_t paramCount;
+  IR_BLOCK* blocks;
+  IR_STACK_SLOT* slots;
+  uint32_t vregCount;
+  IR_INLINE_HINT inlining;
+  // Set while every register has exactly one definition
+  bool ssa;
+
+  // builder state
+  int current;
+  int* placed;
+} IR_FUNCTION;
+
+IR_FUNCTION* IR_newFunction(IR_FUNCTION_KIND kind, STR name, STR module, SYMBOL_TABLE_SCOPE scope);
+void IR_free(IR_FUNCTION* fn);
+
+IR_VREG IR_newVreg(IR_FUNCTION* fn);
+int IR_newBlock(IR_FUNCTION* fn);
+void IR_placeBlock(IR_FUNCTION* fn, int block);
+bool IR_isTerminated(IR_FUNCTION* fn);
+void IR_emit(IR_FUNCTION* fn, IR_INST inst);
+int IR_getSlot(IR_FUNCTION* fn, SYMBOL_TABLE_ENTRY entry, uint32_t size);
+int IR_newTemporary(IR_FUNCTION* fn, uint32_t size);
+void IR_finish(IR_FUNCTION* fn);
+
+bool IR_isTerminator(IR_OP op);
+bool IR_hasDestination(IR_OP op);
+bool IR_isPure(IR_OP op);
+const char* IR_opName(IR_OP op);
+int64_t IR_normalize(int64_t value, IR_TYPE type);
+bool IR_fold(IR_OP op, IR_TYPE type, int64_t a, int64_t b, int64_t* result);
+
+// Control flow helpers
+IR_INST* IR_terminator(IR_BLOCK* block);
+int IR_successors(IR_BLOCK* block, int successors[2]);
+int** IR_predecessors(IR_FUNCTION* fn);
+void IR_freePredecessors(int** predecessors);
+void IR_removeUnreachable(IR_FUNCTION* fn);
+void IR_removeNops(IR_FUNCTION* fn);
+void IR_insert(IR_BLOCK* block, int index, IR_INST inst);
+IR_VREG** IR_operands(IR_INST* inst, IR_VREG** operands);
+
+void IR_print(BUFFER* out, IR_FUNCTION* fn);
+bool IR_verify(IR_FUNCTION* fn);
+
+#endif
@@ -0,0 +1,1390 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "loop.h"
+#include "ssa.h"
+
+typedef struct LOOP {
+  int header;
+  int preheader;
+  // Per block: whether it is part of the loop
+  bool* body;
+  int size;
+} LOOP;
+
+// A register holding scale * iv + base + offset, with base an invariant
+// register or IR_NONE
+typedef struct DERIVED {
+  IR_VREG iv;
+  uint64_t scale;
+  IR_VREG base;
+  uint64_t offset;
+} DERIVED;
+
+// A header phi counting by a constant step, which cannot wrap around
+// before the loop test stops it
+typedef struct INDUCTION {
+  IR_VREG phi;
+  IR_VREG init;
+  IR_VREG next;
+  int64_t step;
+  // The header test, which compares the phi against limit
+  IR_VREG test;
+  IR_VREG limit;
+} INDUCTION;
+
+// Instructions to add once the loop has been examined
+typedef struct PENDING {
+  int block;
+  int index;
+  int order;
+  IR_INST inst;
+} PENDING;
+
+static IR_FUNCTION* fn = NULL;
+// Per register: its defining instruction and block
+static IR_INST** definitions = NULL;
+static int* defBlock = NULL;
+static IR_VREG* replacement = NULL;
+static PENDING* pending = NULL;
+// Per block appended while unrolling: the block it goes in front of
+static int* anchors = NULL;
+
+static bool dominates(int* idom, int a, int b) {
+  while (b != a) {
+    if (b == 0 || idom[b] < 0) {
+      return false;
+    }
+    b = idom[b];
+  }
+  return true;
+}
+
+static bool constantOf(IR_VREG v, int64_t* value) {
+  IR_INST* def = v < arrlen(definitions) ? definitions[v] : NULL;
+  if (def == NULL || def->op != IR_CONST) {
+    return false;
+  }
+  *value = def->imm;
+  return true;
+}
+
+static bool isInvariant(LOOP* loop, IR_VREG v) {
+  return v < arrlen(defBlock) && defBlock[v] >= 0 && !loop->body[defBlock[v]];
+}
+
+// The type a register's value is already normalised to, or -1
+static int valueType(IR_VREG v) {
+  IR_INST* def = v < arrlen(definitions) ? definitions[v] : NULL;
+  if (def == NULL) {
+    return -1;
+  }
+  switch (def->op) {
+    case IR_COPY: return valueType(def->a);
+    case IR_CONST: return IR_normalize(def->imm, def->type) == def->imm ? (int)def->type : -1;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+    case IR_STRING:
+    case IR_GLOBAL:
+    case IR_SLOT:
+    case IR_CALL:
+      return -1;
+    default: return def->type;
+  }
+}
+
+static void analyse(void) {
+  arrsetlen(definitions, fn->vregCount + 1);
+  arrsetlen(defBlock, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    definitions[v] = NULL;
+    defBlock[v] = -1;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        definitions[inst->dst] = inst;
+        defBlock[inst->dst] = i;
+      }
+    }
+  }
+}
+
+static void addPending(int block, int index, IR_INST inst) {
+  arrput(pending, ((PENDING){ block, index, arrlen(pending), inst }));
+}
+
+static int comparePending(const void* x, const void* y) {
+  const PENDING* a = x;
+  const PENDING* b = y;
+  if (a->block != b->block) {
+    return a->block - b->block;
+  }
+  if (a->index != b->index) {
+    return a->index - b->index;
+  }
+  return a->order - b->order;
+}
+
+// Inserts the pending instructions, which are indexed by the positions
+// before any of them went in
+static void flushPending(void) {
+  qsort(pending, arrlen(pending), sizeof(PENDING), comparePending);
+  for (int i = arrlen(pending) - 1; i >= 0; i--) {
+    IR_insert(&fn->blocks[pending[i].block], pending[i].index, pending[i].inst);
+  }
+  arrsetlen(pending, 0);
+}
+
+static IR_VREG emitBefore(int block, int index, IR_OP op, IR_TYPE type, IR_VREG a, IR_VREG b, int64_t imm) {
+  IR_VREG dst = IR_newVreg(fn);
+  addPending(block, index, (IR_INST){ .op = op, .type = type, .dst = dst, .a = a, .b = b, .imm = imm });
+  return dst;
+}
+
+// Emits scale * v + base at the end of the preheader, folding constants
+static IR_VREG emitLinear(LOOP* loop, IR_VREG v, uint64_t scale, IR_VREG base) {
+  int block = loop->preheader;
+  int end = arrlen(fn->blocks[block].insts) - 1;
+  int64_t c;
+  if (constantOf(v, &c)) {
+    if ((uint64_t)c * scale == 0) {
+      return base;
+    }
+    IR_VREG product = emitBefore(block, end, IR_CONST, IR_U64, IR_NONE, IR_NONE, (int64_t)((uint64_t)c * scale));
+    return emitBefore(block, end, IR_ADD, IR_U64, base, product, 0);
+  }
+  IR_VREG product = v;
+  if (scale != 1) {
+    int k = 0;
+    while (k < 63 && ((uint64_t)1 << k) < scale) {
+      k++;
+    }
+    bool power = ((uint64_t)1 << k) == scale;
+    IR_VREG factor = emitBefore(block, end, IR_CONST, IR_U64, IR_NONE, IR_NONE, power ? k : (int64_t)scale);
+    product = emitBefore(block, end, power ? IR_SHL : IR_MUL, IR_U64, v, factor, 0);
+  }
+  return emitBefore(block, end, IR_ADD, IR_U64, base, product, 0);
+}
+
+// ------- Structure -------
+
+// Makes room for a block at index at, moving every later block along
+static void insertBlock(int at) {
+  arrins(fn->blocks, at, ((IR_BLOCK){ NULL }));
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if ((inst->op == IR_JUMP || inst->op == IR_BRANCH) && inst->target >= at) {
+        inst->target++;
+      }
+      if (inst->op == IR_BRANCH && inst->other >= at) {
+        inst->other++;
+      }
+      for (int k = 0; k < arrlen(inst->sources); k++) {
+        if (inst->sources[k] >= at) {
+          inst->sources[k]++;
+        }
+      }
+    }
+  }
+}
+
+// Gives the loop at header a single predecessor outside it which only
+// leads into the loop. The new block goes just before the header.
+static bool addPreheader(int header, int* predecessors, int* idom) {
+  int* outside = NULL;
+  for (int i = 0; i < arrlen(predecessors); i++) {
+    if (!dominates(idom, header, predecessors[i])) {
+      arrput(outside, predecessors[i]);
+    }
+  }
+  int successors[2];
+  if (arrlen(outside) == 0 || (arrlen(outside) == 1 && IR_successors(&fn->blocks[outside[0]], successors) == 1)) {
+    arrfree(outside);
+    return false;
+  }
+  insertBlock(header);
+  int preheader = header++;
+  for (int i = 0; i < arrlen(outside); i++) {
+    if (outside[i] >= preheader) {
+      outside[i]++;
+    }
+    IR_INST* branch = IR_terminator(&fn->blocks[outside[i]]);
+    if (branch->target == header) {
+      branch->target = preheader;
+    }
+    if (branch->op == IR_BRANCH && branch->other == header) {
+      branch->other = preheader;
+    }
+  }
+
+  // Values entering the loop now merge in the preheader
+  IR_BLOCK* block = &fn->blocks[header];
+  IR_INST* phis = NULL;
+  for (int j = 0; j < arrlen(block->insts) && block->insts[j].op == IR_PHI; j++) {
+    IR_INST* phi = &block->insts[j];
+    IR_INST merged = { .op = IR_PHI, .type = phi->type };
+    int kept = 0;
+    for (int k = 0; k < arrlen(phi->sources); k++) {
+      bool entering = false;
+      for (int m = 0; m < arrlen(outside); m++) {
+        entering |= phi->sources[k] == outside[m];
+      }
+      if (entering) {
+        arrput(merged.args, phi->args[k]);
+        arrput(merged.sources, phi->sources[k]);
+      } else {
+        phi->args[kept] = phi->args[k];
+        phi->sources[kept] = phi->sources[k];
+        kept++;
+      }
+    }
+    arrsetlen(phi->args, kept);
+    arrsetlen(phi->sources, kept);
+    IR_VREG value = merged.args[0];
+    bool same = true;
+    for (int k = 1; k < arrlen(merged.args); k++) {
+      same &= merged.args[k] == value;
+    }
+    if (same) {
+      arrfree(merged.args);
+      arrfree(merged.sources);
+    } else {
+      value = merged.dst = IR_newVreg(fn);
+      arrput(phis, merged);
+    }
+    arrput(phi->args, value);
+    arrput(phi->sources, preheader);
+  }
+  IR_BLOCK* pre = &fn->blocks[preheader];
+  for (int j = 0; j < arrlen(phis); j++) {
+    arrput(pre->insts, phis[j]);
+  }
+  arrput(pre->insts, ((IR_INST){ .op = IR_JUMP, .target = header }));
+  arrfree(phis);
+  arrfree(outside);
+  return true;
+}
+
+static LOOP* findLoops(void) {
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    int* idom = SSA_dominators(fn);
+    int** predecessors = IR_predecessors(fn);
+    for (int h = 1; h < arrlen(fn->blocks) && !changed; h++) {
+      bool header = false;
+      for (int i = 0; i < arrlen(predecessors[h]); i++) {
+        header |= idom[predecessors[h][i]] >= 0 && dominates(idom, h, predecessors[h][i]);
+      }
+      changed = header && addPreheader(h, predecessors[h], idom);
+    }
+    IR_freePredecessors(predecessors);
+    arrfree(idom);
+  }
+
+  LOOP* loops = NULL;
+  int count = arrlen(fn->blocks);
+  int* idom = SSA_dominators(fn);
+  int** predecessors = IR_predecessors(fn);
+  for (int h = 1; h < count; h++) {
+    LOOP loop = { h, -1, NULL, 1 };
+    int* work = NULL;
+    for (int i = 0; i < arrlen(predecessors[h]); i++) {
+      int from = predecessors[h][i];
+      if (idom[from] >= 0 && dominates(idom, h, from)) {
+        arrput(work, from);
+      } else {
+        loop.preheader = from;
+      }
+    }
+    if (arrlen(work) == 0 || loop.preheader < 0) {
+      arrfree(work);
+      continue;
+    }
+    // Everything reaching a back edge without passing the header
+    loop.body = calloc(count, sizeof(bool));
+    loop.body[h] = true;
+    while (arrlen(work) > 0) {
+      int block = arrpop(work);
+      if (loop.body[block]) {
+        continue;
+      }
+      loop.body[block] = true;
+      loop.size++;
+      for (int i = 0; i < arrlen(predecessors[block]); i++) {
+        arrput(work, predecessors[block][i]);
+      }
+    }
+    arrfree(work);
+    arrput(loops, loop);
+  }
+  IR_freePredecessors(predecessors);
+  arrfree(idom);
+  return loops;
+}
+
+static int compareLoops(const void* x, const void* y) {
+  return ((const LOOP*)x)->size - ((const LOOP*)y)->size;
+}
+
+// ------- Invariant code motion -------
+
+static bool isHoistable(IR_OP op) {
+  // Division by zero gives zero rather than trapping, so nothing pure
+  // is unsafe to run early
+  return IR_isPure(op) && IR_hasDestination(op)
+    && op != IR_LOAD && op != IR_PHI && op != IR_PARAM && op != IR_CONST;
+}
+
+static void hoistInvariants(LOOP* loop) {
+  analyse();
+  IR_INST* hoisted = NULL;
+  IR_VREG** operands = NULL;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      if (!loop->body[i]) {
+        continue;
+      }
+      IR_BLOCK* block = &fn->blocks[i];
+      for (int j = 0; j < arrlen(block->insts); j++) {
+        IR_INST* inst = &block->insts[j];
+        if (!isHoistable(inst->op)) {
+          continue;
+        }
+        operands = IR_operands(inst, operands);
+        bool invariant = true;
+        for (int k = 0; k < arrlen(operands) && invariant; k++) {
+          int64_t c;
+          invariant = isInvariant(loop, *operands[k]) || constantOf(*operands[k], &c);
+        }
+        if (!invariant) {
+          continue;
+        }
+        // Constants stay where they are, for other uses, and are copied
+        for (int k = 0; k < arrlen(operands); k++) {
+          int64_t c;
+          if (!isInvariant(loop, *operands[k]) && constantOf(*operands[k], &c)) {
+            IR_INST copy = *definitions[*operands[k]];
+            copy.dst = IR_newVreg(fn);
+            arrput(hoisted, copy);
+            *operands[k] = copy.dst;
+          }
+        }
+        arrput(hoisted, *inst);
+        defBlock[inst->dst] = loop->preheader;
+        inst->op = IR_NOP;
+        changed = true;
+      }
+    }
+  }
+  IR_BLOCK* pre = &fn->blocks[loop->preheader];
+  for (int j = 0; j < arrlen(hoisted); j++) {
+    IR_insert(pre, arrlen(pre->insts) - 1, hoisted[j]);
+  }
+  IR_removeNops(fn);
+  arrfree(hoisted);
+  arrfree(operands);
+}
+
+// ------- Induction variables -------
+
+// The comparison giving the same result with its operands swapped
+static IR_OP swapComparison(IR_OP op) {
+  return op == IR_LT ? IR_GT : op == IR_GT ? IR_LT : op == IR_LE ? IR_GE : op == IR_GE ? IR_LE : op;
+}
+
+static IR_OP negateComparison(IR_OP op) {
+  return op == IR_LT ? IR_GE : op == IR_GE ? IR_LT : op == IR_LE ? IR_GT : op == IR_GT ? IR_LE : op;
+}
+
+// Whether the header test keeps the phi from wrapping as it steps, and
+// if so, which test and limit
+static bool isBounded(LOOP* loop, INDUCTION* iv, IR_TYPE type) {
+  IR_INST* branch = IR_terminator(&fn->blocks[loop->header]);
+  if (branch == NULL || branch->op != IR_BRANCH || IR_TYPE_SIZE(type) > 4) {
+    return false;
+  }
+  bool stayOnTrue = loop->body[branch->target] && !loop->body[branch->other];
+  bool stayOnFalse = loop->body[branch->other] && !loop->body[branch->target];
+  IR_INST* test = definitions[branch->a];
+  if ((!stayOnTrue && !stayOnFalse) || test == NULL || defBlock[branch->a] != loop->header || test->type != type) {
+    return false;
+  }
+  IR_OP op = test->op;
+  IR_VREG limit = test->b;
+  if (test->b == iv->phi) {
+    limit = test->a;
+    op = swapComparison(op);
+  } else if (test->a != iv->phi) {
+    return false;
+  }
+  if (stayOnFalse) {
+    op = negateComparison(op);
+  }
+  int64_t c;
+  bool constant = constantOf(limit, &c) && IR_normalize(c, type) == c;
+  if (!constant && (!isInvariant(loop, limit) || valueType(limit) != (int)type)) {
+    return false;
+  }
+  int bits = IR_TYPE_SIZE(type) * 8;
+  int64_t max = IR_TYPE_SIGNED(type) ? ((int64_t)1 << (bits - 1)) - 1 : ((int64_t)1 << bits) - 1;
+  int64_t min = IR_TYPE_SIGNED(type) ? -((int64_t)1 << (bits - 1)) : 0;
+  bool bounded = false;
+  // The phi only steps once the test has passed, so it stays in range
+  if (iv->step > 0 && op == IR_LT) {
+    bounded = iv->step == 1 || (constant && c - 1 + iv->step <= max);
+  } else if (iv->step > 0 && op == IR_LE) {
+    bounded = constant && c + iv->step <= max;
+  } else if (iv->step < 0 && op == IR_GT) {
+    bounded = iv->step == -1 || (constant && c + 1 + iv->step >= min);
+  } else if (iv->step < 0 && op == IR_GE) {
+    bounded = constant && c + iv->step >= min;
+  }
+  if (bounded) {
+    iv->test = branch->a;
+    iv->limit = limit;
+  }
+  return bounded;
+}
+
+static INDUCTION* findInductions(LOOP* loop) {
+  INDUCTION* ivs = NULL;
+  IR_BLOCK* header = &fn->blocks[loop->header];
+  for (int j = 0; j < arrlen(header->insts) && header->insts[j].op == IR_PHI; j++) {
+    IR_INST* phi = &header->insts[j];
+    INDUCTION iv = { phi->dst, IR_NONE, IR_NONE, 0, IR_NONE, IR_NONE };
+    bool valid = true;
+    for (int k = 0; k < arrlen(phi->sources) && valid; k++) {
+      if (phi->sources[k] == loop->preheader) {
+        iv.init = phi->args[k];
+      } else {
+        valid = (iv.next == IR_NONE || iv.next == phi->args[k]) && phi->args[k] != phi->dst;
+        iv.next = phi->args[k];
+      }
+    }
+    IR_INST* step = valid && iv.next != IR_NONE ? definitions[iv.next] : NULL;
+    if (step == NULL || !loop->body[defBlock[iv.next]] || step->type != phi->type) {
+      continue;
+    }
+    int64_t c;
+    if (step->op == IR_ADD && step->a == phi->dst && constantOf(step->b, &c)) {
+      iv.step = c;
+    } else if (step->op == IR_ADD && step->b == phi->dst && constantOf(step->a, &c)) {
+      iv.step = c;
+    } else if (step->op == IR_SUB && step->a == phi->dst && constantOf(step->b, &c)) {
+      iv.step = -c;
+    } else {
+      continue;
+    }
+    if (iv.step != 0 && iv.step > -(1 << 16) && iv.step < (1 << 16) && isBounded(loop, &iv, phi->type)) {
+      arrput(ivs, iv);
+    }
+  }
+  return ivs;
+}
+
+static bool is64(IR_TYPE type) {
+  return IR_TYPE_SIZE(type) == 8;
+}
+
+// Works out which registers in the loop are linear in an induction
+// variable. Addresses are computed in 64 bits, so nothing wraps.
+static DERIVED* deriveValues(LOOP* loop, INDUCTION* ivs) {
+  DERIVED* derived = NULL;
+  arrsetlen(derived, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    derived[v] = (DERIVED){ IR_NONE };
+  }
+  for (int i = 0; i < arrlen(ivs); i++) {
+    derived[ivs[i].phi] = (DERIVED){ ivs[i].phi, 1, IR_NONE, 0 };
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      if (!loop->body[i]) {
+        continue;
+      }
+      IR_BLOCK* block = &fn->blocks[i];
+      for (int j = 0; j < arrlen(block->insts); j++) {
+        IR_INST* inst = &block->insts[j];
+        if (!IR_hasDestination(inst->op) || derived[inst->dst].iv != IR_NONE) {
+          continue;
+        }
+        DERIVED a = (inst->a != IR_NONE && inst->a < arrlen(derived)) ? derived[inst->a] : (DERIVED){ IR_NONE };
+        DERIVED b = (inst->b != IR_NONE && inst->b < arrlen(derived)) ? derived[inst->b] : (DERIVED){ IR_NONE };
+        DERIVED result = { IR_NONE };
+        int64_t c;
+        switch (inst->op) {
+          case IR_COPY:
+            result = a;
+            break;
+          case IR_EXT:
+            result = is64(inst->type) ? a : result;
+            break;
+          case IR_ADD:
+            {
+              IR_VREG other = inst->b;
+              if (b.iv != IR_NONE) {
+                DERIVED swap = a;
+                a = b;
+                b = swap;
+                other = inst->a;
+              }
+              if (!is64(inst->type) || a.iv == IR_NONE) {
+                break;
+              }
+              if (b.iv == a.iv && (a.base == IR_NONE || b.base == IR_NONE)) {
+                // Multiplication by a constant reduced to shifts and adds
+                result = a;
+                result.scale += b.scale;
+                result.offset += b.offset;
+                result.base = a.base != IR_NONE ? a.base : b.base;
+              } else if (b.iv != IR_NONE) {
+                break;
+              } else if (constantOf(other, &c)) {
+                result = a;
+                result.offset += (uint64_t)c;
+              } else if (a.base == IR_NONE && isInvariant(loop, other)) {
+                result = a;
+                result.base = other;
+              }
+              break;
+            }
+          case IR_SUB:
+            if (!is64(inst->type) || a.iv == IR_NONE) {
+              break;
+            }
+            if (b.iv == a.iv && b.base == IR_NONE) {
+              result = a;
+              result.scale -= b.scale;
+              result.offset -= b.offset;
+            } else if (b.iv == IR_NONE && constantOf(inst->b, &c)) {
+              result = a;
+              result.offset -= (uint64_t)c;
+            }
+            break;
+          case IR_SHL:
+            if (is64(inst->type) && a.iv != IR_NONE && a.base == IR_NONE && constantOf(inst->b, &c) && c >= 0 && c < 63) {
+              result = a;
+              result.scale <<= c;
+              result.offset <<= c;
+            }
+            break;
+          case IR_MUL:
+            {
+              IR_VREG other = inst->b;
+              if (b.iv != IR_NONE) {
+                a = b;
+                other = inst->a;
+              }
+              if (is64(inst->type) && a.iv != IR_NONE && a.base == IR_NONE && constantOf(other, &c)) {
+                result = a;
+                result.scale *= (uint64_t)c;
+                result.offset *= (uint64_t)c;
+              }
+              break;
+            }
+          default:
+            break;
+        }
+        if (result.iv != IR_NONE && result.scale != 0) {
+          derived[inst->dst] = result;
+          changed = true;
+        }
+      }
+    }
+  }
+  return derived;
+}
+
+typedef struct GROUP {
+  IR_VREG iv;
+  uint64_t scale;
+  IR_VREG base;
+  IR_VREG phi;
+  // Whether memory is accessed through it, so it holds an address
+  bool address;
+} GROUP;
+
+static void replace(IR_VREG v, IR_VREG with) {
+  while (arrlen(replacement) <= v) {
+    arrput(replacement, IR_NONE);
+  }
+  replacement[v] = with;
+}
+
+static void applyReplacements(void) {
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks) && arrlen(replacement) > 0; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      operands = IR_operands(&block->insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        while (*operands[k] < arrlen(replacement) && replacement[*operands[k]] != IR_NONE) {
+          *operands[k] = replacement[*operands[k]];
+        }
+      }
+    }
+  }
+  arrfree(operands);
+  arrsetlen(replacement, 0);
+}
+
+static int indexOf(IR_INST* inst, int block) {
+  return (int)(inst - fn->blocks[block].insts);
+}
+
+static bool isAddressOperand(IR_INST* inst, IR_VREG* operand) {
+  switch (inst->op) {
+    case IR_LOAD:
+    case IR_STORE:
+    case IR_MEMZERO:
+      return operand == &inst->a;
+    case IR_MEMCPY:
+      return operand == &inst->a || operand == &inst->b;
+    default:
+      return false;
+  }
+}
+
+// Gives each base and scale of an induction variable used outside the
+// arithmetic deriving it a pointer of its own, stepped alongside the
+// counter, and then tests that pointer when the counter has no other use
+static void reduceInductions(LOOP* loop) {
+  analyse();
+  INDUCTION* ivs = findInductions(loop);
+  if (arrlen(ivs) == 0) {
+    arrfree(ivs);
+    return;
+  }
+  DERIVED* derived = deriveValues(loop, ivs);
+  IR_VREG count = arrlen(derived);
+  bool* external = calloc(count, sizeof(bool));
+  bool* addressed = calloc(count, sizeof(bool));
+  // Per induction variable: whether the counter itself is still needed
+  bool* kept = calloc(arrlen(ivs), sizeof(bool));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      IR_VREG dst = IR_hasDestination(inst->op) ? inst->dst : IR_NONE;
+      bool fromDerived = dst != IR_NONE && inst->op != IR_PHI && derived[dst].iv != IR_NONE;
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        IR_VREG v = *operands[k];
+        if (v < count && derived[v].iv != IR_NONE && !fromDerived) {
+          external[v] = true;
+          addressed[v] |= isAddressOperand(inst, operands[k]);
+        }
+        for (int n = 0; n < arrlen(ivs); n++) {
+          INDUCTION* iv = &ivs[n];
+          if (v == iv->phi) {
+            kept[n] |= !fromDerived && (dst == IR_NONE || (dst != iv->next && dst != iv->test));
+          } else if (v == iv->next) {
+            kept[n] |= dst != iv->phi;
+          } else if (v == iv->test) {
+            kept[n] |= !(inst->op == IR_BRANCH && i == loop->header);
+          }
+        }
+      }
+    }
+  }
+
+  GROUP* groups = NULL;
+  for (IR_VREG v = 1; v < count; v++) {
+    DERIVED d = derived[v];
+    if (d.iv == IR_NONE || d.iv == v || !external[v]) {
+      continue;
+    }
+    int n = 0;
+    while (ivs[n].phi != d.iv) {
+      n++;
+    }
+    if (d.base == IR_NONE) {
+      // Scaled counters are left as they are
+      kept[n] = true;
+      continue;
+    }
+    int g = 0;
+    while (g < arrlen(groups) && !(groups[g].iv == d.iv && groups[g].scale == d.scale && groups[g].base == d.base)) {
+      g++;
+    }
+    if (g == arrlen(groups)) {
+      INDUCTION* iv = &ivs[n];
+      GROUP group = { d.iv, d.scale, d.base, IR_newVreg(fn), false };
+      IR_VREG start = emitLinear(loop, iv->init, d.scale, d.base);
+      int at = defBlock[iv->next];
+      int after = indexOf(definitions[iv->next], at) + 1;
+      IR_VREG step = emitBefore(at, after, IR_CONST, IR_U64, IR_NONE, IR_NONE, (int64_t)(d.scale * (uint64_t)iv->step));
+      IR_VREG next = emitBefore(at, after, IR_ADD, IR_U64, group.phi, step, 0);
+      IR_INST* counter = definitions[iv->phi];
+      IR_INST phi = { .op = IR_PHI, .type = IR_U64, .dst = group.phi };
+      for (int k = 0; k < arrlen(counter->sources); k++) {
+        arrput(phi.args, counter->sources[k] == loop->preheader ? start : next);
+        arrput(phi.sources, counter->sources[k]);
+      }
+      addPending(loop->header, 0, phi);
+      arrput(groups, group);
+    }
+    groups[g].address |= addressed[v];
+
+    IR_INST* inst = definitions[v];
+    if (d.offset == 0) {
+      replace(v, groups[g].phi);
+      inst->op = IR_NOP;
+    } else {
+      IR_VREG offset = emitBefore(defBlock[v], indexOf(inst, defBlock[v]), IR_CONST, IR_U64, IR_NONE, IR_NONE, (int64_t)d.offset);
+      *inst = (IR_INST){ .op = IR_ADD, .type = IR_U64, .dst = v, .a = groups[g].phi, .b = offset };
+    }
+  }
+
+  // Linear function test replacement. The counter and its limit are at
+  // most 32 bits wide, so scaling them and adding an address cannot
+  // overflow a signed comparison.
+  for (int n = 0; n < arrlen(ivs); n++) {
+    INDUCTION* iv = &ivs[n];
+    GROUP* group = NULL;
+    for (int g = 0; g < arrlen(groups) && group == NULL; g++) {
+      if (groups[g].iv == iv->phi && groups[g].address && groups[g].scale <= (1 << 20)) {
+        group = &groups[g];
+      }
+    }
+    if (kept[n] || group == NULL) {
+      continue;
+    }
+    IR_INST* test = definitions[iv->test];
+    IR_VREG limit = emitLinear(loop, iv->limit, group->scale, group->base);
+    if (test->a == iv->phi) {
+      test->a = group->phi;
+      test->b = limit;
+    } else {
+      test->a = limit;
+      test->b = group->phi;
+    }
+    test->type = IR_I64;
+  }
+  flushPending();
+  applyReplacements();
+  IR_removeNops(fn);
+
+  arrfree(groups);
+  arrfree(operands);
+  arrfree(derived);
+  arrfree(ivs);
+  free(external);
+  free(addressed);
+  free(kept);
+}
+
+// ------- Unrolling -------
+
+// Instructions a loop may grow by when unrolled unasked, completely or a
+// few iterations at a time
+#define UNROLL_BUDGET 64
+#define UNROLL_PARTIAL_BUDGET 32
+// Limits for loops marked <unroll>
+#define UNROLL_FORCED_BUDGET 1024
+#define UNROLL_MAX_TRIPS 256
+#define UNROLL_FACTOR 4
+
+// A header phi stepping by a constant, which the header test compares
+// against limit. The loop goes on while phi op limit holds.
+typedef struct COUNTER {
+  IR_INST* phi;
+  IR_VREG init;
+  int64_t step;
+  IR_INST* test;
+  IR_OP op;
+  IR_VREG limit;
+} COUNTER;
+
+static IR_VREG incoming(IR_INST* phi, int source) {
+  for (int k = 0; k < arrlen(phi->sources); k++) {
+    if (phi->sources[k] == source) {
+      return phi->args[k];
+    }
+  }
+  return IR_NONE;
+}
+
+static int appendBlock(int anchor) {
+  arrput(fn->blocks, ((IR_BLOCK){ NULL }));
+  arrput(anchors, anchor);
+  return arrlen(fn->blocks) - 1;
+}
+
+// Moves the blocks appended since first in front of the blocks they were
+// added for
+static void placeAppended(int first) {
+  int count = arrlen(fn->blocks);
+  int* index = NULL;
+  arrsetlen(index, count);
+  IR_BLOCK* blocks = NULL;
+  for (int i = 0; i < first; i++) {
+    for (int j = first; j < count; j++) {
+      if (anchors[j - first] == i) {
+        index[j] = arrlen(blocks);
+        arrput(blocks, fn->blocks[j]);
+      }
+    }
+    index[i] = arrlen(blocks);
+    arrput(blocks, fn->blocks[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < arrlen(blocks[i].insts); j++) {
+      IR_INST* inst = &blocks[i].insts[j];
+      if (inst->op == IR_JUMP || inst->op == IR_BRANCH) {
+        inst->target = index[inst->target];
+      }
+      if (inst->op == IR_BRANCH) {
+        inst->other = index[inst->other];
+      }
+      for (int k = 0; k < arrlen(inst->sources); k++) {
+        inst->sources[k] = index[inst->sources[k]];
+      }
+    }
+  }
+  arrfree(fn->blocks);
+  fn->blocks = blocks;
+  arrfree(index);
+  arrsetlen(anchors, 0);
+}
+
+// Whether an innermost loop can be copied: it is only left from the
+// header test and has a single latch. Also counts its instructions.
+static bool canCopy(LOOP* loop, LOOP* loops, int count, int* latch, int* size) {
+  for (int i = 0; i < arrlen(loops); i++) {
+    if (loops[i].header != loop->header && loop->body[loops[i].header]) {
+      return false;
+    }
+  }
+  *latch = -1;
+  *size = 0;
+  for (int b = 0; b < count; b++) {
+    if (!loop->body[b]) {
+      continue;
+    }
+    IR_BLOCK* block = &fn->blocks[b];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_OP op = block->insts[j].op;
+      if (op == IR_ASM) {
+        return false;
+      }
+      *size += op != IR_PHI && !IR_isTerminator(op);
+    }
+    int successors[2];
+    int n = IR_successors(block, successors);
+    for (int k = 0; k < n; k++) {
+      if (!loop->body[successors[k]] && b != loop->header) {
+        return false;
+      }
+      if (successors[k] == loop->header) {
+        if (*latch >= 0 && *latch != b) {
+          return false;
+        }
+        *latch = b;
+      }
+    }
+  }
+  IR_INST* branch = IR_terminator(&fn->blocks[loop->header]);
+  return *latch >= 0 && branch->op == IR_BRANCH && loop->body[branch->target] != loop->body[branch->other];
+}
+
+static bool findCounter(LOOP* loop, int latch, COUNTER* counter) {
+  IR_BLOCK* header = &fn->blocks[loop->header];
+  IR_INST* branch = IR_terminator(header);
+  IR_INST* test = definitions[branch->a];
+  if (test == NULL || defBlock[branch->a] != loop->header || test->op < IR_LT || test->op > IR_GE || test->a == test->b) {
+    return false;
+  }
+  for (int j = 0; j < arrlen(header->insts) && header->insts[j].op == IR_PHI; j++) {
+    IR_INST* phi = &header->insts[j];
+    if (test->a != phi->dst && test->b != phi->dst) {
+      continue;
+    }
+    COUNTER c = { phi, incoming(phi, loop->preheader), 0, test, test->op, test->b };
+    if (test->b == phi->dst) {
+      c.op = swapComparison(c.op);
+      c.limit = test->a;
+    }
+    if (!loop->body[branch->target]) {
+      c.op = negateComparison(c.op);
+    }
+    IR_VREG next = incoming(phi, latch);
+    IR_INST* step = next != IR_NONE ? definitions[next] : NULL;
+    int64_t by;
+    if (step == NULL || step->type != phi->type) {
+      continue;
+    }
+    if (step->op == IR_ADD && step->a == phi->dst && constantOf(step->b, &by)) {
+      c.step = by;
+    } else if (step->op == IR_ADD && step->b == phi->dst && constantOf(step->a, &by)) {
+      c.step = by;
+    } else if (step->op == IR_SUB && step->a == phi->dst && constantOf(step->b, &by)) {
+      c.step = -by;
+    } else {
+      continue;
+    }
+    *counter = c;
+    return true;
+  }
+  return false;
+}
+
+// How many times the body runs, when that is a constant up to max, or -1
+static int tripCount(COUNTER* counter, int max) {
+  int64_t value;
+  int64_t limit;
+  if (!constantOf(counter->init, &value) || !constantOf(counter->limit, &limit)) {
+    return -1;
+  }
+  for (int trips = 0; trips <= max; trips++) {
+    int64_t stay;
+    IR_fold(counter->op, counter->test->type, value, limit, &stay);
+    if (!stay) {
+      return trips;
+    }
+    IR_fold(IR_ADD, counter->phi->type, value, counter->step, &value);
+  }
+  return -1;
+}
+
+// Appends a copy of the loop which runs the body once, with the header
+// phis taking values and the test left out, and which goes on to next
+// where the loop went back to the header. Returns the copy of the latch,
+// with map giving the copy of each register.
+static int copyLoop(LOOP* loop, int count, int latch, IR_VREG* values, int next, IR_VREG** map) {
+  int* blocks = NULL;
+  arrput(blocks, loop->header);
+  for (int b = 0; b < count; b++) {
+    if (loop->body[b] && b != loop->header) {
+      arrput(blocks, b);
+    }
+  }
+  int* copyOf = calloc(count, sizeof(int));
+  for (int i = 0; i < arrlen(blocks); i++) {
+    copyOf[blocks[i]] = appendBlock(loop->header);
+  }
+  arrsetlen(*map, fn->vregCount + 1);
+  for (IR_VREG v = 0; v < arrlen(*map); v++) {
+    (*map)[v] = v;
+  }
+  int phis = 0;
+  for (int i = 0; i < arrlen(blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[blocks[i]];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        (*map)[inst->dst] = i == 0 && inst->op == IR_PHI ? values[phis++] : IR_newVreg(fn);
+      }
+    }
+  }
+
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[blocks[i]];
+    IR_BLOCK* copy = &fn->blocks[copyOf[blocks[i]]];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST inst = block->insts[j];
+      if (i == 0 && inst.op == IR_PHI) {
+        continue;
+      }
+      inst.args = NULL;
+      inst.sources = NULL;
+      for (int k = 0; k < arrlen(block->insts[j].args); k++) {
+        arrput(inst.args, block->insts[j].args[k]);
+      }
+      for (int k = 0; k < arrlen(block->insts[j].sources); k++) {
+        arrput(inst.sources, copyOf[block->insts[j].sources[k]]);
+      }
+      operands = IR_operands(&inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        *operands[k] = (*map)[*operands[k]];
+      }
+      if (IR_hasDestination(inst.op) && inst.dst != IR_NONE) {
+        inst.dst = (*map)[inst.dst];
+      }
+      if (i == 0 && inst.op == IR_BRANCH) {
+        int inside = loop->body[inst.target] ? inst.target : inst.other;
+        inst = (IR_INST){ .op = IR_JUMP, .target = inside };
+      }
+      if (inst.op == IR_JUMP || inst.op == IR_BRANCH) {
+        inst.target = inst.target == loop->header ? next : copyOf[inst.target];
+      }
+      if (inst.op == IR_BRANCH) {
+        inst.other = inst.other == loop->header ? next : copyOf[inst.other];
+      }
+      arrput(copy->insts, inst);
+    }
+  }
+  int result = copyOf[latch];
+  arrfree(operands);
+  arrfree(blocks);
+  free(copyOf);
+  return result;
+}
+
+static int countPhis(int block) {
+  int phis = 0;
+  while (phis < arrlen(fn->blocks[block].insts) && fn->blocks[block].insts[phis].op == IR_PHI) {
+    phis++;
+  }
+  return phis;
+}
+
+// Runs the body from copies of the loop, chained together, and then has
+// the header leave straight away. What was the loop becomes unreachable.
+static void unrollFully(LOOP* loop, int count, int latch, int trips) {
+  int phis = countPhis(loop->header);
+  IR_VREG* values = NULL;
+  IR_VREG* map = NULL;
+  for (int k = 0; k < phis; k++) {
+    arrput(values, incoming(&fn->blocks[loop->header].insts[k], loop->preheader));
+  }
+  int from = loop->preheader;
+  IR_terminator(&fn->blocks[from])->target = trips > 0 ? arrlen(fn->blocks) : loop->header;
+  for (int t = 0; t < trips; t++) {
+    int next = t + 1 < trips ? arrlen(fn->blocks) + loop->size : loop->header;
+    from = copyLoop(loop, count, latch, values, next, &map);
+    for (int k = 0; k < phis; k++) {
+      values[k] = map[incoming(&fn->blocks[loop->header].insts[k], latch)];
+    }
+  }
+  IR_BLOCK* header = &fn->blocks[loop->header];
+  for (int k = 0; k < phis; k++) {
+    IR_INST* phi = &header->insts[k];
+    for (int s = 0; s < arrlen(phi->sources); s++) {
+      if (phi->sources[s] == loop->preheader) {
+        phi->args[s] = values[k];
+        phi->sources[s] = from;
+      }
+    }
+  }
+  IR_INST* branch = IR_terminator(header);
+  *branch = (IR_INST){ .op = IR_JUMP, .target = loop->body[branch->target] ? branch->other : branch->target };
+  arrfree(values);
+  arrfree(map);
+}
+
+// Whether the counter can be checked for several iterations at once:
+// stepping towards the limit, and compared in a way that stays exact
+// when the step is added in 64 bits
+static bool canStepAhead(LOOP* loop, COUNTER* counter) {
+  IR_TYPE type = counter->phi->type;
+  int64_t c;
+  if (counter->step == 0 || counter->step <= -(1 << 16) || counter->step >= (1 << 16)) {
+    return false;
+  }
+  if (counter->step > 0 ? counter->op != IR_LT && counter->op != IR_LE : counter->op != IR_GT && counter->op != IR_GE) {
+    return false;
+  }
+  if (!isInvariant(loop, counter->limit) && !constantOf(counter->limit, &c)) {
+    return false;
+  }
+  // Tests rewritten to compare pointers
+  if (IR_TYPE_SIZE(type) == 8) {
+    return counter->test->type == IR_I64;
+  }
+  bool limitFits = constantOf(counter->limit, &c) ? IR_normalize(c, type) == c : valueType(counter->limit) == (int)type;
+  bool initFits = constantOf(counter->init, &c) ? IR_normalize(c, type) == c : valueType(counter->init) == (int)type;
+  return counter->test->type == type && limitFits && initFits;
+}
+
+// Puts a loop running factor copies of the body in front of the original,
+// for as long as factor more iterations are certain to run. The original
+// loop then runs the rest.
+static void unrollPartially(LOOP* loop, int count, int latch, COUNTER* counter, int factor) {
+  int phis = countPhis(loop->header);
+  int main = appendBlock(loop->header);
+  IR_VREG* merged = NULL;
+  IR_VREG* values = NULL;
+  IR_VREG* map = NULL;
+  for (int k = 0; k < phis; k++) {
+    arrput(merged, IR_newVreg(fn));
+    arrput(values, merged[k]);
+  }
+  IR_terminator(&fn->blocks[loop->preheader])->target = main;
+  int from = main;
+  for (int t = 0; t < factor; t++) {
+    int next = t + 1 < factor ? arrlen(fn->blocks) + loop->size : main;
+    from = copyLoop(loop, count, latch, values, next, &map);
+    for (int k = 0; k < phis; k++) {
+      values[k] = map[incoming(&fn->blocks[loop->header].insts[k], latch)];
+    }
+  }
+
+  IR_BLOCK* header = &fn->blocks[loop->header];
+  IR_BLOCK* block = &fn->blocks[main];
+  IR_VREG counted = IR_NONE;
+  for (int k = 0; k < phis; k++) {
+    IR_INST* phi = &header->insts[k];
+    IR_INST entry = { .op = IR_PHI, .type = phi->type, .dst = merged[k] };
+    arrput(entry.args, incoming(phi, loop->preheader));
+    arrput(entry.sources, loop->preheader);
+    arrput(entry.args, values[k]);
+    arrput(entry.sources, from);
+    arrput(block->insts, entry);
+    if (phi == counter->phi) {
+      counted = merged[k];
+    }
+    // The original loop picks up where the copies left off
+    for (int s = 0; s < arrlen(phi->sources); s++) {
+      if (phi->sources[s] == loop->preheader) {
+        phi->args[s] = merged[k];
+        phi->sources[s] = main;
+      }
+    }
+  }
+  // Enough iterations remain when the last of them would pass the test
+  IR_VREG limit = counter->limit;
+  int64_t c;
+  if (constantOf(limit, &c)) {
+    limit = IR_newVreg(fn);
+    arrput(block->insts, ((IR_INST){ .op = IR_CONST, .type = IR_I64, .dst = limit, .imm = c }));
+  }
+  IR_VREG distance = IR_newVreg(fn);
+  IR_VREG last = IR_newVreg(fn);
+  IR_VREG test = IR_newVreg(fn);
+  arrput(block->insts, ((IR_INST){ .op = IR_CONST, .type = IR_I64, .dst = distance, .imm = (factor - 1) * counter->step }));
+  arrput(block->insts, ((IR_INST){ .op = IR_ADD, .type = IR_I64, .dst = last, .a = counted, .b = distance }));
+  arrput(block->insts, ((IR_INST){ .op = counter->op, .type = IR_I64, .dst = test, .a = last, .b = limit }));
+  arrput(block->insts, ((IR_INST){ .op = IR_BRANCH, .a = test, .target = main + 1, .other = loop->header }));
+  arrfree(merged);
+  arrfree(values);
+  arrfree(map);
+}
+
+// Unrolls each innermost loop with a counter, either completely or a few
+// iterations at a time, and returns whether any changed
+static bool unrollLoops(bool fully) {
+  LOOP* loops = findLoops();
+  int count = arrlen(fn->blocks);
+  bool changed = false;
+  analyse();
+  for (int i = 0; i < arrlen(loops); i++) {
+    LOOP* loop = &loops[i];
+    IR_UNROLL_HINT hint = fn->blocks[loop->header].unroll;
+    int latch;
+    int size;
+    COUNTER counter;
+    if (hint == IR_UNROLL_NEVER || !canCopy(loop, loops, count, &latch, &size) || !findCounter(loop, latch, &counter)) {
+      continue;
+    }
+    bool forced = hint == IR_UNROLL_ALWAYS;
+    if (fully) {
+      int trips = tripCount(&counter, forced ? UNROLL_MAX_TRIPS : UNROLL_BUDGET);
+      if (trips >= 0 && trips * size <= (forced ? UNROLL_FORCED_BUDGET : UNROLL_BUDGET)) {
+        unrollFully(loop, count, latch, trips);
+        changed = true;
+      }
+      continue;
+    }
+    int factor = UNROLL_FACTOR;
+    while (!forced && factor > 1 && factor * size > UNROLL_PARTIAL_BUDGET) {
+      factor /= 2;
+    }
+    if (factor > 1 && tripCount(&counter, factor) < 0 && canStepAhead(loop, &counter)) {
+      unrollPartially(loop, count, latch, &counter, factor);
+      changed = true;
+    }
+  }
+  for (int i = 0; i < arrlen(loops); i++) {
+    free(loops[i].body);
+  }
+  arrfree(loops);
+  placeAppended(count);
+  IR_removeUnreachable(fn);
+  return changed;
+}
+
+// ------- Rotation -------
+
+// Headers of up to this many instructions are copied to their latches
+#define ROTATE_LIMIT 8
+
+static bool isRematerialisable(IR_OP op) {
+  return op == IR_CONST || op == IR_STRING || op == IR_GLOBAL || op == IR_SLOT;
+}
+
+// Replaces the jump at the end of latch with a copy of the header, test
+// and all. Registers which only live inside the header get new names in
+// the copy, and constants it set up are still there to be used.
+static void rotate(int latch, int header, int* defCount, bool* escapes) {
+  IR_BLOCK* source = &fn->blocks[header];
+  IR_INST* copies = NULL;
+  IR_VREG* renamed = NULL;
+  IR_VREG** operands = NULL;
+  for (int j = 0; j < arrlen(source->insts); j++) {
+    IR_INST inst = source->insts[j];
+    IR_VREG original = IR_hasDestination(inst.op) ? inst.dst : IR_NONE;
+    if (original != IR_NONE && defCount[original] == 1 && isRematerialisable(inst.op)) {
+      continue;
+    }
+    IR_VREG* args = inst.args;
+    inst.args = NULL;
+    for (int k = 0; k < arrlen(args); k++) {
+      arrput(inst.args, args[k]);
+    }
+    operands = IR_operands(&inst, operands);
+    for (int k = 0; k < arrlen(operands); k++) {
+      for (int r = 0; r < arrlen(renamed); r += 2) {
+        if (renamed[r] == *operands[k]) {
+          *operands[k] = renamed[r + 1];
+        }
+      }
+    }
+    if (original != IR_NONE && defCount[original] == 1 && !escapes[original]) {
+      inst.dst = IR_newVreg(fn);
+      arrput(renamed, original);
+      arrput(renamed, inst.dst);
+    }
+    arrput(copies, inst);
+  }
+  IR_BLOCK* block = &fn->blocks[latch];
+  arrsetlen(block->insts, arrlen(block->insts) - 1);
+  for (int j = 0; j < arrlen(copies); j++) {
+    arrput(block->insts, copies[j]);
+  }
+  arrfree(copies);
+  arrfree(renamed);
+  arrfree(operands);
+}
+
+void LOOP_unroll(IR_FUNCTION* function) {
+  fn = function;
+  IR_removeUnreachable(fn);
+  // Each round leaves the loops around the unrolled ones innermost
+  while (unrollLoops(true)) {
+  }
+  arrfree(definitions);
+  arrfree(defBlock);
+  arrfree(anchors);
+  fn = NULL;
+}
+
+void LOOP_optimize(IR_FUNCTION* function) {
+  fn = function;
+  IR_removeUnreachable(fn);
+  LOOP* loops = findLoops();
+  // Inner loops first, so what they hoist can move further out
+  qsort(loops, arrlen(loops), sizeof(LOOP), compareLoops);
+  for (int i = 0; i < arrlen(loops); i++) {
+    hoistInvariants(&loops[i]);
+    reduceInductions(&loops[i]);
+    free(loops[i].body);
+  }
+  arrfree(loops);
+  // Counters the tests no longer use would count towards the size
+  SSA_eliminateDeadCode(fn);
+  unrollLoops(false);
+
+  arrfree(replacement);
+  arrfree(definitions);
+  arrfree(defBlock);
+  arrfree(pending);
+  arrfree(anchors);
+  fn = NULL;
+}
+
+void LOOP_rotate(IR_FUNCTION* function) {
+  fn = function;
+  IR_removeUnreachable(fn);
+  int count = arrlen(fn->blocks);
+  int* idom = SSA_dominators(fn);
+  int* defCount = calloc(fn->vregCount + 1, sizeof(int));
+  int* defIndex = calloc(fn->vregCount + 1, sizeof(int));
+  int* home = calloc(fn->vregCount + 1, sizeof(int));
+  // Whether a register is read anywhere but later in its defining block
+  bool* escapes = calloc(fn->vregCount + 1, sizeof(bool));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        defCount[inst->dst]++;
+        home[inst->dst] = i;
+        defIndex[inst->dst] = j;
+      }
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      operands = IR_operands(&block->insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        IR_VREG v = *operands[k];
+        escapes[v] |= home[v] != i || defIndex[v] >= j;
+      }
+    }
+  }
+
+  // Latches jumping back to a header which ends in the loop test
+  int* latches = NULL;
+  for (int i = 0; i < count; i++) {
+    IR_INST* jump = IR_terminator(&fn->blocks[i]);
+    if (jump == NULL || jump->op != IR_JUMP || !dominates(idom, jump->target, i)) {
+      continue;
+    }
+    IR_BLOCK* header = &fn->blocks[jump->target];
+    IR_INST* branch = IR_terminator(header);
+    bool small = branch != NULL && branch->op == IR_BRANCH && arrlen(header->insts) - 1 <= ROTATE_LIMIT;
+    for (int j = 0; j < arrlen(header->insts) && small; j++) {
+      small = header->insts[j].op != IR_ASM && header->insts[j].op != IR_PHI;
+    }
+    if (small) {
+      arrput(latches, i);
+    }
+  }
+  for (int i = 0; i < arrlen(latches); i++) {
+    rotate(latches[i], IR_terminator(&fn->blocks[latches[i]])->target, defCount, escapes);
+  }
+  arrfree(latches);
+  arrfree(operands);
+  arrfree(idom);
+  free(defCount);
+  free(defIndex);
+  free(home);
+  free(escapes);
+  fn = NULL;
+}
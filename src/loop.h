@@ -0,0 +1,49 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef loop_h
+#define loop_h
+
+#include "common.h"
+#include "ir.h"
+
+// Natural loop optimisations on SSA form. Every loop is given a
+// preheader, pure computations which do not change inside a loop move
+// into it, and addresses stepping through an array with an induction
+// variable become pointers bumped each iteration. When the counter is
+// then only used by its test, the test compares the pointer instead.
+// Loads are never hoisted, so loops polling memory an interrupt handler
+// writes keep working. Small counted loops are then unrolled a few
+// iterations at a time, ahead of a loop running whatever is left.
+void LOOP_optimize(IR_FUNCTION* fn);
+// Unrolls small loops with a constant number of iterations completely,
+// on SSA form, so the copies of the body fold
+void LOOP_unroll(IR_FUNCTION* fn);
+// Copies loop tests to the bottom of their loops, once the function is
+// out of SSA form, so an iteration takes one branch instead of two
+void LOOP_rotate(IR_FUNCTION* fn);
+
+#endif
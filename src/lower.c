@@ -0,0 +1,1108 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lower.h"
+#include "type_table.h"
+
+#define BOOL_INDEX 2
+#define U8_INDEX 3
+#define I8_INDEX 4
+#define U16_INDEX 5
+#define I16_INDEX 6
+#define NUMERICAL_INDEX 7
+#define STRING_INDEX 8
+#define CHAR_INDEX 10
+
+// Array initializers with at least this many elements are written a
+// word at a time, rather than each element being scalarised later
+#define PACKED_INITIALIZER 16
+
+static PLATFORM p;
+static IR_FUNCTION* fn = NULL;
+// Base addresses of the initializers being lowered
+static IR_VREG* rStack = NULL;
+// Where the caller wants a record or union result, when returning one
+static IR_VREG resultAddress = IR_NONE;
+// Addresses calls build their results in, and those of them which are
+// locals assigned with `x = f()`
+static IR_VREG* results = NULL;
+static IR_VREG* inPlace = NULL;
+
+static IR_VREG lower(AST* ptr);
+
+static IR_TYPE irType(TYPE_ID type) {
+  switch (type) {
+    case BOOL_INDEX:
+    case U8_INDEX:
+    case CHAR_INDEX: return IR_U8;
+    case I8_INDEX: return IR_I8;
+    case U16_INDEX: return IR_U16;
+    case I16_INDEX: return IR_I16;
+    case NUMERICAL_INDEX: return IR_I32;
+    // Everything else is either a pointer or an aggregate, which is
+    // handled by its address.
+    default: return IR_U64;
+  }
+}
+
+static bool isAggregate(TYPE_ID type) {
+  TYPE_ENTRY_TYPE kind = TYPE_getKind(type);
+  return kind == ENTRY_TYPE_RECORD || kind == ENTRY_TYPE_ARRAY || kind == ENTRY_TYPE_UNION;
+}
+
+// Records and unions are built in memory the caller provides, whose
+// address is passed after the arguments
+static bool returnsInMemory(TYPE_ID type) {
+  TYPE_ENTRY_TYPE kind = TYPE_getKind(type);
+  return kind == ENTRY_TYPE_RECORD || kind == ENTRY_TYPE_UNION;
+}
+
+static bool isPointer(int type) {
+  return TYPE_get(type).entryType == ENTRY_TYPE_POINTER || TYPE_get(type).entryType == ENTRY_TYPE_ARRAY || type == STRING_INDEX;
+}
+
+static void printEntry(TYPE_ENTRY entry) {
+  if (entry.name == EMPTY_STRING) {
+    printf("null entry?\n");
+  }
+  printf("%s\n", CHARS(entry.name));
+}
+
+static IR_VREG emitConst(int64_t value, IR_TYPE type) {
+  IR_VREG dst = IR_newVreg(fn);
+  IR_emit(fn, (IR_INST){ .op = IR_CONST, .type = type, .dst = dst, .imm = IR_normalize(value, type) });
+  return dst;
+}
+
+static void emitConstTo(IR_VREG dst, int64_t value, IR_TYPE type) {
+  IR_emit(fn, (IR_INST){ .op = IR_CONST, .type = type, .dst = dst, .imm = IR_normalize(value, type) });
+}
+
+static IR_VREG emitUnary(IR_OP op, IR_TYPE type, IR_VREG a) {
+  IR_VREG dst = IR_newVreg(fn);
+  IR_emit(fn, (IR_INST){ .op = op, .type = type, .dst = dst, .a = a });
+  return dst;
+}
+
+static IR_VREG emitBinary(IR_OP op, IR_TYPE type, IR_VREG a, IR_VREG b) {
+  IR_VREG dst = IR_newVreg(fn);
+  IR_emit(fn, (IR_INST){ .op = op, .type = type, .dst = dst, .a = a, .b = b });
+  return dst;
+}
+
+static IR_VREG emitOffset(IR_VREG base, int64_t offset) {
+  if (offset == 0) {
+    return base;
+  }
+  return emitBinary(IR_ADD, IR_U64, base, emitConst(offset, IR_U64));
+}
+
+static void emitStore(IR_TYPE type, IR_VREG address, IR_VREG value) {
+  IR_emit(fn, (IR_INST){ .op = IR_STORE, .type = type, .a = address, .b = value });
+}
+
+static void emitCopy(IR_VREG to, IR_VREG from, int64_t size) {
+  IR_emit(fn, (IR_INST){ .op = IR_MEMCPY, .a = to, .b = from, .imm = size });
+}
+
+static void emitZero(IR_VREG to, int64_t size) {
+  IR_emit(fn, (IR_INST){ .op = IR_MEMZERO, .a = to, .imm = size });
+}
+
+static void emitJump(int target) {
+  IR_emit(fn, (IR_INST){ .op = IR_JUMP, .target = target });
+}
+
+static void emitBranch(IR_VREG condition, int target, int other) {
+  IR_emit(fn, (IR_INST){ .op = IR_BRANCH, .a = condition, .target = target, .other = other });
+}
+
+static uint32_t slotSize(SYMBOL_TABLE_ENTRY entry) {
+  if (entry.elementCount > 0) {
+    return p.getSize(TYPE_getParentId(entry.typeIndex)) * entry.elementCount;
+  }
+  return p.getSize(entry.typeIndex);
+}
+
+static IR_VREG emitAddress(SYMBOL_TABLE_ENTRY entry) {
+  IR_VREG dst = IR_newVreg(fn);
+  if (entry.storageType == STORAGE_TYPE_PARAMETER ||
+      entry.storageType == STORAGE_TYPE_LOCAL ||
+      entry.storageType == STORAGE_TYPE_LOCAL_OBJECT) {
+    int slot = IR_getSlot(fn, entry, slotSize(entry));
+    IR_emit(fn, (IR_INST){ .op = IR_SLOT, .type = IR_U64, .dst = dst, .imm = slot });
+  } else {
+    STR name = STR_create(p.symbol(entry));
+    IR_emit(fn, (IR_INST){ .op = IR_GLOBAL, .type = IR_U64, .dst = dst, .symbol = name });
+  }
+  return dst;
+}
+
+// Stores a value of type right into memory of type left, copying
+// aggregates by value
+static void emitAssign(IR_VREG address, IR_VREG value, TYPE_ID left, TYPE_ID right) {
+  TYPE_ENTRY_TYPE kind = TYPE_getKind(left);
+  if ((kind == ENTRY_TYPE_UNION || kind == ENTRY_TYPE_RECORD || kind == ENTRY_TYPE_ARRAY) && TYPE_getKind(right) == kind) {
+    emitCopy(address, value, p.getSize(left));
+  } else {
+    emitStore(irType(left), address, value);
+  }
+}
+
+static IR_VREG emitFieldAddress(IR_VREG base, TYPE_ID typeIndex, STR fieldName) {
+  TYPE_ENTRY entry = TYPE_get(typeIndex);
+  int offset = 0;
+  for (int i = 0; i < arrlen(entry.fields); i++) {
+    if (entry.fields[i].name == fieldName) {
+      break;
+    }
+    if (entry.fields[i].elementCount == 0) {
+      offset += p.getSize(entry.fields[i].typeIndex);
+    } else {
+      offset += p.getSize(TYPE_getParentId(entry.fields[i].typeIndex)) * entry.fields[i].elementCount;
+    }
+  }
+  return emitOffset(base, offset);
+}
+
+static IR_VREG emitIndexAddress(IR_VREG base, IR_VREG index, TYPE_ID type) {
+  int dataSize = p.getSize(type);
+  if (dataSize != 1) {
+    index = emitBinary(IR_MUL, IR_U64, index, emitConst(dataSize, IR_U64));
+  }
+  return emitBinary(IR_ADD, IR_U64, base, index);
+}
+
+// Unions keep their tag in the byte after the largest member
+static IR_VREG emitTagAddress(IR_VREG base, TYPE_ID unionType) {
+  return emitOffset(base, p.getSize(unionType) - 1);
+}
+
+static SYMBOL_TABLE_ENTRY lookup(AST* ptr) {
+  STR identifier = ptr->data.AST_IDENTIFIER.identifier;
+  SYMBOL_TABLE_ENTRY symbol = SYMBOL_TABLE_get(ptr->scopeIndex, identifier);
+  if (!symbol.defined) {
+    symbol = SYMBOL_TABLE_checkBanks(identifier);
+  }
+  return symbol;
+}
+
+// Evaluates expressions made only of literals and constants, the same
+// way the generated code would, so they can be emitted as immediates.
+static bool fold(AST* ptr, int64_t* value) {
+  if (ptr == NULL) {
+    return false;
+  }
+  AST ast = *ptr;
+  switch (ast.tag) {
+    case AST_LITERAL:
+      {
+        Value v = ast.data.AST_LITERAL.value;
+        if (IS_STRING(v) || IS_PTR(v)) {
+          return false;
+        }
+        *value = IR_normalize(AS_LIT_NUM(v), irType(ast.type));
+        return true;
+      }
+    case AST_IDENTIFIER:
+      {
+        SYMBOL_TABLE_ENTRY symbol = lookup(ptr);
+        if (!ast.rvalue || symbol.entryType != SYMBOL_TYPE_CONSTANT || isAggregate(symbol.typeIndex)) {
+          return false;
+        }
+        // Stored with the declared type, then loaded again
+        if (!fold(symbol.constant, value)) {
+          return false;
+        }
+        *value = IR_normalize(*value, irType(symbol.typeIndex));
+        return true;
+      }
+    case AST_SUBSCRIPT:
+      {
+        // Reads from constant tables at constant positions
+        struct AST_SUBSCRIPT data = ast.data.AST_SUBSCRIPT;
+        TYPE_ID elementType = TYPE_getParentId(data.left->type);
+        int64_t index;
+        if (!ast.rvalue || data.left->tag != AST_IDENTIFIER || isAggregate(elementType) || !fold(data.index, &index)) {
+          return false;
+        }
+        SYMBOL_TABLE_ENTRY symbol = lookup(data.left);
+        AST* table = symbol.constant;
+        if (symbol.entryType != SYMBOL_TYPE_CONSTANT || table == NULL || table->tag != AST_INITIALIZER) {
+          return false;
+        }
+        struct AST_INITIALIZER init = table->data.AST_INITIALIZER;
+        if (init.initType != INIT_TYPE_ARRAY || index < 0 || index >= arrlen(init.assignments)) {
+          return false;
+        }
+        if (!fold(init.assignments[index], value)) {
+          return false;
+        }
+        *value = IR_normalize(*value, irType(elementType));
+        return true;
+      }
+    case AST_CAST:
+      {
+        struct AST_CAST data = ast.data.AST_CAST;
+        if (data.tag != -1 || !fold(data.expr, value)) {
+          return false;
+        }
+        IR_TYPE type = irType(ast.type);
+        if (IR_TYPE_SIZE(type) < 8 && type != irType(data.expr->type)) {
+          *value = IR_normalize(*value, type);
+        }
+        return true;
+      }
+    case AST_UNARY:
+      {
+        struct AST_UNARY data = ast.data.AST_UNARY;
+        int64_t operand;
+        if (!fold(data.expr, &operand)) {
+          return false;
+        }
+        switch (data.op) {
+          case OP_BITWISE_NOT: return IR_fold(IR_NOT, irType(ast.type), operand, 0, value);
+          case OP_NOT: return IR_fold(IR_EQ, irType(data.expr->type), operand, 0, value);
+          case OP_NEG: return IR_fold(IR_NEG, irType(ast.type), operand, 0, value);
+          default: return false;
+        }
+      }
+    case AST_BINARY:
+      {
+        struct AST_BINARY data = ast.data.AST_BINARY;
+        int64_t left;
+        int64_t right;
+        if (isPointer(data.left->type) || isPointer(data.right->type) || !fold(data.left, &left)) {
+          return false;
+        }
+        if (data.op == OP_AND || data.op == OP_OR) {
+          // The right operand is never evaluated once the left decides
+          if ((data.op == OP_AND) == (left == 0)) {
+            *value = data.op == OP_OR;
+            return true;
+          }
+          if (!fold(data.right, &right)) {
+            return false;
+          }
+          *value = right != 0;
+          return true;
+        }
+        if (!fold(data.right, &right)) {
+          return false;
+        }
+        IR_TYPE type = irType(ast.type);
+        IR_OP op;
+        switch (data.op) {
+          case OP_COMPARE_EQUAL: op = IR_EQ; type = irType(data.left->type); break;
+          case OP_NOT_EQUAL: op = IR_NE; type = irType(data.left->type); break;
+          case OP_LESS: op = IR_LT; type = irType(data.left->type); break;
+          case OP_LESS_EQUAL: op = IR_LE; type = irType(data.left->type); break;
+          case OP_GREATER: op = IR_GT; type = irType(data.left->type); break;
+          case OP_GREATER_EQUAL: op = IR_GE; type = irType(data.left->type); break;
+          case OP_ADD: op = IR_ADD; break;
+          case OP_SUB: op = IR_SUB; break;
+          case OP_MUL: op = IR_MUL; break;
+          case OP_DIV: op = IR_DIV; break;
+          case OP_MOD: op = IR_MOD; break;
+          case OP_BITWISE_AND: op = IR_AND; break;
+          case OP_BITWISE_OR: op = IR_OR; break;
+          case OP_BITWISE_XOR: op = IR_XOR; break;
+          case OP_SHIFT_LEFT: op = IR_SHL; break;
+          case OP_SHIFT_RIGHT: op = IR_SHR; break;
+          default: return false;
+        }
+        return IR_fold(op, type, left, right, value);
+      }
+    default:
+      return false;
+  }
+}
+
+// Whether a constant declaration needs no storage of its own
+static bool isFoldedConstant(SYMBOL_TABLE_ENTRY symbol) {
+  int64_t value;
+  return symbol.entryType == SYMBOL_TYPE_CONSTANT && !isAggregate(symbol.typeIndex) && fold(symbol.constant, &value);
+}
+
+static IR_VREG lowerCompare(IR_OP op, AST* left, AST* right) {
+  IR_VREG l = lower(left);
+  IR_VREG r = lower(right);
+  return emitBinary(op, irType(left->type), l, r);
+}
+
+static IR_VREG lowerShortCircuit(struct AST_BINARY data) {
+  // Both operands are evaluated for their truth, and the result is
+  // materialised at the end so it can be used as a value.
+  IR_VREG result = IR_newVreg(fn);
+  int rightBlock = IR_newBlock(fn);
+  int trueBlock = IR_newBlock(fn);
+  int falseBlock = IR_newBlock(fn);
+  int doneBlock = IR_newBlock(fn);
+  IR_VREG l = lower(data.left);
+  if (data.op == OP_AND) {
+    emitBranch(l, rightBlock, falseBlock);
+  } else {
+    emitBranch(l, trueBlock, rightBlock);
+  }
+  IR_placeBlock(fn, rightBlock);
+  IR_VREG r = lower(data.right);
+  emitBranch(r, trueBlock, falseBlock);
+  IR_placeBlock(fn, trueBlock);
+  emitConstTo(result, 1, IR_U8);
+  emitJump(doneBlock);
+  IR_placeBlock(fn, falseBlock);
+  emitConstTo(result, 0, IR_U8);
+  IR_placeBlock(fn, doneBlock);
+  return result;
+}
+
+static IR_VREG lowerBinary(AST* ptr) {
+  struct AST_BINARY data = ptr->data.AST_BINARY;
+  if (data.op == OP_AND || data.op == OP_OR) {
+    return lowerShortCircuit(data);
+  }
+  switch (data.op) {
+    case OP_COMPARE_EQUAL: return lowerCompare(IR_EQ, data.left, data.right);
+    case OP_NOT_EQUAL: return lowerCompare(IR_NE, data.left, data.right);
+    case OP_LESS: return lowerCompare(IR_LT, data.left, data.right);
+    case OP_LESS_EQUAL: return lowerCompare(IR_LE, data.left, data.right);
+    case OP_GREATER: return lowerCompare(IR_GT, data.left, data.right);
+    case OP_GREATER_EQUAL: return lowerCompare(IR_GE, data.left, data.right);
+    default: break;
+  }
+
+  IR_VREG l = lower(data.left);
+  IR_VREG r = lower(data.right);
+  IR_TYPE type = irType(ptr->type);
+  if (isPointer(data.left->type) || isPointer(data.right->type)) {
+    if (isPointer(data.right->type)) {
+      IR_VREG swap = l;
+      l = r;
+      r = swap;
+    }
+    if (data.op == OP_ADD || data.op == OP_SUB) {
+      int byteSize = p.getSize(TYPE_getParentId(ptr->type));
+      r = emitBinary(IR_MUL, IR_U64, r, emitConst(byteSize, IR_U64));
+      return emitBinary(data.op == OP_ADD ? IR_ADD : IR_SUB, IR_U64, l, r);
+    }
+  }
+  IR_OP op;
+  switch (data.op) {
+    case OP_ADD: op = IR_ADD; break;
+    case OP_SUB: op = IR_SUB; break;
+    case OP_MUL: op = IR_MUL; break;
+    case OP_DIV: op = IR_DIV; break;
+    case OP_MOD: op = IR_MOD; break;
+    case OP_BITWISE_AND: op = IR_AND; break;
+    case OP_BITWISE_OR: op = IR_OR; break;
+    case OP_BITWISE_XOR: op = IR_XOR; break;
+    case OP_SHIFT_LEFT: op = IR_SHL; break;
+    case OP_SHIFT_RIGHT: op = IR_SHR; break;
+    default:
+      {
+        // unreachable
+        printf("unknown binary operator\n");
+        exit(1);
+      }
+  }
+  return emitBinary(op, type, l, r);
+}
+
+static bool isNamedFunction(AST* callee) {
+  return callee->tag == AST_IDENTIFIER && lookup(callee).entryType == SYMBOL_TYPE_FUNCTION;
+}
+
+// Functions only declared with ext are written outside of Fang, and take
+// their arguments on the stack
+static bool isExternal(AST* callee) {
+  return isNamedFunction(callee) && lookup(callee).status != SYMBOL_TABLE_STATUS_DEFINED;
+}
+
+// Calls a function, which constructs a record or union result at dest,
+// or in a temporary when there is none. Either way the address of the
+// result is given back.
+static IR_VREG lowerCall(AST* ptr, IR_VREG dest) {
+  struct AST_CALL data = ptr->data.AST_CALL;
+  IR_INST call = { .op = IR_CALL, .type = irType(ptr->type), .symbol = EMPTY_STRING };
+  AST* callee = data.identifier;
+  if (isNamedFunction(callee)) {
+    call.symbol = STR_create(p.symbol(lookup(callee)));
+    call.imm = isExternal(callee);
+  } else {
+    call.a = lower(callee);
+  }
+  for (int i = 0; i < arrlen(data.arguments); i++) {
+    IR_VREG r = lower(data.arguments[i]);
+    arrput(call.args, r);
+  }
+  bool inMemory = returnsInMemory(ptr->type) && !call.imm;
+  if (inMemory) {
+    if (dest == IR_NONE) {
+      dest = IR_newVreg(fn);
+      int slot = IR_newTemporary(fn, p.getSize(ptr->type));
+      IR_emit(fn, (IR_INST){ .op = IR_SLOT, .type = IR_U64, .dst = dest, .imm = slot });
+    }
+    arrput(call.args, dest);
+    arrput(results, dest);
+  }
+  call.dst = IR_newVreg(fn);
+  IR_emit(fn, call);
+  return inMemory ? dest : call.dst;
+}
+
+// Evaluates expr into memory of the given type, letting a call construct
+// its result there rather than copying it over afterwards
+static IR_VREG lowerInto(IR_VREG address, AST* expr, TYPE_ID type) {
+  if (expr->tag == AST_CALL && returnsInMemory(expr->type) && !isExternal(expr->data.AST_CALL.identifier) &&
+      TYPE_getKind(type) == TYPE_getKind(expr->type) && p.getSize(type) == p.getSize(expr->type)) {
+    return lowerCall(expr, address);
+  }
+  IR_VREG value = lower(expr);
+  emitAssign(address, value, type, expr->type);
+  return value;
+}
+
+static IR_UNROLL_HINT unrollHint(STR annotation) {
+  if (annotation != EMPTY_STRING && strcmp(CHARS(annotation), "unroll") == 0) {
+    return IR_UNROLL_ALWAYS;
+  } else if (annotation != EMPTY_STRING && strcmp(CHARS(annotation), "nounroll") == 0) {
+    return IR_UNROLL_NEVER;
+  }
+  return IR_UNROLL_AUTO;
+}
+
+// Branches on a condition without materialising it, so short-circuit
+// operators become a chain of branches and negation swaps the targets.
+static void lowerCondition(AST* condition, int target, int other) {
+  if (condition->tag == AST_UNARY && condition->data.AST_UNARY.op == OP_NOT) {
+    lowerCondition(condition->data.AST_UNARY.expr, other, target);
+    return;
+  }
+  if (condition->tag == AST_BINARY) {
+    struct AST_BINARY data = condition->data.AST_BINARY;
+    if (data.op == OP_AND || data.op == OP_OR) {
+      int rightBlock = IR_newBlock(fn);
+      if (data.op == OP_AND) {
+        lowerCondition(data.left, rightBlock, other);
+      } else {
+        lowerCondition(data.left, target, rightBlock);
+      }
+      IR_placeBlock(fn, rightBlock);
+      lowerCondition(data.right, target, other);
+      return;
+    }
+  }
+  IR_VREG r = lower(condition);
+  emitBranch(r, target, other);
+}
+
+// Stores the constant elements of a long array initializer as whole
+// words, clearing the array first when most of those words are zero.
+// Gives back which elements are done, or NULL when none are.
+static bool* lowerPackedElements(IR_VREG base, AST** elements, TYPE_ID dataType) {
+  int count = arrlen(elements);
+  int size = p.getSize(dataType);
+  if (count < PACKED_INITIALIZER || isAggregate(dataType) || size >= 8) {
+    return NULL;
+  }
+  int perWord = 8 / size;
+  int words = count / perWord;
+  bool* written = calloc(count, sizeof(bool));
+  uint64_t* packed = calloc(words, sizeof(uint64_t));
+  bool* constant = calloc(words, sizeof(bool));
+  int zeroWords = 0;
+  for (int w = 0; w < words; w++) {
+    constant[w] = true;
+    for (int k = 0; k < perWord && constant[w]; k++) {
+      int64_t value;
+      constant[w] = fold(elements[w * perWord + k], &value);
+      packed[w] |= ((uint64_t)value & ((1ULL << (8 * size)) - 1)) << (8 * size * k);
+    }
+    zeroWords += constant[w] && packed[w] == 0;
+  }
+  bool cleared = zeroWords * 2 > words;
+  if (cleared) {
+    emitZero(base, (int64_t)count * size);
+  }
+  for (int w = 0; w < words; w++) {
+    if (!constant[w]) {
+      continue;
+    }
+    if (packed[w] != 0 || !cleared) {
+      emitStore(IR_U64, emitOffset(base, (int64_t)w * 8), emitConst(packed[w], IR_U64));
+    }
+    for (int k = 0; k < perWord; k++) {
+      written[w * perWord + k] = true;
+    }
+  }
+  // Zero elements outside whole words are cleared already too
+  for (int i = words * perWord; i < count && cleared; i++) {
+    int64_t value;
+    written[i] = fold(elements[i], &value) && value == 0;
+  }
+  free(packed);
+  free(constant);
+  return written;
+}
+
+static IR_VREG lower(AST* ptr) {
+  if (ptr == NULL) {
+    return IR_NONE;
+  }
+  AST ast = *ptr;
+  int64_t constant;
+  switch (ast.tag) {
+    case AST_IDENTIFIER:
+    case AST_SUBSCRIPT:
+    case AST_CAST:
+    case AST_UNARY:
+    case AST_BINARY:
+      if (fold(ptr, &constant)) {
+        return emitConst(constant, irType(ast.type));
+      }
+      break;
+    default: break;
+  }
+  switch(ast.tag) {
+    case AST_BLOCK:
+      {
+        struct AST_BLOCK data = ast.data.AST_BLOCK;
+        for (int i = 0; i < arrlen(data.decls); i++) {
+          lower(data.decls[i]);
+        }
+        return IR_NONE;
+      }
+    case AST_ASM:
+      {
+        struct AST_ASM data = ast.data.AST_ASM;
+        for (int i = 0; i < arrlen(data.strings); i++) {
+          IR_emit(fn, (IR_INST){ .op = IR_ASM, .text = CHARS(data.strings[i]) });
+        }
+        return IR_NONE;
+      }
+    case AST_MATCH:
+      {
+        struct AST_MATCH data = ast.data.AST_MATCH;
+        int exitBlock = IR_newBlock(fn);
+        IR_VREG* rs = NULL;
+        for (int i = 0; i < arrlen(data.identifiers); i++) {
+          arrput(rs, lower(data.identifiers[i]));
+        }
+        for (int i = 0; i < arrlen(data.clauses); i++) {
+          struct AST_MATCH_CLAUSE clause = data.clauses[i]->data.AST_MATCH_CLAUSE;
+          int skipBlock = IR_newBlock(fn);
+          for (int j = 0; j < arrlen(data.identifiers); j++) {
+            TYPE_ID unionType = data.identifiers[j]->type;
+            int tag = TYPE_getTag(unionType, clause.identifiers[j]->type);
+            IR_VREG current = emitUnary(IR_LOAD, IR_U8, emitTagAddress(rs[j], unionType));
+            IR_VREG matches = emitBinary(IR_EQ, IR_U8, current, emitConst(tag, IR_U8));
+            int nextBlock = IR_newBlock(fn);
+            emitBranch(matches, nextBlock, skipBlock);
+            IR_placeBlock(fn, nextBlock);
+          }
+          lower(clause.body);
+          emitJump(exitBlock);
+          IR_placeBlock(fn, skipBlock);
+        }
+        arrfree(rs);
+        if (data.elseClause != NULL) {
+          lower(data.elseClause);
+        }
+        IR_placeBlock(fn, exitBlock);
+        return IR_NONE;
+      }
+    case AST_IF:
+      {
+        struct AST_IF data = ast.data.AST_IF;
+        int bodyBlock = IR_newBlock(fn);
+        int nextBlock = IR_newBlock(fn);
+        lowerCondition(data.condition, bodyBlock, nextBlock);
+        IR_placeBlock(fn, bodyBlock);
+        lower(data.body);
+        if (data.elseClause != NULL) {
+          int endBlock = IR_newBlock(fn);
+          emitJump(endBlock);
+          IR_placeBlock(fn, nextBlock);
+          lower(data.elseClause);
+          IR_placeBlock(fn, endBlock);
+        } else {
+          IR_placeBlock(fn, nextBlock);
+        }
+        return IR_NONE;
+      }
+    case AST_FOR:
+      {
+        struct AST_FOR data = ast.data.AST_FOR;
+        int loopBlock = IR_newBlock(fn);
+        int bodyBlock = IR_newBlock(fn);
+        int exitBlock = IR_newBlock(fn);
+        fn->blocks[loopBlock].unroll = unrollHint(data.annotation);
+        lower(data.initializer);
+        IR_placeBlock(fn, loopBlock);
+        if (data.condition != NULL) {
+          lowerCondition(data.condition, bodyBlock, exitBlock);
+        }
+        IR_placeBlock(fn, bodyBlock);
+        lower(data.body);
+        lower(data.increment);
+        emitJump(loopBlock);
+        IR_placeBlock(fn, exitBlock);
+        return IR_NONE;
+      }
+    case AST_DO_WHILE:
+      {
+        struct AST_DO_WHILE data = ast.data.AST_DO_WHILE;
+        int loopBlock = IR_newBlock(fn);
+        int exitBlock = IR_newBlock(fn);
+        IR_placeBlock(fn, loopBlock);
+        lower(data.body);
+        lowerCondition(data.condition, loopBlock, exitBlock);
+        IR_placeBlock(fn, exitBlock);
+        return IR_NONE;
+      }
+    case AST_WHILE:
+      {
+        struct AST_WHILE data = ast.data.AST_WHILE;
+        int loopBlock = IR_newBlock(fn);
+        int bodyBlock = IR_newBlock(fn);
+        int exitBlock = IR_newBlock(fn);
+        fn->blocks[loopBlock].unroll = unrollHint(data.annotation);
+        IR_placeBlock(fn, loopBlock);
+        lowerCondition(data.condition, bodyBlock, exitBlock);
+        IR_placeBlock(fn, bodyBlock);
+        lower(data.body);
+        emitJump(loopBlock);
+        IR_placeBlock(fn, exitBlock);
+        return IR_NONE;
+      }
+    case AST_RETURN:
+      {
+        struct AST_RETURN data = ast.data.AST_RETURN;
+        if (resultAddress != IR_NONE && data.value != NULL) {
+          lowerInto(resultAddress, data.value, data.value->type);
+          IR_emit(fn, (IR_INST){ .op = IR_RETURN, .a = resultAddress });
+          return resultAddress;
+        }
+        IR_VREG r = lower(data.value);
+        IR_emit(fn, (IR_INST){ .op = IR_RETURN, .a = r });
+        return r;
+      }
+    case AST_CAST:
+      {
+        struct AST_CAST data = ast.data.AST_CAST;
+        IR_VREG r = lower(data.expr);
+        if (data.tag != -1) {
+          printf("UNION mismatch, retag\n");
+          emitStore(IR_U8, emitTagAddress(r, data.expr->type), emitConst(data.tag, IR_U8));
+          return r;
+        }
+        IR_TYPE type = irType(ast.type);
+        if (IR_TYPE_SIZE(type) < 8 && type != irType(data.expr->type)) {
+          r = emitUnary(IR_EXT, type, r);
+        }
+        return r;
+      }
+    case AST_VAR_INIT:
+    case AST_CONST_DECL:
+      {
+        struct AST_CONST_DECL data = ast.data.AST_CONST_DECL;
+        SYMBOL_TABLE_ENTRY symbol = SYMBOL_TABLE_get(ast.scopeIndex, data.identifier);
+        if (data.expr->tag == AST_INITIALIZER) {
+          struct AST_INITIALIZER init = data.expr->data.AST_INITIALIZER;
+          if (init.initType == INIT_TYPE_NONE) {
+            return IR_NONE;
+          }
+          IR_VREG base = emitAddress(symbol);
+          PUSH(rStack, base);
+          lower(data.expr);
+          POP(rStack);
+          return base;
+        }
+        if (isFoldedConstant(symbol)) {
+          return IR_NONE;
+        }
+        IR_VREG address = emitAddress(symbol);
+        return lowerInto(address, data.expr, symbol.typeIndex);
+      }
+    case AST_INITIALIZER:
+      {
+        struct AST_INITIALIZER init = ast.data.AST_INITIALIZER;
+        IR_VREG base = PEEK(rStack);
+        if (init.initType == INIT_TYPE_RECORD) {
+          for (int i = 0; i < arrlen(init.assignments); i++) {
+            struct AST_PARAM field = init.assignments[i]->data.AST_PARAM;
+            IR_VREG fieldAddress = emitFieldAddress(base, ast.type, field.identifier);
+            PUSH(rStack, fieldAddress);
+            if (field.value->tag == AST_INITIALIZER) {
+              lower(field.value);
+            } else {
+              lowerInto(fieldAddress, field.value, init.assignments[i]->type);
+            }
+            POP(rStack);
+          }
+        } else if (init.initType == INIT_TYPE_ARRAY) {
+          TYPE_ID dataType = TYPE_getParentId(ast.type);
+          bool* written = lowerPackedElements(base, init.assignments, dataType);
+          for (int i = 0; i < arrlen(init.assignments); i++) {
+            if (written != NULL && written[i]) {
+              continue;
+            }
+            IR_VREG slot = emitOffset(base, (int64_t)i * p.getSize(dataType));
+            PUSH(rStack, slot);
+            if (init.assignments[i]->tag == AST_INITIALIZER) {
+              lower(init.assignments[i]);
+            } else {
+              lowerInto(slot, init.assignments[i], dataType);
+            }
+            POP(rStack);
+          }
+          free(written);
+        }
+        return base;
+      }
+    case AST_ASSIGNMENT:
+      {
+        struct AST_ASSIGNMENT data = ast.data.AST_ASSIGNMENT;
+        if (data.expr->tag == AST_CALL && data.lvalue->tag == AST_IDENTIFIER &&
+            lookup(data.lvalue).storageType == STORAGE_TYPE_LOCAL_OBJECT && returnsInMemory(data.lvalue->type)) {
+          // Checked once the whole function is lowered, see separateResults
+          IR_VREG address = lower(data.lvalue);
+          arrput(inPlace, address);
+          return lowerInto(address, data.expr, data.lvalue->type);
+        }
+        IR_VREG r = lower(data.expr);
+        IR_VREG l = lower(data.lvalue);
+        emitAssign(l, r, data.lvalue->type, data.expr->type);
+        return r;
+      }
+    case AST_IDENTIFIER:
+      {
+        SYMBOL_TABLE_ENTRY symbol = lookup(ptr);
+        IR_VREG address = emitAddress(symbol);
+        if (!ast.rvalue || symbol.entryType == SYMBOL_TYPE_FUNCTION) {
+          return address;
+        }
+        if (symbol.storageType != STORAGE_TYPE_PARAMETER && isAggregate(symbol.typeIndex)) {
+          return address;
+        }
+        // Aggregate parameters hold the address of the caller's copy
+        return emitUnary(IR_LOAD, irType(symbol.typeIndex), address);
+      }
+    case AST_LITERAL:
+      {
+        struct AST_LITERAL data = ast.data.AST_LITERAL;
+        Value v = data.value;
+        if (IS_STRING(v)) {
+          IR_VREG dst = IR_newVreg(fn);
+          IR_emit(fn, (IR_INST){ .op = IR_STRING, .type = IR_U64, .dst = dst, .imm = data.constantIndex });
+          return dst;
+        } else if (IS_PTR(v)) {
+          IR_VREG dst = IR_newVreg(fn);
+          IR_emit(fn, (IR_INST){ .op = IR_STRING, .type = IR_U64, .dst = dst, .imm = AS_PTR(v) });
+          return dst;
+        }
+        return emitConst(AS_LIT_NUM(v), irType(ast.type));
+      }
+    case AST_REF:
+      {
+        struct AST_REF data = ast.data.AST_REF;
+        STR identifier = data.expr->data.AST_IDENTIFIER.identifier;
+        SYMBOL_TABLE_ENTRY symbol = SYMBOL_TABLE_get(ast.scopeIndex, identifier);
+        IR_VREG address = emitAddress(symbol);
+        if (isFoldedConstant(symbol) && symbol.storageType == STORAGE_TYPE_LOCAL) {
+          // Folded locals are only stored once their address is needed
+          int64_t value;
+          fold(symbol.constant, &value);
+          emitStore(irType(symbol.typeIndex), address, emitConst(value, irType(symbol.typeIndex)));
+        }
+        return address;
+      }
+    case AST_DEREF:
+      {
+        struct AST_DEREF data = ast.data.AST_DEREF;
+        IR_VREG r = lower(data.expr);
+        if (ast.rvalue) {
+          return emitUnary(IR_LOAD, irType(ast.type), r);
+        }
+        printEntry(TYPE_get(data.expr->type));
+        TYPE_ENTRY_TYPE kind = TYPE_getKind(ast.type);
+        if (TYPE_getKind(data.expr->type) == ENTRY_TYPE_POINTER && kind != ENTRY_TYPE_RECORD && kind != ENTRY_TYPE_ARRAY) {
+          r = emitUnary(IR_LOAD, IR_U64, r);
+        }
+        return r;
+      }
+    case AST_UNARY:
+      {
+        struct AST_UNARY data = ast.data.AST_UNARY;
+        IR_VREG r = lower(data.expr);
+        switch (data.op) {
+          case OP_BITWISE_NOT: return emitUnary(IR_NOT, irType(ast.type), r);
+          case OP_NOT: return emitBinary(IR_EQ, irType(data.expr->type), r, emitConst(0, irType(data.expr->type)));
+          case OP_NEG: return emitUnary(IR_NEG, irType(ast.type), r);
+          default:
+            {
+              // unreachable
+              printf("unknown unary operator\n");
+              exit(1);
+            }
+        }
+      }
+    case AST_BINARY:
+      {
+        return lowerBinary(ptr);
+      }
+    case AST_DOT:
+      {
+        struct AST_DOT data = ast.data.AST_DOT;
+        IR_VREG left = lower(data.left);
+        TYPE_ID typeIndex = data.left->type;
+        TYPE_ID parent = TYPE_getParentId(typeIndex);
+        if (TYPE_getKind(typeIndex) == ENTRY_TYPE_POINTER && TYPE_getKind(parent) == ENTRY_TYPE_RECORD) {
+          typeIndex = parent;
+        }
+        TYPE_ENTRY entry = TYPE_get(typeIndex);
+        TYPE_ID fieldType = ast.type;
+        for (int i = 0; i < arrlen(entry.fields); i++) {
+          if (entry.fields[i].name == data.name) {
+            fieldType = entry.fields[i].typeIndex;
+            break;
+          }
+        }
+        IR_VREG r = emitFieldAddress(left, typeIndex, data.name);
+        if (ast.rvalue && !isAggregate(fieldType)) {
+          r = emitUnary(IR_LOAD, irType(ast.type), r);
+        }
+        return r;
+      }
+    case AST_SUBSCRIPT:
+      {
+        struct AST_SUBSCRIPT data = ast.data.AST_SUBSCRIPT;
+        TYPE_ID typeIndex = TYPE_getParentId(data.left->type);
+        IR_VREG left = lower(data.left);
+        IR_VREG index = lower(data.index);
+        IR_VREG r = emitIndexAddress(left, index, typeIndex);
+        if (ast.rvalue && !isAggregate(typeIndex)) {
+          r = emitUnary(IR_LOAD, irType(typeIndex), r);
+        }
+        return r;
+      }
+    case AST_CALL:
+      {
+        return lowerCall(ptr, IR_NONE);
+      }
+    default: break;
+  }
+  return IR_NONE;
+}
+
+static int slotAddressed(IR_VREG address) {
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST inst = fn->blocks[i].insts[j];
+      if (inst.op == IR_SLOT && inst.dst == address) {
+        return inst.imm;
+      }
+    }
+  }
+  return -1;
+}
+
+static bool contains(IR_VREG* addresses, IR_VREG address) {
+  for (int i = 0; i < arrlen(addresses); i++) {
+    if (addresses[i] == address) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// `x = f()` builds the result straight in x, which is only safe while f
+// cannot reach x any other way. Where x's address is passed on or stored
+// anywhere in the function, the result goes through a temporary after all.
+static void separateResults(void) {
+  int* baseSlot = malloc(sizeof(int) * fn->vregCount);
+  bool* reachable = calloc(arrlen(fn->slots) + 1, sizeof(bool));
+  for (uint32_t v = 0; v < fn->vregCount; v++) {
+    baseSlot[v] = -1;
+  }
+  // Blocks need not come in the order their registers are defined
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+        IR_INST inst = fn->blocks[i].insts[j];
+        int slot = inst.op == IR_SLOT ? inst.imm : -1;
+        if ((inst.op == IR_ADD || inst.op == IR_COPY) && baseSlot[inst.a] >= 0) {
+          slot = baseSlot[inst.a];
+        }
+        if (slot < 0 || baseSlot[inst.dst] == slot) {
+          continue;
+        }
+        if (baseSlot[inst.dst] >= 0) {
+          reachable[slot] = reachable[baseSlot[inst.dst]] = true;
+        } else {
+          baseSlot[inst.dst] = slot;
+          changed = true;
+        }
+      }
+    }
+  }
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      // Inline assembly finds locals by their place in the frame
+      for (int k = 0; inst->op == IR_ASM && k < arrlen(fn->slots); k++) {
+        reachable[k] = true;
+      }
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        int slot = baseSlot[*operands[k]];
+        if (slot < 0) {
+          continue;
+        }
+        bool accessed = operands[k] == &inst->a || (inst->op == IR_MEMCPY && operands[k] == &inst->b);
+        bool isAddress = (inst->op == IR_LOAD || inst->op == IR_STORE || inst->op == IR_MEMCPY || inst->op == IR_MEMZERO) && accessed;
+        bool derived = (inst->op == IR_ADD || inst->op == IR_COPY) && accessed;
+        bool result = inst->op == IR_CALL && operands[k] == &inst->args[arrlen(inst->args) - 1] && contains(results, *operands[k]);
+        if (!isAddress && !derived && !result) {
+          reachable[slot] = true;
+        }
+      }
+    }
+  }
+  arrfree(operands);
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* call = &block->insts[j];
+      if (call->op != IR_CALL || arrlen(call->args) == 0 || !contains(inPlace, arrlast(call->args))) {
+        continue;
+      }
+      IR_VREG address = arrlast(call->args);
+      int slot = baseSlot[address];
+      if (!reachable[slot]) {
+        continue;
+      }
+      uint32_t size = fn->slots[slot].size;
+      IR_VREG temporary = IR_newVreg(fn);
+      arrlast(call->args) = temporary;
+      IR_insert(block, j, (IR_INST){ .op = IR_SLOT, .type = IR_U64, .dst = temporary, .imm = IR_newTemporary(fn, size) });
+      IR_insert(block, j + 2, (IR_INST){ .op = IR_MEMCPY, .a = address, .b = temporary, .imm = size });
+      j += 2;
+    }
+  }
+  free(baseSlot);
+  free(reachable);
+}
+
+// When every return copies out the same local, that local is built in
+// the caller's memory to begin with, and the copies go away
+static void elideResultCopy(void) {
+  int local = -1;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK block = fn->blocks[i];
+    int count = arrlen(block.insts);
+    for (int j = 0; j < count; j++) {
+      // Inline assembly finds locals by their place in the frame
+      if (block.insts[j].op == IR_ASM) {
+        return;
+      }
+    }
+    if (count == 0 || block.insts[count - 1].op != IR_RETURN || block.insts[count - 1].a == IR_NONE) {
+      continue;
+    }
+    IR_INST copy = count > 1 ? block.insts[count - 2] : (IR_INST){ .op = IR_NOP };
+    if (copy.op != IR_MEMCPY || copy.a != resultAddress) {
+      return;
+    }
+    int slot = slotAddressed(copy.b);
+    if (slot < 0 || fn->slots[slot].param || fn->slots[slot].size != copy.imm || (local >= 0 && slot != local)) {
+      return;
+    }
+    local = slot;
+  }
+  if (local < 0) {
+    return;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK block = fn->blocks[i];
+    int count = arrlen(block.insts);
+    for (int j = 0; j < count; j++) {
+      IR_INST* inst = &block.insts[j];
+      if (inst->op == IR_SLOT && inst->imm == local) {
+        *inst = (IR_INST){ .op = IR_COPY, .type = IR_U64, .dst = inst->dst, .a = resultAddress };
+      } else if (inst->op == IR_MEMCPY && inst->a == resultAddress && j == count - 2 && block.insts[count - 1].op == IR_RETURN) {
+        *inst = (IR_INST){ .op = IR_NOP };
+      }
+    }
+  }
+  IR_removeNops(fn);
+}
+
+IR_FUNCTION* LOWER_function(AST* ptr, PLATFORM platform) {
+  p = platform;
+  SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(ptr->scopeIndex);
+  if (ptr->tag == AST_ISR) {
+    struct AST_ISR data = ptr->data.AST_ISR;
+    fn = IR_newFunction(IR_FUNCTION_ISR, data.identifier, EMPTY_STRING, scope);
+    lower(data.body);
+  } else {
+    struct AST_FN data = ptr->data.AST_FN;
+    STR module = SYMBOL_TABLE_getNameFromStart(scope.key);
+    fn = IR_newFunction(IR_FUNCTION_FN, data.identifier, module, scope);
+    fn->paramCount = arrlen(data.params);
+    TYPE_ENTRY fnType = TYPE_get(ptr->type);
+    if (returnsInMemory(fnType.fields[arrlen(fnType.fields) - 1].typeIndex)) {
+      resultAddress = IR_newVreg(fn);
+      IR_emit(fn, (IR_INST){ .op = IR_PARAM, .type = IR_U64, .dst = resultAddress, .imm = fn->paramCount++ });
+    }
+    if (data.annotation != EMPTY_STRING && strcmp(CHARS(data.annotation), "inline") == 0) {
+      fn->inlining = IR_INLINE_ALWAYS;
+    } else if (data.annotation != EMPTY_STRING && strcmp(CHARS(data.annotation), "noinline") == 0) {
+      fn->inlining = IR_INLINE_NEVER;
+    }
+    lower(data.body);
+  }
+  IR_finish(fn);
+  if (arrlen(inPlace) > 0) {
+    separateResults();
+  }
+  arrfree(results);
+  arrfree(inPlace);
+  if (resultAddress != IR_NONE) {
+    elideResultCopy();
+  }
+  IR_FUNCTION* result = fn;
+  fn = NULL;
+  resultAddress = IR_NONE;
+  return result;
+}
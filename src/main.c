@@ -41,6 +41,14 @@ void OPTIONS_init(void) {
   options.dumpAst = false;
   options.timeRun = false;
   options.outfile = NULL;
+  options.jobs = 1;
+  options.cacheDir = NULL;
+  options.compileOnly = false;
+  options.emitObject = false;
+  options.printIr = false;
+  options.optimize = true;
+  options.reportDropped = false;
+  options.dependencyFile = NULL;
 }
 
 char* concat(const char *s1, const char *s2)
@@ -63,11 +71,76 @@ int main(int argc, const char* argv[]) {
   gettimeofday(&t1, NULL);
 
   char* path = "example.fg";
-  if (argc > 1) {
-    path = (char*)argv[1];
+  int positional = 0;
+  bool dependencies = false;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "-j", 2) == 0) {
+      // -j N or -jN: number of codegen workers
+      const char* jobs = argv[i] + 2;
+      if (*jobs == '\0' && i + 1 < argc) {
+        jobs = argv[++i];
+      }
+      options.jobs = atoi(jobs);
+      if (options.jobs < 1) {
+        options.jobs = 1;
+      }
+    } else if (strcmp(argv[i], "-c") == 0) {
+      // emit only the given module, for linking with the others later
+      options.compileOnly = true;
+    } else if (strcmp(argv[i], "-MD") == 0) {
+      // also write a make rule listing the imported modules
+      dependencies = true;
+    } else if (strcmp(argv[i], "--elf") == 0) {
+      // write an ELF object directly instead of assembly text
+      options.emitObject = true;
+    } else if (strcmp(argv[i], "--ir") == 0) {
+      // print the IR of each function as it is generated
+      options.printIr = true;
+    } else if (strcmp(argv[i], "-O0") == 0) {
+      // skip the IR optimisations, keeping every local in its stack slot
+      options.optimize = false;
+    } else if (strcmp(argv[i], "--report-dropped") == 0) {
+      // list the declarations left out as unreachable
+      options.reportDropped = true;
+    } else if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+      // reuse generated code for unchanged functions between builds
+      options.cacheDir = (char*)argv[++i];
+    } else if (positional == 0) {
+      path = (char*)argv[i];
+      positional++;
+    } else if (positional == 1) {
+      options.outfile = (char*)argv[i];
+      positional++;
+    }
   }
-  if (argc > 2) {
-    options.outfile = (char*)argv[2];
+
+  char* defaultOutfile = NULL;
+  if (options.compileOnly && options.outfile == NULL) {
+    // module.fg -> module.S (or module.o)
+    size_t length = strlen(path);
+    if (length > 3 && strcmp(path + length - 3, ".fg") == 0) {
+      length -= 3;
+    }
+    defaultOutfile = malloc(length + 3);
+    memcpy(defaultOutfile, path, length);
+    strcpy(defaultOutfile + length, options.emitObject ? ".o" : ".S");
+    options.outfile = defaultOutfile;
+  }
+
+  if (dependencies) {
+    // file.S -> file.d, next to the output
+    if (options.outfile == NULL) {
+      options.outfile = options.emitObject ? "file.o" : "file.S";
+    }
+    const char* target = options.outfile;
+    size_t length = strlen(target);
+    const char* extension = strrchr(target, '.');
+    if (extension != NULL && strchr(extension, '/') == NULL) {
+      length = extension - target;
+    }
+    options.dependencyFile = malloc(length + 3);
+    memcpy(options.dependencyFile, target, length);
+    strcpy(options.dependencyFile + length, ".d");
   }
 
   char* fileSource = readFile(path);
@@ -92,6 +165,8 @@ int main(int argc, const char* argv[]) {
   } else {
     printf("Fail\n");
   }
+  free(defaultOutfile);
+  free(options.dependencyFile);
   STR_free();
   return success ? 0 : 1;
 }
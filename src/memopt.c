@@ -0,0 +1,517 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "memopt.h"
+#include "modref.h"
+
+typedef enum BASE_KIND {
+  BASE_SLOT,
+  BASE_GLOBAL,
+  BASE_STRING,
+  // Any other pointer, identified by the register holding it
+  BASE_ROOT
+} BASE_KIND;
+
+typedef struct LOCATION {
+  BASE_KIND kind;
+  int64_t id;
+  bool known;
+  int64_t offset;
+  int64_t size;
+} LOCATION;
+
+// Memory holds the low bytes of value, which was stored or loaded as type
+typedef struct FACT {
+  LOCATION location;
+  IR_VREG value;
+  IR_TYPE type;
+} FACT;
+
+static IR_FUNCTION* fn = NULL;
+// Per register: its defining instruction
+static IR_INST** definitions = NULL;
+// Per register: what it points at, once worked out
+static LOCATION* addresses = NULL;
+static bool* decomposed = NULL;
+// Per slot: whether its address is used for anything but reaching its
+// own bytes
+static bool* escaped = NULL;
+
+static bool constantOf(IR_VREG v, int64_t* value) {
+  IR_INST* def = definitions[v];
+  if (def == NULL || def->op != IR_CONST) {
+    return false;
+  }
+  *value = def->imm;
+  return true;
+}
+
+static LOCATION decompose(IR_VREG v) {
+  if (decomposed[v]) {
+    return addresses[v];
+  }
+  LOCATION result = { BASE_ROOT, v, true, 0, 0 };
+  IR_INST* def = definitions[v];
+  int64_t c;
+  if (def != NULL) {
+    switch (def->op) {
+      case IR_SLOT: result = (LOCATION){ BASE_SLOT, def->imm, true, 0, 0 }; break;
+      case IR_GLOBAL: result = (LOCATION){ BASE_GLOBAL, (int64_t)def->symbol, true, 0, 0 }; break;
+      case IR_STRING: result = (LOCATION){ BASE_STRING, def->imm, true, 0, 0 }; break;
+      case IR_COPY: result = decompose(def->a); break;
+      case IR_ADD:
+      case IR_SUB:
+        {
+          if (constantOf(def->b, &c)) {
+            result = decompose(def->a);
+            result.offset += def->op == IR_ADD ? c : -c;
+          } else if (def->op == IR_ADD && constantOf(def->a, &c)) {
+            result = decompose(def->b);
+            result.offset += c;
+          } else {
+            // Indexing keeps the base of whichever side has one
+            LOCATION a = decompose(def->a);
+            LOCATION b = def->op == IR_ADD ? decompose(def->b) : (LOCATION){ BASE_ROOT };
+            if (a.kind != BASE_ROOT) {
+              result = a;
+              result.known = false;
+            } else if (b.kind != BASE_ROOT) {
+              result = b;
+              result.known = false;
+            }
+          }
+          break;
+        }
+      default: break;
+    }
+  }
+  decomposed[v] = true;
+  addresses[v] = result;
+  return result;
+}
+
+static LOCATION locate(IR_VREG address, int64_t size) {
+  LOCATION location = decompose(address);
+  location.size = size;
+  return location;
+}
+
+static bool sameBase(LOCATION a, LOCATION b) {
+  return a.kind == b.kind && a.id == b.id;
+}
+
+static bool sameLocation(LOCATION a, LOCATION b) {
+  return sameBase(a, b) && a.known && b.known && a.offset == b.offset && a.size == b.size;
+}
+
+// Bytes of the frame which nothing else can reach
+static bool isPrivate(LOCATION location) {
+  return location.kind == BASE_SLOT && !escaped[location.id];
+}
+
+static bool mayAlias(LOCATION a, LOCATION b) {
+  if (sameBase(a, b)) {
+    if (!a.known || !b.known) {
+      return true;
+    }
+    return a.offset < b.offset + b.size && b.offset < a.offset + a.size;
+  }
+  if (isPrivate(a) || isPrivate(b)) {
+    return false;
+  }
+  // Distinct objects never overlap, but an unknown pointer can be any
+  return a.kind == BASE_ROOT || b.kind == BASE_ROOT;
+}
+
+// Slots whose address is only used to load, store or copy their bytes,
+// possibly after adding an offset, cannot be seen by anything else
+static void findEscapes(void) {
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        IR_VREG v = *operands[k];
+        LOCATION location = decompose(v);
+        if (location.kind != BASE_SLOT) {
+          continue;
+        }
+        bool asAddress = operands[k] == &inst->a
+          && (inst->op == IR_LOAD || inst->op == IR_STORE || inst->op == IR_MEMCPY || inst->op == IR_MEMZERO || inst->op == IR_COPY || inst->op == IR_SUB);
+        bool derived = inst->op == IR_ADD || (inst->op == IR_MEMCPY && operands[k] == &inst->b);
+        if (!asAddress && !derived) {
+          escaped[location.id] = true;
+        }
+      }
+    }
+  }
+  arrfree(operands);
+}
+
+static void begin(IR_FUNCTION* function) {
+  fn = function;
+  arrsetlen(definitions, fn->vregCount + 1);
+  arrsetlen(addresses, fn->vregCount + 1);
+  arrsetlen(decomposed, fn->vregCount + 1);
+  arrsetlen(escaped, arrlen(fn->slots) + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    definitions[v] = NULL;
+    decomposed[v] = false;
+  }
+  for (int i = 0; i <= arrlen(fn->slots); i++) {
+    escaped[i] = false;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        definitions[inst->dst] = inst;
+      }
+    }
+  }
+  findEscapes();
+}
+
+static void end(void) {
+  arrfree(definitions);
+  arrfree(addresses);
+  arrfree(decomposed);
+  arrfree(escaped);
+  fn = NULL;
+}
+
+// Inline assembly can read and write any memory
+static bool hasAsm(IR_FUNCTION* function) {
+  for (int i = 0; i < arrlen(function->blocks); i++) {
+    IR_BLOCK* block = &function->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      if (block->insts[j].op == IR_ASM) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+// The type a register's value is already normalised to, or -1
+static int valueType(IR_VREG v) {
+  IR_INST* def = definitions[v];
+  if (def == NULL) {
+    return -1;
+  }
+  switch (def->op) {
+    case IR_COPY: return valueType(def->a);
+    case IR_CONST: return IR_normalize(def->imm, def->type) == def->imm ? (int)def->type : -1;
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+    case IR_STRING:
+    case IR_GLOBAL:
+    case IR_SLOT:
+      return -1;
+    default: return def->type;
+  }
+}
+
+static void killFacts(FACT** facts, LOCATION location) {
+  for (int i = arrlen(*facts) - 1; i >= 0; i--) {
+    if (mayAlias((*facts)[i].location, location)) {
+      arrdel(*facts, i);
+    }
+  }
+}
+
+static IR_VREG resolve(IR_VREG* replacement, IR_VREG v) {
+  while (replacement[v] != IR_NONE) {
+    v = replacement[v];
+  }
+  return v;
+}
+
+void MEMOPT_forwardLoads(IR_FUNCTION* function) {
+  if (hasAsm(function)) {
+    return;
+  }
+  begin(function);
+  int count = arrlen(fn->blocks);
+  int** predecessors = IR_predecessors(fn);
+  FACT** out = calloc(count, sizeof(FACT*));
+  IR_VREG* replacement = calloc(fn->vregCount + 1, sizeof(IR_VREG));
+
+  // A single pass in block order. Blocks entered along a back edge start
+  // knowing nothing, which also keeps loops polling memory an interrupt
+  // handler writes.
+  for (int b = 0; b < count; b++) {
+    FACT* facts = NULL;
+    bool first = true;
+    for (int p = 0; p < arrlen(predecessors[b]); p++) {
+      int from = predecessors[b][p];
+      if (from >= b) {
+        arrsetlen(facts, 0);
+        break;
+      }
+      if (first) {
+        for (int i = 0; i < arrlen(out[from]); i++) {
+          arrput(facts, out[from][i]);
+        }
+        first = false;
+        continue;
+      }
+      for (int i = arrlen(facts) - 1; i >= 0; i--) {
+        bool found = false;
+        for (int k = 0; k < arrlen(out[from]) && !found; k++) {
+          FACT other = out[from][k];
+          found = sameLocation(facts[i].location, other.location) && facts[i].value == other.value && facts[i].type == other.type;
+        }
+        if (!found) {
+          arrdel(facts, i);
+        }
+      }
+    }
+
+    IR_BLOCK* block = &fn->blocks[b];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      switch (inst->op) {
+        case IR_LOAD:
+          {
+            LOCATION location = locate(inst->a, IR_TYPE_SIZE(inst->type));
+            if (!location.known) {
+              break;
+            }
+            int found = -1;
+            for (int k = 0; k < arrlen(facts) && found < 0; k++) {
+              if (sameLocation(facts[k].location, location)) {
+                found = k;
+              }
+            }
+            if (found < 0) {
+              arrput(facts, ((FACT){ location, inst->dst, inst->type }));
+              break;
+            }
+            IR_VREG value = resolve(replacement, facts[found].value);
+            if (valueType(value) == (int)inst->type) {
+              replacement[inst->dst] = value;
+              inst->op = IR_NOP;
+            } else {
+              // Same bytes, but they still need extending to this type
+              inst->op = IR_EXT;
+              inst->a = value;
+            }
+            break;
+          }
+        case IR_STORE:
+          {
+            LOCATION location = locate(inst->a, IR_TYPE_SIZE(inst->type));
+            killFacts(&facts, location);
+            if (location.known) {
+              arrput(facts, ((FACT){ location, inst->b, inst->type }));
+            }
+            break;
+          }
+        case IR_MEMCPY:
+        case IR_MEMZERO:
+          {
+            killFacts(&facts, locate(inst->a, inst->imm));
+            break;
+          }
+        case IR_CALL:
+          {
+            // The callee can change anything but the private slots,
+            // unless it is known to write only certain globals
+            MODREF_SUMMARY* writes = inst->symbol == EMPTY_STRING ? NULL : MODREF_get(inst->symbol);
+            if (writes != NULL && !writes->anywhere) {
+              for (int k = 0; k < arrlen(writes->globals); k++) {
+                killFacts(&facts, (LOCATION){ BASE_GLOBAL, (int64_t)writes->globals[k], false, 0, 0 });
+              }
+              break;
+            }
+            for (int k = arrlen(facts) - 1; k >= 0; k--) {
+              if (!isPrivate(facts[k].location)) {
+                arrdel(facts, k);
+              }
+            }
+            break;
+          }
+        default: break;
+      }
+    }
+    out[b] = facts;
+  }
+
+  IR_VREG** operands = NULL;
+  for (int b = 0; b < count; b++) {
+    IR_BLOCK* block = &fn->blocks[b];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      operands = IR_operands(&block->insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        *operands[k] = resolve(replacement, *operands[k]);
+      }
+    }
+    arrfree(out[b]);
+  }
+  IR_removeNops(fn);
+
+  arrfree(operands);
+  free(out);
+  free(replacement);
+  IR_freePredecessors(predecessors);
+  end();
+}
+
+static bool covered(LOCATION* dead, LOCATION location) {
+  for (int i = 0; i < arrlen(dead); i++) {
+    if (sameBase(dead[i], location) && dead[i].offset <= location.offset
+        && location.offset + location.size <= dead[i].offset + dead[i].size) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// A read keeps whatever part of the dead ranges it does not touch
+static void killRanges(LOCATION** dead, LOCATION read) {
+  for (int i = arrlen(*dead) - 1; i >= 0; i--) {
+    LOCATION range = (*dead)[i];
+    if (!mayAlias(range, read)) {
+      continue;
+    }
+    arrdel(*dead, i);
+    if (!sameBase(range, read) || !read.known) {
+      continue;
+    }
+    if (read.offset > range.offset) {
+      arrput(*dead, ((LOCATION){ range.kind, range.id, true, range.offset, read.offset - range.offset }));
+    }
+    int64_t end = read.offset + read.size;
+    if (end < range.offset + range.size) {
+      arrput(*dead, ((LOCATION){ range.kind, range.id, true, end, range.offset + range.size - end }));
+    }
+  }
+}
+
+static void addRange(LOCATION** dead, LOCATION location) {
+  if (isPrivate(location) && location.known && !covered(*dead, location)) {
+    arrput(*dead, location);
+  }
+}
+
+void MEMOPT_eliminateDeadStores(IR_FUNCTION* function) {
+  if (hasAsm(function)) {
+    return;
+  }
+  begin(function);
+  int count = arrlen(fn->blocks);
+  LOCATION** in = calloc(count, sizeof(LOCATION*));
+
+  // Backwards in a single pass. A block branching back to an earlier one
+  // assumes everything may be read later.
+  for (int b = count - 1; b >= 0; b--) {
+    IR_BLOCK* block = &fn->blocks[b];
+    LOCATION* dead = NULL;
+    IR_INST* terminator = IR_terminator(block);
+    if (terminator != NULL && terminator->op == IR_RETURN) {
+      // Locals are gone once the function returns. Parameters live in
+      // the caller's frame, so leave those alone.
+      for (int i = 0; i < arrlen(fn->slots); i++) {
+        if (!fn->slots[i].param && !escaped[i]) {
+          arrput(dead, ((LOCATION){ BASE_SLOT, i, true, 0, fn->slots[i].size }));
+        }
+      }
+    } else {
+      int successors[2];
+      int successorCount = IR_successors(block, successors);
+      bool backwards = false;
+      for (int k = 0; k < successorCount; k++) {
+        backwards |= successors[k] <= b;
+      }
+      for (int k = 0; k < successorCount && !backwards; k++) {
+        LOCATION* next = in[successors[k]];
+        if (k == 0) {
+          for (int i = 0; i < arrlen(next); i++) {
+            arrput(dead, next[i]);
+          }
+          continue;
+        }
+        for (int i = arrlen(dead) - 1; i >= 0; i--) {
+          if (!covered(next, dead[i])) {
+            arrdel(dead, i);
+          }
+        }
+      }
+    }
+
+    for (int j = arrlen(block->insts) - 1; j >= 0; j--) {
+      IR_INST* inst = &block->insts[j];
+      switch (inst->op) {
+        case IR_STORE:
+          {
+            LOCATION location = locate(inst->a, IR_TYPE_SIZE(inst->type));
+            if (isPrivate(location) && location.known && covered(dead, location)) {
+              inst->op = IR_NOP;
+              break;
+            }
+            addRange(&dead, location);
+            break;
+          }
+        case IR_LOAD:
+          {
+            killRanges(&dead, locate(inst->a, IR_TYPE_SIZE(inst->type)));
+            break;
+          }
+        case IR_MEMCPY:
+          {
+            addRange(&dead, locate(inst->a, inst->imm));
+            killRanges(&dead, locate(inst->b, inst->imm));
+            break;
+          }
+        case IR_MEMZERO:
+          {
+            addRange(&dead, locate(inst->a, inst->imm));
+            break;
+          }
+        default: break;
+      }
+    }
+    in[b] = dead;
+  }
+
+  for (int b = 0; b < count; b++) {
+    arrfree(in[b]);
+  }
+  free(in);
+  IR_removeNops(fn);
+  end();
+}
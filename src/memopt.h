@@ -0,0 +1,48 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef memopt_h
+#define memopt_h
+
+#include "common.h"
+#include "ir.h"
+
+// Memory optimisations over a function in SSA form. Addresses are split
+// into a base (a stack slot, a global, a string or an unknown pointer)
+// and an offset, and two accesses only alias when their bases might be
+// the same object and their bytes overlap. Slots whose address is only
+// ever used to reach their own bytes cannot be seen through pointers or
+// by callees. A call invalidates only what its callee's summary says it
+// may write.
+
+// Replaces loads of memory whose value is already known, from an earlier
+// store or load, with that value
+void MEMOPT_forwardLoads(IR_FUNCTION* fn);
+// Removes stores to the frame which are overwritten, or which the
+// function returns without reading
+void MEMOPT_eliminateDeadStores(IR_FUNCTION* fn);
+
+#endif
@@ -0,0 +1,231 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modref.h"
+#include "lower.h"
+
+// Address arithmetic is not followed any deeper than this
+#define MAX_DEPTH 16
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef enum BASE {
+  BASE_FRAME,
+  BASE_GLOBAL,
+  // Anything reached through a pointer
+  BASE_POINTER
+} BASE;
+
+static PLATFORM p;
+static struct { STR key; AST* value; }* functions = NULL;
+static struct { STR key; MODREF_SUMMARY value; }* summaries = NULL;
+// Per register of the function being summarised: its only definition
+static IR_INST** definitions = NULL;
+
+void MODREF_init(PLATFORM platform) {
+  p = platform;
+}
+
+void MODREF_register(AST* fn) {
+  if (fn->tag != AST_FN) {
+    return;
+  }
+  struct AST_FN data = fn->data.AST_FN;
+  SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(fn->scopeIndex);
+  SYMBOL_TABLE_ENTRY entry = SYMBOL_TABLE_get(scope.parent, data.identifier);
+  if (!entry.defined || entry.entryType != SYMBOL_TYPE_FUNCTION) {
+    return;
+  }
+  hmput(functions, STR_create(p.symbol(entry)), fn);
+}
+
+static BASE baseOf(IR_VREG v, STR* symbol, int depth) {
+  IR_INST* def = definitions[v];
+  if (def == NULL || depth > MAX_DEPTH) {
+    return BASE_POINTER;
+  }
+  switch (def->op) {
+    case IR_SLOT: return BASE_FRAME;
+    case IR_GLOBAL:
+      {
+        *symbol = def->symbol;
+        return BASE_GLOBAL;
+      }
+    case IR_COPY: return baseOf(def->a, symbol, depth + 1);
+    case IR_ADD:
+    case IR_SUB:
+      {
+        // Indexing keeps the base of whichever side has one
+        BASE base = baseOf(def->a, symbol, depth + 1);
+        if (base == BASE_POINTER && def->op == IR_ADD) {
+          base = baseOf(def->b, symbol, depth + 1);
+        }
+        return base;
+      }
+    default: return BASE_POINTER;
+  }
+}
+
+static bool addSymbol(STR** symbols, STR symbol) {
+  for (int i = 0; i < arrlen(*symbols); i++) {
+    if ((*symbols)[i] == symbol) {
+      return false;
+    }
+  }
+  arrput(*symbols, symbol);
+  return true;
+}
+
+static void addWrite(MODREF_SUMMARY* summary, IR_VREG address) {
+  STR symbol = EMPTY_STRING;
+  switch (baseOf(address, &symbol, 0)) {
+    case BASE_FRAME: break;
+    case BASE_GLOBAL: addSymbol(&summary->globals, symbol); break;
+    case BASE_POINTER: summary->anywhere = true; break;
+  }
+}
+
+// What the function writes itself, and what it calls
+static MODREF_SUMMARY summarize(IR_FUNCTION* fn) {
+  MODREF_SUMMARY summary = { false, NULL, NULL };
+  int* defCounts = calloc(fn->vregCount + 1, sizeof(int));
+  arrsetlen(definitions, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    definitions[v] = NULL;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        definitions[inst->dst] = ++defCounts[inst->dst] == 1 ? inst : NULL;
+      }
+    }
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      switch (inst->op) {
+        case IR_STORE:
+        case IR_MEMCPY:
+        case IR_MEMZERO: addWrite(&summary, inst->a); break;
+        case IR_CALL:
+          {
+            if (inst->symbol == EMPTY_STRING) {
+              summary.anywhere = true;
+            } else {
+              addSymbol(&summary.callees, inst->symbol);
+            }
+            break;
+          }
+        case IR_ASM: summary.anywhere = true; break;
+        default: break;
+      }
+    }
+  }
+  free(defCounts);
+  arrfree(definitions);
+  return summary;
+}
+
+void MODREF_analyze(void) {
+  for (int i = 0; i < hmlen(functions); i++) {
+    IR_FUNCTION* ir = LOWER_function(functions[i].value, p);
+    hmput(summaries, functions[i].key, summarize(ir));
+    IR_free(ir);
+  }
+  // Callees write on behalf of their callers
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < hmlen(summaries); i++) {
+      MODREF_SUMMARY* summary = &summaries[i].value;
+      for (int k = 0; k < arrlen(summary->callees) && !summary->anywhere; k++) {
+        MODREF_SUMMARY* callee = MODREF_get(summary->callees[k]);
+        if (callee == NULL || callee->anywhere) {
+          summary->anywhere = true;
+          changed = true;
+          break;
+        }
+        for (int g = 0; g < arrlen(callee->globals); g++) {
+          changed |= addSymbol(&summary->globals, callee->globals[g]);
+        }
+      }
+    }
+  }
+}
+
+MODREF_SUMMARY* MODREF_get(STR symbol) {
+  ptrdiff_t index = hmgeti(summaries, symbol);
+  return index >= 0 ? &summaries[index].value : NULL;
+}
+
+static void hashInt(uint64_t* hash, int64_t value) {
+  const unsigned char* bytes = (const unsigned char*)&value;
+  for (size_t i = 0; i < sizeof(value); i++) {
+    *hash = (*hash ^ bytes[i]) * FNV_PRIME;
+  }
+}
+
+static void hashStr(uint64_t* hash, STR str) {
+  const char* chars = CHARS(str);
+  hashInt(hash, strlen(chars));
+  for (const char* c = chars; *c != '\0'; c++) {
+    *hash = (*hash ^ (unsigned char)*c) * FNV_PRIME;
+  }
+}
+
+uint64_t MODREF_hashCallees(IR_FUNCTION* fn) {
+  uint64_t hash = FNV_OFFSET;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST inst = fn->blocks[i].insts[j];
+      if (inst.op != IR_CALL || inst.symbol == EMPTY_STRING) {
+        continue;
+      }
+      MODREF_SUMMARY* summary = MODREF_get(inst.symbol);
+      hashStr(&hash, inst.symbol);
+      hashInt(&hash, summary == NULL ? -1 : summary->anywhere);
+      for (int g = 0; summary != NULL && g < arrlen(summary->globals); g++) {
+        hashStr(&hash, summary->globals[g]);
+      }
+    }
+  }
+  return hash;
+}
+
+void MODREF_free(void) {
+  for (int i = 0; i < hmlen(summaries); i++) {
+    arrfree(summaries[i].value.globals);
+    arrfree(summaries[i].value.callees);
+  }
+  hmfree(summaries);
+  hmfree(functions);
+}
@@ -0,0 +1,59 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef modref_h
+#define modref_h
+
+#include "common.h"
+#include "ast.h"
+#include "ir.h"
+#include "platform.h"
+
+// Whole-program summaries of the memory each function may write, so a
+// call only invalidates what its callee could change. Each registered
+// function is lowered once, and what it writes directly is merged with
+// what its callees write until nothing changes.
+typedef struct MODREF_SUMMARY {
+  // Writes memory it cannot name: through a pointer, in inline assembly,
+  // or by calling something without a summary
+  bool anywhere;
+  // Symbols of the globals it writes
+  STR* globals;
+  // Symbols of the functions it calls directly
+  STR* callees;
+} MODREF_SUMMARY;
+
+void MODREF_init(PLATFORM platform);
+void MODREF_register(AST* fn);
+void MODREF_analyze(void);
+// The summary of the function with this symbol, or NULL when there is none
+MODREF_SUMMARY* MODREF_get(STR symbol);
+// Hash of the summaries of every function fn calls directly, since code
+// optimised using them has to change when they do
+uint64_t MODREF_hashCallees(IR_FUNCTION* fn);
+void MODREF_free(void);
+
+#endif
@@ -0,0 +1,51 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include "opt.h"
+#include "gvn.h"
+#include "loop.h"
+#include "memopt.h"
+#include "sroa.h"
+#include "ssa.h"
+#include "strength.h"
+
+void OPT_function(IR_FUNCTION* fn) {
+  SROA_function(fn);
+  SSA_build(fn);
+  SSA_propagateConstants(fn);
+  LOOP_unroll(fn);
+  STRENGTH_reduce(fn);
+  MEMOPT_forwardLoads(fn);
+  MEMOPT_eliminateDeadStores(fn);
+  // Forwarded and unrolled values may fold further
+  SSA_propagateConstants(fn);
+  GVN_function(fn);
+  LOOP_optimize(fn);
+  SSA_eliminateDeadCode(fn);
+  SSA_simplifyBranches(fn);
+  SSA_destroy(fn);
+  LOOP_rotate(fn);
+}
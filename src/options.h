@@ -34,6 +34,14 @@ typedef struct {
   bool timeRun;
   char* backend;
   char* outfile;
+  int jobs;
+  char* cacheDir;
+  bool compileOnly;
+  bool emitObject;
+  bool printIr;
+  bool optimize;
+  bool reportDropped;
+  char* dependencyFile;
 } FANG_OPTIONS;
 
 extern FANG_OPTIONS options;
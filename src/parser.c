@@ -25,6 +25,7 @@
 
 #include <stdio.h>
 #include <math.h>
+#include <string.h>
 
 #include "common.h"
 #include "compiler.h"
@@ -75,6 +76,7 @@ static AST* declaration();
 static AST* statement();
 static ParseRule* getRule(TokenType type);
 static AST* parsePrecedence(Precedence precedence);
+static STR annotation();
 
 Parser parser;
 
@@ -550,6 +552,10 @@ static AST* isrDecl() {
 }
 
 static AST* fnDecl() {
+  STR hint = annotation();
+  if (hint != EMPTY_STRING && strcmp(CHARS(hint), "inline") != 0 && strcmp(CHARS(hint), "noinline") != 0 && strcmp(CHARS(hint), "export") != 0) {
+    error("Unknown function annotation.");
+  }
   STR identifier = parseVariable("Expect function name.");
   Token token = parser.previous;
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function identifier");
@@ -573,7 +579,7 @@ static AST* fnDecl() {
   consume(TOKEN_LEFT_BRACE,"Expect '{' before function body.");
 
   AST* fnType = AST_NEW(AST_TYPE_FN, paramTypes, returnType);
-  return AST_NEW_T(AST_FN, token, identifier, params, returnType, block(), fnType);
+  return AST_NEW_T(AST_FN, token, identifier, params, returnType, block(), fnType, 0, hint);
 }
 
 ParseRule rules[] = {
@@ -763,7 +769,15 @@ static AST* doWhileStatement() {
 
   return AST_NEW(AST_DO_WHILE, condition, body);
 }
+static STR loopAnnotation() {
+  STR hint = annotation();
+  if (hint != EMPTY_STRING && strcmp(CHARS(hint), "unroll") != 0 && strcmp(CHARS(hint), "nounroll") != 0) {
+    error("Unknown loop annotation.");
+  }
+  return hint;
+}
 static AST* whileStatement() {
+  STR hint = loopAnnotation();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   AST* condition = expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -772,9 +786,10 @@ static AST* whileStatement() {
     body = statement();
   }
 
-  return AST_NEW(AST_WHILE, condition, body);
+  return AST_NEW(AST_WHILE, condition, body, hint);
 }
 static AST* forStatement() {
+  STR hint = loopAnnotation();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   AST* initializer = NULL;
   AST* condition = NULL;
@@ -803,7 +818,7 @@ static AST* forStatement() {
     body = statement();
   }
 
-  return AST_NEW(AST_FOR, initializer, condition, increment, body);
+  return AST_NEW(AST_FOR, initializer, condition, increment, body, hint);
 }
 
 static AST* returnStatement() {
@@ -31,73 +31,31 @@
 #include "symbol_table.h"
 #include "type_table.h"
 #include "value.h"
+#include "buffer.h"
+#include "ir.h"
 
 typedef struct PLATFORM {
   const char* key;
   void (*init)();
-  void (*complete)();
-  void (*freeRegister)(int r);
-  int (*holdRegister)(int r);
-  void (*freeAllRegisters)(void);
+  // Finishes the program once every function is in f
+  void (*complete)(BUFFER* f);
   int (*getSize)(TYPE_ID);
   bool (*calculateSizes)();
+  const char* (*symbol)(SYMBOL_TABLE_ENTRY entry);
+  // Optional: turns the generated assembly into an object file
+  void (*assemble)(const char* text, size_t length, BUFFER* out);
 
-  void (*genPreamble)(FILE* f);
-  void (*genCompletePreamble)(FILE* f);
-  void (*genIsr)(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope);
-  void (*genIsrEpilogue)(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope);
-  void (*genFunction)(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope);
-  void (*genFunctionEpilogue)(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope);
-  void (*genReturn)(FILE* f, STR, int);
-  int (*genLoadRegister)(FILE* f, int, int);
-  int (*genLoad)(FILE* f, int, int);
-  int (*genConstant)(FILE* f, int);
-  int (*genIdentifierAddr)(FILE* f, SYMBOL_TABLE_ENTRY symbol);
-  int (*genIdentifier)(FILE* f, SYMBOL_TABLE_ENTRY symbol);
-  int (*genAssign)(FILE* f, int, int, int);
-  int (*genCopyObject)(FILE* f, int, int, int);
-  int (*genAdd)(FILE* f, int, int, int);
-  int (*genSub)(FILE* f, int, int, int);
-  int (*genMul)(FILE* f, int, int, int);
-  int (*genDiv)(FILE* f, int, int, int);
-  int (*genMod)(FILE* f, int, int);
-  int (*genBitwiseAnd)(FILE* f, int, int);
-  int (*genBitwiseOr)(FILE* f, int, int);
-  int (*genBitwiseXor)(FILE* f, int, int);
-  int (*genBitwiseNot)(FILE* f, int);
-  int (*genShiftLeft)(FILE* f, int, int);
-  int (*genShiftRight)(FILE* f, int, int);
-  int (*genLessThan)(FILE* f, int, int);
-  int (*genGreaterThan)(FILE* f, int, int);
-  int (*genEqualLessThan)(FILE* f, int, int);
-  int (*genEqualGreaterThan)(FILE* f, int, int);
-  int (*genNeg)(FILE* f, int);
-  int (*genLogicalNot)(FILE* f, int);
-  int (*genAllocStack)(FILE* f, int, int);
-  int (*genFunctionCall)(FILE* f, int, int*);
-  int (*genInitSymbol)(FILE* f, SYMBOL_TABLE_ENTRY, int);
-  void (*genRunMain)(FILE* f);
-  void (*genSimpleExit)(FILE* f);
-  void (*genExit)(FILE* f, int);
-  void (*genRaw)(FILE* f, const char*);
-  int (*labelCreate)();
-  int (*genCmp)(FILE* f, int, int);
-  void (*genEqual)(FILE* f, int, int);
-  void (*genNotEqual)(FILE* f, int, int);
-  void (*genJump)(FILE* f, int);
-  void (*genLabel)(FILE* f, int);
-  int (*genRef)(FILE* f, int);
-  int (*genDeref)(FILE* f, int, int);
-  int (*genIndexAddr)(FILE* f, int, int, int);
-  int (*genIndexRead)(FILE* f, int, int, int);
-  int (*genFieldOffset)(FILE* f, int leftReg, int typeIndex, STR fieldName);
-  void (*genGlobalConstant)(FILE* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count);
-  void (*genGlobalVariable)(FILE* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count);
+  void (*genPreamble)(BUFFER* f);
+  void (*genCompletePreamble)(BUFFER* f);
+  // Emits a whole function or ISR, from its prologue to its epilogue
+  void (*genFunction)(BUFFER* f, IR_FUNCTION* fn);
+  void (*genRunMain)(BUFFER* f);
+  void (*genSimpleExit)(BUFFER* f);
+  void (*genGlobalConstant)(BUFFER* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count);
+  void (*genGlobalVariable)(BUFFER* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count);
   void (*reportTypeTable)(void);
-  void (*beginSection)(FILE* f, STR name, STR annotation);
-  void (*endSection)(FILE* f);
-  void (*checkUnionTag)(FILE* f, int base, TYPE_ID unionType, TYPE_ID candidate, int skipLabel);
-  void (*setTag)(FILE* f, int base, int tag, TYPE_ID);
+  void (*beginSection)(BUFFER* f, STR name, STR annotation);
+  void (*endSection)(BUFFER* f);
 } PLATFORM;
 
 void PLATFORM_init();
@@ -3,13 +3,15 @@
 #include "type_table.h"
 #include "symbol_table.h"
 #include "const_table.h"
+#include "asm_arm64.h"
+#include "ir.h"
+#include "regalloc.h"
 
-static int labelId = 0;
-
-#define REG_SIZE 4
-static int freereg[REG_SIZE];
-static char *storeRegList[REG_SIZE] = { "W8", "W9", "W10", "W11" };
-static char *regList[REG_SIZE] = { "X8", "X9", "X10", "X11" };
+// Block labels are qualified by the function's symbol, so each
+// function's code is independent of the order functions are emitted in.
+static char labelScope[128];
+// Epilogue of the function being emitted, the target of early returns
+static char epilogueLabel[160];
 
 #define BOOL_INDEX 2
 #define U8_INDEX 3
@@ -61,47 +63,6 @@ static int getSize(TYPE_ID id) {
   }
 }
 
-static int labelCreate() {
-  return labelId++;
-}
-
-const char* labelPrint(int i) {
-  static char buffer[128];
-  snprintf(buffer, sizeof(buffer), "L%i", i);
-  return buffer;
-}
-
-static void freeAllRegisters() {
-  for (int i = 0; i < REG_SIZE; i++) {
-    freereg[i] = 0;
-  }
-}
-
-static void freeRegister(int r) {
-  if (freereg[r] <= 0) {
-    printf("Double-freeing register, abort to check");
-    exit(1);
-  }
-  freereg[r] -= 1;
-}
-
-static int allocateRegister() {
-  for (int i = 0; i < REG_SIZE; i++) {
-    if (freereg[i] == 0) {
-      freereg[i] += 1;
-      return i;
-    }
-  }
-  printf("\n");
-  printf("Out of registers, abort\n");
-  exit(1);
-}
-
-static int holdRegister(int r) {
-  freereg[r]++;
-  return r;
-}
-
 static bool calculateSizes() {
   // Init primitives
   /*
@@ -154,82 +115,19 @@ static bool calculateSizes() {
   return true;
 }
 
-static void genMacros(FILE* f) {
-  fprintf(f, " .macro PUSH1 register\n");
-  fprintf(f, "        STR \\register, [SP, #-16]!\n");
-  fprintf(f, " .endm\n");
-  fprintf(f, " .macro POP1 register\n");
-  fprintf(f, "        LDR \\register, [SP], #16\n");
-  fprintf(f, " .endm\n");
-  fprintf(f, " .macro PUSH2 register1, register2\n");
-  fprintf(f, "        STP \\register1, \\register2, [SP, #-16]!\n");
-  fprintf(f, " .endm\n");
-  fprintf(f, " .macro POP2 register1, register2\n");
-  fprintf(f, "        LDP \\register1, \\register2, [SP], #16\n");
-  fprintf(f, " .endm\n");
-}
-
-static void genLabel(FILE* f, int label) {
-  fprintf(f, "%s:\n", labelPrint(label));
-}
-static void genJump(FILE* f, int label) {
-  fprintf(f, "  B %s\n", labelPrint(label));
-}
-
-static int genConstant(FILE* f, int i) {
-  // Load i into a register
-  // return the register index
-  int r = allocateRegister();
-  fprintf(f, "  ADRP %s, _fang_str_%i@PAGE\n", regList[r], i);
-  // Strings store their length at the front, so nudge the pointer by 1
-  fprintf(f, "  ADD %s, %s, _fang_str_%i@PAGEOFF + %i\n", regList[r], regList[r], i, getSize(U8_INDEX));
-  return r;
-}
-static int genLoad(FILE* f, int i, int type) {
-  // Load i into a register
-  // return the register index
-  int size = getSize(type);
-  int r = allocateRegister();
-  if (size == 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    int8_t value = i;
-    fprintf(f, "  MOV %s, #%" PRIi8 "\n", regList[r], value);
-  } else if (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX) {
-    fprintf(f, "  MOV %s, #%i\n", regList[r], i);
-    fprintf(f, "  LSL %s, %s, #56\n", regList[r], regList[r]);
-    fprintf(f, "  ASR %s, %s, #56\n", regList[r], regList[r]);
-  } else {
-    fprintf(f, "  MOV %s, #%i\n", regList[r], i);
-  }
-  return r;
-}
-static void genEqual(FILE* f, int r, int jumpLabel) {
-  fprintf(f, "  TBZ %s, #0, %s\n", regList[r], labelPrint(jumpLabel));
-  freeRegister(r);
-}
-static void genNotEqual(FILE* f, int r, int jumpLabel) {
-  fprintf(f, "  TBNZ %s, #0, %s\n", regList[r], labelPrint(jumpLabel));
-  freeRegister(r);
-}
-
-static int genAllocStack(FILE* f, int storage, int type) {
-  char* store = regList[storage];
-  int offset = getSize(type);
-
-  if (offset > 1) {
-    int temp = genLoad(f, offset, 8);
-    // TODO: Convert to MADD
-    fprintf(f, "  MUL %s, %s, %s\n", store, store, regList[temp]);
-    freeRegister(temp);
-  }
-  fprintf(f, "  ADD %s, %s, #15 ; storage\n", store, store);
-  // ARM64 stack has to align to 16 bytes
-  // We add 15, shift right 4 and shift left 4 to round to the next
-  // 16.
-  fprintf(f, "  LSR %s, %s, #4\n", store, store);
-  fprintf(f, "  LSL %s, %s, #4\n", store, store);
-  fprintf(f, "  SUB SP, SP, %s\n", store);
-  fprintf(f, "  MOV %s, SP\n", store);
-  return storage;
+static void genMacros(BUFFER* f) {
+  BUFFER_printf(f, " .macro PUSH1 register\n");
+  BUFFER_printf(f, "        STR \\register, [SP, #-16]!\n");
+  BUFFER_printf(f, " .endm\n");
+  BUFFER_printf(f, " .macro POP1 register\n");
+  BUFFER_printf(f, "        LDR \\register, [SP], #16\n");
+  BUFFER_printf(f, " .endm\n");
+  BUFFER_printf(f, " .macro PUSH2 register1, register2\n");
+  BUFFER_printf(f, "        STP \\register1, \\register2, [SP, #-16]!\n");
+  BUFFER_printf(f, " .endm\n");
+  BUFFER_printf(f, " .macro POP2 register1, register2\n");
+  BUFFER_printf(f, "        LDP \\register1, \\register2, [SP], #16\n");
+  BUFFER_printf(f, " .endm\n");
 }
 
 static int getStackOffset(SYMBOL_TABLE_ENTRY entry) {
@@ -270,7 +168,11 @@ static int getStackOffset(SYMBOL_TABLE_ENTRY entry) {
 }
 
 static const char* symbol(SYMBOL_TABLE_ENTRY entry) {
-  static char buffer[128];
+  // Mangled names are computed once and cached on the table entry
+  if (entry.mangledName != EMPTY_STRING) {
+    return CHARS(entry.mangledName);
+  }
+  char buffer[128];
   snprintf(buffer, sizeof(buffer), "_fang");
   SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(entry.scopeIndex);
   if (scope.moduleName != EMPTY_STRING) {
@@ -293,176 +195,85 @@ static const char* symbol(SYMBOL_TABLE_ENTRY entry) {
     uint32_t offset = getStackOffset(entry);
     snprintf(buffer, sizeof(buffer), "[FP, #%i] ; %s", -offset, CHARS(entry.key));
   }
-  return buffer;
-}
-
-void init(void) {
-  freeAllRegisters();
-}
-void complete(void) {
-  int r = allocateRegister();
-  freeRegister(r);
-}
-
-static int genLoadRegister(FILE* f, int i, int r) {
-  // Load i into a register
-  // return the register index
-  r = r == -1 ? allocateRegister() : r;
-  int8_t value = i;
-  fprintf(f, "  MOV %s, #%"PRIi8"\n", regList[r], value);
-  if (getSize(U8_INDEX) != 1){
-    fprintf(f, "  LSL %s, %s, #56\n", regList[r], regList[r]);
-    fprintf(f, "  ASR %s, %s, #56\n", regList[r], regList[r]);
-  }
-  return r;
-}
-
-
-static int genIdentifierAddr(FILE* f, SYMBOL_TABLE_ENTRY entry) {
-  int r = allocateRegister();
-  if (entry.storageType == STORAGE_TYPE_PARAMETER) {
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], (entry.paramOrdinal + 1) * 16, CHARS(entry.key));
-  } else if (entry.storageType == STORAGE_TYPE_GLOBAL_OBJECT) {
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
-  } else if (entry.storageType == STORAGE_TYPE_GLOBAL) {
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
-  } else if (entry.storageType == STORAGE_TYPE_LOCAL) {
-    uint32_t offset = getStackOffset(entry);
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], -offset, CHARS(entry.key));
-  } else if (entry.storageType == STORAGE_TYPE_LOCAL_OBJECT) {
-    uint32_t offset = getStackOffset(entry);
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], -offset, CHARS(entry.key));
-  }
-  return r;
-}
-
-static int genDeref(FILE* f, int baseReg, int typeIndex) {
-  // TODO: handle different types here
-  uint32_t size = getSize(typeIndex);
-  freeRegister(baseReg);
-  int leftReg = allocateRegister();
-  if (size == 1) {
-    fprintf(f, "  LDURSB %s, [%s] ; deref\n", regList[leftReg], regList[baseReg]);
-  } else {
-    fprintf(f, "  LDUR %s, [%s]\n ; deref\n", regList[leftReg], regList[baseReg]);
-  }
-  return leftReg;
-}
-
-static int genIdentifier(FILE* f, SYMBOL_TABLE_ENTRY entry) {
-  int r = allocateRegister();
-  if (entry.entryType == SYMBOL_TYPE_FUNCTION) {
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
-    return r;
-  } else if (entry.storageType == STORAGE_TYPE_PARAMETER) {
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], (entry.paramOrdinal + 1) * 16, CHARS(entry.key));
-  } else if (entry.storageType == STORAGE_TYPE_GLOBAL) {
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
-  } else if (entry.storageType == STORAGE_TYPE_LOCAL) {
-    uint32_t offset = getStackOffset(entry);
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], -offset, CHARS(entry.key));
-  } else if (entry.storageType == STORAGE_TYPE_LOCAL_OBJECT) {
-    uint32_t offset = getStackOffset(entry);
-    fprintf(f, "  ADD %s, FP, #%i ; %s\n", regList[r], -offset, CHARS(entry.key));
-    return r;
-  } else if (entry.storageType == STORAGE_TYPE_GLOBAL_OBJECT) {
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
-    return r;
-  }
-  return genDeref(f, r, entry.typeIndex);
-}
-
-static int genRef(FILE* f, int leftReg) {
-  return leftReg;
+  STR name = STR_create(buffer);
+  SYMBOL_TABLE_setMangledName(entry, name);
+  return CHARS(name);
 }
 
-static int genFieldOffset(FILE* f, int baseReg, int typeIndex, STR fieldName) {
-  TYPE_ENTRY entry = TYPE_get(typeIndex);
-  int offset = 0;
-  for (int i = 0; i < arrlen(entry.fields); i++) {
-    if (entry.fields[i].name == fieldName) {
-      break;
-    }
-    if (entry.fields[i].elementCount == 0) {
-      offset += getSize(entry.fields[i].typeIndex);
-    } else {
-      offset += getSize(TYPE_getParentId(entry.fields[i].typeIndex)) * entry.fields[i].elementCount;
-    }
-  }
-
-  freeRegister(baseReg);
-  int leftReg = allocateRegister();
-  fprintf(f, "  ADD %s, %s, #%i; field offset address\n", regList[leftReg], regList[baseReg], offset);
-  return leftReg;
-}
-static int genIndexAddr(FILE* f, int baseReg, int index, int type) {
-  int dataSize = getSize(type);
-  if (dataSize > 1) {
-    int temp = genLoad(f, dataSize, 8);
-    // TODO: Convert to MADD
-    freeRegister(temp);
-    fprintf(f, "  MUL %s, %s, %s\n", regList[index], regList[index], regList[temp]);
-  }
-  // We might still be holding onto the baseReg (for initializations especially)
-  // so we attempt to free add re-allocate to get a destination reg
-  freeRegister(baseReg);
-  freeRegister(index);
-  int leftReg = allocateRegister();
-  fprintf(f, "  ADD %s, %s, %s; index address\n", regList[leftReg], regList[baseReg], regList[index]);
-  return leftReg;
-}
-static int genIndexRead(FILE* f, int baseReg, int index, int type) {
-  int dataSize = getSize(type);
-  if (dataSize > 1) {
-    int temp = genLoad(f, dataSize, 8);
-    // TODO: Convert to MADD
-    freeRegister(temp);
-    fprintf(f, "  MUL %s, %s, %s\n", regList[index], regList[index], regList[temp]);
-  }
-  // We might still be holding onto the baseReg (for initializations especially)
-  // so we attempt to free add re-allocate to get a destination reg
-  freeRegister(baseReg);
-  freeRegister(index);
-  int leftReg = allocateRegister();
-  fprintf(f, "  ADD %s, %s, %s; index read\n", regList[leftReg], regList[baseReg], regList[index]);
-  return genDeref(f, leftReg, type);
-}
-
-static void genPreamble(FILE* f) {
+static void genPreamble(BUFFER* f) {
   genMacros(f);
-  fprintf(f, "\n\n.data\n");
-}
-static void genCompletePreamble(FILE* f) {
-  fprintf(f, ".text\n");
+  BUFFER_printf(f, "\n\n.data\n");
+}
+// Routines for copying and clearing objects too large to do in line.
+// They take the destination in X10, any source in X11 and the size in
+// X9, which is at least 32, and only change those, X16, X17 and V16-V17.
+static void genCopyRoutine(BUFFER* f) {
+  BUFFER_printf(f, ".balign 8\n");
+  BUFFER_printf(f, "_fang_copy:\n");
+  BUFFER_printf(f, "  ADD X16, X11, X9\n");
+  BUFFER_printf(f, "  ADD X17, X10, X9\n");
+  BUFFER_printf(f, "L_fang_copy_loop:\n");
+  BUFFER_printf(f, "  LDP Q16, Q17, [X11], #32\n");
+  BUFFER_printf(f, "  STP Q16, Q17, [X10], #32\n");
+  BUFFER_printf(f, "  SUB X9, X9, #32\n");
+  BUFFER_printf(f, "  CMP X9, #32\n");
+  BUFFER_printf(f, "  B.hi L_fang_copy_loop\n");
+  BUFFER_printf(f, "  LDP Q16, Q17, [X16, #-32]\n");
+  BUFFER_printf(f, "  STP Q16, Q17, [X17, #-32]\n");
+  BUFFER_printf(f, "  RET\n");
+}
+
+static void genZeroRoutine(BUFFER* f) {
+  BUFFER_printf(f, ".balign 8\n");
+  BUFFER_printf(f, "_fang_zero:\n");
+  BUFFER_printf(f, "  ADD X17, X10, X9\n");
+  BUFFER_printf(f, "L_fang_zero_loop:\n");
+  BUFFER_printf(f, "  STP XZR, XZR, [X10], #16\n");
+  BUFFER_printf(f, "  STP XZR, XZR, [X10], #16\n");
+  BUFFER_printf(f, "  SUB X9, X9, #32\n");
+  BUFFER_printf(f, "  CMP X9, #32\n");
+  BUFFER_printf(f, "  B.hi L_fang_zero_loop\n");
+  BUFFER_printf(f, "  STP XZR, XZR, [X17, #-32]\n");
+  BUFFER_printf(f, "  STP XZR, XZR, [X17, #-16]\n");
+  BUFFER_printf(f, "  RET\n");
+}
+
+static void genCompletePreamble(BUFFER* f) {
+  BUFFER_printf(f, ".text\n");
   for (int i = 0; i < arrlen(constTable); i++) {
     Value v = constTable[i].value;
-    if (!IS_STRING(v)) {
+    if (!IS_STRING(v) || constTable[i].unused) {
       continue;
     }
 
-    fprintf(f, ".balign 8\n");
-    fprintf(f, "_fang_str_%i: ", i);
+    BUFFER_printf(f, ".balign 8\n");
+    BUFFER_printf(f, "_fang_str_%i: ", i);
     if (getSize(CHAR_INDEX) == 1) {
-      fprintf(f, ".byte %i\n", (uint8_t)(STR_len(AS_STRING(constTable[i].value))) % 256);
+      BUFFER_printf(f, ".byte %i\n", (uint8_t)(STR_len(AS_STRING(constTable[i].value))) % 256);
     } else {
-      fprintf(f, ".quad %i\n", (uint8_t)(STR_len(AS_STRING(constTable[i].value))) % 256);
+      BUFFER_printf(f, ".quad %i\n", (uint8_t)(STR_len(AS_STRING(constTable[i].value))) % 256);
     }
     if (getSize(CHAR_INDEX) == 1) {
-      fprintf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(constTable[i].value)));
+      BUFFER_printf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(constTable[i].value)));
     } else {
       for (int j = 0; j < STR_len(AS_STRING(constTable[i].value)); j++) {
-        fprintf(f, ".quad '%c'\n", (char)(CHARS(AS_STRING(constTable[i].value))[j]));
+        BUFFER_printf(f, ".quad '%c'\n", (char)(CHARS(AS_STRING(constTable[i].value))[j]));
       }
     }
   }
 }
 
-static void emitValue(FILE* f, Value value, int typeIndex) {
+// Writes a numeric initializer in the width its type occupies
+static void emitNumber(BUFFER* f, Value value, int size) {
+  switch (size) {
+    case 1: BUFFER_printf(f, ".byte %i\n", AS_I8(value)); break;
+    case 2: BUFFER_printf(f, ".hword %i\n", AS_NUMBER(value)); break;
+    case 4: BUFFER_printf(f, ".word %i\n", AS_NUMBER(value)); break;
+    default: BUFFER_printf(f, ".quad %i\n", AS_NUMBER(value)); break;
+  }
+}
+
+static void emitValue(BUFFER* f, Value value, int typeIndex) {
   if (IS_RECORD(value)) {
     Record record = AS_RECORD(value);
     int typeIndex = record.typeIndex;
@@ -480,7 +291,7 @@ static void emitValue(FILE* f, Value value, int typeIndex) {
       if (found) {
         emitValue(f, record.values[j], TYPE_get(typeIndex).fields[i].typeIndex);
       } else {
-        fprintf(f, ".quad %i\n", getSize(TYPE_get(typeIndex).fields[i].typeIndex));
+        BUFFER_printf(f, ".quad %i\n", getSize(TYPE_get(typeIndex).fields[i].typeIndex));
       }
     }
   } else if (IS_ARRAY(value)) {
@@ -489,471 +300,1527 @@ static void emitValue(FILE* f, Value value, int typeIndex) {
     for (int i = 0; i < arrlen(values); i++) {
       emitValue(f, values[i], TYPE_getParentId(typeIndex));
     }
-//    fprintf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
+//    BUFFER_printf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
   } else if (IS_PTR(value)) {
-    fprintf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
+    BUFFER_printf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
   } else if (getSize(typeIndex) == 1) {
   //  || IS_I8(value) || IS_U8(value) || IS_CHAR(value)) {
-    fprintf(f, ".byte %i\n", AS_I8(value));
+    BUFFER_printf(f, ".byte %i\n", AS_I8(value));
   } else if (IS_EMPTY(value)) {
-    fprintf(f, ".quad 0\n");
+    BUFFER_printf(f, ".quad 0\n");
   } else {
-    fprintf(f, ".quad %i\n", AS_I8(value));
+    emitNumber(f, value, getSize(typeIndex));
   }
 }
-static void genGlobalConstant(FILE* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count) {
-  fprintf(f, ".global %s\n", symbol(entry));
-  fprintf(f, ".balign 8\n");
+static void genGlobalConstant(BUFFER* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count) {
+  BUFFER_printf(f, ".global %s\n", symbol(entry));
+  BUFFER_printf(f, ".balign 8\n");
   if (IS_STRING(value)) {
-    //fprintf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(value))) % 256);
-    //fprintf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
+    //BUFFER_printf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(value))) % 256);
+    //BUFFER_printf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
   }
   if (IS_PTR(value)) {
     //Value s = CONST_TABLE_get(AS_PTR(value));
-    //fprintf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
-   // fprintf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
+    //BUFFER_printf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
+   // BUFFER_printf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
   }
-  fprintf(f, "%s: ", symbol(entry));
+  BUFFER_printf(f, "%s: ", symbol(entry));
   if (TYPE_getKind(entry.typeIndex) == ENTRY_TYPE_RECORD) {
     emitValue(f, value, 0);
   } else if (TYPE_getKind(entry.typeIndex) == ENTRY_TYPE_ARRAY) {
     if (IS_STRING(value)) {
-      fprintf(f, ".asciz \"%s\"\n", CHARS(AS_STRING (value)));
+      BUFFER_printf(f, ".asciz \"%s\"\n", CHARS(AS_STRING (value)));
     } else if (IS_PTR(value)) {
       Value s = CONST_TABLE_get(AS_PTR(value));
-      // fprintf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
-      fprintf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(s)));
+      // BUFFER_printf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
+      BUFFER_printf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(s)));
     } else {
       // RECORD too
       Value* values = AS_ARRAY(value);
       // TODO: check for 16bit nums
       for (int i = 0; i < arrlen(values); i++) {
         if (IS_PTR(values[i])) {
-          fprintf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(values[i]), getSize(U8_INDEX));
-        } else if (getSize(TYPE_getParentId(entry.typeIndex)) == 1) {
-          fprintf(f, ".byte %i\n", AS_I8(values[i]));
+          BUFFER_printf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(values[i]), getSize(U8_INDEX));
         } else {
-          fprintf(f, ".quad %i\n", AS_U8(values[i]));
+          emitNumber(f, values[i], getSize(TYPE_getParentId(entry.typeIndex)));
         }
       }
-      fprintf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
+      BUFFER_printf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
     }
   } else {
     if (IS_PTR(value)) {
-      fprintf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
+      BUFFER_printf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
     } else if (getSize(entry.typeIndex) == 1) {
     //  || IS_I8(value) || IS_U8(value) || IS_CHAR(value)) {
-    fprintf(f, ".byte %i\n", AS_I8(value));
+    BUFFER_printf(f, ".byte %i\n", AS_I8(value));
     } else {
-      fprintf(f, ".quad %i\n", AS_U8(value));
+      BUFFER_printf(f, ".quad %i\n", AS_NUMBER(value));
     }
   }
 }
 
 
-static void genGlobalVariable(FILE* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count) {
+static void genGlobalVariable(BUFFER* f, SYMBOL_TABLE_ENTRY entry, Value value, Value count) {
   uint32_t size = getSize(entry.typeIndex);
-  fprintf(f, ".global %s\n ", symbol(entry));
-  fprintf(f, ".balign 8\n");
+  BUFFER_printf(f, ".global %s\n ", symbol(entry));
+  BUFFER_printf(f, ".balign 8\n");
   if (IS_STRING(value)) {
-    fprintf(f, ".byte %i\n", (uint8_t)STR_len(AS_STRING(value)) % 256);
-   // fprintf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
+    BUFFER_printf(f, ".byte %i\n", (uint8_t)STR_len(AS_STRING(value)) % 256);
+   // BUFFER_printf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
   }
   if (IS_PTR(value)) {
     Value s = CONST_TABLE_get(AS_PTR(value));
-    //fprintf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
-    fprintf(f, ".byte %i\n", (uint8_t)STR_len(AS_STRING(s)) % 256);
+    //BUFFER_printf(f, ".xword _fang_str_%zu + 1\n", AS_PTR(value));
+    BUFFER_printf(f, ".byte %i\n", (uint8_t)STR_len(AS_STRING(s)) % 256);
   }
-  fprintf(f, "%s: ", symbol(entry));
+  BUFFER_printf(f, "%s: ", symbol(entry));
   if (TYPE_getKind(entry.typeIndex) == ENTRY_TYPE_RECORD) {
     emitValue(f, value, 0);
   } else if (TYPE_getKind(entry.typeIndex) == ENTRY_TYPE_ARRAY || TYPE_getKind(entry.typeIndex) == ENTRY_TYPE_UNION) {
     // RECORD too
     if (IS_EMPTY(value)) {
       if (size > 8) {
-        fprintf(f, ".zero %i\n", AS_U8(count) * size);
+        BUFFER_printf(f, ".zero %i\n", AS_U8(count) * size);
       } else {
-        fprintf(f, ".fill %i, %i, 0\n", AS_U8(count), size);
+        BUFFER_printf(f, ".fill %i, %i, 0\n", AS_U8(count), size);
       }
     } else if (IS_STRING(value)) {
-      fprintf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(value)));
+      BUFFER_printf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(value)));
     } else if (IS_PTR(value)) {
       Value s = CONST_TABLE_get(AS_PTR(value));
-      // fprintf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
-      fprintf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(s)));
+      // BUFFER_printf(f, ".byte %i\n", STR_len((uint8_t)(AS_CHAR(s))) % 256);
+      BUFFER_printf(f, ".asciz \"%s\"\n", CHARS(AS_STRING(s)));
     } else {
       Value* values = AS_ARRAY(value);
       // TODO: check for 16bit nums
       for (int i = 0; i < arrlen(values); i++) {
         if (IS_PTR(values[i])) {
-          fprintf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(values[i]), getSize(U8_INDEX));
-        } else if (getSize(TYPE_getParentId(entry.typeIndex)) == 1) {
-          fprintf(f, ".byte %i\n", AS_I8(values[i]));
+          BUFFER_printf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(values[i]), getSize(U8_INDEX));
         } else {
-          fprintf(f, ".quad %i\n", AS_U8(values[i]));
+          emitNumber(f, values[i], getSize(TYPE_getParentId(entry.typeIndex)));
         }
       }
     }
-    fprintf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
+    BUFFER_printf(f, "_fang_size_const_%s: .byte %u\n", CHARS(entry.key), AS_I8(count));
   } else {
     if (IS_EMPTY(value)) {
-      fprintf(f, ".quad 0\n");
+      BUFFER_printf(f, ".quad 0\n");
     } else if (IS_PTR(value)) {
-      fprintf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
+      BUFFER_printf(f, ".xword _fang_str_%zu + %i\n", AS_PTR(value), getSize(U8_INDEX));
     } else if (getSize(entry.typeIndex) == 1) {
       //  || IS_I8(value) || IS_U8(value) || IS_CHAR(value)) {
-      fprintf(f, ".byte %i\n", AS_I8(value));
+      BUFFER_printf(f, ".byte %i\n", AS_I8(value));
     } else {
-      fprintf(f, ".quad %i\n", AS_I8(value));
+      BUFFER_printf(f, ".quad %i\n", AS_NUMBER(value));
     }
   }
 }
 
-static void genRunMain(FILE* f) {
-  fprintf(f, ".global _start\n");
-  fprintf(f, ".align 2\n");
-  fprintf(f, "_start:\n");
+static void genRunMain(BUFFER* f) {
+  BUFFER_printf(f, ".global _start\n");
+  BUFFER_printf(f, ".align 2\n");
+  BUFFER_printf(f, "_start:\n");
 
-  fprintf(f, "  MOV X0, XZR\n");
-  fprintf(f, "  BL _fang_fn_main\n");
+  BUFFER_printf(f, "  MOV X0, XZR\n");
+  BUFFER_printf(f, "  BL _fang_fn_main\n");
 }
-static void genSimpleExit(FILE* f) {
+static void genSimpleExit(BUFFER* f) {
   // Returns 0;
-  // fprintf(f, "mov X0, #0\n");
-  fprintf(f, "  MOV X16, #1\n");
-  fprintf(f, "  SVC 0\n");
+  // BUFFER_printf(f, "mov X0, #0\n");
+  BUFFER_printf(f, "  MOV X16, #1\n");
+  BUFFER_printf(f, "  SVC 0\n");
+}
+
+// Code generation from the IR. Virtual registers live wherever the
+// register allocator put them. X9-X11 are scratch for values kept in the
+// frame, and X16 for addresses too far from FP to encode. X17 holds the
+// target of an indirect call while its arguments are put in place.
+static IR_FUNCTION* current = NULL;
+static REGALLOC* allocation = NULL;
+static uint32_t frameBase = 0;
+// Distance below FP of each local slot
+static uint32_t* slotOffsets = NULL;
+// Index of the instruction being generated, in the allocator's numbering
+static uint32_t position = 0;
+// Set when the arguments are copied into the frame above FP on entry,
+// where the parameters are addressed
+static bool homed = false;
+static uint32_t homeSize = 0;
+// Leaf functions which read no stack arguments push no frame record.
+// They address the frame off SP instead, frameSize below where FP would
+// point, and leave out the unused 16 bytes at the top.
+static bool framed = true;
+static uint32_t frameSize = 0;
+
+#define SCRATCH_SIZE 3
+#define ZERO_REGISTER 31
+#define ARGUMENT_REGISTERS 8
+// Copies and clears of up to this many bytes are generated in line
+#define BLOCK_INLINE_LIMIT 256
+static const int scratchList[SCRATCH_SIZE] = { 9, 10, 11 };
+static const int callerSaved[] = { 1, 2, 3, 4, 5, 6, 7, 8, 12, 13, 14, 15, 0 };
+static const int calleeSaved[] = { 19, 20, 21, 22, 23, 24, 25, 26, 27, 28 };
+static const int argumentRegisters[ARGUMENT_REGISTERS] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+
+// Edges whose reloads are generated after the function body
+typedef struct EDGE {
+  int from;
+  int to;
+} EDGE;
+static EDGE* stubs = NULL;
+
+static const char* xreg(int reg) {
+  static const char* names[] = {
+    "X0", "X1", "X2", "X3", "X4", "X5", "X6", "X7", "X8", "X9", "X10",
+    "X11", "X12", "X13", "X14", "X15", "X16", "X17", "X18", "X19", "X20",
+    "X21", "X22", "X23", "X24", "X25", "X26", "X27", "X28", "FP", "LR", "XZR"
+  };
+  return names[reg];
+}
+
+static const char* wreg(int reg) {
+  static const char* names[] = {
+    "W0", "W1", "W2", "W3", "W4", "W5", "W6", "W7", "W8", "W9", "W10",
+    "W11", "W12", "W13", "W14", "W15", "W16", "W17", "W18", "W19", "W20",
+    "W21", "W22", "W23", "W24", "W25", "W26", "W27", "W28", "W29", "W30", "WZR"
+  };
+  return names[reg];
+}
+
+// Constants which MOVZ, MOVN or ORR can encode take a single MOV. Others
+// start from all zeros or all ones, whichever more of their 16-bit chunks
+// already are, and MOVK sets each chunk which differs from that.
+static void genImmediate(BUFFER* f, const char* reg, int64_t value) {
+  if (value == 0) {
+    BUFFER_printf(f, "  MOV %s, XZR\n", reg);
+    return;
+  }
+  uint64_t bits = (uint64_t)value;
+  int zeros = 0;
+  int ones = 0;
+  for (int shift = 0; shift < 64; shift += 16) {
+    uint32_t chunk = (bits >> shift) & 0xFFFF;
+    zeros += chunk == 0;
+    ones += chunk == 0xFFFF;
+  }
+  if (zeros == 3) {
+    BUFFER_printf(f, "  MOV %s, #%" PRIu64 "\n", reg, bits);
+    return;
+  }
+  if (ones >= 3 || ASM_ARM64_isBitmask(bits)) {
+    BUFFER_printf(f, "  MOV %s, #%" PRIi64 "\n", reg, value);
+    return;
+  }
+  uint32_t fill = ones > zeros ? 0xFFFF : 0;
+  bool first = true;
+  for (int shift = 0; shift < 64; shift += 16) {
+    uint32_t chunk = (bits >> shift) & 0xFFFF;
+    if (chunk == fill) {
+      continue;
+    }
+    if (!first) {
+      BUFFER_printf(f, "  MOVK %s, #%u, LSL #%i\n", reg, chunk, shift);
+    } else if (fill == 0) {
+      BUFFER_printf(f, "  MOVZ %s, #%u, LSL #%i\n", reg, chunk, shift);
+    } else {
+      BUFFER_printf(f, "  MOVN %s, #%u, LSL #%i\n", reg, ~chunk & 0xFFFF, shift);
+    }
+    first = false;
+  }
 }
 
-static void genExit(FILE* f, int r) {
-  // Assumes return code is in reg r.
-  fprintf(f, "  MOV X0, %s\n", regList[r]);
-  fprintf(f, "  MOV X16, #1\n");
-  fprintf(f, "  SVC 0\n");
+static const char* frameRegister(void) {
+  return framed ? "FP" : "SP";
 }
 
-static void genIsr(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope) {
-  // get max function scope offset
-  // and round to next 16
-  // TODO: Allocate based on function local scopes
-  // int p = (scope.tableAllocationCount + 1) * 16;
+// Computes FP + offset into reg
+static void genFrameAddress(BUFFER* f, const char* reg, int64_t offset) {
+  if (!framed) {
+    offset += frameSize;
+  }
+  const char* op = offset < 0 ? "SUB" : "ADD";
+  uint64_t amount = offset < 0 ? -offset : offset;
+  if (amount <= 4095) {
+    BUFFER_printf(f, "  %s %s, %s, #%" PRIu64 "\n", op, reg, frameRegister(), amount);
+  } else {
+    genImmediate(f, "X16", amount);
+    BUFFER_printf(f, "  %s %s, %s, X16\n", op, reg, frameRegister());
+  }
+}
 
-  int p = 16 + (((scope.tableAllocationSize + 15) >> 4) << 4);
+// Spill slots sit below the locals
+static uint32_t spillOffset(int slot) {
+  return frameBase + 8 * (slot + 1);
+}
 
-  // get scope name
-  fprintf(f, "\n.global _fang_isr_%s\n", CHARS(name));
-  fprintf(f, "\n.balign 8\n");
-  fprintf(f, "\n_fang_isr_%s:\n", CHARS(name));
-  fprintf(f, "  PUSH2 LR, FP\n"); // push LR onto stack
-  fprintf(f, "  MOV FP, SP\n"); // create stack frame
-  fprintf(f, "  SUB SP, SP, #%i\n", p); // stack is 16 byte aligned
+static void genFrameAccess(BUFFER* f, const char* op, const char* reg, uint32_t offset) {
+  if (framed && offset <= 256) {
+    BUFFER_printf(f, "  %s %s, [FP, #-%u]\n", op, reg, offset);
+  } else if (!framed && frameSize - offset <= 32760) {
+    // Spill slots are 8-byte aligned, so the scaled forms reach further up
+    // from SP
+    BUFFER_printf(f, "  %s %s, [SP, #%u]\n", strcmp(op, "LDUR") == 0 ? "LDR" : "STR", reg, frameSize - offset);
+  } else {
+    genFrameAddress(f, "X16", -(int64_t)offset);
+    BUFFER_printf(f, "  %s %s, [X16]\n", op, reg);
+  }
 }
 
-static void genIsrEpilogue(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope) {
-  // get max function scope offset
-  // and round to next 16
-  fprintf(f, "\n_fang_fn_ep_%s:\n", CHARS(name));
-  fprintf(f, "  MOV SP, FP\n");
-  fprintf(f, "  POP2 LR, FP\n"); // pop LR from stack
-  fprintf(f, "  RET\n");
+static void genSlotAddress(BUFFER* f, const char* reg, int index) {
+  IR_STACK_SLOT slot = current->slots[index];
+  if (slot.param) {
+    genFrameAddress(f, reg, (slot.entry.paramOrdinal + 1) * 16);
+  } else {
+    genFrameAddress(f, reg, -(int64_t)slotOffsets[index]);
+  }
 }
 
-static void genFunction(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope) {
-  // get max function scope offset
-  // and round to next 16
-  // TODO: Allocate based on function local scopes
-  // int p = (scope.tableAllocationCount + 1) * 16;
+static void genMove(BUFFER* f, int dst, int src) {
+  if (dst != src) {
+    BUFFER_printf(f, "  MOV %s, %s\n", xreg(dst), xreg(src));
+  }
+}
 
-  int p = 16 + (((scope.tableAllocationSize + 15) >> 4) << 4);
+// Moves every source register into its destination at once, parking a
+// value in X16 to break a cycle
+static void genParallelMove(BUFFER* f, int* dsts, int* srcs, int count) {
+  bool done[ARGUMENT_REGISTERS] = { false };
+  int pending = count;
+  for (int i = 0; i < count; i++) {
+    if (dsts[i] == srcs[i]) {
+      done[i] = true;
+      pending--;
+    }
+  }
+  while (pending > 0) {
+    bool progress = false;
+    for (int i = 0; i < count; i++) {
+      if (done[i]) {
+        continue;
+      }
+      bool blocked = false;
+      for (int k = 0; k < count; k++) {
+        blocked |= !done[k] && k != i && srcs[k] == dsts[i];
+      }
+      if (!blocked) {
+        genMove(f, dsts[i], srcs[i]);
+        done[i] = true;
+        pending--;
+        progress = true;
+      }
+    }
+    for (int i = 0; i < count && !progress; i++) {
+      if (!done[i]) {
+        genMove(f, 16, dsts[i]);
+        for (int k = 0; k < count; k++) {
+          if (!done[k] && srcs[k] == dsts[i]) {
+            srcs[k] = 16;
+          }
+        }
+        progress = true;
+      }
+    }
+  }
+}
 
-  // get scope name
-  STR module = SYMBOL_TABLE_getNameFromStart(scope.key);
-  if (module == EMPTY_STRING) {
-    fprintf(f, "\n.global _fang_fn_%s\n", CHARS(name));
-    fprintf(f, "\n.balign 8\n");
+// Instructions which only produce a constant or an address, and so can
+// be repeated wherever their result is needed
+static void genValue(BUFFER* f, IR_INST inst, int reg) {
+  switch (inst.op) {
+    case IR_CONST:
+      {
+        genImmediate(f, xreg(reg), inst.imm);
+        break;
+      }
+    case IR_STRING:
+      {
+        // Strings store their length at the front, so nudge the pointer by 1
+        BUFFER_printf(f, "  ADRP %s, _fang_str_%" PRIi64 "@PAGE\n", xreg(reg), inst.imm);
+        BUFFER_printf(f, "  ADD %s, %s, _fang_str_%" PRIi64 "@PAGEOFF + %i\n", xreg(reg), xreg(reg), inst.imm, getSize(U8_INDEX));
+        break;
+      }
+    case IR_GLOBAL:
+      {
+        BUFFER_printf(f, "  ADRP %s, %s@PAGE\n", xreg(reg), CHARS(inst.symbol));
+        BUFFER_printf(f, "  ADD %s, %s, %s@PAGEOFF\n", xreg(reg), xreg(reg), CHARS(inst.symbol));
+        break;
+      }
+    case IR_SLOT:
+      {
+        genSlotAddress(f, xreg(reg), inst.imm);
+        break;
+      }
+    default: break;
+  }
+}
 
-    fprintf(f, "\n_fang_fn_%s:\n", CHARS(name));
+// Puts v into reg from its spill slot, or by recomputing it
+static int genReload(BUFFER* f, IR_VREG v, int reg) {
+  REGALLOC_LOCATION location = allocation->locations[v];
+  if (location.remat) {
+    genValue(f, location.def, reg);
   } else {
-    fprintf(f, "\n.global _fang_%s_fn_%s\n", CHARS(module), CHARS(name));
-    fprintf(f, "\n.balign 8\n");
-    fprintf(f, "\n_fang_%s_fn_%s:\n", CHARS(module), CHARS(name));
+    genFrameAccess(f, "LDUR", xreg(reg), spillOffset(location.slot));
+  }
+  return reg;
+}
+
+// The register holding operand v, which is reloaded into a scratch
+// register when it has none here
+static int use(BUFFER* f, IR_VREG v, int scratch) {
+  int reg = REGALLOC_registerAt(allocation, v, 2 * position);
+  if (reg >= 0) {
+    return reg;
   }
-  fprintf(f, "  PUSH2 LR, FP\n"); // push LR onto stack
-  fprintf(f, "  MOV FP, SP\n"); // create stack frame
-  fprintf(f, "  SUB SP, SP, #%i\n", p); // stack is 16 byte aligned
+  return genReload(f, v, scratchList[scratch]);
 }
 
-static void genFunctionEpilogue(FILE* f, STR name, SYMBOL_TABLE_SCOPE scope) {
-  // get max function scope offset
-  // and round to next 16
-  STR module = SYMBOL_TABLE_getNameFromStart(scope.key);
-  if (module == EMPTY_STRING) {
-    fprintf(f, "\n_fang_fn_ep_%s:\n", CHARS(name));
+static void useInto(BUFFER* f, IR_VREG v, int reg) {
+  int held = REGALLOC_registerAt(allocation, v, 2 * position);
+  if (held >= 0) {
+    genMove(f, reg, held);
   } else {
-    fprintf(f, "\n_fang_%s_fn_ep_%s:\n", CHARS(module), CHARS(name));
+    genReload(f, v, reg);
   }
+}
 
-  fprintf(f, "  MOV SP, FP\n");
-  fprintf(f, "  POP2 LR, FP\n"); // pop LR from stack
-  fprintf(f, "  RET\n");
+// The register a result is computed into, which is the first scratch
+// register when it goes straight to the frame
+static int result(IR_VREG v) {
+  int reg = REGALLOC_registerAt(allocation, v, 2 * position + 1);
+  return reg >= 0 ? reg : scratchList[0];
 }
 
-static void genReturn(FILE* f, STR name, int r) {
-  if (r != -1) {
-    fprintf(f, "  MOV X0, %s\n", regList[r]);
-    freeRegister(r);
-  } else {
-    fprintf(f, "  MOV X0, XZR\n");
+static void def(BUFFER* f, IR_VREG v, int reg) {
+  int slot = allocation->locations[v].slot;
+  if (slot >= 0) {
+    genFrameAccess(f, "STUR", xreg(reg), spillOffset(slot));
   }
-  fprintf(f, "  B _fang_fn_ep_%s\n", CHARS(name));
 }
 
-static void genRaw(FILE* f, const char* str) {
-  fprintf(f, "  %s\n", str);
+// Narrow values are kept truncated and then sign- or zero-extended
+static void genNormalize(BUFFER* f, int dst, int src, IR_TYPE type) {
+  const char* x = xreg(dst);
+  switch (type) {
+    case IR_I8: BUFFER_printf(f, "  SXTB %s, %s\n", x, wreg(src)); break;
+    case IR_I16: BUFFER_printf(f, "  SXTH %s, %s\n", x, wreg(src)); break;
+    case IR_I32: BUFFER_printf(f, "  SXTW %s, %s\n", x, wreg(src)); break;
+    // Writing a W register clears the upper half
+    case IR_U8: BUFFER_printf(f, "  UXTB %s, %s\n", wreg(dst), wreg(src)); break;
+    case IR_U16: BUFFER_printf(f, "  UXTH %s, %s\n", wreg(dst), wreg(src)); break;
+    case IR_U32: BUFFER_printf(f, "  MOV %s, %s\n", wreg(dst), wreg(src)); break;
+    default: genMove(f, dst, src); break;
+  }
 }
-static int genInitSymbol(FILE* f, SYMBOL_TABLE_ENTRY entry, int rvalue) {
-  if (entry.storageType == STORAGE_TYPE_GLOBAL || entry.storageType == STORAGE_TYPE_GLOBAL_OBJECT) {
-    int r = allocateRegister();
-    fprintf(f, "  ADRP %s, %s@PAGE\n", regList[r], symbol(entry));
-    fprintf(f, "  ADD %s, %s, %s@PAGEOFF\n", regList[r], regList[r], symbol(entry));
 
-    if (getSize(entry.typeIndex) == 1) {
-      fprintf(f, "  STURB %s, [%s]\n", storeRegList[rvalue], regList[r]);
-    } else {
-      fprintf(f, "  STUR %s, [%s]\n", regList[rvalue], regList[r]);
-    }
-    freeRegister(r);
-  } else if (entry.storageType == STORAGE_TYPE_LOCAL || entry.storageType == STORAGE_TYPE_LOCAL_OBJECT) {
-    if (getSize(entry.typeIndex) == 1) {
-      fprintf(f, "  STURB %s, %s\n", storeRegList[rvalue], symbol(entry));
-    } else {
-      fprintf(f, "  STUR %s, %s\n", regList[rvalue], symbol(entry));
+// Width tracking. A result is left as the instruction produced it when
+// its uses only read its low bytes, or when it already lies within its
+// type because its operands did.
+
+// Bytes of each value read by its uses
+static uint8_t* demands = NULL;
+// The narrowest type holding every value each register can take, with
+// IR_I64 for anything
+static IR_TYPE* ranges = NULL;
+
+static bool holds(IR_TYPE outer, IR_TYPE inner) {
+  if (IR_TYPE_SIZE(outer) == 8) {
+    return true;
+  }
+  if (IR_TYPE_SIZE(inner) == 8) {
+    return false;
+  }
+  int outerBits = IR_TYPE_SIZE(outer) * 8 - IR_TYPE_SIGNED(outer);
+  int innerBits = IR_TYPE_SIZE(inner) * 8 - IR_TYPE_SIGNED(inner);
+  return innerBits <= outerBits && (IR_TYPE_SIGNED(outer) || !IR_TYPE_SIGNED(inner));
+}
+
+static IR_TYPE joinRanges(IR_TYPE a, IR_TYPE b) {
+  for (IR_TYPE type = IR_U8; type < IR_U64; type++) {
+    if (holds(type, a) && holds(type, b)) {
+      return type;
     }
   }
-  return rvalue;
-}
-static int genCopyObject(FILE* f, int lvalue, int rvalue, int type) {
-  int size = getSize(type);
-  int current = size;
-  int r = allocateRegister();
-  int i = 0;
-  while (current >= 8) {
-    i++;
-    current -= 8;
-  }
-  if (i > 0) {
-    fprintf(f, "  .rept %i ; copy\n", i);
-    fprintf(f, "  LDR %s, [%s], #8\n", regList[r], regList[rvalue]);
-    fprintf(f, "  STR %s, [%s], #8 ; copy\n", regList[r], regList[lvalue]);
-    fprintf(f, "  .endr\n");
-  }
-  i = 0;
-  while (current >= 4) {
-    i++;
-    current -= 4;
-  }
-  if (i > 0) {
-    fprintf(f, "  .rept %i ; copy\n", i);
-    fprintf(f, "  LDR %s, [%s], #4\n", storeRegList[r], regList[rvalue]);
-    fprintf(f, "  STR %s, [%s], #4 ; copy\n", storeRegList[r], regList[lvalue]);
-    fprintf(f, "  .endr\n");
-  }
-  i = 0;
-  while (current >= 2) {
-    i++;
-    current -= 2;
-  }
-  if (i > 0) {
-    fprintf(f, "  .rept %i ; copy\n", i);
-    fprintf(f, "  LDRH %s, [%s], #2\n", storeRegList[r], regList[rvalue]);
-    fprintf(f, "  STRH %s, [%s], #2 ; copy\n", storeRegList[r], regList[lvalue]);
-    fprintf(f, "  .endr\n");
-  }
-  if (current > 0) {
-    fprintf(f, "  .rept %i ; copy\n", current);
-    fprintf(f, "  LDRB %s, [%s], #1\n", storeRegList[r], regList[rvalue]);
-    fprintf(f, "  STRB %s, [%s], #1 ; copy\n", storeRegList[r], regList[lvalue]);
-    fprintf(f, "  .endr\n");
-  }
-  freeRegister(r);
-  freeRegister(rvalue);
-  return lvalue;
-}
-static int genAssign(FILE* f, int lvalue, int rvalue, int type) {
-  int size = getSize(type);
-  if (size == 1) {
-    fprintf(f, "  STURB %s, [%s] ; assign\n", storeRegList[rvalue], regList[lvalue]);
-  } else {
-    fprintf(f, "  STUR %s, [%s] ; assign\n", regList[rvalue], regList[lvalue]);
+  return IR_I64;
+}
+
+static bool fits(IR_VREG v, IR_TYPE type) {
+  return holds(type, ranges[v]);
+}
+
+// The low bytes of a sum, difference, product or bitwise result only
+// depend on the low bytes of its operands, and a store or conversion
+// reads no more than its width
+static int bytesRead(IR_INST* inst, IR_VREG* operand) {
+  int size = IR_TYPE_SIZE(inst->type);
+  switch (inst->op) {
+    case IR_STORE: return operand == &inst->b ? size : 8;
+    case IR_SHL: return operand == &inst->a ? size : 8;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_NEG:
+    case IR_NOT:
+    case IR_EXT: return size;
+    default: return 8;
   }
-  freeRegister(lvalue);
-  return rvalue;
 }
 
-static int genBitwiseNot(FILE* f, int leftReg) {
-  fprintf(f, "  MVN %s, %s\n", regList[leftReg], regList[leftReg]);
-  return leftReg;
+// Results which are extended to their type once computed
+static bool isExtended(IR_OP op) {
+  return op == IR_PARAM || op == IR_CALL || (op >= IR_ADD && op <= IR_EXT);
 }
-static int genBitwiseXor(FILE* f, int leftReg, int rightReg) {
-  fprintf(f, "  EOR %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  freeRegister(rightReg);
-  return leftReg;
+
+static bool isLoose(IR_INST inst) {
+  return isExtended(inst.op) && IR_TYPE_SIZE(inst.type) < 8 && demands[inst.dst] <= IR_TYPE_SIZE(inst.type);
 }
-static int genBitwiseOr(FILE* f, int leftReg, int rightReg) {
-  fprintf(f, "  ORR %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  freeRegister(rightReg);
-  return leftReg;
+
+static IR_TYPE constantRange(int64_t value) {
+  for (IR_TYPE type = IR_U8; type < IR_U64; type++) {
+    if (IR_normalize(value, type) == value) {
+      return type;
+    }
+  }
+  return IR_I64;
 }
-static int genBitwiseAnd(FILE* f, int leftReg, int rightReg) {
-  fprintf(f, "  AND %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  freeRegister(rightReg);
-  return leftReg;
+
+static bool staysInRange(IR_INST inst);
+
+static IR_TYPE resultRange(IR_INST inst) {
+  if (isLoose(inst) && !staysInRange(inst)) {
+    return IR_I64;
+  }
+  switch (inst.op) {
+    case IR_CONST: return constantRange(inst.imm);
+    case IR_COPY: return ranges[inst.a];
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE: return IR_U8;
+    case IR_PARAM:
+    case IR_LOAD:
+    case IR_CALL: return IR_TYPE_SIZE(inst.type) < 8 ? inst.type : IR_I64;
+    default: return isExtended(inst.op) && IR_TYPE_SIZE(inst.type) < 8 ? inst.type : IR_I64;
+  }
 }
 
-static int genAdd(FILE* f, int leftReg, int rightReg, int type) {
-  int size = getSize(type);
-  if (size != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  LSL %s, %s, #56\n", regList[leftReg], regList[leftReg]);
-    fprintf(f, "  LSL %s, %s, #56\n", regList[rightReg], regList[rightReg]);
+static void trackWidths(IR_FUNCTION* fn) {
+  demands = calloc(fn->vregCount + 1, sizeof(uint8_t));
+  ranges = malloc((fn->vregCount + 1) * sizeof(IR_TYPE));
+  for (uint32_t v = 0; v <= fn->vregCount; v++) {
+    ranges[v] = IR_I64;
+  }
+  bool* defined = calloc(fn->vregCount + 1, sizeof(bool));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        int bytes = bytesRead(inst, operands[k]);
+        if (bytes > demands[*operands[k]]) {
+          demands[*operands[k]] = bytes;
+        }
+      }
+    }
+  }
+  // Ranges are carried around loops, so results wait for their operands
+  // and this runs until nothing widens
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+        IR_INST inst = fn->blocks[i].insts[j];
+        if (!IR_hasDestination(inst.op) || inst.dst == IR_NONE) {
+          continue;
+        }
+        bool ready = true;
+        operands = IR_operands(&inst, operands);
+        for (int k = 0; k < arrlen(operands); k++) {
+          ready &= defined[*operands[k]];
+        }
+        if (!ready) {
+          continue;
+        }
+        IR_TYPE range = resultRange(inst);
+        if (defined[inst.dst]) {
+          range = joinRanges(range, ranges[inst.dst]);
+        }
+        if (!defined[inst.dst] || range != ranges[inst.dst]) {
+          ranges[inst.dst] = range;
+          defined[inst.dst] = true;
+          changed = true;
+        }
+      }
+    }
   }
-  fprintf(f, "  ADDS %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  if (size != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  ASR %s, %s, #56\n", regList[leftReg], regList[leftReg]);
+  arrfree(operands);
+  free(defined);
+}
+
+// Whether a result computed at full width already lies within its type
+static bool staysInRange(IR_INST inst) {
+  IR_TYPE type = inst.type;
+  IR_TYPE rangeB = inst.b == IR_NONE ? constantRange(inst.imm) : ranges[inst.b];
+  switch (inst.op) {
+    case IR_AND:
+      {
+        // Masking with a value known not to be negative bounds the result
+        bool a = fits(inst.a, type);
+        bool b = holds(type, rangeB);
+        return (a && b) || (a && !IR_TYPE_SIGNED(ranges[inst.a])) || (b && !IR_TYPE_SIGNED(rangeB));
+      }
+    case IR_OR:
+    case IR_XOR: return fits(inst.a, type) && holds(type, rangeB);
+    case IR_MOD: return fits(inst.a, type) && fits(inst.b, type);
+    // Only the smallest value divided by -1 overflows
+    case IR_DIV: return !IR_TYPE_SIGNED(type) && fits(inst.a, type) && fits(inst.b, type);
+    case IR_SHR: return fits(inst.a, type);
+    case IR_NOT: return IR_TYPE_SIGNED(type) && fits(inst.a, type);
+    case IR_EXT: return fits(inst.a, type);
+    default: return false;
   }
+}
 
-  freeRegister(rightReg);
-  return leftReg;
+static bool needsExtension(IR_INST inst) {
+  return IR_TYPE_SIZE(inst.type) < 8 && !isLoose(inst) && !staysInRange(inst);
 }
 
-static int genSub(FILE* f, int leftReg, int rightReg, int type) {
-  if (getSize(type) != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  LSL %s, %s, #56\n", regList[leftReg], regList[leftReg]);
-    fprintf(f, "  LSL %s, %s, #56\n", regList[rightReg], regList[rightReg]);
+// Conversions which leave their operand as it is become copies, which
+// the register allocator can then coalesce
+static void removeConversions(IR_FUNCTION* fn) {
+  trackWidths(fn);
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (inst->op == IR_EXT && staysInRange(*inst)) {
+        inst->op = IR_COPY;
+      }
+    }
   }
-  fprintf(f, "  SUBS %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  if (getSize(type) != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  ASR %s, %s, #56\n", regList[leftReg], regList[leftReg]);
+  free(demands);
+  free(ranges);
+}
+
+// Extends the result of inst from src into dst, if it has to be
+static void genExtend(BUFFER* f, IR_INST inst, int dst, int src) {
+  if (needsExtension(inst)) {
+    genNormalize(f, dst, src, inst.type);
+  } else {
+    genMove(f, dst, src);
   }
-  freeRegister(rightReg);
-  return leftReg;
 }
 
-static int genMul(FILE* f, int leftReg, int rightReg, int type) {
-  int size = getSize(type);
-  fprintf(f, "  MUL %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  if (size != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  AND %s, %s, #255\n", regList[leftReg], regList[leftReg]);
+static void genBlockLabel(BUFFER* f, int block) {
+  BUFFER_printf(f, "L%s_%i:\n", labelScope, block);
+}
+
+static bool needsReloads(int from, int to) {
+  IR_VREG* reloads = REGALLOC_reloads(allocation, from, to);
+  bool needed = arrlen(reloads) > 0;
+  arrfree(reloads);
+  return needed;
+}
+
+static void genReloads(BUFFER* f, int from, int to) {
+  IR_VREG* reloads = REGALLOC_reloads(allocation, from, to);
+  for (int i = 0; i < arrlen(reloads); i++) {
+    genReload(f, reloads[i], allocation->locations[reloads[i]].reg);
   }
-  freeRegister(rightReg);
-  return leftReg;
+  arrfree(reloads);
 }
-static int genDiv(FILE* f, int leftReg, int rightReg, int type) {
-  int size = getSize(type);
-  fprintf(f, "  SDIV %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  if (size != 1 && (type == I8_INDEX || type == U8_INDEX || type == CHAR_INDEX || type == BOOL_INDEX)) {
-    fprintf(f, "  AND %s, %s, #255\n", regList[leftReg], regList[leftReg]);
+
+// Branches along an edge, going through a stub when values have to be
+// reloaded on the way
+static void genBranchTo(BUFFER* f, const char* op, int reg, int from, int to) {
+  const char* operand = reg < 0 ? "" : xreg(reg);
+  const char* separator = reg < 0 ? "" : ", ";
+  if (!needsReloads(from, to)) {
+    BUFFER_printf(f, "  %s %s%sL%s_%i\n", op, operand, separator, labelScope, to);
+    return;
+  }
+  BUFFER_printf(f, "  %s %s%sL%s_%i_%i\n", op, operand, separator, labelScope, from, to);
+  for (int i = 0; i < arrlen(stubs); i++) {
+    if (stubs[i].from == from && stubs[i].to == to) {
+      return;
+    }
+  }
+  arrput(stubs, ((EDGE){ from, to }));
+}
+
+static void genLoadTyped(BUFFER* f, IR_TYPE type, int dst, int address) {
+  const char* x = xreg(dst);
+  const char* w = wreg(dst);
+  const char* a = xreg(address);
+  switch (type) {
+    case IR_U8: BUFFER_printf(f, "  LDRB %s, [%s]\n", w, a); break;
+    case IR_I8: BUFFER_printf(f, "  LDRSB %s, [%s]\n", x, a); break;
+    case IR_U16: BUFFER_printf(f, "  LDRH %s, [%s]\n", w, a); break;
+    case IR_I16: BUFFER_printf(f, "  LDRSH %s, [%s]\n", x, a); break;
+    case IR_U32: BUFFER_printf(f, "  LDR %s, [%s]\n", w, a); break;
+    case IR_I32: BUFFER_printf(f, "  LDRSW %s, [%s]\n", x, a); break;
+    default: BUFFER_printf(f, "  LDR %s, [%s]\n", x, a); break;
   }
-  freeRegister(rightReg);
-  return leftReg;
 }
 
-static int genFunctionCall(FILE* f, int callable, int* params) {
-  // We need to push registers which aren't free
-  // non-params first
-  int* snapshot = NULL;
-  for (int i = 0; i < 4; i++) {
-    if (freereg[i] > 0 && i != callable) {
-      bool found = false;
-      for (int j = arrlen(params) - 1; j >= 0; j--) {
-        if (params[j] == i) {
-          found = true;
-          break;
-        }
-      }
-      if (!found) {
-        fprintf(f, "  PUSH1 %s\n", regList[i]);
-        arrput(snapshot, i);
-      }
+static void genStoreTyped(BUFFER* f, IR_TYPE type, int src, int address) {
+  const char* a = xreg(address);
+  switch (IR_TYPE_SIZE(type)) {
+    case 1: BUFFER_printf(f, "  STRB %s, [%s]\n", wreg(src), a); break;
+    case 2: BUFFER_printf(f, "  STRH %s, [%s]\n", wreg(src), a); break;
+    case 4: BUFFER_printf(f, "  STR %s, [%s]\n", wreg(src), a); break;
+    default: BUFFER_printf(f, "  STR %s, [%s]\n", xreg(src), a); break;
+  }
+}
+
+// Loads or stores one SIMD register of the given width at base+offset,
+// which need not be a multiple of the width
+static void genVectorAccess(BUFFER* f, bool load, int width, int reg, const char* base, int64_t offset) {
+  static const char kinds[] = { 'B', 'H', 'S', 'D', 'Q' };
+  int kind = __builtin_ctz(width);
+  const char* op = offset % width == 0 ? (load ? "LDR" : "STR") : (load ? "LDUR" : "STUR");
+  BUFFER_printf(f, "  %s %c%i, [%s, #%" PRIi64 "]\n", op, kinds[kind], reg, base, offset);
+}
+
+// Copies size bytes between objects through V16 and V17, 32 bytes at a
+// time. Whatever is left over is copied as the last 16 bytes, or for
+// small objects as two overlapping accesses, so no byte-sized steps remain.
+// Larger objects go to _fang_copy instead.
+static void genCopy(BUFFER* f, const char* to, const char* from, int64_t size) {
+  int64_t offset = 0;
+  if (size < 16) {
+    int width = 8;
+    while (width > size) {
+      width >>= 1;
+    }
+    if (width == 0) {
+      return;
     }
+    genVectorAccess(f, true, width, 16, from, 0);
+    if (size > width) {
+      genVectorAccess(f, true, width, 17, from, size - width);
+      genVectorAccess(f, false, width, 17, to, size - width);
+    }
+    genVectorAccess(f, false, width, 16, to, 0);
+    return;
+  }
+  for (; offset + 32 <= size; offset += 32) {
+    BUFFER_printf(f, "  LDP Q16, Q17, [%s, #%" PRIi64 "]\n", from, offset);
+    BUFFER_printf(f, "  STP Q16, Q17, [%s, #%" PRIi64 "]\n", to, offset);
+  }
+  if (offset + 16 <= size) {
+    genVectorAccess(f, true, 16, 16, from, offset);
+    genVectorAccess(f, false, 16, 16, to, offset);
+    offset += 16;
   }
+  if (offset < size) {
+    genVectorAccess(f, true, 16, 16, from, size - 16);
+    genVectorAccess(f, false, 16, 16, to, size - 16);
+  }
+}
 
-  for (int i = arrlen(params) - 1; i >= 0; i--) {
-    fprintf(f, "  PUSH1 %s\n", regList[params[i]]);
-    freeRegister(params[i]);
+// Clears size bytes with pairs of XZR, finishing with an overlapping
+// store like genCopy. Larger objects go to _fang_zero instead.
+static void genZero(BUFFER* f, const char* to, int64_t size) {
+  static const char* stores[] = { "STRB WZR", "STRH WZR", "STR WZR", "STR XZR" };
+  static const char* unscaled[] = { "STURB WZR", "STURH WZR", "STUR WZR", "STUR XZR" };
+  if (size < 16) {
+    int width = 8;
+    while (width > size) {
+      width >>= 1;
+    }
+    if (width == 0) {
+      return;
+    }
+    int kind = __builtin_ctz(width);
+    BUFFER_printf(f, "  %s, [%s]\n", stores[kind], to);
+    if (size > width) {
+      int64_t last = size - width;
+      BUFFER_printf(f, "  %s, [%s, #%" PRIi64 "]\n", last % width == 0 ? stores[kind] : unscaled[kind], to, last);
+    }
+    return;
   }
-  fprintf(f, "  BLR %s\n", regList[callable]);
-  fprintf(f, "  MOV %s, X0\n", regList[callable]);
-  fprintf(f, "  ADD SP, SP, #%li\n", (arrlen(params)) * 16);
-  for (int i = arrlen(snapshot) - 1; i >= 0; i--) {
-    fprintf(f, "  POP1 %s\n", regList[i]);
+  int64_t offset = 0;
+  for (; offset + 16 <= size; offset += 16) {
+    BUFFER_printf(f, "  STP XZR, XZR, [%s, #%" PRIi64 "]\n", to, offset);
+  }
+  if (offset < size) {
+    int64_t last = size - 16;
+    if (last % 8 == 0) {
+      BUFFER_printf(f, "  STP XZR, XZR, [%s, #%" PRIi64 "]\n", to, last);
+    } else {
+      BUFFER_printf(f, "  STUR XZR, [%s, #%" PRIi64 "]\n", to, last);
+      BUFFER_printf(f, "  STUR XZR, [%s, #%" PRIi64 "]\n", to, last + 8);
+    }
   }
-  arrfree(snapshot);
+}
 
-  return callable;
+static const char* conditionName(IR_OP op, IR_TYPE type) {
+  bool isSigned = IR_TYPE_SIGNED(type);
+  switch (op) {
+    case IR_EQ: return "eq";
+    case IR_NE: return "ne";
+    case IR_LT: return isSigned ? "lt" : "lo";
+    case IR_LE: return isSigned ? "le" : "ls";
+    case IR_GT: return isSigned ? "gt" : "hi";
+    case IR_GE: return isSigned ? "ge" : "hs";
+    default: return "al";
+  }
 }
 
-static int genMod(FILE* f, int leftReg, int rightReg) {
-  int r = allocateRegister();
-  fprintf(f, "  UDIV %s, %s, %s\n", regList[r], regList[leftReg], regList[rightReg]);
-  fprintf(f, "  MSUB %s, %s, %s, %s\n", regList[leftReg], regList[r], regList[rightReg], regList[leftReg]);
-  fprintf(f, "  AND %s, %s, #255\n", regList[leftReg], regList[leftReg]);
-  freeRegister(r);
-  freeRegister(rightReg);
-  return leftReg;
+static IR_OP invertCondition(IR_OP op) {
+  switch (op) {
+    case IR_EQ: return IR_NE;
+    case IR_NE: return IR_EQ;
+    case IR_LT: return IR_GE;
+    case IR_LE: return IR_GT;
+    case IR_GT: return IR_LE;
+    case IR_GE: return IR_LT;
+    default: return op;
+  }
 }
-static int genShiftLeft(FILE* f, int leftReg, int rightReg) {
-  fprintf(f, "  LSL %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  freeRegister(rightReg);
-  return leftReg;
+
+// A comparison used only by the branch right after it leaves its result
+// in the flags, and the branch tests them directly
+static IR_VREG fusedCompare = IR_NONE;
+static IR_INST fusedCondition;
+
+static bool isComparison(IR_OP op) {
+  return op >= IR_EQ && op <= IR_GE;
 }
-static int genShiftRight(FILE* f, int leftReg, int rightReg) {
-  fprintf(f, "  LSR %s, %s, %s\n", regList[leftReg], regList[leftReg], regList[rightReg]);
-  freeRegister(rightReg);
-  return leftReg;
+
+static bool canFuse(IR_BLOCK block, int index, uint32_t* useCounts) {
+  IR_INST inst = block.insts[index];
+  if (!isComparison(inst.op) || index + 1 >= arrlen(block.insts)) {
+    return false;
+  }
+  IR_INST next = block.insts[index + 1];
+  return next.op == IR_BRANCH && next.a == inst.dst && useCounts[inst.dst] == 1;
 }
 
-static int genNeg(FILE* f, int valueReg) {
-  fprintf(f, "  NEG %s, %s\n", regList[valueReg], regList[valueReg]);
-  return valueReg;
+static IR_OP swapCondition(IR_OP op) {
+  switch (op) {
+    case IR_LT: return IR_GT;
+    case IR_LE: return IR_GE;
+    case IR_GT: return IR_LT;
+    case IR_GE: return IR_LE;
+    default: return op;
+  }
 }
 
-static int genCmp(FILE* f, int left, int right) {
-  fprintf(f, "  CMP %s, %s\n", regList[left], regList[right]);
-  freeRegister(right);
-  return left;
+// A conversion used only by the addition, subtraction or comparison
+// right after it is folded into that instruction, which extends a W
+// register as it reads it
+static IR_INST foldedExtension;
+
+static const char* extendName(IR_TYPE type) {
+  switch (type) {
+    case IR_U8: return "UXTB";
+    case IR_I8: return "SXTB";
+    case IR_U16: return "UXTH";
+    case IR_I16: return "SXTH";
+    case IR_U32: return "UXTW";
+    default: return "SXTW";
+  }
+}
+
+static bool canFold(IR_BLOCK block, int index, uint32_t* useCounts) {
+  IR_INST inst = block.insts[index];
+  if (inst.op != IR_EXT || !needsExtension(inst) || useCounts[inst.dst] != 1 || index + 1 >= arrlen(block.insts)) {
+    return false;
+  }
+  IR_INST next = block.insts[index + 1];
+  if (next.b == IR_NONE) {
+    return false;
+  }
+  if (next.op == IR_ADD || isComparison(next.op)) {
+    return next.a == inst.dst || next.b == inst.dst;
+  }
+  return next.op == IR_SUB && next.b == inst.dst;
 }
-static int genGreaterThan(FILE* f, int left, int right) {
-  fprintf(f, "  CMP %s, %s\n", regList[left], regList[right]);
-  freeRegister(right);
-  fprintf(f, "  CSET %s, gt\n", regList[left]);
-  fprintf(f, "  AND %s, %s, #0x1\n", regList[left], regList[left]);
-  return left;
+
+// The last operand of an instruction, as text. That is its immediate
+// when it has no register, and a folded conversion reads its source from
+// where the conversion was.
+static const char* genOperand(BUFFER* f, IR_INST inst, IR_VREG v, int scratch) {
+  static char text[24];
+  if (v == IR_NONE) {
+    if (inst.op == IR_SHL || inst.op == IR_SHR) {
+      snprintf(text, sizeof(text), "#%i", (int)(inst.imm & 63));
+    } else {
+      snprintf(text, sizeof(text), "#%" PRIi64, inst.imm);
+    }
+    return text;
+  }
+  if (v != foldedExtension.dst) {
+    return xreg(use(f, v, scratch));
+  }
+  position--;
+  int reg = use(f, foldedExtension.a, scratch);
+  position++;
+  snprintf(text, sizeof(text), "%s, %s", wreg(reg), extendName(foldedExtension.type));
+  foldedExtension.dst = IR_NONE;
+  return text;
+}
+
+// Immediates. A constant operand which the instruction using it can
+// encode is written into that instruction, as imm with no b, so it takes
+// no register. Constants left with no uses are dropped, as are the
+// results of calls nothing reads, so they are never moved out of X0.
+
+static bool isArithmeticImmediate(int64_t value) {
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  return magnitude <= 0xFFF || ((magnitude & 0xFFF) == 0 && magnitude <= 0xFFF000);
+}
+
+static bool canEncode(IR_OP op, int64_t value) {
+  switch (op) {
+    case IR_ADD:
+    case IR_SUB:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE: return isArithmeticImmediate(value);
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR: return ASM_ARM64_isBitmask((uint64_t)value);
+    case IR_SHL:
+    case IR_SHR: return true;
+    // Zero is stored straight from the zero register
+    case IR_STORE: return value == 0;
+    default: return false;
+  }
 }
-static int genEqualGreaterThan(FILE* f, int left, int right) {
-  fprintf(f, "  CMP %s, %s\n", regList[left], regList[right]);
-  freeRegister(right);
-  fprintf(f, "  CSET %s, ge\n", regList[left]);
-  fprintf(f, "  AND %s, %s, #0x1\n", regList[left], regList[left]);
-  return left;
+
+static void selectImmediates(IR_FUNCTION* fn) {
+  uint32_t* defCounts = calloc(fn->vregCount + 1, sizeof(uint32_t));
+  int64_t* constants = calloc(fn->vregCount + 1, sizeof(int64_t));
+  bool* constant = calloc(fn->vregCount + 1, sizeof(bool));
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST inst = fn->blocks[i].insts[j];
+      if (IR_hasDestination(inst.op) && inst.dst != IR_NONE) {
+        defCounts[inst.dst]++;
+        constant[inst.dst] = inst.op == IR_CONST;
+        constants[inst.dst] = inst.imm;
+      }
+    }
+  }
+  for (uint32_t v = 0; v <= fn->vregCount; v++) {
+    constant[v] &= defCounts[v] == 1;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      // Constants go second in operations which allow it
+      bool commutes = inst->op == IR_ADD || inst->op == IR_AND || inst->op == IR_OR || inst->op == IR_XOR;
+      if ((commutes || isComparison(inst->op)) && constant[inst->a] && !constant[inst->b]) {
+        IR_VREG first = inst->a;
+        inst->a = inst->b;
+        inst->b = first;
+        inst->op = swapCondition(inst->op);
+      }
+      if (inst->b != IR_NONE && constant[inst->b] && canEncode(inst->op, constants[inst->b])) {
+        inst->imm = constants[inst->b];
+        inst->b = IR_NONE;
+      }
+    }
+  }
+  uint32_t* useCounts = calloc(fn->vregCount + 1, sizeof(uint32_t));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      operands = IR_operands(&fn->blocks[i].insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        useCounts[*operands[k]]++;
+      }
+    }
+  }
+  arrfree(operands);
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (inst->op == IR_CONST && useCounts[inst->dst] == 0) {
+        inst->op = IR_NOP;
+      } else if (inst->op == IR_CALL && useCounts[inst->dst] == 0) {
+        inst->dst = IR_NONE;
+      }
+    }
+  }
+  free(useCounts);
+  free(defCounts);
+  free(constants);
+  free(constant);
+}
+
+// Callee-saved registers are kept at the bottom of the frame, in pairs
+static void genSavedRegisters(BUFFER* f, bool store) {
+  int count = arrlen(allocation->saved);
+  for (int i = 0; i < count; i += 2) {
+    if (i + 1 < count) {
+      BUFFER_printf(f, "  %s %s, %s, [SP, #%i]\n", store ? "STP" : "LDP", xreg(allocation->saved[i]), xreg(allocation->saved[i + 1]), i * 8);
+    } else {
+      BUFFER_printf(f, "  %s %s, [SP, #%i]\n", store ? "STR" : "LDR", xreg(allocation->saved[i]), i * 8);
+    }
+  }
+}
+
+static void genStackAdjust(BUFFER* f, const char* op, uint32_t amount) {
+  if (amount <= 4095) {
+    BUFFER_printf(f, "  %s SP, SP, #%u\n", op, amount);
+  } else {
+    genImmediate(f, "X16", amount);
+    BUFFER_printf(f, "  %s SP, SP, X16\n", op);
+  }
+}
+
+static void genEpilogue(BUFFER* f) {
+  genSavedRegisters(f, false);
+  if (framed) {
+    BUFFER_printf(f, "  MOV SP, FP\n");
+    BUFFER_printf(f, "  POP2 LR, FP\n"); // pop LR from stack
+  } else if (frameSize > 16) {
+    genStackAdjust(f, "ADD", frameSize - 16);
+  }
+  if (homed) {
+    BUFFER_printf(f, "  ADD SP, SP, #%u\n", homeSize);
+  }
+  BUFFER_printf(f, "  RET\n");
+}
+
+static void genInstruction(BUFFER* f, IR_INST inst, int block) {
+  switch (inst.op) {
+    case IR_NOP: break;
+    case IR_CONST:
+    case IR_STRING:
+    case IR_GLOBAL:
+    case IR_SLOT:
+      {
+        if (REGALLOC_registerAt(allocation, inst.dst, 2 * position + 1) < 0 && allocation->locations[inst.dst].remat) {
+          // recomputed wherever it is used
+          break;
+        }
+        int dst = result(inst.dst);
+        genValue(f, inst, dst);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_PARAM:
+      {
+        // The prologue moved the register arguments into place
+        if (!homed && inst.imm < ARGUMENT_REGISTERS) {
+          break;
+        }
+        int dst = result(inst.dst);
+        if (homed) {
+          genFrameAddress(f, "X16", 16 * (inst.imm + 1));
+        } else {
+          genFrameAddress(f, "X16", 16 + 8 * (inst.imm - ARGUMENT_REGISTERS));
+        }
+        genLoadTyped(f, inst.type, dst, 16);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_COPY:
+      {
+        int dst = result(inst.dst);
+        useInto(f, inst.a, dst);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_LOAD:
+      {
+        int address = use(f, inst.a, 1);
+        int dst = result(inst.dst);
+        genLoadTyped(f, inst.type, dst, address);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_STORE:
+      {
+        int address = use(f, inst.a, 1);
+        genStoreTyped(f, inst.type, inst.b == IR_NONE ? ZERO_REGISTER : use(f, inst.b, 0), address);
+        break;
+      }
+    case IR_MEMCPY:
+      {
+        if (inst.imm > BLOCK_INLINE_LIMIT) {
+          useInto(f, inst.a, scratchList[1]);
+          useInto(f, inst.b, scratchList[2]);
+          genImmediate(f, xreg(scratchList[0]), inst.imm);
+          BUFFER_printf(f, "  BL _fang_copy\n");
+          break;
+        }
+        int to = use(f, inst.a, 1);
+        genCopy(f, xreg(to), xreg(use(f, inst.b, 2)), inst.imm);
+        break;
+      }
+    case IR_MEMZERO:
+      {
+        if (inst.imm > BLOCK_INLINE_LIMIT) {
+          useInto(f, inst.a, scratchList[1]);
+          genImmediate(f, xreg(scratchList[0]), inst.imm);
+          BUFFER_printf(f, "  BL _fang_zero\n");
+          break;
+        }
+        genZero(f, xreg(use(f, inst.a, 1)), inst.imm);
+        break;
+      }
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_SHL:
+    case IR_SHR:
+      {
+        const char* op = "ADD";
+        switch (inst.op) {
+          case IR_SUB: op = "SUB"; break;
+          case IR_MUL: op = "MUL"; break;
+          case IR_AND: op = "AND"; break;
+          case IR_OR: op = "ORR"; break;
+          case IR_XOR: op = "EOR"; break;
+          case IR_SHL: op = "LSL"; break;
+          case IR_SHR: op = IR_TYPE_SIGNED(inst.type) ? "ASR" : "LSR"; break;
+          default: break;
+        }
+        IR_VREG first = inst.a;
+        IR_VREG second = inst.b;
+        if (first == foldedExtension.dst) {
+          first = inst.b;
+          second = inst.a;
+        }
+        if (second == IR_NONE && inst.imm < 0 && (inst.op == IR_ADD || inst.op == IR_SUB)) {
+          // Adding a negative amount is subtracting, and the other way round
+          op = inst.op == IR_ADD ? "SUB" : "ADD";
+          inst.imm = -inst.imm;
+        }
+        int a = use(f, first, 0);
+        const char* b = genOperand(f, inst, second, 1);
+        int dst = result(inst.dst);
+        BUFFER_printf(f, "  %s %s, %s, %s\n", op, xreg(dst), xreg(a), b);
+        genExtend(f, inst, dst, dst);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_DIV:
+    case IR_MOD:
+      {
+        // Narrow values are already extended, so only full width unsigned
+        // values need an unsigned division
+        const char* op = inst.type == IR_U64 ? "UDIV" : "SDIV";
+        int a = use(f, inst.a, 0);
+        int b = use(f, inst.b, 1);
+        int dst = result(inst.dst);
+        if (inst.op == IR_DIV) {
+          BUFFER_printf(f, "  %s %s, %s, %s\n", op, xreg(dst), xreg(a), xreg(b));
+        } else {
+          BUFFER_printf(f, "  %s X11, %s, %s\n", op, xreg(a), xreg(b));
+          BUFFER_printf(f, "  MSUB %s, X11, %s, %s\n", xreg(dst), xreg(b), xreg(a));
+        }
+        genExtend(f, inst, dst, dst);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_NEG:
+    case IR_NOT:
+      {
+        int a = use(f, inst.a, 0);
+        int dst = result(inst.dst);
+        BUFFER_printf(f, "  %s %s, %s\n", inst.op == IR_NEG ? "NEG" : "MVN", xreg(dst), xreg(a));
+        genExtend(f, inst, dst, dst);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_EXT:
+      {
+        if (inst.dst == foldedExtension.dst) {
+          break;
+        }
+        int a = use(f, inst.a, 0);
+        int dst = result(inst.dst);
+        genExtend(f, inst, dst, a);
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+      {
+        IR_VREG first = inst.a;
+        IR_VREG second = inst.b;
+        if (first == foldedExtension.dst) {
+          first = inst.b;
+          second = inst.a;
+          inst.op = swapCondition(inst.op);
+        }
+        const char* op = "CMP";
+        if (second == IR_NONE && inst.imm < 0) {
+          op = "CMN";
+          inst.imm = -inst.imm;
+        }
+        int a = use(f, first, 0);
+        const char* b = genOperand(f, inst, second, 1);
+        int dst = result(inst.dst);
+        BUFFER_printf(f, "  %s %s, %s\n", op, xreg(a), b);
+        if (inst.dst == fusedCompare) {
+          fusedCondition = inst;
+          break;
+        }
+        BUFFER_printf(f, "  CSET %s, %s\n", xreg(dst), conditionName(inst.op, inst.type));
+        def(f, inst.dst, dst);
+        break;
+      }
+    case IR_CALL:
+      {
+        int count = arrlen(inst.args);
+        uint32_t outgoing = 0;
+        if (inst.imm) {
+          // Arguments are passed on the stack, in 16-byte slots
+          for (int i = count - 1; i >= 0; i--) {
+            BUFFER_printf(f, "  PUSH1 %s\n", xreg(use(f, inst.args[i], 0)));
+          }
+          outgoing = count * 16;
+        } else {
+          // The first arguments are passed in X0-X7, and the rest on the
+          // stack 8 bytes apart. Values are read before any of those
+          // registers is overwritten.
+          if (inst.symbol == EMPTY_STRING) {
+            useInto(f, inst.a, 17);
+          }
+          if (count > ARGUMENT_REGISTERS) {
+            outgoing = (((count - ARGUMENT_REGISTERS) * 8 + 15) >> 4) << 4;
+            BUFFER_printf(f, "  SUB SP, SP, #%u\n", outgoing);
+            for (int i = ARGUMENT_REGISTERS; i < count; i++) {
+              BUFFER_printf(f, "  STR %s, [SP, #%i]\n", xreg(use(f, inst.args[i], 0)), (i - ARGUMENT_REGISTERS) * 8);
+            }
+          }
+          int dsts[ARGUMENT_REGISTERS];
+          int srcs[ARGUMENT_REGISTERS];
+          int moves = 0;
+          for (int i = 0; i < count && i < ARGUMENT_REGISTERS; i++) {
+            int reg = REGALLOC_registerAt(allocation, inst.args[i], 2 * position);
+            if (reg >= 0) {
+              dsts[moves] = i;
+              srcs[moves++] = reg;
+            }
+          }
+          genParallelMove(f, dsts, srcs, moves);
+          for (int i = 0; i < count && i < ARGUMENT_REGISTERS; i++) {
+            if (REGALLOC_registerAt(allocation, inst.args[i], 2 * position) < 0) {
+              genReload(f, inst.args[i], i);
+            }
+          }
+        }
+        if (inst.symbol != EMPTY_STRING) {
+          BUFFER_printf(f, "  BL %s\n", CHARS(inst.symbol));
+        } else if (inst.imm) {
+          BUFFER_printf(f, "  BLR %s\n", xreg(use(f, inst.a, 0)));
+        } else {
+          BUFFER_printf(f, "  BLR X17\n");
+        }
+        if (outgoing > 0) {
+          BUFFER_printf(f, "  ADD SP, SP, #%u\n", outgoing);
+        }
+        if (inst.dst != IR_NONE) {
+          int dst = result(inst.dst);
+          genExtend(f, inst, dst, 0);
+          def(f, inst.dst, dst);
+        }
+        break;
+      }
+    case IR_ASM:
+      {
+        BUFFER_printf(f, "  %s\n", inst.text);
+        break;
+      }
+    case IR_JUMP:
+      {
+        genReloads(f, block, inst.target);
+        if (inst.target != block + 1) {
+          genBranchTo(f, "B", -1, block, inst.target);
+        }
+        break;
+      }
+    case IR_BRANCH:
+      {
+        if (inst.a == fusedCompare) {
+          char taken[8];
+          char skipped[8];
+          snprintf(taken, sizeof(taken), "B.%s", conditionName(fusedCondition.op, fusedCondition.type));
+          snprintf(skipped, sizeof(skipped), "B.%s", conditionName(invertCondition(fusedCondition.op), fusedCondition.type));
+          if (inst.other == block + 1 && !needsReloads(block, inst.other)) {
+            genBranchTo(f, taken, -1, block, inst.target);
+          } else {
+            genBranchTo(f, skipped, -1, block, inst.other);
+            if (inst.target != block + 1 || needsReloads(block, inst.target)) {
+              genBranchTo(f, "B", -1, block, inst.target);
+            }
+          }
+          fusedCompare = IR_NONE;
+          break;
+        }
+        int condition = use(f, inst.a, 0);
+        if (inst.other == block + 1 && !needsReloads(block, inst.other)) {
+          genBranchTo(f, "CBNZ", condition, block, inst.target);
+        } else {
+          genBranchTo(f, "CBZ", condition, block, inst.other);
+          if (inst.target != block + 1 || needsReloads(block, inst.target)) {
+            genBranchTo(f, "B", -1, block, inst.target);
+          }
+        }
+        break;
+      }
+    case IR_RETURN:
+      {
+        if (inst.a != IR_NONE) {
+          useInto(f, inst.a, 0);
+        } else {
+          BUFFER_printf(f, "  MOV X0, XZR\n");
+        }
+        // The last block falls through into the epilogue, and the short
+        // epilogue of a function without a frame record is repeated
+        if (block == arrlen(current->blocks) - 1) {
+          break;
+        }
+        if (!framed && arrlen(allocation->saved) == 0) {
+          genEpilogue(f);
+        } else {
+          BUFFER_printf(f, "  B %s\n", epilogueLabel);
+        }
+        break;
+      }
+    case IR_PHI:
+      {
+        // SSA form is taken apart before code generation
+        printf("trap %d\n", __LINE__);
+        exit(1);
+      }
+  }
 }
-static int genEqualLessThan(FILE* f, int left, int right) {
-  fprintf(f, "  CMP %s, %s\n", regList[left], regList[right]);
-  freeRegister(right);
-  fprintf(f, "  CSET %s, le\n", regList[left]);
-  fprintf(f, "  AND %s, %s, #0x1\n", regList[left], regList[left]);
-  return left;
+
+// Register arguments are read in the prologue, so the parameters are
+// moved ahead of anything which could be given those registers first
+static void hoistParameters(IR_FUNCTION* fn) {
+  IR_BLOCK* entry = &fn->blocks[0];
+  int front = 0;
+  for (int j = 0; j < arrlen(entry->insts); j++) {
+    if (entry->insts[j].op == IR_PARAM) {
+      IR_INST param = entry->insts[j];
+      memmove(&entry->insts[front + 1], &entry->insts[front], (j - front) * sizeof(IR_INST));
+      entry->insts[front++] = param;
+    }
+  }
 }
 
-static int genLessThan(FILE* f, int left, int right) {
-  fprintf(f, "  CMP %s, %s\n", regList[left], regList[right]);
-  fprintf(f, "  CSET %s, lt\n", regList[left]);
-  fprintf(f, "  AND %s, %s, #0x1\n", regList[left], regList[left]);
-  return left;
+// Moves each register argument into the register given to its parameter
+static void genParameters(BUFFER* f, IR_FUNCTION* fn, uint32_t* useCounts) {
+  IR_BLOCK entry = fn->blocks[0];
+  int dsts[ARGUMENT_REGISTERS];
+  int srcs[ARGUMENT_REGISTERS];
+  IR_INST params[ARGUMENT_REGISTERS];
+  int moves = 0;
+  for (int j = 0; j < arrlen(entry.insts) && entry.insts[j].op == IR_PARAM; j++) {
+    IR_INST param = entry.insts[j];
+    if (param.imm >= ARGUMENT_REGISTERS || useCounts[param.dst] == 0) {
+      continue;
+    }
+    int reg = REGALLOC_registerAt(allocation, param.dst, 2 * j + 1);
+    // A parameter which leaves its register before a later one is given
+    // it goes straight to the frame, as the moves happen all at once
+    for (int k = j + 1; reg >= 0 && k < arrlen(entry.insts) && entry.insts[k].op == IR_PARAM; k++) {
+      IR_INST later = entry.insts[k];
+      if (later.imm < ARGUMENT_REGISTERS && useCounts[later.dst] > 0 && REGALLOC_registerAt(allocation, later.dst, 2 * k + 1) == reg) {
+        reg = -1;
+      }
+    }
+    if (reg < 0) {
+      genExtend(f, param, 17, param.imm);
+      def(f, param.dst, 17);
+      continue;
+    }
+    dsts[moves] = reg;
+    srcs[moves] = param.imm;
+    params[moves++] = param;
+  }
+  genParallelMove(f, dsts, srcs, moves);
+  for (int i = 0; i < moves; i++) {
+    genExtend(f, params[i], dsts[i], dsts[i]);
+    def(f, params[i].dst, dsts[i]);
+  }
 }
-static int genLogicalNot(FILE* f, int valueReg) {
-  fprintf(f, "  CMP %s, #0\n", regList[valueReg]);
-  fprintf(f, "  CSET %s, eq\n", regList[valueReg]);
-  fprintf(f, "  AND %s, %s, #255\n", regList[valueReg], regList[valueReg]);
-  return valueReg;
+
+static void genFunction(BUFFER* f, IR_FUNCTION* fn) {
+  current = fn;
+  hoistParameters(fn);
+  selectImmediates(fn);
+  removeConversions(fn);
+  REGALLOC_TARGET target = {
+    .callerSaved = callerSaved,
+    .callerSavedCount = sizeof(callerSaved) / sizeof(callerSaved[0]),
+    .calleeSaved = calleeSaved,
+    .calleeSavedCount = sizeof(calleeSaved) / sizeof(calleeSaved[0]),
+    .arguments = argumentRegisters,
+    .argumentCount = ARGUMENT_REGISTERS
+  };
+  allocation = REGALLOC_allocate(fn, target);
+  // Only the locals still addressed need room in the frame, as promoted
+  // ones live in registers. Inline assembly may address any of them.
+  // Nested scopes also count the parameters when placing their locals,
+  // so the deepest slot is what decides.
+  arrsetlen(slotOffsets, arrlen(fn->slots));
+  bool* referenced = calloc(arrlen(fn->slots) + 1, sizeof(bool));
+  for (int k = 0; k < arrlen(fn->slots); k++) {
+    slotOffsets[k] = fn->slots[k].param || fn->slots[k].temporary ? 0 : getStackOffset(fn->slots[k].entry);
+  }
+  frameBase = 16;
+  homed = false;
+  bool hasAsm = false;
+  bool leaf = fn->kind == IR_FUNCTION_FN;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK block = fn->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      uint32_t size = 0;
+      IR_INST inst = block.insts[j];
+      // Parameters still addressed, and any inline assembly, expect the
+      // arguments above FP as if they had been passed on the stack
+      hasAsm |= inst.op == IR_ASM;
+      homed |= inst.op == IR_ASM;
+      homed |= inst.op == IR_SLOT && fn->slots[inst.imm].param;
+      leaf &= inst.op != IR_CALL && !(inst.op == IR_PARAM && inst.imm >= ARGUMENT_REGISTERS);
+      // Calling out to a block routine overwrites LR
+      leaf &= !((inst.op == IR_MEMCPY || inst.op == IR_MEMZERO) && inst.imm > BLOCK_INLINE_LIMIT);
+      if (block.insts[j].op == IR_ASM) {
+        size = 16 + fn->scope.tableAllocationSize;
+        for (int k = 0; k < arrlen(fn->slots); k++) {
+          if (slotOffsets[k] > size) {
+            size = slotOffsets[k];
+          }
+        }
+      } else if (block.insts[j].op == IR_SLOT) {
+        referenced[block.insts[j].imm] = true;
+        size = slotOffsets[block.insts[j].imm];
+      }
+      size = ((size + 15) >> 4) << 4;
+      frameBase = size > frameBase ? size : frameBase;
+    }
+  }
+  // Temporaries and locals of inlined functions have no place in this
+  // function's table, so they go below everything else
+  for (int k = 0; k < arrlen(fn->slots); k++) {
+    if (fn->slots[k].temporary && referenced[k]) {
+      frameBase += ((fn->slots[k].size + 7) >> 3) << 3;
+      slotOffsets[k] = frameBase;
+    }
+  }
+  frameBase = ((frameBase + 15) >> 4) << 4;
+  free(referenced);
+  frameSize = frameBase + (((allocation->slotCount * 8) + 15) >> 4 << 4);
+  frameSize += ((arrlen(allocation->saved) * 8) + 15) >> 4 << 4;
+  homed = homed && fn->paramCount > 0;
+  homeSize = homed ? 16 * fn->paramCount : 0;
+  framed = !leaf || homed || hasAsm;
+
+  // get scope name
+  if (fn->kind == IR_FUNCTION_ISR) {
+    snprintf(labelScope, sizeof(labelScope), "_fang_isr_%s", CHARS(fn->name));
+    snprintf(epilogueLabel, sizeof(epilogueLabel), "_fang_fn_ep_%s", CHARS(fn->name));
+  } else if (fn->module == EMPTY_STRING) {
+    snprintf(labelScope, sizeof(labelScope), "_fang_fn_%s", CHARS(fn->name));
+    snprintf(epilogueLabel, sizeof(epilogueLabel), "_fang_fn_ep_%s", CHARS(fn->name));
+  } else {
+    snprintf(labelScope, sizeof(labelScope), "_fang_%s_fn_%s", CHARS(fn->module), CHARS(fn->name));
+    snprintf(epilogueLabel, sizeof(epilogueLabel), "_fang_%s_fn_ep_%s", CHARS(fn->module), CHARS(fn->name));
+  }
+
+  BUFFER_printf(f, "\n.global %s\n", labelScope);
+  BUFFER_printf(f, "\n.balign 8\n");
+  BUFFER_printf(f, "\n%s:\n", labelScope);
+  if (homed) {
+    BUFFER_printf(f, "  SUB SP, SP, #%u\n", homeSize);
+    for (int i = 0; i < fn->paramCount; i++) {
+      if (i < ARGUMENT_REGISTERS) {
+        BUFFER_printf(f, "  STR %s, [SP, #%i]\n", xreg(i), 16 * i);
+      } else {
+        BUFFER_printf(f, "  LDR X16, [SP, #%i]\n", homeSize + 8 * (i - ARGUMENT_REGISTERS));
+        BUFFER_printf(f, "  STR X16, [SP, #%i]\n", 16 * i);
+      }
+    }
+  }
+  if (framed) {
+    BUFFER_printf(f, "  PUSH2 LR, FP\n"); // push LR onto stack
+    BUFFER_printf(f, "  MOV FP, SP\n"); // create stack frame
+  }
+  // Nothing goes in the 16 bytes below FP but what inline assembly puts there
+  uint32_t reserved = framed && (hasAsm || frameSize > 16) ? frameSize : frameSize - 16;
+  if (reserved > 0) {
+    genStackAdjust(f, "SUB", reserved); // stack is 16 byte aligned
+  }
+  genSavedRegisters(f, true);
+
+  uint32_t* useCounts = calloc(fn->vregCount + 1, sizeof(uint32_t));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      operands = IR_operands(&fn->blocks[i].insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        useCounts[*operands[k]]++;
+      }
+    }
+  }
+  arrfree(operands);
+  trackWidths(fn);
+  if (!homed) {
+    genParameters(f, fn, useCounts);
+  }
+
+  position = 0;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    if (i > 0) {
+      genBlockLabel(f, i);
+    }
+    IR_BLOCK block = fn->blocks[i];
+    for (int j = 0; j < arrlen(block.insts); j++) {
+      if (canFuse(block, j, useCounts)) {
+        fusedCompare = block.insts[j].dst;
+      }
+      if (canFold(block, j, useCounts)) {
+        foldedExtension = block.insts[j];
+      }
+      genInstruction(f, block.insts[j], i);
+      position++;
+    }
+  }
+
+  BUFFER_printf(f, "\n%s:\n", epilogueLabel);
+  genEpilogue(f);
+
+  for (int i = 0; i < arrlen(stubs); i++) {
+    BUFFER_printf(f, "L%s_%i_%i:\n", labelScope, stubs[i].from, stubs[i].to);
+    genReloads(f, stubs[i].from, stubs[i].to);
+    BUFFER_printf(f, "  B L%s_%i\n", labelScope, stubs[i].to);
+  }
+  arrfree(stubs);
+  arrfree(slotOffsets);
+  free(useCounts);
+  free(demands);
+  free(ranges);
+  REGALLOC_free(allocation);
+  allocation = NULL;
+  current = NULL;
 }
 
 void reportTypeTable(void) {
@@ -967,30 +1834,35 @@ void reportTypeTable(void) {
 }
 
 
-static void checkUnionTag(FILE* f, int base, TYPE_ID unionType, TYPE_ID candidate, int skipLabel) {
-  int size = getSize(unionType) - 1;
-  int offset = allocateRegister();
-  fprintf(f, "  LDRB %s, [%s, #%i]\n", storeRegList[offset], regList[base], size);
-  int tag = TYPE_getTag(unionType, candidate);
-
-  // TODO: assert on -1
-  fprintf(f, "  CMP %s, #%i\n", storeRegList[offset], tag);
-  fprintf(f, "  CSET %s, eq\n", storeRegList[offset]);
-  fprintf(f, "  TBZ %s, #0, %s\n", regList[offset], labelPrint(skipLabel));
-  freeRegister(offset);
+void beginSection(BUFFER* f, STR name, STR annotation) {
+  BUFFER_printf(f, "; SECTION (%s, %s)\n", CHARS(name), annotation == EMPTY_STRING ? "ROM0" : "ROM1");
 }
-static void setTag(FILE* f, int base, int tag, TYPE_ID unionType) {
-  int size = getSize(unionType) - 1;
-  int tagReg = genLoad(f, tag, U8_INDEX);
-  fprintf(f, "  STRB %s, [%s, #%i ]; set tag\n", storeRegList[tagReg], regList[base], size);
-  freeRegister(tagReg);
+void endSection(BUFFER* f) {
+  BUFFER_printf(f, "; END SECTION\n");
 }
 
-void beginSection(FILE* f, STR name, STR annotation) {
-  fprintf(f, "; SECTION (%s, %s)\n", CHARS(name), annotation == EMPTY_STRING ? "ROM0" : "ROM1");
+void init(void) {
 }
-void endSection(FILE* f) {
-  fprintf(f, "; END SECTION\n");
+static bool contains(BUFFER* f, const char* text) {
+  size_t length = strlen(text);
+  for (size_t i = 0; i + length <= f->length; i++) {
+    if (f->data[i] == text[0] && memcmp(f->data + i, text, length) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The block routines go last, and only when a function calls them. That
+// function may have come from the cache or a codegen worker, so the
+// finished text is what tells.
+void complete(BUFFER* f) {
+  if (contains(f, "BL _fang_copy\n")) {
+    genCopyRoutine(f);
+  }
+  if (contains(f, "BL _fang_zero\n")) {
+    genZeroRoutine(f);
+  }
 }
 
 PLATFORM platform_apple_arm64 = {
@@ -998,66 +1870,19 @@ PLATFORM platform_apple_arm64 = {
   .init = init,
   .complete = complete,
   .calculateSizes = calculateSizes,
-  .freeRegister = freeRegister,
-  .holdRegister = holdRegister,
-  .freeAllRegisters = freeAllRegisters,
+  .getSize = getSize,
+  .symbol = symbol,
+  .assemble = ASM_ARM64_assemble,
   .genPreamble = genPreamble,
   .genCompletePreamble = genCompletePreamble,
-  .genExit = genExit,
+  .genFunction = genFunction,
   .genRunMain = genRunMain,
   .genSimpleExit = genSimpleExit,
-  .genFunction = genFunction,
-  .genFunctionEpilogue = genFunctionEpilogue,
-  .genReturn = genReturn,
-  .genConstant = genConstant,
-  .genLoad = genLoad,
-  .genLoadRegister = genLoadRegister,
-  .genInitSymbol = genInitSymbol,
-  .genIdentifierAddr = genIdentifierAddr,
-  .genIdentifier = genIdentifier,
-  .genRaw = genRaw,
-  .genAssign = genAssign,
-  .genCopyObject = genCopyObject,
-  .genAdd = genAdd,
-  .genSub = genSub,
-  .genMul = genMul,
-  .genDiv = genDiv,
-  .genMod = genMod,
-  .genLogicalNot = genLogicalNot,
-  .genNeg = genNeg,
-  .genFunctionCall = genFunctionCall,
-  .genAllocStack = genAllocStack,
-  .labelCreate = labelCreate,
-  .genCmp = genCmp,
-  .genEqual = genEqual,
-  .genNotEqual = genNotEqual,
-  .genJump = genJump,
-  .genLabel = genLabel,
-  .genLessThan = genLessThan,
-  .genGreaterThan = genGreaterThan,
-  .genEqualLessThan = genEqualLessThan,
-  .genEqualGreaterThan = genEqualGreaterThan,
-  .genShiftLeft = genShiftLeft,
-  .genShiftRight = genShiftRight,
-  .genBitwiseAnd = genBitwiseAnd,
-  .genBitwiseOr = genBitwiseOr,
-  .genBitwiseXor = genBitwiseXor,
-  .genBitwiseNot = genBitwiseNot,
-  .genRef = genRef,
-  .genDeref = genDeref,
-  .genIndexAddr = genIndexAddr,
-  .genIndexRead = genIndexRead,
   .genGlobalVariable = genGlobalVariable,
   .genGlobalConstant = genGlobalConstant,
-  .genFieldOffset = genFieldOffset,
-  .getSize = getSize,
   .reportTypeTable = reportTypeTable,
   .beginSection = beginSection,
   .endSection = endSection,
-  .genIsr = genIsr,
-  .genIsrEpilogue = genIsrEpilogue,
-  .checkUnionTag = checkUnionTag,
-  .setTag = setTag
 };
 
 #undef emitf
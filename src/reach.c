@@ -0,0 +1,296 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "reach.h"
+#include "const_table.h"
+
+typedef struct DECL {
+  AST* ast;
+  STR symbol;
+  SYMBOL_TABLE_ENTRY entry;
+  bool live;
+} DECL;
+
+static PLATFORM p;
+static DECL* decls = NULL;
+static struct { STR key; int value; }* bySymbol = NULL;
+static struct { AST* key; int value; }* byNode = NULL;
+static int* worklist = NULL;
+static const char** asmTexts = NULL;
+static bool* liveStrings = NULL;
+static bool analyzed = false;
+
+void REACH_init(PLATFORM platform) {
+  p = platform;
+}
+
+static SYMBOL_TABLE_ENTRY entryOf(AST* decl) {
+  switch (decl->tag) {
+    case AST_FN:
+      {
+        SYMBOL_TABLE_SCOPE scope = SYMBOL_TABLE_getScope(decl->scopeIndex);
+        return SYMBOL_TABLE_get(scope.parent, decl->data.AST_FN.identifier);
+      }
+    case AST_VAR_DECL: return SYMBOL_TABLE_get(decl->scopeIndex, decl->data.AST_VAR_DECL.identifier);
+    case AST_VAR_INIT: return SYMBOL_TABLE_get(decl->scopeIndex, decl->data.AST_VAR_INIT.identifier);
+    case AST_CONST_DECL: return SYMBOL_TABLE_get(decl->scopeIndex, decl->data.AST_CONST_DECL.identifier);
+    default: return (SYMBOL_TABLE_ENTRY){ .mangledName = EMPTY_STRING };
+  }
+}
+
+void REACH_declare(AST* decl) {
+  DECL d = { decl, EMPTY_STRING, entryOf(decl), false };
+  if (d.entry.defined) {
+    d.symbol = STR_create(p.symbol(d.entry));
+    hmput(bySymbol, d.symbol, arrlen(decls));
+  }
+  hmput(byNode, decl, arrlen(decls));
+  arrput(decls, d);
+}
+
+static void mark(int index) {
+  if (!decls[index].live) {
+    decls[index].live = true;
+    arrput(worklist, index);
+  }
+}
+
+static void visit(AST* ptr);
+
+static void visitAll(AST** nodes) {
+  for (int i = 0; i < arrlen(nodes); i++) {
+    visit(nodes[i]);
+  }
+}
+
+static void visit(AST* ptr) {
+  if (ptr == NULL) {
+    return;
+  }
+  AST ast = *ptr;
+  switch (ast.tag) {
+    case AST_ASM:
+      {
+        // Assembly may name a symbol directly
+        struct AST_ASM data = ast.data.AST_ASM;
+        for (int i = 0; i < arrlen(data.strings); i++) {
+          arrput(asmTexts, CHARS(data.strings[i]));
+        }
+        break;
+      }
+    case AST_LITERAL:
+      {
+        struct AST_LITERAL data = ast.data.AST_LITERAL;
+        if (IS_STRING(data.value)) {
+          liveStrings[data.constantIndex] = true;
+        } else if (IS_PTR(data.value)) {
+          liveStrings[AS_PTR(data.value)] = true;
+        }
+        break;
+      }
+    case AST_IDENTIFIER:
+      {
+        STR identifier = ast.data.AST_IDENTIFIER.identifier;
+        SYMBOL_TABLE_ENTRY entry = SYMBOL_TABLE_get(ast.scopeIndex, identifier);
+        if (!entry.defined) {
+          entry = SYMBOL_TABLE_checkBanks(identifier);
+        }
+        bool global = entry.storageType == STORAGE_TYPE_GLOBAL || entry.storageType == STORAGE_TYPE_GLOBAL_OBJECT;
+        bool named = entry.entryType == SYMBOL_TYPE_FUNCTION || entry.entryType == SYMBOL_TYPE_VARIABLE || entry.entryType == SYMBOL_TYPE_CONSTANT;
+        if (entry.defined && global && named) {
+          STR symbol = STR_create(p.symbol(entry));
+          if (hmgeti(bySymbol, symbol) >= 0) {
+            mark(hmget(bySymbol, symbol));
+          }
+        }
+        break;
+      }
+    case AST_INITIALIZER: visitAll(ast.data.AST_INITIALIZER.assignments); break;
+    case AST_TYPE: visit(ast.data.AST_TYPE.type); break;
+    case AST_TYPE_ARRAY: visit(ast.data.AST_TYPE_ARRAY.length); visit(ast.data.AST_TYPE_ARRAY.subType); break;
+    case AST_TYPE_FN: visitAll(ast.data.AST_TYPE_FN.params); visit(ast.data.AST_TYPE_FN.returnType); break;
+    case AST_TYPE_PTR: visit(ast.data.AST_TYPE_PTR.subType); break;
+    case AST_REF: visit(ast.data.AST_REF.expr); break;
+    case AST_DEREF: visit(ast.data.AST_DEREF.expr); break;
+    case AST_UNARY: visit(ast.data.AST_UNARY.expr); break;
+    case AST_BINARY: visit(ast.data.AST_BINARY.left); visit(ast.data.AST_BINARY.right); break;
+    case AST_DOT: visit(ast.data.AST_DOT.left); break;
+    case AST_MATCH:
+      {
+        struct AST_MATCH data = ast.data.AST_MATCH;
+        visitAll(data.identifiers);
+        visitAll(data.clauses);
+        visit(data.elseClause);
+        break;
+      }
+    case AST_MATCH_CLAUSE: visit(ast.data.AST_MATCH_CLAUSE.body); break;
+    case AST_IF:
+      {
+        struct AST_IF data = ast.data.AST_IF;
+        visit(data.condition);
+        visit(data.body);
+        visit(data.elseClause);
+        break;
+      }
+    case AST_WHILE: visit(ast.data.AST_WHILE.condition); visit(ast.data.AST_WHILE.body); break;
+    case AST_DO_WHILE: visit(ast.data.AST_DO_WHILE.condition); visit(ast.data.AST_DO_WHILE.body); break;
+    case AST_FOR:
+      {
+        struct AST_FOR data = ast.data.AST_FOR;
+        visit(data.initializer);
+        visit(data.condition);
+        visit(data.increment);
+        visit(data.body);
+        break;
+      }
+    case AST_CALL: visit(ast.data.AST_CALL.identifier); visitAll(ast.data.AST_CALL.arguments); break;
+    case AST_SUBSCRIPT: visit(ast.data.AST_SUBSCRIPT.left); visit(ast.data.AST_SUBSCRIPT.index); break;
+    case AST_CAST: visit(ast.data.AST_CAST.expr); visit(ast.data.AST_CAST.type); break;
+    case AST_RETURN: visit(ast.data.AST_RETURN.value); break;
+    case AST_PARAM: visit(ast.data.AST_PARAM.value); break;
+    case AST_ASSIGNMENT: visit(ast.data.AST_ASSIGNMENT.lvalue); visit(ast.data.AST_ASSIGNMENT.expr); break;
+    case AST_VAR_DECL: visit(ast.data.AST_VAR_DECL.type); break;
+    case AST_VAR_INIT: visit(ast.data.AST_VAR_INIT.type); visit(ast.data.AST_VAR_INIT.expr); break;
+    case AST_CONST_DECL: visit(ast.data.AST_CONST_DECL.type); visit(ast.data.AST_CONST_DECL.expr); break;
+    case AST_FN:
+      {
+        struct AST_FN data = ast.data.AST_FN;
+        visitAll(data.params);
+        visit(data.returnType);
+        visit(data.body);
+        break;
+      }
+    case AST_ISR: visit(ast.data.AST_ISR.body); break;
+    case AST_BLOCK: visitAll(ast.data.AST_BLOCK.decls); break;
+    default: break;
+  }
+}
+
+static bool isRoot(AST* decl) {
+  if (decl->tag == AST_ISR) {
+    return true;
+  }
+  if (decl->tag != AST_FN) {
+    return false;
+  }
+  struct AST_FN data = decl->data.AST_FN;
+  if (strcmp(CHARS(data.identifier), "main") == 0) {
+    return true;
+  }
+  return data.annotation != EMPTY_STRING && strcmp(CHARS(data.annotation), "export") == 0;
+}
+
+void REACH_analyze(void) {
+  bool hasMain = false;
+  for (int i = 0; i < arrlen(decls); i++) {
+    AST* decl = decls[i].ast;
+    hasMain |= decl->tag == AST_FN && strcmp(CHARS(decl->data.AST_FN.identifier), "main") == 0;
+  }
+  // Without an entry point, any of it may be used from elsewhere
+  if (!hasMain) {
+    return;
+  }
+  analyzed = true;
+  liveStrings = calloc(arrlen(constTable) + 1, sizeof(bool));
+  for (int i = 0; i < arrlen(decls); i++) {
+    if (isRoot(decls[i].ast)) {
+      mark(i);
+    }
+  }
+  while (arrlen(worklist) > 0) {
+    while (arrlen(worklist) > 0) {
+      visit(decls[arrpop(worklist)].ast);
+    }
+    for (int i = 0; i < arrlen(decls); i++) {
+      if (decls[i].live || decls[i].symbol == EMPTY_STRING) {
+        continue;
+      }
+      for (int j = 0; j < arrlen(asmTexts); j++) {
+        if (strstr(asmTexts[j], CHARS(decls[i].symbol)) != NULL) {
+          mark(i);
+          break;
+        }
+      }
+    }
+  }
+  for (int i = 0; i < arrlen(constTable); i++) {
+    constTable[i].unused = IS_STRING(constTable[i].value) && !liveStrings[i];
+  }
+}
+
+bool REACH_isLive(AST* decl) {
+  if (!analyzed || hmgeti(byNode, decl) < 0) {
+    return true;
+  }
+  return decls[hmget(byNode, decl)].live;
+}
+
+void REACH_report(void) {
+  if (!analyzed) {
+    printf("Nothing dropped: the program has no main function.\n");
+    return;
+  }
+  printf("-------- DROPPED DECLARATIONS -----------\n");
+  for (int i = 0; i < arrlen(decls); i++) {
+    DECL decl = decls[i];
+    if (decl.live || !decl.entry.defined) {
+      continue;
+    }
+    const char* kind = "var";
+    if (decl.ast->tag == AST_FN) {
+      kind = "fn";
+    } else if (decl.ast->tag == AST_CONST_DECL) {
+      kind = "const";
+    }
+    STR module = SYMBOL_TABLE_getScope(decl.entry.scopeIndex).moduleName;
+    if (module != EMPTY_STRING) {
+      printf("%s %s::%s\n", kind, CHARS(module), CHARS(decl.entry.key));
+    } else {
+      printf("%s %s\n", kind, CHARS(decl.entry.key));
+    }
+  }
+  for (int i = 0; i < arrlen(constTable); i++) {
+    if (constTable[i].unused) {
+      printf("string \"%s\"\n", CHARS(AS_STRING(constTable[i].value)));
+    }
+  }
+  printf("-----------------------------------------\n");
+}
+
+void REACH_free(void) {
+  arrfree(decls);
+  hmfree(bySymbol);
+  hmfree(byNode);
+  arrfree(worklist);
+  arrfree(asmTexts);
+  free(liveStrings);
+  liveStrings = NULL;
+  analyzed = false;
+}
@@ -0,0 +1,47 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef reach_h
+#define reach_h
+
+#include "common.h"
+#include "ast.h"
+#include "platform.h"
+
+// Whole-program reachability over the top-level declarations. Starting
+// from main, interrupt routines and fn<export> functions, anything named
+// by reachable code is reachable too, including functions whose address
+// is only taken. Declarations never reached, and string literals they
+// alone use, are left out of the output.
+void REACH_init(PLATFORM platform);
+void REACH_declare(AST* decl);
+void REACH_analyze(void);
+bool REACH_isLive(AST* decl);
+// Lists what was dropped
+void REACH_report(void);
+void REACH_free(void);
+
+#endif
@@ -0,0 +1,618 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "regalloc.h"
+
+#define MAX_REGISTERS 32
+// Loops deeper than this are not weighted any further
+#define MAX_DEPTH 6
+
+// The live range of a value, from its first to its last live position,
+// with the positions it is read or written at and how often each runs
+typedef struct INTERVAL {
+  IR_VREG vreg;
+  uint32_t start;
+  uint32_t end;
+  bool crossesCall;
+  uint32_t* refs;
+  uint64_t* weights;
+  // Registers this one is copied to or from
+  IR_VREG* partners;
+} INTERVAL;
+
+static INTERVAL* intervals = NULL;
+static REGALLOC_LOCATION* locations = NULL;
+
+static bool isLive(uint64_t* set, IR_VREG v) {
+  return (set[v >> 6] >> (v & 63)) & 1;
+}
+
+static void setLive(uint64_t* set, IR_VREG v) {
+  set[v >> 6] |= 1ULL << (v & 63);
+}
+
+static void extend(IR_VREG v, uint32_t position) {
+  INTERVAL* interval = &intervals[v];
+  if (position < interval->start) {
+    interval->start = position;
+  }
+  if (position > interval->end) {
+    interval->end = position;
+  }
+}
+
+static void reference(IR_VREG v, uint32_t position, uint64_t weight) {
+  extend(v, position);
+  arrput(intervals[v].refs, position);
+  arrput(intervals[v].weights, weight);
+}
+
+// Cost of keeping the value out of a register from position onwards.
+// Recomputing a constant is cheaper than a load, and needs no store.
+static uint64_t spillCost(IR_VREG v, uint32_t position) {
+  INTERVAL* interval = &intervals[v];
+  uint64_t cost = 0;
+  for (int i = 0; i < arrlen(interval->refs); i++) {
+    if (interval->refs[i] >= position) {
+      cost += interval->weights[i];
+    }
+  }
+  return locations[v].remat ? cost : cost * 2;
+}
+
+static int compareStart(const void* a, const void* b) {
+  const INTERVAL* x = &intervals[*(const IR_VREG*)a];
+  const INTERVAL* y = &intervals[*(const IR_VREG*)b];
+  if (x->start != y->start) {
+    return x->start < y->start ? -1 : 1;
+  }
+  return x->vreg < y->vreg ? -1 : (x->vreg > y->vreg);
+}
+
+static bool inPool(const int* pool, int count, int reg) {
+  for (int i = 0; i < count; i++) {
+    if (pool[i] == reg) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Numbers the instructions and computes which registers are live into
+// each block
+static void computeLiveness(IR_FUNCTION* fn, REGALLOC* ra, uint64_t** liveOut, size_t words) {
+  int count = arrlen(fn->blocks);
+  uint64_t** uses = calloc(count, sizeof(uint64_t*));
+  uint64_t** defs = calloc(count, sizeof(uint64_t*));
+  IR_VREG** operands = NULL;
+  uint32_t n = 0;
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    uses[i] = calloc(words, sizeof(uint64_t));
+    defs[i] = calloc(words, sizeof(uint64_t));
+    arrput(ra->blockStart, n);
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        if (!isLive(defs[i], *operands[k])) {
+          setLive(uses[i], *operands[k]);
+        }
+      }
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        setLive(defs[i], inst->dst);
+      }
+      n++;
+    }
+    arrput(ra->blockEnd, n - 1);
+  }
+  arrfree(operands);
+
+  for (int i = 0; i < count; i++) {
+    arrput(ra->liveIn, calloc(words, sizeof(uint64_t)));
+  }
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = count - 1; i >= 0; i--) {
+      int successors[2];
+      int successorCount = IR_successors(&fn->blocks[i], successors);
+      for (int k = 0; k < successorCount; k++) {
+        for (size_t w = 0; w < words; w++) {
+          liveOut[i][w] |= ra->liveIn[successors[k]][w];
+        }
+      }
+      for (size_t w = 0; w < words; w++) {
+        uint64_t in = uses[i][w] | (liveOut[i][w] & ~defs[i][w]);
+        if (in != ra->liveIn[i][w]) {
+          ra->liveIn[i][w] = in;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    free(uses[i]);
+    free(defs[i]);
+  }
+  free(uses);
+  free(defs);
+}
+
+// Blocks inside a back edge, in block order, are treated as a loop body
+static int* computeDepths(IR_FUNCTION* fn) {
+  int count = arrlen(fn->blocks);
+  int* depth = NULL;
+  arrsetlen(depth, count);
+  for (int i = 0; i < count; i++) {
+    depth[i] = 0;
+  }
+  for (int i = 0; i < count; i++) {
+    int successors[2];
+    int successorCount = IR_successors(&fn->blocks[i], successors);
+    for (int k = 0; k < successorCount; k++) {
+      for (int b = successors[k]; b <= i; b++) {
+        depth[b]++;
+      }
+    }
+  }
+  return depth;
+}
+
+static uint64_t** newSets(int count, size_t words) {
+  uint64_t** sets = calloc(count, sizeof(uint64_t*));
+  for (int i = 0; i < count; i++) {
+    sets[i] = calloc(words, sizeof(uint64_t));
+  }
+  return sets;
+}
+
+static void freeSets(uint64_t** sets, int count) {
+  for (int i = 0; i < count; i++) {
+    free(sets[i]);
+  }
+  free(sets);
+}
+
+static void freeLiveness(REGALLOC* ra) {
+  for (int i = 0; i < arrlen(ra->liveIn); i++) {
+    free(ra->liveIn[i]);
+  }
+  arrfree(ra->liveIn);
+  arrfree(ra->blockStart);
+  arrfree(ra->blockEnd);
+}
+
+typedef struct COPY {
+  IR_INST* inst;
+  uint64_t weight;
+} COPY;
+
+static int compareWeight(const void* a, const void* b) {
+  const COPY* x = a;
+  const COPY* y = b;
+  if (x->weight != y->weight) {
+    return x->weight > y->weight ? -1 : 1;
+  }
+  return x->inst < y->inst ? -1 : (x->inst > y->inst);
+}
+
+static IR_VREG find(IR_VREG* parent, IR_VREG v) {
+  while (parent[v] != v) {
+    parent[v] = parent[parent[v]];
+    v = parent[v];
+  }
+  return parent[v];
+}
+
+static uint64_t pairKey(IR_VREG a, IR_VREG b) {
+  return a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+}
+
+// Renames the two sides of a copy to the same register whenever they are
+// never live at the same time, and drops the copy. Phi copies left by
+// SSA destruction mostly disappear this way, so a promoted local keeps
+// one register across the loop that updates it.
+static void coalesce(IR_FUNCTION* fn) {
+  uint32_t vregs = fn->vregCount + 1;
+  size_t words = (vregs + 63) / 64;
+  int blockCount = arrlen(fn->blocks);
+  int* depth = computeDepths(fn);
+  COPY* copies = NULL;
+  bool* candidate = calloc(vregs, sizeof(bool));
+  IR_VREG* candidates = NULL;
+  for (int i = 0; i < blockCount; i++) {
+    uint64_t weight = 1;
+    for (int d = 0; d < depth[i] && d < MAX_DEPTH; d++) {
+      weight *= 10;
+    }
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (inst->op != IR_COPY || inst->dst == inst->a) {
+        continue;
+      }
+      arrput(copies, ((COPY){ inst, weight }));
+      IR_VREG sides[2] = { inst->dst, inst->a };
+      for (int k = 0; k < 2; k++) {
+        if (!candidate[sides[k]]) {
+          candidate[sides[k]] = true;
+          arrput(candidates, sides[k]);
+        }
+      }
+    }
+  }
+  arrfree(depth);
+  if (arrlen(copies) == 0) {
+    free(candidate);
+    return;
+  }
+
+  // Two candidates interfere when one is defined while the other is
+  // live, unless the definition is a copy of the other
+  REGALLOC liveness = { 0 };
+  uint64_t** liveOut = newSets(blockCount, words);
+  computeLiveness(fn, &liveness, liveOut, words);
+  struct { uint64_t key; bool value; }* interferes = NULL;
+  uint64_t* live = calloc(words, sizeof(uint64_t));
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < blockCount; i++) {
+    memcpy(live, liveOut[i], words * sizeof(uint64_t));
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = arrlen(block->insts) - 1; j >= 0; j--) {
+      IR_INST* inst = &block->insts[j];
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        if (candidate[inst->dst]) {
+          for (int k = 0; k < arrlen(candidates); k++) {
+            IR_VREG other = candidates[k];
+            if (other != inst->dst && isLive(live, other) && !(inst->op == IR_COPY && inst->a == other)) {
+              hmput(interferes, pairKey(inst->dst, other), true);
+            }
+          }
+        }
+        live[inst->dst >> 6] &= ~(1ULL << (inst->dst & 63));
+      }
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        setLive(live, *operands[k]);
+      }
+    }
+  }
+  free(live);
+  freeSets(liveOut, blockCount);
+  freeLiveness(&liveness);
+
+  // Merge the most frequently run copies first
+  qsort(copies, arrlen(copies), sizeof(COPY), compareWeight);
+  IR_VREG* parent = calloc(vregs, sizeof(IR_VREG));
+  IR_VREG** members = calloc(vregs, sizeof(IR_VREG*));
+  for (IR_VREG v = 0; v < vregs; v++) {
+    parent[v] = v;
+  }
+  for (int k = 0; k < arrlen(candidates); k++) {
+    arrput(members[candidates[k]], candidates[k]);
+  }
+  for (int c = 0; c < arrlen(copies); c++) {
+    IR_VREG x = find(parent, copies[c].inst->dst);
+    IR_VREG y = find(parent, copies[c].inst->a);
+    if (x == y) {
+      continue;
+    }
+    bool conflict = false;
+    for (int i = 0; i < arrlen(members[x]) && !conflict; i++) {
+      for (int j = 0; j < arrlen(members[y]) && !conflict; j++) {
+        conflict = hmgeti(interferes, pairKey(members[x][i], members[y][j])) >= 0;
+      }
+    }
+    if (conflict) {
+      continue;
+    }
+    parent[y] = x;
+    for (int j = 0; j < arrlen(members[y]); j++) {
+      arrput(members[x], members[y][j]);
+    }
+    arrfree(members[y]);
+  }
+
+  for (int i = 0; i < blockCount; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        *operands[k] = find(parent, *operands[k]);
+      }
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        inst->dst = find(parent, inst->dst);
+      }
+      if (inst->op == IR_COPY && inst->dst == inst->a) {
+        inst->op = IR_NOP;
+      }
+    }
+  }
+  IR_removeNops(fn);
+
+  for (IR_VREG v = 0; v < vregs; v++) {
+    arrfree(members[v]);
+  }
+  free(members);
+  free(parent);
+  free(candidate);
+  arrfree(candidates);
+  arrfree(copies);
+  arrfree(operands);
+  hmfree(interferes);
+}
+
+REGALLOC* REGALLOC_allocate(IR_FUNCTION* fn, REGALLOC_TARGET target) {
+  REGALLOC* ra = calloc(1, sizeof(REGALLOC));
+  ra->vregCount = fn->vregCount;
+  uint32_t vregs = fn->vregCount + 1;
+  size_t words = (vregs + 63) / 64;
+  int blockCount = arrlen(fn->blocks);
+
+  coalesce(fn);
+  uint64_t** liveOut = newSets(blockCount, words);
+  computeLiveness(fn, ra, liveOut, words);
+  int* depth = computeDepths(fn);
+
+  intervals = calloc(vregs, sizeof(INTERVAL));
+  locations = calloc(vregs, sizeof(REGALLOC_LOCATION));
+  int* defCount = calloc(vregs, sizeof(int));
+  // The register a value arrives in or has to be passed in, if any
+  int* hints = malloc(vregs * sizeof(int));
+  for (IR_VREG v = 0; v < vregs; v++) {
+    intervals[v].vreg = v;
+    intervals[v].start = UINT32_MAX;
+    locations[v] = (REGALLOC_LOCATION){ .reg = -1, .split = REGALLOC_NEVER, .slot = -1 };
+    hints[v] = -1;
+  }
+
+  // Build the intervals
+  uint32_t* calls = NULL;
+  bool hasAsm = false;
+  IR_VREG** operands = NULL;
+  uint32_t n = 0;
+  for (int i = 0; i < blockCount; i++) {
+    uint32_t start = 2 * ra->blockStart[i];
+    uint32_t end = 2 * ra->blockEnd[i] + 1;
+    for (IR_VREG v = 1; v < vregs; v++) {
+      if (isLive(ra->liveIn[i], v)) {
+        extend(v, start);
+      }
+      if (isLive(liveOut[i], v)) {
+        extend(v, end);
+      }
+    }
+    uint64_t weight = 1;
+    for (int d = 0; d < depth[i] && d < MAX_DEPTH; d++) {
+      weight *= 10;
+    }
+    IR_BLOCK* block = &fn->blocks[i];
+    for (int j = 0; j < arrlen(block->insts); j++, n++) {
+      IR_INST* inst = &block->insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        reference(*operands[k], 2 * n, weight);
+      }
+      if (IR_hasDestination(inst->op) && inst->dst != IR_NONE) {
+        reference(inst->dst, 2 * n + 1, weight);
+        defCount[inst->dst]++;
+        locations[inst->dst].def = *inst;
+      }
+      if (inst->op == IR_COPY) {
+        arrput(intervals[inst->dst].partners, inst->a);
+        arrput(intervals[inst->a].partners, inst->dst);
+      } else if (inst->op == IR_PARAM && inst->imm < target.argumentCount) {
+        hints[inst->dst] = target.arguments[inst->imm];
+      } else if (inst->op == IR_CALL) {
+        arrput(calls, 2 * n);
+        // Calls with imm set take their arguments on the stack. Results
+        // come back in the first argument register.
+        for (int k = 0; k < arrlen(inst->args) && k < target.argumentCount && !inst->imm; k++) {
+          if (hints[inst->args[k]] < 0) {
+            hints[inst->args[k]] = target.arguments[k];
+          }
+        }
+        if (inst->dst != IR_NONE) {
+          hints[inst->dst] = target.arguments[0];
+        }
+      } else if (inst->op == IR_RETURN && inst->a != IR_NONE) {
+        hints[inst->a] = target.arguments[0];
+      } else if (inst->op == IR_ASM) {
+        hasAsm = true;
+      }
+    }
+  }
+  arrfree(operands);
+
+  IR_VREG* order = NULL;
+  for (IR_VREG v = 1; v < vregs; v++) {
+    INTERVAL* interval = &intervals[v];
+    if (interval->start == UINT32_MAX) {
+      continue;
+    }
+    IR_OP op = locations[v].def.op;
+    locations[v].remat = defCount[v] == 1 && (op == IR_CONST || op == IR_STRING || op == IR_GLOBAL || op == IR_SLOT);
+    // Calls are sorted, so look for the first at or after the start
+    int low = 0;
+    int high = arrlen(calls);
+    while (low < high) {
+      int mid = (low + high) / 2;
+      if (calls[mid] < interval->start) {
+        low = mid + 1;
+      } else {
+        high = mid;
+      }
+    }
+    interval->crossesCall = low < arrlen(calls) && calls[low] < interval->end;
+    arrput(order, v);
+  }
+  qsort(order, arrlen(order), sizeof(IR_VREG), compareStart);
+
+  // Inline assembly may use any register, so functions containing it keep
+  // every value in the frame
+  int owner[MAX_REGISTERS];
+  bool used[MAX_REGISTERS];
+  for (int r = 0; r < MAX_REGISTERS; r++) {
+    owner[r] = IR_NONE;
+    used[r] = false;
+  }
+  IR_VREG* active = NULL;
+  for (int i = 0; i < arrlen(order) && !hasAsm; i++) {
+    IR_VREG v = order[i];
+    INTERVAL* current = &intervals[v];
+    for (int k = arrlen(active) - 1; k >= 0; k--) {
+      if (intervals[active[k]].end < current->start) {
+        owner[locations[active[k]].reg] = IR_NONE;
+        arrdelswap(active, k);
+      }
+    }
+
+    // Values which can be recomputed are never worth saving and
+    // restoring a callee-saved register for
+    int pool[MAX_REGISTERS];
+    int poolCount = 0;
+    if (!current->crossesCall && fn->kind != IR_FUNCTION_ISR) {
+      for (int r = 0; r < target.callerSavedCount; r++) {
+        pool[poolCount++] = target.callerSaved[r];
+      }
+    }
+    for (int r = 0; r < target.calleeSavedCount && !locations[v].remat; r++) {
+      pool[poolCount++] = target.calleeSaved[r];
+    }
+
+    int reg = -1;
+    if (hints[v] >= 0 && owner[hints[v]] == IR_NONE && inPool(pool, poolCount, hints[v])) {
+      reg = hints[v];
+    }
+    for (int k = 0; k < arrlen(current->partners) && reg < 0; k++) {
+      int hint = locations[current->partners[k]].reg;
+      if (hint >= 0 && owner[hint] == IR_NONE && inPool(pool, poolCount, hint)) {
+        reg = hint;
+      }
+    }
+    for (int k = 0; k < poolCount && reg < 0; k++) {
+      if (owner[pool[k]] == IR_NONE) {
+        reg = pool[k];
+      }
+    }
+    if (reg < 0) {
+      // Evict whichever value is cheapest to do without from here on,
+      // splitting it so the part already allocated keeps its register
+      int victim = -1;
+      uint64_t victimCost = 0;
+      for (int k = 0; k < arrlen(active); k++) {
+        IR_VREG other = active[k];
+        if (!inPool(pool, poolCount, locations[other].reg)) {
+          continue;
+        }
+        uint64_t cost = spillCost(other, current->start);
+        if (victim < 0 || cost < victimCost) {
+          victim = k;
+          victimCost = cost;
+        }
+      }
+      if (victim < 0 || spillCost(v, current->start) <= victimCost) {
+        continue;
+      }
+      IR_VREG other = active[victim];
+      reg = locations[other].reg;
+      locations[other].split = current->start;
+      if (intervals[other].start >= current->start) {
+        locations[other].reg = -1;
+      }
+      arrdelswap(active, victim);
+    }
+    locations[v].reg = reg;
+    owner[reg] = v;
+    used[reg] = true;
+    arrput(active, v);
+  }
+
+  for (IR_VREG v = 1; v < vregs; v++) {
+    REGALLOC_LOCATION* location = &locations[v];
+    if (intervals[v].start != UINT32_MAX && !location->remat && (location->reg < 0 || location->split != REGALLOC_NEVER)) {
+      location->slot = ra->slotCount++;
+    }
+  }
+  for (int r = 0; r < MAX_REGISTERS; r++) {
+    if (used[r] && inPool(target.calleeSaved, target.calleeSavedCount, r)) {
+      arrput(ra->saved, r);
+    }
+  }
+  ra->locations = locations;
+
+  for (IR_VREG v = 0; v < vregs; v++) {
+    arrfree(intervals[v].refs);
+    arrfree(intervals[v].weights);
+    arrfree(intervals[v].partners);
+  }
+  free(intervals);
+  intervals = NULL;
+  locations = NULL;
+  freeSets(liveOut, blockCount);
+  free(defCount);
+  free(hints);
+  arrfree(depth);
+  arrfree(calls);
+  arrfree(order);
+  arrfree(active);
+  return ra;
+}
+
+void REGALLOC_free(REGALLOC* ra) {
+  freeLiveness(ra);
+  arrfree(ra->saved);
+  free(ra->locations);
+  free(ra);
+}
+
+int REGALLOC_registerAt(REGALLOC* ra, IR_VREG v, uint32_t position) {
+  REGALLOC_LOCATION location = ra->locations[v];
+  if (location.reg >= 0 && position < location.split) {
+    return location.reg;
+  }
+  return -1;
+}
+
+IR_VREG* REGALLOC_reloads(REGALLOC* ra, int from, int to) {
+  IR_VREG* reloads = NULL;
+  uint32_t leave = 2 * ra->blockEnd[from] + 1;
+  uint32_t enter = 2 * ra->blockStart[to];
+  for (IR_VREG v = 1; v <= ra->vregCount; v++) {
+    REGALLOC_LOCATION location = ra->locations[v];
+    if (location.reg >= 0 && location.split <= leave && location.split > enter && isLive(ra->liveIn[to], v)) {
+      arrput(reloads, v);
+    }
+  }
+  return reloads;
+}
@@ -0,0 +1,92 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef regalloc_h
+#define regalloc_h
+
+#include "common.h"
+#include "ir.h"
+
+// Linear scan register allocation over the IR of one function. Copies
+// between values which are never live together are coalesced first,
+// which rewrites the function.
+//
+// Instructions are numbered in block order, and instruction n reads its
+// operands at position 2n and writes its result at 2n + 1, so a result
+// may share the register of an operand which dies in the same
+// instruction. The backend walks the function in the same order.
+
+#define REGALLOC_NEVER UINT32_MAX
+
+typedef struct REGALLOC_LOCATION {
+  // Register holding the value before position split, or -1
+  int reg;
+  uint32_t split;
+  // Frame slot holding the value once it is out of its register, or -1.
+  // Every definition of a value with a slot stores to it.
+  int slot;
+  // Values defined once by a constant or address are recomputed at each
+  // use instead of being kept in a slot
+  bool remat;
+  IR_INST def;
+} REGALLOC_LOCATION;
+
+typedef struct REGALLOC {
+  REGALLOC_LOCATION* locations;
+  uint32_t slotCount;
+  // Callee-saved registers which were handed out, in ascending order
+  int* saved;
+
+  uint32_t vregCount;
+  uint32_t* blockStart;
+  uint32_t* blockEnd;
+  uint64_t** liveIn;
+} REGALLOC;
+
+// Registers the target makes available. Values live across a call, or
+// anything in an interrupt handler, only get callee-saved registers.
+typedef struct REGALLOC_TARGET {
+  const int* callerSaved;
+  int callerSavedCount;
+  const int* calleeSaved;
+  int calleeSavedCount;
+  // Registers the arguments arrive in and are passed in, which the
+  // parameters and arguments prefer. Results use the first.
+  const int* arguments;
+  int argumentCount;
+} REGALLOC_TARGET;
+
+REGALLOC* REGALLOC_allocate(IR_FUNCTION* fn, REGALLOC_TARGET target);
+void REGALLOC_free(REGALLOC* ra);
+
+// The register holding v when read or written at position, or -1
+int REGALLOC_registerAt(REGALLOC* ra, IR_VREG v, uint32_t position);
+// Values which have to be reloaded into their register on the edge from
+// one block to another, because a split moved them out of it on the way.
+// The caller frees the array.
+IR_VREG* REGALLOC_reloads(REGALLOC* ra, int from, int to);
+
+#endif
@@ -700,6 +700,7 @@ static bool traverse(AST* ptr) {
         ptr->type = leftType;
         if (ptr->scopeIndex <= 1 || ast.tag == AST_CONST_DECL) {
           SYMBOL_TABLE_define(identifier, SYMBOL_TYPE_CONSTANT, leftType, storageType);
+          SYMBOL_TABLE_setConstant(identifier, data.expr);
         } else {
           SYMBOL_TABLE_define(identifier, SYMBOL_TYPE_VARIABLE, leftType, storageType);
         }
@@ -806,7 +807,8 @@ static bool traverse(AST* ptr) {
           uint32_t index = TYPE_get(ast.type).fields[i].typeIndex;
           SYMBOL_TABLE_define(paramName, SYMBOL_TYPE_PARAMETER, index, STORAGE_TYPE_PARAMETER);
         }
-        PUSH(typeStack, TYPE_get(ast.type).fields[0].typeIndex);
+        TYPE_ENTRY fnType = TYPE_get(ast.type);
+        PUSH(typeStack, fnType.fields[arrlen(fnType.fields) - 1].typeIndex);
         functionScope = true;
         r &= traverse(data.body);
         functionScope = false;
@@ -1254,8 +1256,11 @@ static bool traverse(AST* ptr) {
           printf("trap %d\n", __LINE__);
           return false;
         }
+        // The index is read even when the element is assigned to
         PUSH(assignStack, false);
+        PUSH(evaluateStack, true);
         r &= traverse(data.index);
+        POP(evaluateStack);
         POP(assignStack);
         if (!r || !isNumeric(data.index->type)) {
           printf("trap %d\n", __LINE__);
@@ -1323,7 +1328,7 @@ static bool traverse(AST* ptr) {
           }
           data.arguments[i]->type = fnType.fields[i].typeIndex;
         }
-        ptr->type = TYPE_get(leftType).fields[0].typeIndex;
+        ptr->type = fnType.fields[arrlen(fnType.fields) - 1].typeIndex;
         return true;
       }
     default:
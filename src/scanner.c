@@ -63,6 +63,24 @@ bool SCANNER_addFile(const char* path) {
   return true;
 }
 
+// Writes a make rule naming every file the program was read from, plus an
+// empty rule for each import so a deleted module doesn't break the build.
+bool SCANNER_writeDependencies(const char* path, const char* target) {
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    return false;
+  }
+  fprintf(file, "%s:", target);
+  for (int i = 0; i < arrlen(scanner.sources); i++) {
+    fprintf(file, " %s", scanner.sources[i].name);
+  }
+  fprintf(file, "\n");
+  for (int i = 1; i < arrlen(scanner.sources); i++) {
+    fprintf(file, "\n%s:\n", scanner.sources[i].name);
+  }
+  return fclose(file) == 0;
+}
+
 static bool isAlpha(char c) {
   return (c >= 'a' && c <= 'z') ||
          (c >= 'A' && c <= 'Z') ||
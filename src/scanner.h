@@ -78,6 +78,7 @@ void initScanner(const SourceFile* sources);
 Token scanToken();
 const char* getTokenTypeName(TokenType name);
 bool SCANNER_addFile(const char* path);
+bool SCANNER_writeDependencies(const char* path, const char* target);
 
 
 #endif
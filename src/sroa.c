@@ -0,0 +1,226 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "sroa.h"
+
+// A part of a slot which is accessed as a whole, and the slot replacing it
+typedef struct PIECE {
+  int slot;
+  int64_t offset;
+  IR_TYPE type;
+  int replacement;
+} PIECE;
+
+static IR_FUNCTION* fn = NULL;
+// Per register: how often it is defined, and any constant it holds
+static int* definitions = NULL;
+static bool* isConstant = NULL;
+static int64_t* constants = NULL;
+// Per register: the slot it points into, or -1, and how far in
+static int* baseSlot = NULL;
+static int64_t* offsets = NULL;
+// Per slot
+static bool* candidate = NULL;
+static bool* escapes = NULL;
+static PIECE* pieces = NULL;
+
+static bool derive(IR_VREG dst, int slot, int64_t offset) {
+  if (definitions[dst] != 1) {
+    escapes[slot] = true;
+    return false;
+  }
+  if (baseSlot[dst] >= 0) {
+    return false;
+  }
+  baseSlot[dst] = slot;
+  offsets[dst] = offset;
+  return true;
+}
+
+// Whether inst computes an address within a slot from another one
+static bool isDerivation(IR_INST* inst) {
+  return inst->op == IR_SLOT
+    || (inst->op == IR_ADD && baseSlot[inst->a] >= 0 && isConstant[inst->b])
+    || (inst->op == IR_COPY && baseSlot[inst->a] >= 0);
+}
+
+static int findPiece(int slot, int64_t offset, IR_TYPE type) {
+  for (int i = 0; i < arrlen(pieces); i++) {
+    if (pieces[i].slot == slot && pieces[i].offset == offset && pieces[i].type == type) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void findAddresses(void) {
+  // Blocks need not come in the order their registers are defined
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+        IR_INST* inst = &fn->blocks[i].insts[j];
+        if (inst->op == IR_SLOT && candidate[inst->imm]) {
+          changed |= derive(inst->dst, inst->imm, 0);
+        } else if (inst->op != IR_SLOT && isDerivation(inst)) {
+          int64_t offset = offsets[inst->a] + (inst->op == IR_ADD ? constants[inst->b] : 0);
+          changed |= derive(inst->dst, baseSlot[inst->a], offset);
+        }
+      }
+    }
+  }
+}
+
+static void findPieces(void) {
+  IR_VREG** operands = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        IR_VREG v = *operands[k];
+        int slot = baseSlot[v];
+        if (slot < 0) {
+          continue;
+        }
+        bool isAddress = (inst->op == IR_LOAD || inst->op == IR_STORE) && operands[k] == &inst->a;
+        if (isAddress) {
+          if (findPiece(slot, offsets[v], inst->type) < 0) {
+            arrput(pieces, ((PIECE){ slot, offsets[v], inst->type, -1 }));
+          }
+        } else if (!(isDerivation(inst) && operands[k] == &inst->a)) {
+          escapes[slot] = true;
+        }
+      }
+    }
+  }
+  arrfree(operands);
+
+  // Pieces have to stay inside the slot and apart from each other
+  for (int i = 0; i < arrlen(pieces); i++) {
+    PIECE a = pieces[i];
+    int64_t end = a.offset + IR_TYPE_SIZE(a.type);
+    if (a.offset < 0 || end > fn->slots[a.slot].size) {
+      escapes[a.slot] = true;
+    }
+    for (int j = i + 1; j < arrlen(pieces); j++) {
+      PIECE b = pieces[j];
+      if (a.slot == b.slot && a.offset < b.offset + IR_TYPE_SIZE(b.type) && b.offset < end) {
+        escapes[a.slot] = true;
+      }
+    }
+  }
+}
+
+static void rewrite(void) {
+  for (int i = 0; i < arrlen(pieces); i++) {
+    if (escapes[pieces[i].slot]) {
+      continue;
+    }
+    IR_STACK_SLOT slot = fn->slots[pieces[i].slot];
+    slot.entry.storageType = STORAGE_TYPE_LOCAL;
+    slot.size = IR_TYPE_SIZE(pieces[i].type);
+    slot.temporary = true;
+    pieces[i].replacement = arrlen(fn->slots);
+    arrput(fn->slots, slot);
+  }
+
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    IR_INST* insts = NULL;
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST inst = block->insts[j];
+      if (IR_hasDestination(inst.op) && baseSlot[inst.dst] >= 0 && !escapes[baseSlot[inst.dst]]) {
+        continue;
+      }
+      if ((inst.op == IR_LOAD || inst.op == IR_STORE) && baseSlot[inst.a] >= 0 && !escapes[baseSlot[inst.a]]) {
+        PIECE piece = pieces[findPiece(baseSlot[inst.a], offsets[inst.a], inst.type)];
+        IR_VREG address = IR_newVreg(fn);
+        arrput(insts, ((IR_INST){ .op = IR_SLOT, .type = IR_U64, .dst = address, .imm = piece.replacement }));
+        inst.a = address;
+      }
+      arrput(insts, inst);
+    }
+    arrfree(block->insts);
+    block->insts = insts;
+  }
+}
+
+void SROA_function(IR_FUNCTION* function) {
+  fn = function;
+  int slotCount = arrlen(fn->slots);
+  IR_VREG count = fn->vregCount + 1;
+  definitions = calloc(count, sizeof(int));
+  isConstant = calloc(count, sizeof(bool));
+  constants = calloc(count, sizeof(int64_t));
+  baseSlot = malloc(count * sizeof(int));
+  offsets = calloc(count, sizeof(int64_t));
+  candidate = calloc(slotCount + 1, sizeof(bool));
+  escapes = calloc(slotCount + 1, sizeof(bool));
+  for (IR_VREG v = 0; v < count; v++) {
+    baseSlot[v] = -1;
+  }
+
+  bool hasAsm = false;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST inst = fn->blocks[i].insts[j];
+      hasAsm |= inst.op == IR_ASM;
+      if (IR_hasDestination(inst.op) && inst.dst != IR_NONE) {
+        definitions[inst.dst]++;
+        isConstant[inst.dst] = inst.op == IR_CONST;
+        constants[inst.dst] = inst.imm;
+      }
+    }
+  }
+  for (IR_VREG v = 0; v < count; v++) {
+    isConstant[v] &= definitions[v] == 1;
+  }
+  // Scalars are already promoted whole, and inline assembly may read any
+  // slot through the frame pointer
+  for (int i = 0; i < slotCount; i++) {
+    candidate[i] = !hasAsm && !fn->slots[i].param && fn->slots[i].entry.storageType == STORAGE_TYPE_LOCAL_OBJECT;
+  }
+
+  findAddresses();
+  findPieces();
+  rewrite();
+
+  free(definitions);
+  free(isConstant);
+  free(constants);
+  free(baseSlot);
+  free(offsets);
+  free(candidate);
+  free(escapes);
+  arrfree(pieces);
+  fn = NULL;
+}
@@ -0,0 +1,1046 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ssa.h"
+
+static IR_FUNCTION* fn = NULL;
+
+static void freeLists(int** lists) {
+  for (int i = 0; i < arrlen(lists); i++) {
+    arrfree(lists[i]);
+  }
+  arrfree(lists);
+}
+
+static void clearInst(IR_INST* inst) {
+  arrfree(inst->args);
+  arrfree(inst->sources);
+  *inst = (IR_INST){ .op = IR_NOP };
+}
+
+static bool hasPhi(IR_BLOCK* block) {
+  return arrlen(block->insts) > 0 && block->insts[0].op == IR_PHI;
+}
+
+static int sourceIndex(IR_INST* phi, int block) {
+  for (int k = 0; k < arrlen(phi->sources); k++) {
+    if (phi->sources[k] == block) {
+      return k;
+    }
+  }
+  return -1;
+}
+
+// ------- Dominators -------
+
+static int* reversePostorder(void) {
+  int count = arrlen(fn->blocks);
+  bool* visited = calloc(count, sizeof(bool));
+  int* order = NULL;
+  int* stack = NULL;
+  int* next = NULL;
+  arrput(stack, 0);
+  arrput(next, 0);
+  visited[0] = true;
+  while (arrlen(stack) > 0) {
+    int top = arrlen(stack) - 1;
+    int successors[2];
+    int n = IR_successors(&fn->blocks[stack[top]], successors);
+    if (next[top] < n) {
+      int successor = successors[next[top]++];
+      if (!visited[successor]) {
+        visited[successor] = true;
+        arrput(stack, successor);
+        arrput(next, 0);
+      }
+    } else {
+      arrput(order, stack[top]);
+      (void)arrpop(stack);
+      (void)arrpop(next);
+    }
+  }
+  for (int i = 0, j = arrlen(order) - 1; i < j; i++, j--) {
+    int swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  free(visited);
+  arrfree(stack);
+  arrfree(next);
+  return order;
+}
+
+static int intersect(int* idom, int* position, int a, int b) {
+  while (a != b) {
+    while (position[a] > position[b]) {
+      a = idom[a];
+    }
+    while (position[b] > position[a]) {
+      b = idom[b];
+    }
+  }
+  return a;
+}
+
+int* SSA_dominators(IR_FUNCTION* function) {
+  // Cooper, Harvey and Kennedy's iterative algorithm
+  fn = function;
+  int count = arrlen(fn->blocks);
+  int* order = reversePostorder();
+  int* position = NULL;
+  int* idom = NULL;
+  arrsetlen(position, count);
+  arrsetlen(idom, count);
+  for (int i = 0; i < count; i++) {
+    position[i] = count;
+    idom[i] = -1;
+  }
+  for (int i = 0; i < arrlen(order); i++) {
+    position[order[i]] = i;
+  }
+  int** predecessors = IR_predecessors(fn);
+  idom[0] = 0;
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 1; i < arrlen(order); i++) {
+      int block = order[i];
+      int newIdom = -1;
+      for (int j = 0; j < arrlen(predecessors[block]); j++) {
+        int predecessor = predecessors[block][j];
+        if (idom[predecessor] == -1) {
+          continue;
+        }
+        newIdom = newIdom == -1 ? predecessor : intersect(idom, position, predecessor, newIdom);
+      }
+      if (idom[block] != newIdom) {
+        idom[block] = newIdom;
+        changed = true;
+      }
+    }
+  }
+  IR_freePredecessors(predecessors);
+  arrfree(position);
+  arrfree(order);
+  return idom;
+}
+
+// ------- Construction -------
+
+// Per register: the slot it addresses, or -1
+static int* slotOf = NULL;
+// Per slot: the variable it was promoted to, or -1
+static int* varOfSlot = NULL;
+// Per register: the variable for registers with several definitions
+static int* varOfVreg = NULL;
+// Per register: the type its value is already normalised to
+static IR_TYPE* valueType = NULL;
+static IR_TYPE* varType = NULL;
+static IR_VREG** stacks = NULL;
+static IR_VREG* initial = NULL;
+static int** children = NULL;
+static IR_VREG** operands = NULL;
+
+static IR_VREG newValue(IR_TYPE type) {
+  IR_VREG v = IR_newVreg(fn);
+  arrsetlen(slotOf, v + 1);
+  arrsetlen(varOfVreg, v + 1);
+  arrsetlen(valueType, v + 1);
+  slotOf[v] = -1;
+  varOfVreg[v] = -1;
+  valueType[v] = type;
+  return v;
+}
+
+// Whether a value normalised to one type is already normalised to another
+static bool fits(IR_TYPE from, IR_TYPE to) {
+  if (from == to || IR_TYPE_SIZE(to) == 8) {
+    return true;
+  }
+  if (IR_TYPE_SIZE(to) <= IR_TYPE_SIZE(from)) {
+    return false;
+  }
+  return !IR_TYPE_SIGNED(from) || IR_TYPE_SIGNED(to);
+}
+
+static IR_TYPE resultType(IR_INST* inst) {
+  switch (inst->op) {
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+      return IR_U8;
+    default:
+      return inst->type;
+  }
+}
+
+static bool isPromoted(IR_VREG address) {
+  return slotOf[address] >= 0 && varOfSlot[slotOf[address]] >= 0;
+}
+
+static IR_VREG top(int var) {
+  if (arrlen(stacks[var]) == 0) {
+    return initial[var];
+  }
+  return stacks[var][arrlen(stacks[var]) - 1];
+}
+
+static void findPromotableSlots(void) {
+  int slotCount = arrlen(fn->slots);
+  bool* escapes = calloc(slotCount + 1, sizeof(bool));
+  bool* accessed = calloc(slotCount + 1, sizeof(bool));
+  IR_TYPE* types = calloc(slotCount + 1, sizeof(IR_TYPE));
+  bool hasAsm = false;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      hasAsm |= inst->op == IR_ASM;
+      operands = IR_operands(inst, operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        IR_VREG v = *operands[k];
+        if (slotOf[v] < 0) {
+          continue;
+        }
+        int slot = slotOf[v];
+        bool isAddress = (inst->op == IR_LOAD || inst->op == IR_STORE) && operands[k] == &inst->a;
+        if (!isAddress) {
+          escapes[slot] = true;
+        } else if (accessed[slot] && types[slot] != inst->type) {
+          escapes[slot] = true;
+        } else {
+          accessed[slot] = true;
+          types[slot] = inst->type;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < slotCount; i++) {
+    IR_STACK_SLOT slot = fn->slots[i];
+    bool scalar = slot.entry.storageType == STORAGE_TYPE_LOCAL || slot.entry.storageType == STORAGE_TYPE_PARAMETER;
+    // Inline assembly may read any slot through the frame pointer
+    if (hasAsm || escapes[i] || !scalar || !accessed[i]) {
+      varOfSlot[i] = -1;
+      continue;
+    }
+    varOfSlot[i] = arrlen(varType);
+    arrput(varType, types[i]);
+  }
+  free(escapes);
+  free(accessed);
+  free(types);
+}
+
+static void placePhis(int** predecessors, int** frontiers) {
+  int varCount = arrlen(varType);
+  int blockCount = arrlen(fn->blocks);
+  int** definitions = NULL;
+  arrsetlen(definitions, varCount);
+  for (int i = 0; i < varCount; i++) {
+    definitions[i] = NULL;
+  }
+  for (int i = 0; i < blockCount; i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (inst->op == IR_STORE && isPromoted(inst->a)) {
+        arrput(definitions[varOfSlot[slotOf[inst->a]]], i);
+      } else if (IR_hasDestination(inst->op) && varOfVreg[inst->dst] >= 0) {
+        arrput(definitions[varOfVreg[inst->dst]], i);
+      }
+    }
+  }
+
+  int* placed = NULL;
+  int* queued = NULL;
+  arrsetlen(placed, blockCount);
+  arrsetlen(queued, blockCount);
+  for (int i = 0; i < blockCount; i++) {
+    placed[i] = -1;
+    queued[i] = -1;
+  }
+  int* work = NULL;
+  for (int var = 0; var < varCount; var++) {
+    for (int i = 0; i < arrlen(definitions[var]); i++) {
+      if (queued[definitions[var][i]] != var) {
+        queued[definitions[var][i]] = var;
+        arrput(work, definitions[var][i]);
+      }
+    }
+    while (arrlen(work) > 0) {
+      int block = arrpop(work);
+      for (int i = 0; i < arrlen(frontiers[block]); i++) {
+        int frontier = frontiers[block][i];
+        if (placed[frontier] == var) {
+          continue;
+        }
+        placed[frontier] = var;
+        IR_INST phi = { .op = IR_PHI, .type = varType[var], .dst = newValue(varType[var]), .imm = var };
+        for (int k = 0; k < arrlen(predecessors[frontier]); k++) {
+          arrput(phi.args, IR_NONE);
+          arrput(phi.sources, predecessors[frontier][k]);
+        }
+        IR_insert(&fn->blocks[frontier], 0, phi);
+        if (queued[frontier] != var) {
+          queued[frontier] = var;
+          arrput(work, frontier);
+        }
+      }
+    }
+  }
+  arrfree(work);
+  arrfree(placed);
+  arrfree(queued);
+  freeLists(definitions);
+}
+
+static void renameBlock(int block) {
+  int* pushed = NULL;
+  IR_BLOCK* current = &fn->blocks[block];
+  for (int j = 0; j < arrlen(current->insts); j++) {
+    IR_INST* inst = &current->insts[j];
+    if (inst->op == IR_PHI) {
+      arrput(stacks[inst->imm], inst->dst);
+      arrput(pushed, inst->imm);
+      continue;
+    }
+    operands = IR_operands(inst, operands);
+    for (int k = 0; k < arrlen(operands); k++) {
+      if (varOfVreg[*operands[k]] >= 0) {
+        *operands[k] = top(varOfVreg[*operands[k]]);
+      }
+    }
+    if (inst->op == IR_LOAD && isPromoted(inst->a)) {
+      inst->op = IR_COPY;
+      inst->a = top(varOfSlot[slotOf[inst->a]]);
+    } else if (inst->op == IR_STORE && isPromoted(inst->a)) {
+      int var = varOfSlot[slotOf[inst->a]];
+      IR_VREG value = inst->b;
+      if (fits(valueType[value], varType[var])) {
+        *inst = (IR_INST){ .op = IR_NOP };
+      } else {
+        // Storing truncates, and loading extends again
+        value = newValue(varType[var]);
+        *inst = (IR_INST){ .op = IR_EXT, .type = varType[var], .dst = value, .a = inst->b };
+      }
+      arrput(stacks[var], value);
+      arrput(pushed, var);
+    } else if (IR_hasDestination(inst->op) && varOfVreg[inst->dst] >= 0) {
+      int var = varOfVreg[inst->dst];
+      inst->dst = newValue(varType[var]);
+      arrput(stacks[var], inst->dst);
+      arrput(pushed, var);
+    }
+  }
+
+  int successors[2];
+  int count = IR_successors(current, successors);
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* successor = &fn->blocks[successors[i]];
+    for (int j = 0; j < arrlen(successor->insts) && successor->insts[j].op == IR_PHI; j++) {
+      IR_INST* phi = &successor->insts[j];
+      phi->args[sourceIndex(phi, block)] = top(phi->imm);
+    }
+  }
+
+  for (int i = 0; i < arrlen(children[block]); i++) {
+    renameBlock(children[block][i]);
+  }
+  for (int i = 0; i < arrlen(pushed); i++) {
+    (void)arrpop(stacks[pushed[i]]);
+  }
+  arrfree(pushed);
+}
+
+// Forwards copies and phis which only ever see one value to their uses
+static void propagateCopies(void) {
+  IR_VREG* replacement = NULL;
+  arrsetlen(replacement, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    replacement[v] = v;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (inst->op == IR_COPY) {
+        replacement[inst->dst] = inst->a;
+        clearInst(inst);
+      }
+    }
+  }
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (int i = 0; i < arrlen(fn->blocks); i++) {
+      for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+        IR_INST* inst = &fn->blocks[i].insts[j];
+        if (inst->op != IR_PHI) {
+          continue;
+        }
+        IR_VREG value = IR_NONE;
+        bool trivial = true;
+        for (int k = 0; k < arrlen(inst->args); k++) {
+          IR_VREG arg = inst->args[k];
+          while (replacement[arg] != arg) {
+            arg = replacement[arg];
+          }
+          inst->args[k] = arg;
+          if (arg == inst->dst || arg == value) {
+            continue;
+          }
+          if (value != IR_NONE) {
+            trivial = false;
+          }
+          value = arg;
+        }
+        if (trivial && value != IR_NONE) {
+          replacement[inst->dst] = value;
+          clearInst(inst);
+          changed = true;
+        }
+      }
+    }
+  }
+
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      operands = IR_operands(&fn->blocks[i].insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        while (replacement[*operands[k]] != *operands[k]) {
+          *operands[k] = replacement[*operands[k]];
+        }
+      }
+    }
+  }
+  arrfree(replacement);
+  IR_removeNops(fn);
+}
+
+void SSA_build(IR_FUNCTION* function) {
+  fn = function;
+  IR_removeUnreachable(fn);
+  int blockCount = arrlen(fn->blocks);
+
+  arrsetlen(slotOf, fn->vregCount + 1);
+  arrsetlen(varOfVreg, fn->vregCount + 1);
+  arrsetlen(valueType, fn->vregCount + 1);
+  arrsetlen(varOfSlot, arrlen(fn->slots));
+  int* definitions = calloc(fn->vregCount + 1, sizeof(int));
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    slotOf[v] = -1;
+    varOfVreg[v] = -1;
+    valueType[v] = IR_U64;
+  }
+  for (int i = 0; i < blockCount; i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (!IR_hasDestination(inst->op)) {
+        continue;
+      }
+      definitions[inst->dst]++;
+      valueType[inst->dst] = resultType(inst);
+      if (inst->op == IR_SLOT) {
+        slotOf[inst->dst] = inst->imm;
+      }
+    }
+  }
+  findPromotableSlots();
+  // Registers assigned on several paths, like the result of && and ||
+  for (IR_VREG v = 1; v <= fn->vregCount; v++) {
+    if (definitions[v] > 1) {
+      varOfVreg[v] = arrlen(varType);
+      arrput(varType, valueType[v]);
+    }
+  }
+  free(definitions);
+
+  int varCount = arrlen(varType);
+  arrsetlen(stacks, varCount);
+  arrsetlen(initial, varCount);
+  for (int i = 0; i < varCount; i++) {
+    stacks[i] = NULL;
+    initial[i] = newValue(varType[i]);
+  }
+
+  int* idom = SSA_dominators(fn);
+  int** predecessors = IR_predecessors(fn);
+  int** frontiers = NULL;
+  arrsetlen(children, blockCount);
+  arrsetlen(frontiers, blockCount);
+  for (int i = 0; i < blockCount; i++) {
+    children[i] = NULL;
+    frontiers[i] = NULL;
+  }
+  for (int i = 1; i < blockCount; i++) {
+    arrput(children[idom[i]], i);
+  }
+  for (int i = 0; i < blockCount; i++) {
+    if (arrlen(predecessors[i]) < 2) {
+      continue;
+    }
+    for (int j = 0; j < arrlen(predecessors[i]); j++) {
+      int runner = predecessors[i][j];
+      while (runner != idom[i]) {
+        bool found = false;
+        for (int k = 0; k < arrlen(frontiers[runner]); k++) {
+          found |= frontiers[runner][k] == i;
+        }
+        if (!found) {
+          arrput(frontiers[runner], i);
+        }
+        runner = idom[runner];
+      }
+    }
+  }
+
+  placePhis(predecessors, frontiers);
+  renameBlock(0);
+
+  // Promoted slots are no longer addressed. Parameters start out with the
+  // argument passed in, and everything else with zero.
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (inst->op == IR_SLOT && varOfSlot[inst->imm] >= 0) {
+        clearInst(inst);
+      } else if (inst->op == IR_PHI) {
+        inst->imm = 0;
+      }
+    }
+  }
+  int insertAt = 0;
+  for (int i = 0; i < arrlen(fn->slots); i++) {
+    int var = varOfSlot[i];
+    if (var >= 0 && fn->slots[i].param) {
+      IR_insert(&fn->blocks[0], insertAt++, (IR_INST){ .op = IR_PARAM, .type = varType[var], .dst = initial[var], .imm = fn->slots[i].entry.paramOrdinal });
+    }
+  }
+  for (int i = 0; i < arrlen(fn->slots); i++) {
+    int var = varOfSlot[i];
+    if (var >= 0 && !fn->slots[i].param) {
+      IR_insert(&fn->blocks[0], insertAt++, (IR_INST){ .op = IR_CONST, .type = varType[var], .dst = initial[var] });
+    }
+  }
+  for (IR_VREG v = 0; v < arrlen(varOfVreg); v++) {
+    if (varOfVreg[v] >= 0) {
+      int var = varOfVreg[v];
+      IR_insert(&fn->blocks[0], insertAt++, (IR_INST){ .op = IR_CONST, .type = varType[var], .dst = initial[var] });
+    }
+  }
+
+  fn->ssa = true;
+  IR_removeNops(fn);
+  propagateCopies();
+
+  arrfree(idom);
+  IR_freePredecessors(predecessors);
+  freeLists(frontiers);
+  freeLists(children);
+  children = NULL;
+  for (int i = 0; i < varCount; i++) {
+    arrfree(stacks[i]);
+  }
+  arrfree(stacks);
+  arrfree(initial);
+  arrfree(slotOf);
+  arrfree(varOfSlot);
+  arrfree(varOfVreg);
+  arrfree(valueType);
+  arrfree(varType);
+  arrfree(operands);
+}
+
+// ------- Constant propagation -------
+
+typedef enum { LATTICE_TOP, LATTICE_CONSTANT, LATTICE_BOTTOM } LATTICE;
+
+typedef struct { int block; int index; } USE;
+
+static LATTICE* lattice = NULL;
+static int64_t* constants = NULL;
+static bool* executable = NULL;
+// Per block: the predecessors whose edge into it has been found executable
+static int** incoming = NULL;
+static int* flowWork = NULL;
+static IR_VREG* valueWork = NULL;
+
+static bool isExecutableEdge(int from, int to) {
+  for (int i = 0; i < arrlen(incoming[to]); i++) {
+    if (incoming[to][i] == from) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void addEdge(int from, int to) {
+  if (isExecutableEdge(from, to)) {
+    return;
+  }
+  arrput(incoming[to], from);
+  arrput(flowWork, from);
+  arrput(flowWork, to);
+}
+
+static void setValue(IR_VREG v, LATTICE state, int64_t value) {
+  if (lattice[v] == LATTICE_BOTTOM || (lattice[v] == state && (state != LATTICE_CONSTANT || constants[v] == value))) {
+    return;
+  }
+  if (lattice[v] == LATTICE_CONSTANT && state == LATTICE_CONSTANT) {
+    state = LATTICE_BOTTOM;
+  }
+  lattice[v] = state;
+  constants[v] = value;
+  arrput(valueWork, v);
+}
+
+static bool isFoldable(IR_OP op) {
+  switch (op) {
+    case IR_COPY:
+    case IR_EXT:
+    case IR_ADD:
+    case IR_SUB:
+    case IR_MUL:
+    case IR_DIV:
+    case IR_MOD:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+    case IR_SHL:
+    case IR_SHR:
+    case IR_NEG:
+    case IR_NOT:
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+static void visit(int block, int index) {
+  IR_INST* inst = &fn->blocks[block].insts[index];
+  switch (inst->op) {
+    case IR_PHI:
+      {
+        LATTICE state = LATTICE_TOP;
+        int64_t value = 0;
+        for (int k = 0; k < arrlen(inst->args) && state != LATTICE_BOTTOM; k++) {
+          IR_VREG arg = inst->args[k];
+          if (!isExecutableEdge(inst->sources[k], block) || lattice[arg] == LATTICE_TOP) {
+            continue;
+          }
+          if (lattice[arg] == LATTICE_BOTTOM || (state == LATTICE_CONSTANT && value != constants[arg])) {
+            state = LATTICE_BOTTOM;
+          } else {
+            state = LATTICE_CONSTANT;
+            value = constants[arg];
+          }
+        }
+        setValue(inst->dst, state, value);
+        return;
+      }
+    case IR_JUMP:
+      addEdge(block, inst->target);
+      return;
+    case IR_BRANCH:
+      if (lattice[inst->a] == LATTICE_CONSTANT) {
+        addEdge(block, constants[inst->a] != 0 ? inst->target : inst->other);
+      } else if (lattice[inst->a] == LATTICE_BOTTOM) {
+        addEdge(block, inst->target);
+        addEdge(block, inst->other);
+      }
+      return;
+    case IR_CONST:
+      setValue(inst->dst, LATTICE_CONSTANT, inst->imm);
+      return;
+    default:
+      break;
+  }
+  if (!IR_hasDestination(inst->op)) {
+    return;
+  }
+  if (!isFoldable(inst->op)) {
+    setValue(inst->dst, LATTICE_BOTTOM, 0);
+    return;
+  }
+  operands = IR_operands(inst, operands);
+  LATTICE state = LATTICE_CONSTANT;
+  for (int k = 0; k < arrlen(operands); k++) {
+    if (lattice[*operands[k]] == LATTICE_BOTTOM) {
+      state = LATTICE_BOTTOM;
+    } else if (lattice[*operands[k]] == LATTICE_TOP && state == LATTICE_CONSTANT) {
+      state = LATTICE_TOP;
+    }
+  }
+  int64_t value = 0;
+  if (state == LATTICE_CONSTANT) {
+    int64_t a = inst->a == IR_NONE ? 0 : constants[inst->a];
+    int64_t b = inst->b == IR_NONE ? 0 : constants[inst->b];
+    if (!IR_fold(inst->op, inst->type, a, b, &value)) {
+      state = LATTICE_BOTTOM;
+    }
+  }
+  setValue(inst->dst, state, value);
+}
+
+static void rewriteConstants(void) {
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    if (!executable[i]) {
+      continue;
+    }
+    bool reorder = false;
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST* inst = &block->insts[j];
+      if (inst->op == IR_PHI) {
+        // Drop the values arriving along edges which are never taken
+        int kept = 0;
+        for (int k = 0; k < arrlen(inst->args); k++) {
+          if (isExecutableEdge(inst->sources[k], i)) {
+            inst->args[kept] = inst->args[k];
+            inst->sources[kept] = inst->sources[k];
+            kept++;
+          }
+        }
+        arrsetlen(inst->args, kept);
+        arrsetlen(inst->sources, kept);
+      }
+      if (inst->op == IR_BRANCH && lattice[inst->a] == LATTICE_CONSTANT) {
+        int target = constants[inst->a] != 0 ? inst->target : inst->other;
+        *inst = (IR_INST){ .op = IR_JUMP, .target = target };
+      } else if (IR_hasDestination(inst->op) && inst->op != IR_CONST && IR_isPure(inst->op)
+          && lattice[inst->dst] == LATTICE_CONSTANT) {
+        reorder |= inst->op == IR_PHI;
+        IR_INST constant = { .op = IR_CONST, .type = inst->type, .dst = inst->dst, .imm = constants[inst->dst] };
+        clearInst(inst);
+        *inst = constant;
+      }
+    }
+    if (reorder) {
+      // Phis have to stay at the start of the block
+      IR_INST* insts = NULL;
+      for (int pass = 0; pass < 2; pass++) {
+        for (int j = 0; j < arrlen(block->insts); j++) {
+          if ((block->insts[j].op == IR_PHI) == (pass == 0)) {
+            arrput(insts, block->insts[j]);
+          }
+        }
+      }
+      arrfree(block->insts);
+      block->insts = insts;
+    }
+  }
+}
+
+void SSA_propagateConstants(IR_FUNCTION* function) {
+  // Wegman and Zadeck's sparse conditional constant propagation
+  fn = function;
+  int blockCount = arrlen(fn->blocks);
+  USE** uses = NULL;
+  arrsetlen(uses, fn->vregCount + 1);
+  arrsetlen(lattice, fn->vregCount + 1);
+  arrsetlen(constants, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    uses[v] = NULL;
+    lattice[v] = LATTICE_TOP;
+    constants[v] = 0;
+  }
+  for (int i = 0; i < blockCount; i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      operands = IR_operands(&fn->blocks[i].insts[j], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        arrput(uses[*operands[k]], ((USE){ i, j }));
+      }
+    }
+  }
+  executable = calloc(blockCount, sizeof(bool));
+  arrsetlen(incoming, blockCount);
+  for (int i = 0; i < blockCount; i++) {
+    incoming[i] = NULL;
+  }
+
+  executable[0] = true;
+  for (int j = 0; j < arrlen(fn->blocks[0].insts); j++) {
+    visit(0, j);
+  }
+  while (arrlen(flowWork) > 0 || arrlen(valueWork) > 0) {
+    while (arrlen(flowWork) > 0) {
+      int to = arrpop(flowWork);
+      (void)arrpop(flowWork);
+      IR_BLOCK* block = &fn->blocks[to];
+      if (!executable[to]) {
+        executable[to] = true;
+        for (int j = 0; j < arrlen(block->insts); j++) {
+          visit(to, j);
+        }
+      } else {
+        for (int j = 0; j < arrlen(block->insts) && block->insts[j].op == IR_PHI; j++) {
+          visit(to, j);
+        }
+      }
+    }
+    while (arrlen(valueWork) > 0) {
+      IR_VREG v = arrpop(valueWork);
+      for (int k = 0; k < arrlen(uses[v]); k++) {
+        if (executable[uses[v][k].block]) {
+          visit(uses[v][k].block, uses[v][k].index);
+        }
+      }
+    }
+  }
+
+  rewriteConstants();
+  IR_removeUnreachable(fn);
+  propagateCopies();
+
+  for (IR_VREG v = 0; v < arrlen(uses); v++) {
+    arrfree(uses[v]);
+  }
+  arrfree(uses);
+  freeLists(incoming);
+  incoming = NULL;
+  free(executable);
+  executable = NULL;
+  arrfree(lattice);
+  arrfree(constants);
+  arrfree(flowWork);
+  arrfree(valueWork);
+  arrfree(operands);
+}
+
+// ------- Dead code -------
+
+void SSA_eliminateDeadCode(IR_FUNCTION* function) {
+  fn = function;
+  IR_INST** definition = calloc(fn->vregCount + 1, sizeof(IR_INST*));
+  bool* live = calloc(fn->vregCount + 1, sizeof(bool));
+  IR_VREG* work = NULL;
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (IR_hasDestination(inst->op)) {
+        definition[inst->dst] = inst;
+      }
+      if (!IR_isPure(inst->op)) {
+        operands = IR_operands(inst, operands);
+        for (int k = 0; k < arrlen(operands); k++) {
+          arrput(work, *operands[k]);
+        }
+      }
+    }
+  }
+  while (arrlen(work) > 0) {
+    IR_VREG v = arrpop(work);
+    if (live[v]) {
+      continue;
+    }
+    live[v] = true;
+    if (definition[v] != NULL) {
+      operands = IR_operands(definition[v], operands);
+      for (int k = 0; k < arrlen(operands); k++) {
+        arrput(work, *operands[k]);
+      }
+    }
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (IR_isPure(inst->op) && IR_hasDestination(inst->op) && !live[inst->dst]) {
+        clearInst(inst);
+      }
+    }
+  }
+  IR_removeNops(fn);
+  free(definition);
+  free(live);
+  arrfree(work);
+  arrfree(operands);
+}
+
+// ------- Control flow -------
+
+static void renameSource(int block, int from, int to) {
+  int successors[2];
+  int count = IR_successors(&fn->blocks[block], successors);
+  for (int i = 0; i < count; i++) {
+    IR_BLOCK* successor = &fn->blocks[successors[i]];
+    for (int j = 0; j < arrlen(successor->insts) && successor->insts[j].op == IR_PHI; j++) {
+      IR_INST* phi = &successor->insts[j];
+      for (int k = 0; k < arrlen(phi->sources); k++) {
+        if (phi->sources[k] == from) {
+          phi->sources[k] = to;
+        }
+      }
+    }
+  }
+}
+
+static bool simplifyOnce(void) {
+  int** predecessors = IR_predecessors(fn);
+  bool changed = false;
+  for (int i = 0; i < arrlen(fn->blocks) && !changed; i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    IR_INST* last = IR_terminator(block);
+    if (last == NULL) {
+      continue;
+    }
+    if (last->op == IR_BRANCH && last->target == last->other) {
+      *last = (IR_INST){ .op = IR_JUMP, .target = last->target };
+      changed = true;
+      continue;
+    }
+    if (last->op != IR_JUMP) {
+      continue;
+    }
+    int target = last->target;
+    IR_BLOCK* next = &fn->blocks[target];
+    if (target != i && target != 0 && arrlen(predecessors[target]) == 1 && !hasPhi(next)) {
+      // Straight-line code: append the only successor to this block
+      (void)arrpop(block->insts);
+      for (int j = 0; j < arrlen(next->insts); j++) {
+        arrput(block->insts, next->insts[j]);
+      }
+      arrfree(next->insts);
+      arrput(next->insts, ((IR_INST){ .op = IR_JUMP, .target = target }));
+      renameSource(i, target, i);
+      changed = true;
+    } else if (i != 0 && arrlen(block->insts) == 1 && target != i && !hasPhi(next)) {
+      // An empty block: send its predecessors straight on
+      for (int j = 0; j < arrlen(predecessors[i]); j++) {
+        IR_INST* jump = IR_terminator(&fn->blocks[predecessors[i][j]]);
+        if (jump->target == i) {
+          jump->target = target;
+        }
+        if (jump->op == IR_BRANCH && jump->other == i) {
+          jump->other = target;
+        }
+      }
+      changed = arrlen(predecessors[i]) > 0;
+    }
+  }
+  IR_freePredecessors(predecessors);
+  return changed;
+}
+
+void SSA_simplifyBranches(IR_FUNCTION* function) {
+  fn = function;
+  while (simplifyOnce()) {
+    IR_removeUnreachable(fn);
+  }
+}
+
+// ------- Destruction -------
+
+void SSA_destroy(IR_FUNCTION* function) {
+  fn = function;
+  int blockCount = arrlen(fn->blocks);
+  int** predecessors = IR_predecessors(fn);
+  for (int i = 0; i < blockCount; i++) {
+    if (!hasPhi(&fn->blocks[i])) {
+      continue;
+    }
+    for (int k = 0; k < arrlen(predecessors[i]); k++) {
+      int from = predecessors[i][k];
+      int successors[2];
+      int into = from;
+      if (IR_successors(&fn->blocks[from], successors) > 1) {
+        // Split the critical edge so the copies only run along it
+        into = IR_newBlock(fn);
+        arrput(fn->blocks[into].insts, ((IR_INST){ .op = IR_JUMP, .target = i }));
+        IR_INST* branch = IR_terminator(&fn->blocks[from]);
+        if (branch->target == i) {
+          branch->target = into;
+        }
+        if (branch->other == i) {
+          branch->other = into;
+        }
+      }
+      // Every phi reads its argument before any of them is written, which
+      // only needs temporaries when one phi feeds another
+      IR_BLOCK* block = &fn->blocks[i];
+      int phiCount = 0;
+      while (phiCount < arrlen(block->insts) && block->insts[phiCount].op == IR_PHI) {
+        phiCount++;
+      }
+      bool overlaps = false;
+      for (int j = 0; j < phiCount; j++) {
+        IR_INST* phi = &block->insts[j];
+        IR_VREG arg = phi->args[sourceIndex(phi, from)];
+        for (int m = 0; m < phiCount; m++) {
+          overlaps |= m != j && block->insts[m].dst == arg;
+        }
+      }
+      IR_INST* copies = NULL;
+      IR_VREG* temporaries = NULL;
+      for (int j = 0; j < phiCount; j++) {
+        IR_INST* phi = &block->insts[j];
+        IR_VREG arg = phi->args[sourceIndex(phi, from)];
+        if (arg == phi->dst) {
+          arrput(temporaries, IR_NONE);
+          continue;
+        }
+        IR_VREG temporary = overlaps ? IR_newVreg(fn) : phi->dst;
+        arrput(temporaries, temporary);
+        arrput(copies, ((IR_INST){ .op = IR_COPY, .type = phi->type, .dst = temporary, .a = arg }));
+      }
+      for (int j = 0; overlaps && j < phiCount; j++) {
+        IR_INST* phi = &block->insts[j];
+        if (temporaries[j] != IR_NONE) {
+          arrput(copies, ((IR_INST){ .op = IR_COPY, .type = phi->type, .dst = phi->dst, .a = temporaries[j] }));
+        }
+      }
+      IR_BLOCK* predecessor = &fn->blocks[into];
+      int at = arrlen(predecessor->insts) - 1;
+      for (int j = 0; j < arrlen(copies); j++) {
+        IR_insert(predecessor, at + j, copies[j]);
+      }
+      arrfree(copies);
+      arrfree(temporaries);
+    }
+  }
+  for (int i = 0; i < blockCount; i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      if (fn->blocks[i].insts[j].op == IR_PHI) {
+        clearInst(&fn->blocks[i].insts[j]);
+      }
+    }
+  }
+  IR_freePredecessors(predecessors);
+  fn->ssa = false;
+  IR_removeNops(fn);
+}
@@ -0,0 +1,49 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#ifndef ssa_h
+#define ssa_h
+
+#include "common.h"
+#include "ir.h"
+
+// Dominator tree of a function whose blocks are all reachable, as the
+// immediate dominator of each block. The entry block dominates itself.
+int* SSA_dominators(IR_FUNCTION* fn);
+
+// Puts a function into SSA form. Scalar locals and parameters whose
+// address never escapes are promoted from their stack slots to registers.
+void SSA_build(IR_FUNCTION* fn);
+// Sparse conditional constant propagation, which also prunes the
+// branches it proves are never taken
+void SSA_propagateConstants(IR_FUNCTION* fn);
+void SSA_eliminateDeadCode(IR_FUNCTION* fn);
+// Merges straight-line blocks and skips over empty ones
+void SSA_simplifyBranches(IR_FUNCTION* fn);
+// Replaces phis with copies so the backend can consume the function
+void SSA_destroy(IR_FUNCTION* fn);
+
+#endif
@@ -0,0 +1,298 @@
+/*
+  MIT License
+
+  Copyright (c) 2023 Aviv Beeri
+  Copyright (c) 2015 Robert "Bob" Nystrom
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in all
+  copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+  SOFTWARE.
+*/
+
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "strength.h"
+
+static IR_FUNCTION* fn = NULL;
+// Instructions of the block being rewritten
+static IR_INST* out = NULL;
+// Per register: whether it holds a known constant, and which
+static bool* isConstant = NULL;
+static int64_t* constants = NULL;
+// Per register: the type its value is normalised to
+static IR_TYPE* valueType = NULL;
+
+static IR_VREG emit(IR_OP op, IR_TYPE type, IR_VREG a, IR_VREG b) {
+  IR_VREG dst = IR_newVreg(fn);
+  arrput(out, ((IR_INST){ .op = op, .type = type, .dst = dst, .a = a, .b = b }));
+  return dst;
+}
+
+static void emitTo(IR_VREG dst, IR_OP op, IR_TYPE type, IR_VREG a, IR_VREG b) {
+  arrput(out, ((IR_INST){ .op = op, .type = type, .dst = dst, .a = a, .b = b }));
+}
+
+static IR_VREG emitConst(int64_t value) {
+  IR_VREG dst = IR_newVreg(fn);
+  arrput(out, ((IR_INST){ .op = IR_CONST, .type = IR_U64, .dst = dst, .imm = value }));
+  return dst;
+}
+
+static bool constantOf(IR_VREG v, int64_t* value) {
+  if (v >= arrlen(isConstant) || !isConstant[v]) {
+    return false;
+  }
+  *value = constants[v];
+  return true;
+}
+
+static IR_TYPE typeOf(IR_VREG v) {
+  return v < arrlen(valueType) ? valueType[v] : IR_U64;
+}
+
+static int log2Of(uint64_t value) {
+  if (value == 0 || (value & (value - 1)) != 0) {
+    return -1;
+  }
+  int k = 0;
+  while ((value >> k) != 1) {
+    k++;
+  }
+  return k;
+}
+
+// Smallest k with c <= 2^k
+static int ceilLog2(uint64_t c) {
+  int k = 0;
+  while (k < 63 && ((uint64_t)1 << k) < c) {
+    k++;
+  }
+  return k;
+}
+
+// Emits a * c into dst with shifts and adds, when c has a cheap form
+static bool emitProduct(IR_VREG dst, IR_TYPE type, IR_VREG a, int64_t c) {
+  uint64_t magnitude = c < 0 ? 0 - (uint64_t)c : (uint64_t)c;
+  int k = log2Of(magnitude);
+  if (c == 0) {
+    arrput(out, ((IR_INST){ .op = IR_CONST, .type = type, .dst = dst, .imm = 0 }));
+  } else if (c == 1) {
+    emitTo(dst, IR_EXT, type, a, IR_NONE);
+  } else if (c == -1) {
+    emitTo(dst, IR_NEG, type, a, IR_NONE);
+  } else if (k > 0 && c > 0) {
+    emitTo(dst, IR_SHL, type, a, emitConst(k));
+  } else if (k > 0) {
+    emitTo(dst, IR_NEG, type, emit(IR_SHL, IR_U64, a, emitConst(k)), IR_NONE);
+  } else if (c > 0 && log2Of(magnitude - 1) > 0) {
+    emitTo(dst, IR_ADD, type, emit(IR_SHL, IR_U64, a, emitConst(log2Of(magnitude - 1))), a);
+  } else if (c > 0 && log2Of(magnitude + 1) > 0) {
+    emitTo(dst, IR_SUB, type, emit(IR_SHL, IR_U64, a, emitConst(log2Of(magnitude + 1))), a);
+  } else if (c > 0 && log2Of(magnitude & (magnitude - 1)) > 0) {
+    // Two bits set: add the two shifted copies
+    uint64_t low = magnitude & (0 - magnitude);
+    IR_VREG high = emit(IR_SHL, IR_U64, a, emitConst(log2Of(magnitude - low)));
+    emitTo(dst, IR_ADD, type, high, emit(IR_SHL, IR_U64, a, emitConst(log2Of(low))));
+  } else {
+    return false;
+  }
+  return true;
+}
+
+static bool reduceMultiply(IR_INST inst) {
+  int64_t c;
+  if (constantOf(inst.b, &c)) {
+    return emitProduct(inst.dst, inst.type, inst.a, c);
+  }
+  if (constantOf(inst.a, &c)) {
+    return emitProduct(inst.dst, inst.type, inst.b, c);
+  }
+  return false;
+}
+
+// Emits the truncated quotient of a by c into dst, normalised to type.
+// Relies on a being extended from a type narrower than the registers.
+static bool emitQuotient(IR_VREG dst, IR_TYPE type, IR_VREG a, int64_t c) {
+  IR_TYPE aType = typeOf(a);
+  int bits = IR_TYPE_SIZE(aType) * 8;
+  int k = c > 0 ? log2Of(c) : -1;
+  if (c <= 1) {
+    return false;
+  }
+  if (!IR_TYPE_SIGNED(aType) && bits <= 32) {
+    // Non-negative values
+    if (k > 0) {
+      emitTo(dst, IR_SHR, type, a, emitConst(k));
+      return true;
+    }
+    if (bits > 16) {
+      return false;
+    }
+    int shift = bits + ceilLog2(c);
+    int64_t multiplier = (int64_t)((((uint64_t)1 << shift) + (uint64_t)c - 1) / (uint64_t)c);
+    emitTo(dst, IR_SHR, type, emit(IR_MUL, IR_U64, a, emitConst(multiplier)), emitConst(shift));
+    return true;
+  }
+  if (bits > 32 && k <= 0) {
+    return false;
+  }
+  if (k > 0) {
+    // Round towards zero by biasing negative values by c - 1
+    IR_VREG sign = emit(IR_SHR, IR_I64, a, emitConst(63));
+    IR_VREG bias = emit(IR_SHR, IR_U64, sign, emitConst(64 - k));
+    IR_VREG biased = emit(IR_ADD, IR_U64, a, bias);
+    if (IR_TYPE_SIGNED(type) || type == IR_U64) {
+      emitTo(dst, IR_SHR, IR_TYPE_SIGNED(type) ? type : IR_I64, biased, emitConst(k));
+    } else {
+      emitTo(dst, IR_EXT, type, emit(IR_SHR, IR_I64, biased, emitConst(k)), IR_NONE);
+    }
+    return true;
+  }
+  // Multiply by the rounded up reciprocal, then step negative results
+  // towards zero
+  int shift = bits - 1 + ceilLog2(c);
+  int64_t multiplier = (int64_t)((((uint64_t)1 << shift) + (uint64_t)c - 1) / (uint64_t)c);
+  IR_VREG product = emit(IR_MUL, IR_I64, a, emitConst(multiplier));
+  IR_VREG floor = emit(IR_SHR, IR_I64, product, emitConst(shift));
+  IR_VREG negative = emit(IR_SHR, IR_U64, a, emitConst(63));
+  emitTo(dst, IR_ADD, type, floor, negative);
+  return true;
+}
+
+static bool reduceDivide(IR_INST inst) {
+  int64_t c;
+  if (!constantOf(inst.b, &c)) {
+    return false;
+  }
+  if (inst.type == IR_U64) {
+    // Full width unsigned division only has the power of two case
+    int k = log2Of((uint64_t)c);
+    if (k < 0) {
+      return false;
+    }
+    if (inst.op == IR_DIV) {
+      emitTo(inst.dst, IR_SHR, IR_U64, inst.a, emitConst(k));
+    } else {
+      emitTo(inst.dst, IR_AND, IR_U64, inst.a, emitConst(c - 1));
+    }
+    return true;
+  }
+  if (c == 0 || c == 1 || c == -1) {
+    // Division by zero gives zero, so the remainder is the dividend
+    if (inst.op == IR_MOD && c == 0) {
+      emitTo(inst.dst, IR_EXT, inst.type, inst.a, IR_NONE);
+    } else if (inst.op == IR_MOD || c == 0) {
+      arrput(out, ((IR_INST){ .op = IR_CONST, .type = inst.type, .dst = inst.dst, .imm = 0 }));
+    } else {
+      emitTo(inst.dst, c == 1 ? IR_EXT : IR_NEG, inst.type, inst.a, IR_NONE);
+    }
+    return true;
+  }
+  if (inst.op == IR_DIV) {
+    return emitQuotient(inst.dst, inst.type, inst.a, c);
+  }
+  IR_TYPE aType = typeOf(inst.a);
+  int k = c > 0 ? log2Of(c) : -1;
+  if (k > 0 && !IR_TYPE_SIGNED(aType) && IR_TYPE_SIZE(aType) <= 4) {
+    emitTo(inst.dst, IR_AND, inst.type, inst.a, emitConst(c - 1));
+    return true;
+  }
+  // a - (a / c) * c
+  int mark = arrlen(out);
+  IR_VREG quotient = IR_newVreg(fn);
+  if (!emitQuotient(quotient, IR_I64, inst.a, c)) {
+    arrsetlen(out, mark);
+    return false;
+  }
+  IR_VREG multiple = IR_newVreg(fn);
+  if (!emitProduct(multiple, IR_U64, quotient, c)) {
+    emitTo(multiple, IR_MUL, IR_U64, quotient, emitConst(c));
+  }
+  emitTo(inst.dst, IR_SUB, inst.type, inst.a, multiple);
+  return true;
+}
+
+static IR_TYPE resultType(IR_INST* inst) {
+  switch (inst->op) {
+    case IR_EQ:
+    case IR_NE:
+    case IR_LT:
+    case IR_LE:
+    case IR_GT:
+    case IR_GE:
+      return IR_U8;
+    default:
+      return inst->type;
+  }
+}
+
+void STRENGTH_reduce(IR_FUNCTION* function) {
+  fn = function;
+  arrsetlen(isConstant, fn->vregCount + 1);
+  arrsetlen(constants, fn->vregCount + 1);
+  arrsetlen(valueType, fn->vregCount + 1);
+  for (IR_VREG v = 0; v <= fn->vregCount; v++) {
+    isConstant[v] = false;
+    valueType[v] = IR_U64;
+  }
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    for (int j = 0; j < arrlen(fn->blocks[i].insts); j++) {
+      IR_INST* inst = &fn->blocks[i].insts[j];
+      if (IR_hasDestination(inst->op)) {
+        valueType[inst->dst] = resultType(inst);
+      }
+      if (inst->op == IR_CONST) {
+        isConstant[inst->dst] = true;
+        constants[inst->dst] = inst->imm;
+      }
+    }
+  }
+
+  for (int i = 0; i < arrlen(fn->blocks); i++) {
+    IR_BLOCK* block = &fn->blocks[i];
+    bool changed = false;
+    out = NULL;
+    for (int j = 0; j < arrlen(block->insts); j++) {
+      IR_INST inst = block->insts[j];
+      int mark = arrlen(out);
+      bool reduced = false;
+      if (inst.op == IR_MUL) {
+        reduced = reduceMultiply(inst);
+      } else if (inst.op == IR_DIV || inst.op == IR_MOD) {
+        reduced = reduceDivide(inst);
+      }
+      if (reduced) {
+        changed = true;
+      } else {
+        arrsetlen(out, mark);
+        arrput(out, inst);
+      }
+    }
+    if (changed) {
+      arrfree(block->insts);
+      block->insts = out;
+    } else {
+      arrfree(out);
+    }
+  }
+  out = NULL;
+  arrfree(isConstant);
+  arrfree(constants);
+  arrfree(valueType);
+}
@@ -71,7 +71,7 @@ void SYMBOL_TABLE_openScope(SYMBOL_TABLE_SCOPE_TYPE scopeType) {
   }));
 
   // Prevent memory leaks somehow
-  SYMBOL_TABLE_ENTRY defaultEntry = {};
+  SYMBOL_TABLE_ENTRY defaultEntry = { .mangledName = EMPTY_STRING };
   SYMBOL_TABLE_SCOPE scope = hmgets(scopes, scopeId);
   hmdefaults(scope.table, defaultEntry);
   hmputs(scopes, scope);
@@ -165,6 +165,24 @@ void SYMBOL_TABLE_updateElementCount(STR name, uint32_t elementCount) {
   }
 }
 
+void SYMBOL_TABLE_setConstant(STR name, struct AST* constant) {
+  uint32_t current = SYMBOL_TABLE_getCurrentScopeIndex();
+  SYMBOL_TABLE_SCOPE scope = hmgets(scopes, current);
+  SYMBOL_TABLE_ENTRY entry = hmgets(scope.table, name);
+  if (entry.defined) {
+    entry.constant = constant;
+    hmputs(scope.table, entry);
+  }
+}
+
+void SYMBOL_TABLE_setMangledName(SYMBOL_TABLE_ENTRY entry, STR mangledName) {
+  SYMBOL_TABLE_SCOPE scope = hmgets(scopes, entry.scopeIndex);
+  ptrdiff_t index = hmgeti(scope.table, entry.key);
+  if (index >= 0) {
+    scope.table[index].mangledName = mangledName;
+  }
+}
+
 void SYMBOL_TABLE_closeScope() {
   uint32_t current = SYMBOL_TABLE_getCurrentScopeIndex();
   SYMBOL_TABLE_SCOPE closingScope = SYMBOL_TABLE_getScope(current);
@@ -207,10 +225,12 @@ void SYMBOL_TABLE_declare(STR name, SYMBOL_TYPE type, TYPE_ID typeIndex, SYMBOL_
     .defined = true,
     .entryType = type,
     .status = SYMBOL_TABLE_STATUS_DECLARED,
+    .storageType = storageType,
     .typeIndex = typeIndex,
     .scopeIndex = scopeIndex,
     .bankIndex = scope.bankIndex,
-    .constantIndex = 0
+    .constant = NULL,
+    .mangledName = EMPTY_STRING
   };
   hmputs(scope.table, entry);
   hmputs(scopes, scope);
@@ -233,7 +253,8 @@ void SYMBOL_TABLE_define(STR name, SYMBOL_TYPE type, TYPE_ID typeIndex, SYMBOL_T
     .offset = offset,
     .ordinal = scope.ordinal,
     .paramOrdinal = scope.paramOrdinal,
-    .constantIndex = 0
+    .constant = NULL,
+    .mangledName = EMPTY_STRING
   };
   if (type == SYMBOL_TYPE_VARIABLE || type == SYMBOL_TYPE_CONSTANT) {
     scope.ordinal++;
@@ -271,7 +292,7 @@ SYMBOL_TABLE_ENTRY SYMBOL_TABLE_get(uint32_t scopeIndex, STR name) {
     }
     current = scope.parent;
   }
-  return (SYMBOL_TABLE_ENTRY){0};
+  return (SYMBOL_TABLE_ENTRY){ .mangledName = EMPTY_STRING };
 }
 SYMBOL_TABLE_ENTRY SYMBOL_TABLE_getCurrentOnly(STR name) {
   uint32_t current = scopeStack[arrlen(scopeStack) - 1];
@@ -280,7 +301,7 @@ SYMBOL_TABLE_ENTRY SYMBOL_TABLE_getCurrentOnly(STR name) {
   if (entry.defined) {
     return entry;
   }
-  return (SYMBOL_TABLE_ENTRY){0};
+  return (SYMBOL_TABLE_ENTRY){ .mangledName = EMPTY_STRING };
 }
 SYMBOL_TABLE_ENTRY SYMBOL_TABLE_checkBanks(STR name) {
   for (int i = 0; i < hmlen(scopes); i++) {
@@ -293,7 +314,7 @@ SYMBOL_TABLE_ENTRY SYMBOL_TABLE_checkBanks(STR name) {
     }
   }
 
-  return (SYMBOL_TABLE_ENTRY){0};
+  return (SYMBOL_TABLE_ENTRY){ .mangledName = EMPTY_STRING };
 }
 
 STR SYMBOL_TABLE_getNameFromCurrent(void) {
@@ -329,7 +350,7 @@ SYMBOL_TABLE_ENTRY SYMBOL_TABLE_getCurrent(STR name) {
     }
     current = scope.parent;
   }
-  return (SYMBOL_TABLE_ENTRY){0};
+  return (SYMBOL_TABLE_ENTRY){ .mangledName = EMPTY_STRING };
 }
 
 void SYMBOL_TABLE_report(void) {
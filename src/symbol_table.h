@@ -30,6 +30,7 @@
 #include "type_table.h"
 
 struct PLATFORM;
+struct AST;
 
 typedef enum SYMBOL_TABLE_ENTRY_STATUS {
   SYMBOL_TABLE_STATUS_INVALID,
@@ -78,10 +79,13 @@ typedef struct SYMBOL_TABLE_ENTRY {
   TYPE_ID typeIndex;
   uint32_t scopeIndex;
   uint32_t bankIndex;
-  // only for constants
-  uint32_t constantIndex;
+  // only for constants: the initializer, when code can use it in place
+  // of the stored value
+  struct AST* constant;
   // only for arrays
   uint32_t elementCount;
+  // set by the backend on first reference
+  STR mangledName;
 } SYMBOL_TABLE_ENTRY;
 
 
@@ -128,6 +132,8 @@ SYMBOL_TABLE_ENTRY SYMBOL_TABLE_get(uint32_t scope, STR name);
 bool SYMBOL_TABLE_nameScope(STR name);
 void SYMBOL_TABLE_free(void);
 void SYMBOL_TABLE_updateElementCount(STR name, uint32_t elementCount);
+void SYMBOL_TABLE_setConstant(STR name, struct AST* constant);
+void SYMBOL_TABLE_setMangledName(SYMBOL_TABLE_ENTRY entry, STR mangledName);
 void SYMBOL_TABLE_pushScope(int index);
 void SYMBOL_TABLE_popScope();
 STR SYMBOL_TABLE_getNameFromStart(int start);
@@ -49,7 +49,7 @@ typedef uint32_t TYPE_ID;
 typedef struct TYPE_FIELD_ENTRY {
   TYPE_ID typeIndex;
   STR name;
-  uint8_t elementCount;
+  uint32_t elementCount;
   // Not sure why I want this right now
   // Hoping we can do without it.
   // SYMBOL_KIND kind;
@@ -32,7 +32,7 @@ Value getTypedNumberValue(ValueType type, int32_t n) {
     case VAL_U8: return U8(n % 256); break;
     case VAL_I8: return I8(n); break;
     case VAL_I16: return I16(n); break;
-    case VAL_U16: return U16(n % 32768); break;
+    case VAL_U16: return U16(n); break;
     case VAL_PTR: return PTR(n % 32768); break;
     case VAL_LIT_NUM: return LIT_NUM(n); break;
     default: return ERROR(1);
@@ -44,13 +44,13 @@ Value getNumericalValue(int32_t n) {
   if (-128 <= n && n <= 127) {
     return I8(n);
   }
-  if (n <= 255) {
+  if (0 <= n && n <= 255) {
     return U8(n);
   }
   if (-32768 <= n && n <= 32767) {
     return I16(n);
   }
-  if (n <= 32767) {
+  if (0 <= n && n <= 65535) {
     return U16(n);
   }
   return LIT_NUM(n);